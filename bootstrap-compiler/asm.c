@@ -1,3 +1,5 @@
+// For MAP_ANONYMOUS
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +8,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <elf.h>
+#include <sys/mman.h>
 #include "asm.h"
 
 
@@ -16,9 +19,75 @@
 void as_free(asm_p as) {
 	free(as->code_ptr);
 	free(as->data_ptr);
+	free(as->jumps_ptr);
+	free(as->fixups_ptr);
+	free(as->data_fixups_ptr);
 	*as = as_empty();
 }
 
+// Doubles the capacity until at least needed bytes fit into the buffer
+static void as_grow(uint8_t** ptr, size_t* cap, size_t needed) {
+	size_t new_cap = (*cap > 0) ? *cap : 4096;
+	while (new_cap < needed)
+		new_cap *= 2;
+	
+	uint8_t* new_ptr = realloc(*ptr, new_cap);
+	if (new_ptr == NULL) {
+		perror("as_grow(): realloc()");
+		abort();
+	}
+	
+	*ptr = new_ptr;
+	*cap = new_cap;
+}
+
+void as_reserve(asm_p as, size_t code_bytes, size_t data_bytes) {
+	if (as->code_len + code_bytes > as->code_cap)
+		as_grow(&as->code_ptr, &as->code_cap, as->code_len + code_bytes);
+	if (as->data_len + data_bytes > as->data_cap)
+		as_grow(&as->data_ptr, &as->data_cap, as->data_len + data_bytes);
+}
+
+// Appends size uninitialized bytes to the code buffer and returns a pointer to
+// them. Only valid until the next write into the code buffer.
+static inline uint8_t* as_code_append(asm_p as, size_t size) {
+	if (as->code_len + size > as->code_cap)
+		as_grow(&as->code_ptr, &as->code_cap, as->code_len + size);
+	uint8_t* ptr = as->code_ptr + as->code_len;
+	as->code_len += size;
+	return ptr;
+}
+
+// Makes room for one more element in one of the ptr/len/cap lists in asm_t
+#define AS_LIST_GROW(ptr, len, cap)  do {                \
+	if ((len) == (cap)) {                                  \
+		(cap) = ((cap) > 0) ? (cap) * 2 : 64;              \
+		(ptr) = realloc((ptr), (cap) * sizeof((ptr)[0]));  \
+		if ((ptr) == NULL) {                               \
+			perror("AS_LIST_GROW(): realloc()");           \
+			abort();                                       \
+		}                                                  \
+	}                                                      \
+} while(0)
+
+
+// Fills in the displacements of the as_patch_data_slot() slots in a copy of
+// the code. code_addr and data_addr are the addresses the code and data are
+// placed at.
+static void as_patch_data_slots(asm_p as, uint8_t* code_ptr, uint64_t code_addr, uint64_t data_addr) {
+	for(size_t i = 0; i < as->data_fixups_len; i++) {
+		asm_fixup_p fixup = &as->data_fixups_ptr[i];
+		int64_t disp_value = (int64_t)(data_addr + fixup->target) - (int64_t)(code_addr + fixup->next_instruction_offset);
+		if (disp_value < INT32_MIN || disp_value > INT32_MAX) {
+			fprintf(stderr, "as_patch_data_slots(): Data is too far away from the code for a RIP relative displacement!\n");
+			abort();
+		}
+		
+		int32_t disp32 = disp_value;
+		memcpy(code_ptr + fixup->value_offset, &disp32, sizeof(disp32));
+	}
+}
+
 
 //
 // Basic save functions
@@ -172,6 +241,7 @@ void as_save_elf(asm_p as, size_t code_vaddr, size_t data_vaddr, const char* fil
 	fwrite(&data_section_header, 1, sizeof(data_section_header), f);
 	fwrite(&strtab_section_header, 1, sizeof(strtab_section_header), f);
 	
+	as_patch_data_slots(as, as->code_ptr, code_vaddr, data_vaddr);
 	fseek(f, code_prog_header.p_offset, SEEK_SET);
 	fwrite(as->code_ptr, 1, as->code_len, f);
 	fseek(f, data_prog_header.p_offset, SEEK_SET);
@@ -183,164 +253,265 @@ void as_save_elf(asm_p as, size_t code_vaddr, size_t data_vaddr, const char* fil
 }
 
 
+//
+// In-process execution
+//
+
+asm_jit_t as_jit_map(asm_p as) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	// Map at least one code page so the jit always has a valid mapping
+	size_t code_size = (as->code_len > 0) ? (as->code_len + page_size - 1) / page_size * page_size : page_size;
+	size_t data_size = (as->data_len + page_size - 1) / page_size * page_size;
+	
+	// One mapping for code and data keeps both within reach of RIP relative
+	// addressing
+	uint8_t* ptr = mmap(NULL, code_size + data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		perror("as_jit_map(): mmap()");
+		abort();
+	}
+	
+	asm_jit_t jit = { ptr, code_size, ptr + code_size, data_size };
+	memcpy(jit.code_ptr, as->code_ptr, as->code_len);
+	memcpy(jit.data_ptr, as->data_ptr, as->data_len);
+	as_patch_data_slots(as, jit.code_ptr, (uint64_t)jit.code_ptr, (uint64_t)jit.data_ptr);
+	
+	if ( mprotect(jit.code_ptr, jit.code_size, PROT_READ | PROT_EXEC) != 0 || (jit.data_size > 0 && mprotect(jit.data_ptr, jit.data_size, PROT_READ) != 0) ) {
+		perror("as_jit_map(): mprotect()");
+		abort();
+	}
+	
+	return jit;
+}
+
+void as_jit_unmap(asm_jit_p jit) {
+	if (jit->code_ptr)
+		munmap(jit->code_ptr, jit->code_size + jit->data_size);
+	*jit = (asm_jit_t){ 0 };
+}
+
+void* as_jit_func(asm_jit_p jit, size_t code_offset) {
+	if (code_offset >= jit->code_size) {
+		fprintf(stderr, "as_jit_func(): code_offset is outside of the mapped code!\n");
+		abort();
+	}
+	return jit->code_ptr + code_offset;
+}
+
+
 //
 // Functions to put stuff into the data segment
 //
 
 size_t as_data(asm_p as, const void* ptr, size_t size) {
+	as_reserve(as, 0, size);
+	memcpy(as->data_ptr + as->data_len, ptr, size);
 	as->data_len += size;
-	as->data_ptr = realloc(as->data_ptr, as->data_len);
-	memcpy(as->data_ptr + as->data_len - size, ptr, size);
 	return as->data_len - size;
 }
 
 
 //
-// Binary printf() like helper functions
+// Functions to put raw bytes into the code segment
 //
 
-void as_write(asm_p as, const char* format, ...) {
-	va_list args;
-	va_start(args, format);
+size_t as_code(asm_p as, const void* ptr, size_t size) {
+	memcpy(as_code_append(as, size), ptr, size);
+	return as->code_len - size;
+}
+
+
+//
+// Instruction templates
+//
+
+void as_template_compile(asm_template_p tmpl, const char* format, const char* var_names[]) {
+	*tmpl = (asm_template_t){ .compiled = false };
 	
-	uint8_t bits = 0;
+	asm_template_item_t* item = &tmpl->items[0];
 	uint8_t bits_used = 0;
 	
 	for(char const * c = format; *c != '\0'; c++) {
+		uint8_t field_bits = 0;
+		int     field_arg = -1;
+		
+		if (tmpl->item_count == ASM_TEMPLATE_MAX_ITEMS || tmpl->arg_count == ASM_TEMPLATE_MAX_ARGS) {
+			fprintf(stderr, "as_template_compile(): Format is too long: \"%s\"!\n", format);
+			abort();
+		}
+		
 		if (*c == '0') {
-			bits <<= 1;
+			item->fixed_bits <<= 1;
 			bits_used++;
 		} else if (*c == '1') {
-			bits <<= 1;
-			bits |= 1;
+			item->fixed_bits = (item->fixed_bits << 1) | 1;
 			bits_used++;
 		} else if ( isspace(*c) || *c == ':' ) {
 			// Ignore spaces and ':'
-		} else if ( isalpha(*c) ) {
-			int data = va_arg(args, int);
-			uint8_t bits_to_copy = 0;
+		} else if ( isalpha(*c) && var_names == NULL ) {
+			// A group of the same letter (spaces allowed) takes the next argument
+			field_arg = tmpl->arg_count++;
 			for(char letter = *c; *c == letter || isspace(*c); c++) {
 				if (*c == letter)
-					bits_to_copy++;
+					field_bits++;
 			}
 			// Go back one char so we can process whatever came after the letter
 			// normally on the next loop iteration.
 			c--;
+		} else if ( isalpha(*c) ) {
+			// Got a variable, search for the longest matching name
+			size_t found_len = 0;
+			for(size_t i = 0; var_names[i] != NULL; i++) {
+				size_t var_len = strlen(var_names[i]);
+				if ( strncmp(c, var_names[i], var_len) == 0 && var_len > found_len ) {
+					field_arg = i;
+					found_len = var_len;
+				}
+			}
 			
-			for(int bit = bits_to_copy - 1; bit >= 0; bit--) {
-				bits <<= 1;
-				bits |= (data >> bit) & 1;
-				bits_used++;
+			if (field_arg == -1) {
+				fprintf(stderr, "as_template_compile(): Failed to find variable at pos %zd of \"%s\"\n", c - format, format);
+				abort();
 			}
+			
+			field_bits = found_len;
+			if (field_arg >= tmpl->arg_count)
+				tmpl->arg_count = field_arg + 1;
+			// Advance to the last char of this variable, the for loop increments c
+			c += found_len - 1;
 		} else if (*c == '%') {
 			uint8_t width = 0;
 			for(c++; isdigit(*c); c++)
 				width = width * 10 + (*c - '0');
 			
 			if (*c != 'd') {
-				fprintf(stderr, "as_write(): Unknown type of format specifier: %%%c!\n", *c);
+				fprintf(stderr, "as_template_compile(): Unknown type of format specifier: %%%c!\n", *c);
 				abort();
 			} else if ( !(width == 8 || width == 16 || width == 32 || width == 64) ) {
-				fprintf(stderr, "as_write(): Unsupported data width: %hhu!\n", width);
+				fprintf(stderr, "as_template_compile(): Unsupported data width: %hhu!\n", width);
 				abort();
 			} else if (bits_used != 0) {
-				fprintf(stderr, "as_write(): %%d can only be used on byte boundaries!\n");
+				fprintf(stderr, "as_template_compile(): %%d can only be used on byte boundaries!\n");
+				abort();
+			} else if (var_names != NULL) {
+				fprintf(stderr, "as_template_compile(): %%d can't be used with named variables!\n");
 				abort();
 			}
 			
-			uint64_t data = 0;
-			if (width == 64)
-				data = va_arg(args, uint64_t);
-			else
-				data = va_arg(args, uint32_t);
-			
-			uint8_t bytes = width / 8;
-			as->code_len += bytes;
-			as->code_ptr = realloc(as->code_ptr, as->code_len);
-			memcpy(as->code_ptr + as->code_len - bytes, &data, bytes);
+			item->data_bytes = width / 8;
+			item->data_arg = tmpl->arg_count;
+			tmpl->arg_bits[tmpl->arg_count] = width;
+			tmpl->used_args |= 1 << tmpl->arg_count;
+			tmpl->arg_count++;
+			tmpl->len += item->data_bytes;
+			item++;
+			tmpl->item_count++;
 		}
 		
-		// Push bits into code buffer once the byte is full
+		if (field_arg != -1) {
+			if (item->field_count == ASM_TEMPLATE_MAX_FIELDS) {
+				fprintf(stderr, "as_template_compile(): Too many fields in one byte!\n");
+				abort();
+			}
+			// The shift is only known once the byte is complete. Until then
+			// shift counts the bits used by the field.
+			item->fields[item->field_count++] = (asm_template_field_t){
+				.arg = field_arg,
+				.mask = (1 << field_bits) - 1,
+				.shift = bits_used + field_bits
+			};
+			item->fixed_bits <<= field_bits;
+			bits_used += field_bits;
+			tmpl->used_args |= 1 << field_arg;
+		}
+		
+		// Finish the byte once it's full
 		if (bits_used == 8) {
-			as->code_len++;
-			as->code_ptr = realloc(as->code_ptr, as->code_len);
-			as->code_ptr[as->code_len-1] = bits;
-			bits = 0;
+			for(size_t i = 0; i < item->field_count; i++)
+				item->fields[i].shift = 8 - item->fields[i].shift;
+			tmpl->len++;
+			item++;
+			tmpl->item_count++;
 			bits_used = 0;
 		} else if (bits_used > 8) {
-			fprintf(stderr, "as_write(): Got more than 8 bits in one go!\n");
+			fprintf(stderr, "as_template_compile(): Got more than 8 bits in one go!\n");
 			abort();
 		}
 	}
 	
 	if (bits_used != 0) {
-		fprintf(stderr, "as_write(): Finished not on byte boundary!\n");
+		fprintf(stderr, "as_template_compile(): Finished not on byte boundary!\n");
 		abort();
 	}
+	
+	tmpl->compiled = true;
 }
 
-void as_write_with_vars(asm_p as, const char* format, asm_var_t vars[]) {
-	uint8_t bits = 0;
-	uint8_t bits_used = 0;
+asm_template_p as_template_once(asm_template_p tmpl, const char* format, const char* var_names[]) {
+	if (!tmpl->compiled)
+		as_template_compile(tmpl, format, var_names);
+	return tmpl;
+}
+
+void as_template_emit(asm_p as, asm_template_p tmpl, const uint64_t args[]) {
+	uint8_t* out = as_code_append(as, tmpl->len);
 	
-	for(char const * c = format; *c != '\0'; c++) {
-		if (*c == '0') {
-			bits <<= 1;
-			bits_used++;
-		} else if (*c == '1') {
-			bits <<= 1;
-			bits |= 1;
-			bits_used++;
-		} else if ( isspace(*c) || *c == ':' ) {
-			// Ignore spaces and ':'
-		} else if ( isalpha(*c) ) {
-			// Got a variable, search for the matching value
-			ssize_t found_index = -1;
-			size_t found_len = 0;
-			for(size_t i = 0; vars[i].name != NULL; i++) {
-				size_t var_len = strlen(vars[i].name);
-				if ( strncmp(c, vars[i].name, var_len) == 0 && var_len > found_len ) {
-					found_index = i;
-					found_len = var_len;
-				}
-			}
-			
-			if (found_index == -1) {
-				fprintf(stderr, "as_write_with_vars(): Failed to find variable at pos %zd\n", c - format);
-				abort();
-			}
-			
-			uint8_t data = vars[found_index].bits;
-			uint8_t bits_to_copy = found_len;
-			
-			for(int bit = bits_to_copy - 1; bit >= 0; bit--) {
-				bits <<= 1;
-				bits |= (data >> bit) & 1;
-				bits_used++;
-			}
-			
-			// Advance to next char after this variable. Keep in mind that the
-			// for loop will increment c at the end (that's what the - 1 is for).
-			c += found_len - 1;
-		}
-		
-		// Push bits into code buffer once the byte is full
-		if (bits_used == 8) {
-			as->code_len++;
-			as->code_ptr = realloc(as->code_ptr, as->code_len);
-			as->code_ptr[as->code_len-1] = bits;
-			bits = 0;
-			bits_used = 0;
-		} else if (bits_used > 8) {
-			fprintf(stderr, "as_write_with_vars(): Got more than 8 bits in one go!\n");
-			abort();
+	for(size_t i = 0; i < tmpl->item_count; i++) {
+		asm_template_item_t* item = &tmpl->items[i];
+		if (item->data_bytes > 0) {
+			// ATTENTION: Only works for little endian system (like x86)
+			memcpy(out, &args[item->data_arg], item->data_bytes);
+			out += item->data_bytes;
+		} else {
+			uint8_t byte = item->fixed_bits;
+			for(size_t j = 0; j < item->field_count; j++)
+				byte |= (args[item->fields[j].arg] & item->fields[j].mask) << item->fields[j].shift;
+			*out++ = byte;
 		}
 	}
+}
+
+
+//
+// Binary printf() like helper functions
+//
+
+void as_write(asm_p as, const char* format, ...) {
+	asm_template_t tmpl;
+	as_template_compile(&tmpl, format, NULL);
 	
-	if (bits_used != 0) {
-		fprintf(stderr, "as_write_with_vars(): Finished not on byte boundary!\n");
-		abort();
+	uint64_t args[ASM_TEMPLATE_MAX_ARGS];
+	va_list va;
+	va_start(va, format);
+	for(size_t i = 0; i < tmpl.arg_count; i++) {
+		if (tmpl.arg_bits[i] == 64)
+			args[i] = va_arg(va, uint64_t);
+		else if (tmpl.arg_bits[i] > 0)
+			args[i] = va_arg(va, uint32_t);
+		else
+			args[i] = va_arg(va, int);
+	}
+	va_end(va);
+	
+	as_template_emit(as, &tmpl, args);
+}
+
+void as_write_with_vars(asm_p as, const char* format, asm_var_t vars[]) {
+	size_t var_count = 0;
+	while (vars[var_count].name != NULL)
+		var_count++;
+	
+	const char* names[var_count + 1];
+	uint64_t    values[var_count + 1];
+	for(size_t i = 0; i < var_count; i++) {
+		names[i] = vars[i].name;
+		values[i] = vars[i].bits;
 	}
+	names[var_count] = NULL;
+	
+	asm_template_t tmpl;
+	as_template_compile(&tmpl, format, names);
+	as_template_emit(as, &tmpl, values);
 }
 
 
@@ -361,22 +532,229 @@ size_t as_next_instr_offset(asm_p as) {
 	return as->code_len;
 }
 
+static void as_write_disp(asm_p as, size_t value_offset, size_t next_instruction_offset, uint8_t bytes, size_t target_offset) {
+	int64_t disp_value = (int64_t)target_offset - (int64_t)next_instruction_offset;
+	int64_t min = -(1LL << (bytes*8 - 1));
+	int64_t max = (1LL << (bytes*8 - 1)) - 1;
+	if (disp_value < min || disp_value > max) {
+		fprintf(stderr, "as_patch_slot(): Calculated displacement is to large for slot!\n");
+		abort();
+	}
+	
+	// ATTENTION: Only works for little endian system (like x86)
+	memcpy(as->code_ptr + value_offset, &disp_value, bytes);
+}
+
+static asm_jump_p as_find_jump_ending_at(asm_jump_p jumps, size_t jumps_len, size_t end_offset, bool use_old_layout);
+
+void as_patch_data_slot(asm_p as, asm_slot_t slot, size_t data_offset) {
+	if (slot.value_type != ASM_ARG_DISP || slot.bytes != 4) {
+		fprintf(stderr, "as_patch_data_slot(): Got a slot that isn't a 32 bit displacement!\n");
+		abort();
+	}
+	
+	AS_LIST_GROW(as->data_fixups_ptr, as->data_fixups_len, as->data_fixups_cap);
+	asm_fixup_p fixup = &as->data_fixups_ptr[as->data_fixups_len++];
+	*fixup = (asm_fixup_t){ slot.value_offset, slot.next_instruction_offset, slot.bytes, data_offset };
+}
+
 void as_patch_slot(asm_p as, asm_slot_t slot, size_t target_offset) {
 	if (slot.value_type != ASM_ARG_DISP) {
 		fprintf(stderr, "as_patch_slot(): Got a slot that isn't a displacement!\n");
 		abort();
 	}
 	
-	int64_t disp_value = (int64_t)target_offset - (int64_t)slot.next_instruction_offset;
-	int64_t max = (1LL << (slot.bytes*8 - 1));
-	int64_t min = -max - 1;
-	if (disp_value < min || disp_value > max) {
-		fprintf(stderr, "as_patch_slot(): Calculated displacement is to large for slot!\n");
-		abort();
+	as_write_disp(as, slot.value_offset, slot.next_instruction_offset, slot.bytes, target_offset);
+	
+	// Remember the target so as_relax() can redo the patch once the code moved
+	asm_jump_p jump = as_find_jump_ending_at(as->jumps_ptr, as->jumps_len, slot.next_instruction_offset, false);
+	if (jump) {
+		jump->target = target_offset;
+	} else {
+		AS_LIST_GROW(as->fixups_ptr, as->fixups_len, as->fixups_cap);
+		asm_fixup_p fixup = &as->fixups_ptr[as->fixups_len++];
+		*fixup = (asm_fixup_t){ slot.value_offset, slot.next_instruction_offset, slot.bytes, target_offset };
+	}
+}
+
+
+//
+// Branch relaxation
+//
+
+static uint8_t as_jump_size(asm_jump_p jump) {
+	if (jump->is_short)
+		return 2;
+	return (jump->condition < 0) ? 5 : 6;
+}
+
+static void as_record_jump(asm_p as, asm_cond_t condition_code, bool conditional, int32_t disp) {
+	AS_LIST_GROW(as->jumps_ptr, as->jumps_len, as->jumps_cap);
+	asm_jump_p jump = &as->jumps_ptr[as->jumps_len++];
+	*jump = (asm_jump_t){
+		.offset = as->code_len - (conditional ? 6 : 5),
+		.target = as->code_len + (int64_t)disp,
+		.condition = conditional ? (int8_t)condition_code : -1,
+		.is_short = false
+	};
+}
+
+// Jumps are recorded in code order and never overlap, so their end offsets are
+// sorted as well
+static asm_jump_p as_find_jump_ending_at(asm_jump_p jumps, size_t jumps_len, size_t end_offset, bool use_old_layout) {
+	size_t lo = 0, hi = jumps_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t end = use_old_layout ? jumps[mid].old_offset + jumps[mid].old_size : jumps[mid].offset + as_jump_size(&jumps[mid]);
+		if (end == end_offset)
+			return &jumps[mid];
+		else if (end < end_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return NULL;
+}
+
+// Returns the index of the first jump that starts at or after old_offset (in
+// the layout before relaxation)
+static size_t as_first_jump_at_or_after(asm_jump_p jumps, size_t jumps_len, size_t old_offset) {
+	size_t lo = 0, hi = jumps_len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (jumps[mid].old_offset < old_offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Shrinks jumps to their short form until no more jumps fit. Shrinking a jump
+ * only brings other jumps closer to their targets, so once a jump fits into the
+ * short form it stays that way and the loop terminates. Afterwards the code
+ * buffer is rebuilt with the new jump encodings and the recorded fixups are
+ * patched again.
+ */
+void as_relax(asm_p as) {
+	asm_jump_p jumps = as->jumps_ptr;
+	size_t jumps_len = as->jumps_len;
 	
-	// ATTENTION: Only works for little endian system (like x86)
-	memcpy(as->code_ptr + slot.value_offset, &disp_value, slot.bytes);
+	for(size_t i = 0; i < jumps_len; i++) {
+		jumps[i].old_offset = jumps[i].offset;
+		jumps[i].old_size = as_jump_size(&jumps[i]);
+	}
+	as->relaxed_jumps_len = jumps_len;
+	as->relaxed_removed_bytes = 0;
+	
+	// removed_before[i] = bytes removed by the jumps before jump i
+	size_t* removed_before = malloc((jumps_len + 1) * sizeof(removed_before[0]));
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		
+		removed_before[0] = 0;
+		for(size_t i = 0; i < jumps_len; i++)
+			removed_before[i+1] = removed_before[i] + jumps[i].old_size - as_jump_size(&jumps[i]);
+		
+		for(size_t i = 0; i < jumps_len; i++) {
+			if (jumps[i].is_short)
+				continue;
+			
+			size_t target_idx = as_first_jump_at_or_after(jumps, jumps_len, jumps[i].target);
+			int64_t new_target = (int64_t)jumps[i].target - removed_before[target_idx];
+			// Forward jumps also move their target when they shrink themselves
+			if (target_idx > i)
+				new_target -= jumps[i].old_size - 2;
+			int64_t new_end = (int64_t)(jumps[i].old_offset - removed_before[i]) + 2;
+			int64_t disp = new_target - new_end;
+			if (disp >= INT8_MIN && disp <= INT8_MAX) {
+				jumps[i].is_short = true;
+				changed = true;
+			}
+		}
+	}
+	
+	size_t removed_bytes = removed_before[jumps_len];
+	for(size_t i = 0; i < jumps_len; i++)
+		jumps[i].target -= removed_before[ as_first_jump_at_or_after(jumps, jumps_len, jumps[i].target) ];
+	free(removed_before);
+	if (removed_bytes == 0)
+		return;
+	as->relaxed_removed_bytes = removed_bytes;
+	
+	// Rebuild the code buffer with the new jump encodings
+	asm_t out = { 0 };
+	as_reserve(&out, as->code_len - removed_bytes, 0);
+	size_t copied_until = 0;
+	for(size_t i = 0; i < jumps_len; i++) {
+		asm_jump_p jump = &jumps[i];
+		as_code(&out, as->code_ptr + copied_until, jump->old_offset - copied_until);
+		copied_until = jump->old_offset + jump->old_size;
+		
+		jump->offset = out.code_len;
+		int32_t disp = (int64_t)jump->target - (int64_t)(jump->offset + as_jump_size(jump));
+		if (jump->is_short && jump->condition < 0)
+			as_emit(&out, "1110 1011 : %8d", disp);
+		else if (jump->is_short)
+			as_emit(&out, "0111 tttt : %8d", jump->condition, disp);
+		else if (jump->condition < 0)
+			as_emit(&out, "1110 1001 : %32d", disp);
+		else
+			as_emit(&out, "0000 1111 : 1000 tttt : %32d", jump->condition, disp);
+	}
+	as_code(&out, as->code_ptr + copied_until, as->code_len - copied_until);
+	
+	free(as->code_ptr);
+	as->code_ptr = out.code_ptr;
+	as->code_len = out.code_len;
+	as->code_cap = out.code_cap;
+	
+	for(size_t i = 0; i < as->fixups_len; i++) {
+		asm_fixup_p fixup = &as->fixups_ptr[i];
+		fixup->value_offset = as_relaxed_offset(as, fixup->value_offset);
+		fixup->next_instruction_offset = as_relaxed_offset(as, fixup->next_instruction_offset);
+		fixup->target = as_relaxed_offset(as, fixup->target);
+		as_write_disp(as, fixup->value_offset, fixup->next_instruction_offset, fixup->bytes, fixup->target);
+	}
+	
+	// Data slots are patched later on, only their position changes
+	for(size_t i = 0; i < as->data_fixups_len; i++) {
+		asm_fixup_p fixup = &as->data_fixups_ptr[i];
+		fixup->value_offset = as_relaxed_offset(as, fixup->value_offset);
+		fixup->next_instruction_offset = as_relaxed_offset(as, fixup->next_instruction_offset);
+	}
+}
+
+size_t as_relaxed_offset(asm_p as, size_t old_offset) {
+	asm_jump_p jumps = as->jumps_ptr;
+	size_t idx = as_first_jump_at_or_after(jumps, as->relaxed_jumps_len, old_offset);
+	if (idx == as->relaxed_jumps_len)
+		return old_offset - as->relaxed_removed_bytes;
+	// Everything between the previous jump and this one moved by the same amount
+	return old_offset - (jumps[idx].old_offset - jumps[idx].offset);
+}
+
+asm_slot_t as_relaxed_slot(asm_p as, asm_slot_t old_slot) {
+	if (old_slot.bytes == 0)
+		return old_slot;
+	
+	asm_jump_p jump = as_find_jump_ending_at(as->jumps_ptr, as->relaxed_jumps_len, old_slot.next_instruction_offset, true);
+	if (jump) {
+		size_t next_instruction_offset = jump->offset + as_jump_size(jump);
+		uint8_t bytes = jump->is_short ? 1 : 4;
+		return (asm_slot_t){
+			.bytes = bytes,
+			.value_offset = next_instruction_offset - bytes,
+			.value_type = old_slot.value_type,
+			.next_instruction_offset = next_instruction_offset
+		};
+	}
+	
+	old_slot.value_offset = as_relaxed_offset(as, old_slot.value_offset);
+	old_slot.next_instruction_offset = as_relaxed_offset(as, old_slot.next_instruction_offset);
+	return old_slot;
 }
 
 
@@ -390,8 +768,58 @@ void as_patch_slot(asm_p as, asm_slot_t slot, size_t target_offset) {
 // Instruction needs a REX prefix, even if it's empty and unused. For example to
 // address 8 bit areas of some registers.
 #define WMRM_FORCE_REX     (1 << 1)
+// Vector instruction: The operand size is defined by the prefixes and opcode
+// and the operands don't need to have the same size (e.g. a XMM register and a
+// 4 byte memory location). Also implies WMRM_FIXED_OP_SIZE.
+#define WMRM_VECTOR        (1 << 2)
+// Write a VEX prefix instead of the 66H prefix and the REX byte. The VEX
+// fields are taken from the OV_VEX_* variables.
+#define WMRM_VEX           (1 << 3)
+// Always use a disp32 for [reg + disp] memory operands, even if the value
+// would fit into less. For slots that are patched later on.
+#define WMRM_DISP32        (1 << 4)
+
+// Variables that can be used in the opcode format of as_write_modrm(). d and w
+// are set by as_write_modrm(), the others can be supplied by the caller. The
+// OV_VEX_* variables aren't available in the opcode format, they only fill the
+// VEX prefix.
+enum { OV_D, OV_W, OV_S, OV_TTTT, OV_VEX_L, OV_VEX_PP, OV_VEX_MMMMM, OV_VEX_W, OV_VEX_VVVV, OV_COUNT };
+static const char* opcode_var_names[] = { "d", "w", "s", "tttt", NULL };
+// Opcode format for as_write_modrm(), compiled into tmpl on first use. Each
+// instruction function keeps its own static template.
+#define AS_OPCODE(tmpl, format)  as_template_once(&(tmpl), (format), opcode_var_names)
+
+static bool as_is_mem_arg(asm_arg_t arg) {
+	switch(arg.type) {
+		case ASM_ARG_MEM_REL_DISP: case ASM_ARG_MEM_REG: case ASM_ARG_MEM_DISP: case ASM_ARG_MEM_REG_DISP: case ASM_ARG_MEM_SIB_DISP:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Use the shortest displacement unless force_disp32 is set, Volume 2A, p33:
+// mod == 00 signals [reg] without displacement
+// mod == 01 signals [reg] + disp8 (sign extended)
+// mod == 10 signals [reg] + disp32
+// [RBP] and [R13] with mod == 00 are special cases for RIP + disp32 or disp32
+// alone (also as SIB base). So these always need at least a disp8 of 0.
+static uint8_t as_mod_for_disp(int32_t disp, uint8_t base, bool force_disp32, uint8_t* disp_bytes) {
+	if (force_disp32) {
+		*disp_bytes = 4;
+		return 0b10;
+	} else if (disp == 0 && (base & 0b111) != 0b101) {
+		*disp_bytes = 0;
+		return 0b00;
+	} else if (disp >= INT8_MIN && disp <= INT8_MAX) {
+		*disp_bytes = 1;
+		return 0b01;
+	}
+	*disp_bytes = 4;
+	return 0b10;
+}
 
-bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest, asm_arg_t src, asm_slot_p slot, asm_var_t vars[]) {
+bool as_write_modrm(asm_p as, uint32_t flags, asm_template_p opcode, asm_arg_t dest, asm_arg_t src, asm_slot_p slot, const uint64_t vars[OV_COUNT]) {
 	// Variables for parts of the opcode format:
 	// 66H : REX : opcode : mod reg r/m : SIB : disp : imm
 	// The value -1 represents invalid values
@@ -401,6 +829,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	uint8_t mod, reg, r_m;
 	int16_t scale, index, base;
 	int32_t* displacement_ptr = NULL;
+	uint8_t displacement_bytes = 4;
 	
 	// Map dest and src to the reg and r/m arguments and set the d bit accordingly
 	// ASM_ARG_REG
@@ -414,6 +843,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	// ASM_ARG_MEM_REG
 	// ASM_ARG_MEM_DISP
 	// ASM_ARG_MEM_REG_DISP
+	// ASM_ARG_MEM_SIB_DISP
 	//   -> can only be reg argument
 	
 	// Notify caller of invalid arguments or a wrong op_code argument
@@ -435,7 +865,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 		r_m_arg = src;
 		// No valid direction bit for just one argument
 		op_d = -1;
-	} else if (dt == ASM_ARG_MEM_REL_DISP || dt == ASM_ARG_MEM_REG || dt == ASM_ARG_MEM_DISP || dt == ASM_ARG_MEM_REG_DISP) {
+	} else if ( as_is_mem_arg(dest) ) {
 		// If dest parameter is a memory reference it has to be the r/m argument.
 		// In all other cases it can be the reg argument.
 		// reg to r/m, reg is source, so d = 0
@@ -456,7 +886,10 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	// TODO: Add a flag to ignore match, meaning using the max of both. This
 	// will be the case for instructions that zero- or sign-extend the source.
 	uint8_t bytes = 0;
-	if ( dest.bytes == 0 && src.bytes > 0 ) {
+	if (flags & WMRM_VECTOR) {
+		// Size comes from the prefixes and opcode, see case 0 below
+		bytes = 0;
+	} else if ( dest.bytes == 0 && src.bytes > 0 ) {
 		bytes = src.bytes;
 	} else if ( src.bytes == 0 && dest.bytes > 0 ) {
 		bytes = dest.bytes;
@@ -473,15 +906,21 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	// 32 bit         1 (full size)   0 (default size)   no (default size)
 	// 64 bit         1 (full size)   1 (64 bit size)    ignored
 	switch(bytes) {
+		case 0:
+			// Only for WMRM_VECTOR
+			op_w = -1;
+			rex_W = 0;
+			prefix_66h = false;
+			break;
 		case 1:
 			op_w = 0;
 			rex_W = 0;
 			prefix_66h = false;
 			// The byte versions of RSI, RDI, RBP and RSP (SIL, DIL, BPL, SPL) can only
 			// be encoded by an empty REX byte. We we omit this we get AH, BH, CH and DH.
-			// So for now we force the precense of a REX byte with a flag.
-			// TODO: Only needed for RSI, RDI, RBP and RSP registers, don't set for the rest.
-			flags |= WMRM_FORCE_REX;
+			// So we force the precense of a REX byte for these registers.
+			if ( (reg_arg.type == ASM_ARG_REG && reg_arg.reg >= 4 && reg_arg.reg <= 7) || (r_m_arg.type == ASM_ARG_REG && r_m_arg.reg >= 4 && r_m_arg.reg <= 7) )
+				flags |= WMRM_FORCE_REX;
 			break;
 		case 2:
 			op_w = 1;
@@ -513,7 +952,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	
 	
 	// Handle register argument
-	if (reg_arg.type == ASM_ARG_REG) {
+	if (reg_arg.type == ASM_ARG_REG || reg_arg.type == ASM_ARG_VREG) {
 		// ModR/M byte reg field contains register operand, REX.R bit extends it
 		reg = reg_arg.reg;
 		rex_R = reg_arg.reg >> 3;
@@ -543,6 +982,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	// always is a register.
 	switch(r_m_arg.type) {
 		case ASM_ARG_REG:
+		case ASM_ARG_VREG:
 			// register to register
 			mod = 0b11;
 			r_m = r_m_arg.reg;
@@ -582,9 +1022,12 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 			
 			displacement_ptr = &r_m_arg.mem.disp;
 			break;
+		case ASM_ARG_MEM_REG:
 		case ASM_ARG_MEM_REG_DISP:
-			// mod == 10 signals [reg] + disp32 addressing mode, Volume 2A, p33
-			mod = 0b10; 
+			// Use the shortest displacement, see as_mod_for_disp()
+			if (r_m_arg.type == ASM_ARG_MEM_REG)
+				r_m_arg.mem.disp = 0;
+			mod = as_mod_for_disp(r_m_arg.mem.disp, r_m_arg.mem.base, (flags & WMRM_DISP32), &displacement_bytes);
 			r_m = r_m_arg.mem.base & 0b111;
 			rex_B = r_m_arg.mem.base >> 3;
 			
@@ -593,7 +1036,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 			rex_X = 0;
 			
 			if (r_m == 0b100) {
-				// Would usually mean [RSP] + disp32 but is a special case that signals
+				// Would usually mean [RSP] + disp but is a special case that signals
 				// a following SIB byte. Encode with an SIB byte with no index (special
 				// case SS = 00, Index = 100) and RSP as base. In this case REX.B is
 				// used to extend SIB.base, so we can just keep the bit in there.
@@ -603,47 +1046,98 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 				base = r_m_arg.mem.base;
 			}
 			
-			displacement_ptr = &r_m_arg.mem.disp;
+			if (mod != 0b00)
+				displacement_ptr = &r_m_arg.mem.disp;
+			break;
+		case ASM_ARG_MEM_SIB_DISP:
+			// [base + scale * index + disp], Volume 2A, p34 (Table 2-3)
+			// R/M = 100 signals a following SIB byte. The mod field selects the
+			// displacement just like for [reg + disp]. This also covers the special
+			// cases: RSP and R12 can be used as base since the SIB byte is already
+			// there. RBP and R13 as base with mod = 00 would mean disp32 without base
+			// so they get a disp8 of 0 as well.
+			mod = as_mod_for_disp(r_m_arg.mem.disp, r_m_arg.mem.base, (flags & WMRM_DISP32), &displacement_bytes);
+			r_m = 0b100;
+			
+			sib = true;
+			switch(r_m_arg.mem.scale) {
+				case 1: scale = 0b00; break;
+				case 2: scale = 0b01; break;
+				case 4: scale = 0b10; break;
+				case 8: scale = 0b11; break;
+				default:
+					fprintf(stderr, "as_write_modrm(): scale has to be 1, 2, 4 or 8!\n");
+					abort();
+			}
+			// index = 100 means no index, so RSP can't be used as index (R12 can)
+			if (r_m_arg.mem.index == 0b100) {
+				fprintf(stderr, "as_write_modrm(): RSP can't be used as index register!\n");
+				abort();
+			}
+			index = r_m_arg.mem.index & 0b111;
+			rex_X = r_m_arg.mem.index >> 3;
+			base = r_m_arg.mem.base & 0b111;
+			rex_B = r_m_arg.mem.base >> 3;
+			
+			if (mod != 0b00)
+				displacement_ptr = &r_m_arg.mem.disp;
 			break;
 		default:
 			fprintf(stderr, "as_write_modrm(): unsupported memory operand!\n");
 			abort();
 	}
 	
-	// Add our local opcode variables to the list of user supplied opcode
-	// variables (like condition code, etc.)
-	size_t user_supplied_var_count = 0;
-	for(size_t i = 0; vars != NULL && vars[i].name != NULL; i++)
-		user_supplied_var_count++;
-	asm_var_t all_vars[user_supplied_var_count + 2];
-	memcpy(all_vars, vars, user_supplied_var_count * sizeof(asm_var_t));
-	if (op_d != -1)
-		all_vars[user_supplied_var_count++] = (asm_var_t){ "d", op_d };
-	if (op_w != -1)
-		all_vars[user_supplied_var_count++] = (asm_var_t){ "w", op_w };
-	all_vars[user_supplied_var_count++] = (asm_var_t){ NULL, 0 };
+	// Add our local opcode variables to the user supplied opcode variables (like
+	// condition code, etc.)
+	uint64_t all_vars[OV_COUNT] = { 0 };
+	if (vars != NULL)
+		memcpy(all_vars, vars, sizeof(all_vars));
+	if ( (op_d == -1 && (opcode->used_args & (1 << OV_D))) || (op_w == -1 && (opcode->used_args & (1 << OV_W))) ) {
+		fprintf(stderr, "as_write_modrm(): opcode uses the d or w bit but it isn't valid for the arguments!\n");
+		abort();
+	}
+	all_vars[OV_D] = op_d;
+	all_vars[OV_W] = op_w;
 	
 	// Write encoded instruction
 	
-	// 66H prefix
-	if (prefix_66h)
-		as_write(as, "0110 0110");
-	// REX byte (if necessary). If we want to address some byte registers we
-	// need a REX byte even if W, R, X and B bits are set to 0. For now that's
-	// what the WMRM_FORCE_REX flag is for.
-	if ( (rex_W == 1 || rex_R == 1 || rex_X == 1 || rex_B == 1) || (flags & WMRM_FORCE_REX) )
-		as_write(as, "0100 WRXB", rex_W, rex_R, rex_X, rex_B);
+	if (flags & WMRM_VEX) {
+		// Volume 2A, p45, 2.3.5 The VEX Prefix
+		// Replaces the 66H, F2H and F3H prefixes, the REX byte and the 0FH, 0FH 38H
+		// and 0FH 3AH escape bytes. R, X, B and vvvv are stored inverted. The
+		// 2 byte form can only be used when X, B and W are 0 and the opcode is in
+		// the 0FH map.
+		uint8_t vvvv = ~all_vars[OV_VEX_VVVV] & 0b1111;
+		if (rex_X == 0 && rex_B == 0 && all_vars[OV_VEX_W] == 0 && all_vars[OV_VEX_MMMMM] == 0b00001)
+			as_emit(as, "1100 0101 : R vvvv L pp", !rex_R, vvvv, all_vars[OV_VEX_L], all_vars[OV_VEX_PP]);
+		else
+			as_emit(as, "1100 0100 : RXB mmmmm : W vvvv L pp", !rex_R, !rex_X, !rex_B, all_vars[OV_VEX_MMMMM], all_vars[OV_VEX_W], vvvv, all_vars[OV_VEX_L], all_vars[OV_VEX_PP]);
+	} else {
+		// 66H prefix
+		if (prefix_66h)
+			as_emit_fixed(as, "0110 0110");
+		// REX byte (if necessary). If we want to address some byte registers we
+		// need a REX byte even if W, R, X and B bits are set to 0. For now that's
+		// what the WMRM_FORCE_REX flag is for.
+		if ( (rex_W == 1 || rex_R == 1 || rex_X == 1 || rex_B == 1) || (flags & WMRM_FORCE_REX) )
+			as_emit(as, "0100 WRXB", rex_W, rex_R, rex_X, rex_B);
+	}
 	// Opcode byte(s)
-	as_write_with_vars(as, format, all_vars);
+	as_template_emit(as, opcode, all_vars);
 	// ModR/M byte
-	as_write(as, "mm rrr bbb", mod, reg, r_m);
+	as_emit(as, "mm rrr bbb", mod, reg, r_m);
 	// SIB byte (if used)
 	if (sib)
-		as_write(as, "ss xxx bbb", scale, index, base);
+		as_emit(as, "ss xxx bbb", scale, index, base);
 	// Displacement (if used)
 	if (displacement_ptr != NULL) {
-		as_write(as, "%32d", *displacement_ptr);
-		if (slot) *slot = as_slot_for_last_instr(as, 4, ASM_ARG_DISP);
+		if (displacement_bytes == 1)
+			as_emit(as, "%8d", *displacement_ptr);
+		else
+			as_emit(as, "%32d", *displacement_ptr);
+		// Shorter displacements can't hold an arbitrary value, so don't hand
+		// them out as slot (see WMRM_DISP32)
+		if (slot) *slot = (displacement_bytes == 4) ? as_slot_for_last_instr(as, 4, ASM_ARG_DISP) : as_invalid_slot();
 	} else {
 		if (slot) *slot = as_invalid_slot();
 	}
@@ -657,19 +1151,49 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 // Data Transfer Instructions
 //
 
-asm_slot_t as_mov(asm_p as, asm_arg_t dest, asm_arg_t src) {
+// With wide set immediates for 8 byte registers always use the imm64 form and
+// memory operands a disp32, so the returned slot can hold any value
+static asm_slot_t as_write_mov(asm_p as, asm_arg_t dest, asm_arg_t src, bool wide) {
+	static asm_template_t opcode;
 	if (dest.type == ASM_ARG_REG && src.type == ASM_ARG_IMM) {
 		// Volume 2C - Instruction Set Reference, p97 (B.2.1 General Purpose Instruction Formats and Encodings for 64-Bit Mode)
-		if (dest.bytes != 8) {
-			fprintf(stderr, "as_mov(): Only 8 byte immediates supported for now!\n");
+		if (dest.bytes != 8 && dest.bytes != 4) {
+			fprintf(stderr, "as_mov(): Only 4 and 8 byte immediates supported for now!\n");
 			abort();
 		}
-		as_write(as, "0100 100B : 1011 1bbb : %64d", dest.reg >> 3, dest.reg, src.imm);
-		return as_slot_for_last_instr(as, 8, ASM_ARG_IMM);
-	} else if ( as_write_modrm(as, 0, "1000 10dw", dest, src, NULL, NULL) ) {
+		
+		if ( src.imm <= UINT32_MAX && !(wide && dest.bytes == 8) ) {
+			// immediate32 to dwordregister, writing the 32 bit register zeros the upper
+			// 32 bits, so it works for qwordregisters as well
+			// 0100 000B : 1011 1reg : imm32
+			if (dest.reg >> 3)
+				as_emit(as, "0100 000B : 1011 1bbb : %32d", dest.reg >> 3, dest.reg, src.imm);
+			else
+				as_emit(as, "1011 1bbb : %32d", dest.reg, src.imm);
+			// For qwordregisters that imm32 can't hold all values, so it's no slot
+			return (dest.bytes == 4) ? as_slot_for_last_instr(as, 4, ASM_ARG_IMM) : as_invalid_slot();
+		} else if (dest.bytes == 8 && !wide && (int64_t)src.imm < 0 && (int64_t)src.imm >= INT32_MIN) {
+			// immediate32 to qwordregister (sign extended), one byte shorter than imm64
+			// 0100 100B : 1100 0111 : 11 000 reg : imm32
+			as_emit(as, "0100 100B : 1100 0111 : 11 000 bbb : %32d", dest.reg >> 3, dest.reg, src.imm);
+			return as_invalid_slot();
+		} else if (dest.bytes == 8) {
+			// immediate64 to qwordregister
+			// 0100 100B : 1011 1reg : imm64
+			as_emit(as, "0100 100B : 1011 1bbb : %64d", dest.reg >> 3, dest.reg, src.imm);
+			return as_slot_for_last_instr(as, 8, ASM_ARG_IMM);
+		}
+		
+		fprintf(stderr, "as_mov(): immediate doesn't fit into the register!\n");
+		abort();
+	}
+	
+	asm_slot_t slot;
+	if ( as_write_modrm(as, wide ? WMRM_DISP32 : 0, AS_OPCODE(opcode, "1000 10dw"), dest, src, &slot, NULL) ) {
 		// memory to reg 0100 0RXB : 1000 101w : mod reg r/m
 		// reg to memory 0100 0RXB : 1000 100w : mod reg r/m
-		return as_invalid_slot();
+		// Slot of the memory operand displacement (if any)
+		return slot;
 	}
 	
 	fprintf(stderr, "as_mov(): unsupported arg combination!\n");
@@ -677,28 +1201,48 @@ asm_slot_t as_mov(asm_p as, asm_arg_t dest, asm_arg_t src) {
 	return as_invalid_slot();
 }
 
-asm_slot_t as_push(asm_p as, asm_arg_t src) {
+asm_slot_t as_mov(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	return as_write_mov(as, dest, src, false);
+}
+
+asm_slot_t as_mov_slot(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	return as_write_mov(as, dest, src, true);
+}
+
+// With wide set imm32 values always use the imm32 form
+static asm_slot_t as_write_push(asm_p as, asm_arg_t src, bool wide) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p100
 	if (src.type == ASM_ARG_IMM) {
+		// Both imm8 and imm32 are sign extended and push 8 bytes. So imm32 values
+		// that fit into a byte can use the shorter imm8 form. That one is no slot
+		// though, it can't hold other values.
+		if ( !wide && src.bytes == 4 && (int32_t)src.imm >= INT8_MIN && (int32_t)src.imm <= INT8_MAX ) {
+			as_emit(as, "0110 1010 : %8d", src.imm);
+			return as_invalid_slot();
+		} else if (wide && src.bytes == 1) {
+			src.bytes = 4;
+		}
+		
 		switch(src.bytes) {
 			case 1:
-				as_write(as, "0110 1010 : %8d", src.imm);
+				as_emit(as, "0110 1010 : %8d", src.imm);
 				break;
 			case 2:
 				// PUSH immediate16  0101 0101 : 0110 1000 : imm16
 				// 55H (address size) prefix probably error in the docs!
 				// 66H (operand size) prefix works.
-				as_write(as, "0110 0110 : 0110 1000 : %16d", src.imm);
+				as_emit(as, "0110 0110 : 0110 1000 : %16d", src.imm);
 				break;
 			case 4:
-				as_write(as, "0110 1000 : %32d", src.imm);
+				as_emit(as, "0110 1000 : %32d", src.imm);
 				break;
 			default:
 				fprintf(stderr, "as_push(): Immediate can only be 1, 2 or 4 bytes, sorry.\n");
 				abort();
 		}
 		return as_slot_for_last_instr(as, src.bytes, ASM_ARG_IMM);
-	} else if ( src.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, "1111 1111", as_op_code(0b110), src, NULL, NULL) ) {
+	} else if ( src.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, AS_OPCODE(opcode, "1111 1111"), as_op_code(0b110), src, NULL, NULL) ) {
 		// wordregister  0101 0101 : 0100 000B : 1111 1111 : 11  110 reg16
 		// qwordregister             0100 W00B : 1111 1111 : 11  110 reg64
 		// memory16      0101 0101 : 0100 000B : 1111 1111 : mod 110 r/m
@@ -711,10 +1255,44 @@ asm_slot_t as_push(asm_p as, asm_arg_t src) {
 	return as_invalid_slot();
 }
 
+asm_slot_t as_push(asm_p as, asm_arg_t src) {
+	return as_write_push(as, src, false);
+}
+
+asm_slot_t as_push_slot(asm_p as, asm_arg_t src) {
+	return as_write_push(as, src, true);
+}
+
+static asm_slot_t as_write_lea(asm_p as, asm_arg_t dest, asm_arg_t src, bool wide) {
+	static asm_template_t opcode;
+	// Volume 2C - Instruction Set Reference, p98
+	// 0100 WRXB : 1000 1101 : mod reg r/m
+	if (dest.type == ASM_ARG_REG && dest.bytes >= 2 && as_is_mem_arg(src)) {
+		// Only the address is used so the size of the memory operand doesn't matter
+		src.bytes = 0;
+		asm_slot_t slot;
+		as_write_modrm(as, wide ? WMRM_DISP32 : 0, AS_OPCODE(opcode, "1000 1101"), dest, src, &slot, NULL);
+		return slot;
+	}
+	
+	fprintf(stderr, "as_lea(): unsupported arg combination!\n");
+	abort();
+	return as_invalid_slot();
+}
+
+asm_slot_t as_lea(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	return as_write_lea(as, dest, src, false);
+}
+
+asm_slot_t as_lea_slot(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	return as_write_lea(as, dest, src, true);
+}
+
 void as_pop(asm_p as, asm_arg_t dest) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p100
 	// POP only supports 2 and 8 byte arguments (just like PUSH without immediates)
-	if ( dest.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, "1000 1111", as_op_code(0b000), dest, NULL, NULL) )
+	if ( dest.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, AS_OPCODE(opcode, "1000 1111"), as_op_code(0b000), dest, NULL, NULL) )
 		return;
 	
 	fprintf(stderr, "as_pop(): unsupported arg type!\n");
@@ -727,26 +1305,54 @@ void as_pop(asm_p as, asm_arg_t dest) {
 // Binary Arithmetic Instructions
 //
 
+// Writes the immediate form shared by ADD, SUB, CMP, etc. (1000 00sw : mod ext r/m : imm).
+// Presence of REX.W forces sign extention to 64 bits... (Combined Volumes, p1348)
+// Without it it's written into the 32 bit registers which zeros out the upper 32
+// bits of that register. So effectively we can't disable sign-extention in 64 bit
+// mode... :( Therefore the immediate has to fit into a sign extended imm32.
+// When it fits into a byte we use the sign extended imm8 form (s = 1, opcode
+// 83H), see B.1.4.4 Sign-Extend (s) Bit, Volume 2C p76. That form returns no
+// slot since it can't hold other values. With wide set it's never used.
+static asm_slot_t as_write_alu_imm(asm_p as, const char* name, uint8_t op_code_ext, asm_arg_t dest, asm_arg_t src, bool wide) {
+	static asm_template_t opcode;
+	if (src.type != ASM_ARG_IMM) {
+		fprintf(stderr, "%s(): only supports immediates!\n", name);
+		abort();
+	}
+	if (dest.bytes < 2) {
+		fprintf(stderr, "%s(): can't use immediates with smaller register!\n", name);
+		abort();
+	}
+	
+	int64_t value = (int64_t)src.imm;
+	if (value < INT32_MIN || value > INT32_MAX || (dest.bytes == 2 && (value < INT16_MIN || value > INT16_MAX))) {
+		fprintf(stderr, "%s(): immediate doesn't fit into a sign extended imm%d!\n", name, (dest.bytes == 2) ? 16 : 32);
+		abort();
+	}
+	
+	if (!wide && value >= INT8_MIN && value <= INT8_MAX) {
+		as_write_modrm(as, 0, AS_OPCODE(opcode, "1000 00sw"), as_op_code(op_code_ext), dest, NULL, (uint64_t[OV_COUNT]){ [OV_S] = 1 });
+		as_emit(as, "%8d", src.imm);
+		return as_invalid_slot();
+	} else if (dest.bytes == 2) {
+		// The 66H prefix also shrinks the immediate to imm16
+		as_write_modrm(as, 0, AS_OPCODE(opcode, "1000 00sw"), as_op_code(op_code_ext), dest, NULL, (uint64_t[OV_COUNT]){ [OV_S] = 0 });
+		as_emit(as, "%16d", src.imm);
+		return as_slot_for_last_instr(as, 2, ASM_ARG_IMM);
+	}
+	
+	as_write_modrm(as, 0, AS_OPCODE(opcode, "1000 00sw"), as_op_code(op_code_ext), dest, NULL, (uint64_t[OV_COUNT]){ [OV_S] = 0 });
+	as_emit(as, "%32d", src.imm);
+	return as_slot_for_last_instr(as, 4, ASM_ARG_IMM);
+}
+
 asm_slot_t as_add(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p90
 	if (src.type == ASM_ARG_IMM) {
-		// 1000 00sw : mm 000, but for now we set s = 0 since we only have unsigned regs
-		// Presence of REX.W forces sign extention to 64 bits... (Combined Volumes, p1348)
-		// Without it it's written into the 32 bit registers which zeros out the upper 32
-		// bits of that register. So effectively we can't disable sign-extention in 64 bit
-		// mode... :(
-		if (src.imm & 0x80000000) {
-			fprintf(stderr, "as_add(): can't encode unsigned immediates larget than 31 bits!\n");
-			abort();
-		}
-		if (dest.bytes < 2) {
-			fprintf(stderr, "as_add(): can't put immediates into smaller register!\n");
-			abort();
-		}
-		as_write_modrm(as, 0, "1000 000w", as_op_code(0b000), dest, NULL, NULL);
-		as_write(as, "%32d", src.imm);
-		return as_slot_for_last_instr(as, 4, ASM_ARG_IMM);
-	} else if ( as_write_modrm(as, 0, "0000 00dw", dest, src, NULL, NULL) ) {
+		// 1000 00sw : mm 000 : imm
+		return as_write_alu_imm(as, "as_add", 0b000, dest, src, false);
+	} else if ( as_write_modrm(as, 0, AS_OPCODE(opcode, "0000 00dw"), dest, src, NULL, NULL) ) {
 		return as_invalid_slot();
 	}
 	
@@ -756,25 +1362,12 @@ asm_slot_t as_add(asm_p as, asm_arg_t dest, asm_arg_t src) {
 }
 
 asm_slot_t as_sub(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p106
 	if (src.type == ASM_ARG_IMM) {
-		// 1000 00sw : mm 101, but for now we set s = 0 since we only have unsigned regs
-		// Presence of REX.W forces sign extention to 64 bits... (Combined Volumes, p1348)
-		// Without it it's written into the 32 bit registers which zeros out the upper 32
-		// bits of that register. So effectively we can't disable sign-extention in 64 bit
-		// mode... :(
-		if (src.imm & 0x80000000) {
-			fprintf(stderr, "as_sub(): can't encode unsigned immediates larget than 31 bits!\n");
-			abort();
-		}
-		if (dest.bytes < 2) {
-			fprintf(stderr, "as_sub(): can't put immediates into smaller register!\n");
-			abort();
-		}
-		as_write_modrm(as, 0, "1000 000w", as_op_code(0b101), dest, NULL, NULL);
-		as_write(as, "%32d", src.imm);
-		return as_slot_for_last_instr(as, 4, ASM_ARG_IMM);
-	} else if ( as_write_modrm(as, 0, "0010 10dw", dest, src, NULL, NULL) ) {
+		// 1000 00sw : mm 101 : imm
+		return as_write_alu_imm(as, "as_sub", 0b101, dest, src, false);
+	} else if ( as_write_modrm(as, 0, AS_OPCODE(opcode, "0010 10dw"), dest, src, NULL, NULL) ) {
 		return as_invalid_slot();
 	}
 	
@@ -784,8 +1377,9 @@ asm_slot_t as_sub(asm_p as, asm_arg_t dest, asm_arg_t src) {
 }
 
 void as_mul(asm_p as, asm_arg_t src) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p99
-	if ( as_write_modrm(as, 0, "1111 011w", as_op_code(0b100), src, NULL, NULL) )
+	if ( as_write_modrm(as, 0, AS_OPCODE(opcode, "1111 011w"), as_op_code(0b100), src, NULL, NULL) )
 		return;
 	
 	fprintf(stderr, "as_mul(): unsupported arg combination!\n");
@@ -793,10 +1387,11 @@ void as_mul(asm_p as, asm_arg_t src) {
 }
 
 void as_div(asm_p as, asm_arg_t src) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p94
 	// Divide RDX:RAX by qwordregister  0100 100B : 1111 0111 : 11  110 qwordreg
 	// Divide RDX:RAX by memory64       0100 10XB : 1111 0111 : mod 110 r/m
-	if ( as_write_modrm(as, 0, "1111 011w", as_op_code(0b110), src, NULL, NULL) )
+	if ( as_write_modrm(as, 0, AS_OPCODE(opcode, "1111 011w"), as_op_code(0b110), src, NULL, NULL) )
 		return;
 	
 	fprintf(stderr, "as_div(): unsupported arg combination!\n");
@@ -804,20 +1399,12 @@ void as_div(asm_p as, asm_arg_t src) {
 }
 
 asm_slot_t as_cmp(asm_p as, asm_arg_t arg1, asm_arg_t arg2) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p93 (B.2.1 General Purpose Instruction Formats and Encodings for 64-Bit Mode)
 	if (arg2.type == ASM_ARG_IMM) {
-		if (arg1.bytes < 2) {
-			fprintf(stderr, "as_cmp(): can't compare immediates with smaller register!\n");
-			abort();
-		}
 		// 0100 00XB 1000 00sw : mod 111 r/m : imm
-		as_write_modrm(as, 0, "1000 00sw", as_op_code(0b111), arg1, NULL, (asm_var_t[]){
-			{ "s",  0 },  // B.1.4.4 Sign-Extend (s) Bit, Volume 2C p76
-			{ NULL, 0 }
-		});
-		as_write(as, "%32d", arg2.imm);
-		return as_slot_for_last_instr(as, 4, ASM_ARG_IMM);
-	} else if ( as_write_modrm(as, 0, "0011 10dw", arg1, arg2, NULL, NULL) ) {
+		return as_write_alu_imm(as, "as_cmp", 0b111, arg1, arg2, false);
+	} else if ( as_write_modrm(as, 0, AS_OPCODE(opcode, "0011 10dw"), arg1, arg2, NULL, NULL) ) {
 		// memory64 with qwordregister  0100 1RXB : 0011 1001  : mod qwordreg r/m
 		// qwordregister with memory64  0100 1RXB : 0011 101w1 : mod qwordreg r/m
 		//                                                   |-- PROBABLY ERROR IN DOCS
@@ -829,12 +1416,26 @@ asm_slot_t as_cmp(asm_p as, asm_arg_t arg1, asm_arg_t arg2) {
 	return as_invalid_slot();
 }
 
+// Immediate forms of ADD, SUB and CMP that always use the imm32 (or imm16) form
+asm_slot_t as_add_slot(asm_p as, asm_arg_t dest, asm_arg_t imm) {
+	return as_write_alu_imm(as, "as_add_slot", 0b000, dest, imm, true);
+}
+
+asm_slot_t as_sub_slot(asm_p as, asm_arg_t dest, asm_arg_t imm) {
+	return as_write_alu_imm(as, "as_sub_slot", 0b101, dest, imm, true);
+}
+
+asm_slot_t as_cmp_slot(asm_p as, asm_arg_t arg1, asm_arg_t imm) {
+	return as_write_alu_imm(as, "as_cmp_slot", 0b111, arg1, imm, true);
+}
+
 
 //
 // Bit and Byte Instructions
 //
 
 void as_set_cc(asm_p as, asm_cond_t condition_code, asm_arg_t dest) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p104
 	// 
 	// Combined Volumes 1, 2ABC, 3ABC, p1308
@@ -848,9 +1449,8 @@ void as_set_cc(asm_p as, asm_cond_t condition_code, asm_arg_t dest) {
 		fprintf(stderr, "as_set_cc(): target has to be an byte (8 bit) r/m!\n");
 		abort();
 	}
-	bool result = as_write_modrm(as, WMRM_FIXED_OP_SIZE, "0000 1111 : 1001 tttt", as_op_code(0b000), dest, NULL, (asm_var_t[]){
-		{ "tttt", condition_code },
-		{ NULL, 0 }
+	bool result = as_write_modrm(as, WMRM_FIXED_OP_SIZE, AS_OPCODE(opcode, "0000 1111 : 1001 tttt"), as_op_code(0b000), dest, NULL, (uint64_t[OV_COUNT]){
+		[OV_TTTT] = condition_code
 	});
 	if (result)
 		return;
@@ -865,10 +1465,12 @@ void as_set_cc(asm_p as, asm_cond_t condition_code, asm_arg_t dest) {
 //
 
 asm_slot_t as_jmp(asm_p as, asm_arg_t target) {
+	static asm_template_t opcode;
 	if (target.type == ASM_ARG_DISP) {
-		as_write(as, "1110 1001 : %32d", target.disp);
+		as_emit(as, "1110 1001 : %32d", target.disp);
+		as_record_jump(as, 0, false, target.disp);
 		return as_slot_for_last_instr(as, 4, ASM_ARG_DISP);
-	} else if ( target.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, "1111 1111", as_op_code(0b100), target, NULL, NULL) ) {
+	} else if ( target.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, AS_OPCODE(opcode, "1111 1111"), as_op_code(0b100), target, NULL, NULL) ) {
 		// Combined Volumes 1, 2ABC, 3ABC, p856:
 		// In 64-Bit Mode — The instruction’s operation size is fixed at 64 bits. If a selector points to a gate, then RIP equals
 		// the 64-bit displacement taken from gate; else RIP equals the zero-extended offset from the far pointer referenced
@@ -890,7 +1492,8 @@ asm_slot_t as_jmp_cc(asm_p as, asm_cond_t condition_code, asm_arg_t displacement
 		abort();
 	}
 	
-	as_write(as, "0000 1111 : 1000 tttt : %32d", condition_code, displacement.disp);
+	as_emit(as, "0000 1111 : 1000 tttt : %32d", condition_code, displacement.disp);
+	as_record_jump(as, condition_code, true, displacement.disp);
 	return as_slot_for_last_instr(as, 4, ASM_ARG_DISP);
 }
 
@@ -900,11 +1503,12 @@ asm_slot_t as_jmp_cc(asm_p as, asm_cond_t condition_code, asm_arg_t displacement
 //
 
 asm_slot_t as_call(asm_p as, asm_arg_t target) {
+	static asm_template_t opcode;
 	// Volume 2C - Instruction Set Reference, p93
 	if (target.type == ASM_ARG_DISP) {
-		as_write(as, "1110 1000 : %32d", target.disp);
+		as_emit(as, "1110 1000 : %32d", target.disp);
 		return as_slot_for_last_instr(as, 4, ASM_ARG_DISP);
-	} else if ( target.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, "1111 1111", as_op_code(0b010), target, NULL, NULL) ) {
+	} else if ( target.bytes == 8 && as_write_modrm(as, WMRM_FIXED_OP_SIZE, AS_OPCODE(opcode, "1111 1111"), as_op_code(0b010), target, NULL, NULL) ) {
 		return as_invalid_slot();
 	}
 	
@@ -916,22 +1520,22 @@ asm_slot_t as_call(asm_p as, asm_arg_t target) {
 asm_slot_t as_ret(asm_p as, int16_t stack_size_to_pop) {
 	// Volume 2C - Instruction Set Reference, p102
 	if (stack_size_to_pop == 0) {
-		as_write(as, "1100 0011");
+		as_emit_fixed(as, "1100 0011");
 		return as_invalid_slot();
 	}
 	
-	as_write(as, "1100 0010 : %16d", stack_size_to_pop);
+	as_emit(as, "1100 0010 : %16d", stack_size_to_pop);
 	return as_slot_for_last_instr(as, 2, ASM_ARG_IMM);
 }
 
 void as_enter(asm_p as, int16_t stack_size, int8_t level) {
 	// Volume 2C - Instruction Set Reference, p94
-	as_write(as, "1100 1000 : %16d : %8d", stack_size, level);
+	as_emit(as, "1100 1000 : %16d : %8d", stack_size, level);
 }
 
 void as_leave(asm_p as) {
 	// Volume 2C - Instruction Set Reference, p96
-	as_write(as, "1100 1001");
+	as_emit_fixed(as, "1100 1001");
 }
 
 
@@ -941,5 +1545,265 @@ void as_leave(asm_p as) {
 
 void as_syscall(asm_p as) {
 	// Volume 2C - Instruction Set Reference, p107 (B.2.1 General Purpose Instruction Formats and Encodings for 64-Bit Mode)
-	as_write(as, "0000 1111 : 0000 0101");
-}
\ No newline at end of file
+	as_emit_fixed(as, "0000 1111 : 0000 0101");
+}
+
+
+//
+// Vector instructions
+//
+
+// Mandatory prefixes, same values as the VEX.pp field
+enum { VP_NONE = 0b00, VP_66 = 0b01, VP_F3 = 0b10, VP_F2 = 0b11 };
+// Opcode maps, same values as the VEX.mmmmm field
+enum { VM_0F = 0b00001, VM_0F38 = 0b00010, VM_0F3A = 0b00011 };
+
+#define VF_IMM8      (1 << 0)  // takes an imm8
+#define VF_UNARY     (1 << 1)  // only one source, VEX.vvvv is unused
+#define VF_VEX_W1    (1 << 2)  // VEX.W has to be set
+#define VF_AVX_ONLY  (1 << 3)  // no legacy SSE encoding
+#define VF_GPR_DEST  (1 << 4)  // dest is a general purpose register
+#define VF_MERGE     (1 << 5)  // scalar move, the VEX reg-reg form takes the upper bits from src1 (VEX.vvvv)
+
+static struct {
+	char*    name;
+	uint8_t  prefix, map;
+	char*    opcode;        // opcode byte after the escape bytes
+	char*    store_opcode;  // used by moves when dest is a memory operand
+	uint32_t flags;
+	
+	// Compiled on first use: legacy load, legacy store, VEX load, VEX store
+	asm_template_t templates[4];
+} vec_ops[VEC_OP_COUNT] = {
+	[VEC_MOVUPS]       = { "movups",       VP_NONE, VM_0F,   "0001 0000", "0001 0001", VF_UNARY },
+	[VEC_MOVAPS]       = { "movaps",       VP_NONE, VM_0F,   "0010 1000", "0010 1001", VF_UNARY },
+	[VEC_MOVUPD]       = { "movupd",       VP_66,   VM_0F,   "0001 0000", "0001 0001", VF_UNARY },
+	[VEC_MOVAPD]       = { "movapd",       VP_66,   VM_0F,   "0010 1000", "0010 1001", VF_UNARY },
+	[VEC_MOVDQU]       = { "movdqu",       VP_F3,   VM_0F,   "0110 1111", "0111 1111", VF_UNARY },
+	[VEC_MOVDQA]       = { "movdqa",       VP_66,   VM_0F,   "0110 1111", "0111 1111", VF_UNARY },
+	[VEC_MOVSS]        = { "movss",        VP_F3,   VM_0F,   "0001 0000", "0001 0001", VF_UNARY | VF_MERGE },
+	[VEC_MOVSD]        = { "movsd",        VP_F2,   VM_0F,   "0001 0000", "0001 0001", VF_UNARY | VF_MERGE },
+	
+	[VEC_ADDPS]        = { "addps",        VP_NONE, VM_0F,   "0101 1000", NULL,        0 },
+	[VEC_ADDPD]        = { "addpd",        VP_66,   VM_0F,   "0101 1000", NULL,        0 },
+	[VEC_ADDSS]        = { "addss",        VP_F3,   VM_0F,   "0101 1000", NULL,        0 },
+	[VEC_ADDSD]        = { "addsd",        VP_F2,   VM_0F,   "0101 1000", NULL,        0 },
+	[VEC_SUBPS]        = { "subps",        VP_NONE, VM_0F,   "0101 1100", NULL,        0 },
+	[VEC_SUBPD]        = { "subpd",        VP_66,   VM_0F,   "0101 1100", NULL,        0 },
+	[VEC_SUBSS]        = { "subss",        VP_F3,   VM_0F,   "0101 1100", NULL,        0 },
+	[VEC_SUBSD]        = { "subsd",        VP_F2,   VM_0F,   "0101 1100", NULL,        0 },
+	[VEC_MULPS]        = { "mulps",        VP_NONE, VM_0F,   "0101 1001", NULL,        0 },
+	[VEC_MULPD]        = { "mulpd",        VP_66,   VM_0F,   "0101 1001", NULL,        0 },
+	[VEC_MULSS]        = { "mulss",        VP_F3,   VM_0F,   "0101 1001", NULL,        0 },
+	[VEC_MULSD]        = { "mulsd",        VP_F2,   VM_0F,   "0101 1001", NULL,        0 },
+	[VEC_DIVPS]        = { "divps",        VP_NONE, VM_0F,   "0101 1110", NULL,        0 },
+	[VEC_DIVPD]        = { "divpd",        VP_66,   VM_0F,   "0101 1110", NULL,        0 },
+	[VEC_DIVSS]        = { "divss",        VP_F3,   VM_0F,   "0101 1110", NULL,        0 },
+	[VEC_DIVSD]        = { "divsd",        VP_F2,   VM_0F,   "0101 1110", NULL,        0 },
+	[VEC_MINPS]        = { "minps",        VP_NONE, VM_0F,   "0101 1101", NULL,        0 },
+	[VEC_MINPD]        = { "minpd",        VP_66,   VM_0F,   "0101 1101", NULL,        0 },
+	[VEC_MINSS]        = { "minss",        VP_F3,   VM_0F,   "0101 1101", NULL,        0 },
+	[VEC_MINSD]        = { "minsd",        VP_F2,   VM_0F,   "0101 1101", NULL,        0 },
+	[VEC_MAXPS]        = { "maxps",        VP_NONE, VM_0F,   "0101 1111", NULL,        0 },
+	[VEC_MAXPD]        = { "maxpd",        VP_66,   VM_0F,   "0101 1111", NULL,        0 },
+	[VEC_MAXSS]        = { "maxss",        VP_F3,   VM_0F,   "0101 1111", NULL,        0 },
+	[VEC_MAXSD]        = { "maxsd",        VP_F2,   VM_0F,   "0101 1111", NULL,        0 },
+	[VEC_SQRTPS]       = { "sqrtps",       VP_NONE, VM_0F,   "0101 0001", NULL,        VF_UNARY },
+	[VEC_SQRTPD]       = { "sqrtpd",       VP_66,   VM_0F,   "0101 0001", NULL,        VF_UNARY },
+	[VEC_ANDPS]        = { "andps",        VP_NONE, VM_0F,   "0101 0100", NULL,        0 },
+	[VEC_ANDNPS]       = { "andnps",       VP_NONE, VM_0F,   "0101 0101", NULL,        0 },
+	[VEC_ORPS]         = { "orps",         VP_NONE, VM_0F,   "0101 0110", NULL,        0 },
+	[VEC_XORPS]        = { "xorps",        VP_NONE, VM_0F,   "0101 0111", NULL,        0 },
+	[VEC_CVTDQ2PS]     = { "cvtdq2ps",     VP_NONE, VM_0F,   "0101 1011", NULL,        VF_UNARY },
+	[VEC_CVTTPS2DQ]    = { "cvttps2dq",    VP_F3,   VM_0F,   "0101 1011", NULL,        VF_UNARY },
+	
+	[VEC_PADDB]        = { "paddb",        VP_66,   VM_0F,   "1111 1100", NULL,        0 },
+	[VEC_PADDW]        = { "paddw",        VP_66,   VM_0F,   "1111 1101", NULL,        0 },
+	[VEC_PADDD]        = { "paddd",        VP_66,   VM_0F,   "1111 1110", NULL,        0 },
+	[VEC_PADDQ]        = { "paddq",        VP_66,   VM_0F,   "1101 0100", NULL,        0 },
+	[VEC_PSUBB]        = { "psubb",        VP_66,   VM_0F,   "1111 1000", NULL,        0 },
+	[VEC_PSUBW]        = { "psubw",        VP_66,   VM_0F,   "1111 1001", NULL,        0 },
+	[VEC_PSUBD]        = { "psubd",        VP_66,   VM_0F,   "1111 1010", NULL,        0 },
+	[VEC_PSUBQ]        = { "psubq",        VP_66,   VM_0F,   "1111 1011", NULL,        0 },
+	[VEC_PMULLW]       = { "pmullw",       VP_66,   VM_0F,   "1101 0101", NULL,        0 },
+	[VEC_PMULLD]       = { "pmulld",       VP_66,   VM_0F38, "0100 0000", NULL,        0 },
+	[VEC_PMULUDQ]      = { "pmuludq",      VP_66,   VM_0F,   "1111 0100", NULL,        0 },
+	[VEC_PAND]         = { "pand",         VP_66,   VM_0F,   "1101 1011", NULL,        0 },
+	[VEC_PANDN]        = { "pandn",        VP_66,   VM_0F,   "1101 1111", NULL,        0 },
+	[VEC_POR]          = { "por",          VP_66,   VM_0F,   "1110 1011", NULL,        0 },
+	[VEC_PXOR]         = { "pxor",         VP_66,   VM_0F,   "1110 1111", NULL,        0 },
+	
+	[VEC_PCMPEQB]      = { "pcmpeqb",      VP_66,   VM_0F,   "0111 0100", NULL,        0 },
+	[VEC_PCMPEQW]      = { "pcmpeqw",      VP_66,   VM_0F,   "0111 0101", NULL,        0 },
+	[VEC_PCMPEQD]      = { "pcmpeqd",      VP_66,   VM_0F,   "0111 0110", NULL,        0 },
+	[VEC_PCMPEQQ]      = { "pcmpeqq",      VP_66,   VM_0F38, "0010 1001", NULL,        0 },
+	[VEC_PCMPGTB]      = { "pcmpgtb",      VP_66,   VM_0F,   "0110 0100", NULL,        0 },
+	[VEC_PCMPGTW]      = { "pcmpgtw",      VP_66,   VM_0F,   "0110 0101", NULL,        0 },
+	[VEC_PCMPGTD]      = { "pcmpgtd",      VP_66,   VM_0F,   "0110 0110", NULL,        0 },
+	[VEC_PCMPGTQ]      = { "pcmpgtq",      VP_66,   VM_0F38, "0011 0111", NULL,        0 },
+	[VEC_CMPPS]        = { "cmpps",        VP_NONE, VM_0F,   "1100 0010", NULL,        VF_IMM8 },
+	[VEC_CMPPD]        = { "cmppd",        VP_66,   VM_0F,   "1100 0010", NULL,        VF_IMM8 },
+	
+	[VEC_PSHUFB]       = { "pshufb",       VP_66,   VM_0F38, "0000 0000", NULL,        0 },
+	[VEC_PSHUFD]       = { "pshufd",       VP_66,   VM_0F,   "0111 0000", NULL,        VF_UNARY | VF_IMM8 },
+	[VEC_SHUFPS]       = { "shufps",       VP_NONE, VM_0F,   "1100 0110", NULL,        VF_IMM8 },
+	[VEC_PUNPCKLBW]    = { "punpcklbw",    VP_66,   VM_0F,   "0110 0000", NULL,        0 },
+	[VEC_PUNPCKHBW]    = { "punpckhbw",    VP_66,   VM_0F,   "0110 1000", NULL,        0 },
+	[VEC_PUNPCKLDQ]    = { "punpckldq",    VP_66,   VM_0F,   "0110 0010", NULL,        0 },
+	[VEC_PUNPCKHDQ]    = { "punpckhdq",    VP_66,   VM_0F,   "0110 1010", NULL,        0 },
+	[VEC_PUNPCKLQDQ]   = { "punpcklqdq",   VP_66,   VM_0F,   "0110 1100", NULL,        0 },
+	[VEC_PUNPCKHQDQ]   = { "punpckhqdq",   VP_66,   VM_0F,   "0110 1101", NULL,        0 },
+	[VEC_UNPCKLPS]     = { "unpcklps",     VP_NONE, VM_0F,   "0001 0100", NULL,        0 },
+	[VEC_UNPCKHPS]     = { "unpckhps",     VP_NONE, VM_0F,   "0001 0101", NULL,        0 },
+	[VEC_VPERMD]       = { "vpermd",       VP_66,   VM_0F38, "0011 0110", NULL,        VF_AVX_ONLY },
+	[VEC_VPERMQ]       = { "vpermq",       VP_66,   VM_0F3A, "0000 0000", NULL,        VF_AVX_ONLY | VF_UNARY | VF_IMM8 | VF_VEX_W1 },
+	[VEC_VPERM2I128]   = { "vperm2i128",   VP_66,   VM_0F3A, "0100 0110", NULL,        VF_AVX_ONLY | VF_IMM8 },
+	[VEC_VPBLENDD]     = { "vpblendd",     VP_66,   VM_0F3A, "0000 0010", NULL,        VF_AVX_ONLY | VF_IMM8 },
+	
+	[VEC_VPBROADCASTB] = { "vpbroadcastb", VP_66,   VM_0F38, "0111 1000", NULL,        VF_AVX_ONLY | VF_UNARY },
+	[VEC_VPBROADCASTD] = { "vpbroadcastd", VP_66,   VM_0F38, "0101 1000", NULL,        VF_AVX_ONLY | VF_UNARY },
+	[VEC_VPBROADCASTQ] = { "vpbroadcastq", VP_66,   VM_0F38, "0101 1001", NULL,        VF_AVX_ONLY | VF_UNARY },
+	[VEC_VBROADCASTSS] = { "vbroadcastss", VP_66,   VM_0F38, "0001 1000", NULL,        VF_AVX_ONLY | VF_UNARY },
+	
+	[VEC_PMOVMSKB]     = { "pmovmskb",     VP_66,   VM_0F,   "1101 0111", NULL,        VF_UNARY | VF_GPR_DEST },
+	[VEC_MOVMSKPS]     = { "movmskps",     VP_NONE, VM_0F,   "0101 0000", NULL,        VF_UNARY | VF_GPR_DEST },
+	[VEC_MOVMSKPD]     = { "movmskpd",     VP_66,   VM_0F,   "0101 0000", NULL,        VF_UNARY | VF_GPR_DEST },
+};
+
+static asm_template_p vec_opcode(asm_vec_op_t op, bool vex, bool store) {
+	asm_template_p tmpl = &vec_ops[op].templates[vex * 2 + store];
+	if (!tmpl->compiled) {
+		// The VEX prefix contains the escape bytes, the legacy encoding needs them
+		// in front of the opcode byte.
+		const char* escape = "";
+		if (!vex && vec_ops[op].map == VM_0F)
+			escape = "0000 1111 : ";
+		else if (!vex && vec_ops[op].map == VM_0F38)
+			escape = "0000 1111 : 0011 1000 : ";
+		else if (!vex && vec_ops[op].map == VM_0F3A)
+			escape = "0000 1111 : 0011 1010 : ";
+		
+		char format[64];
+		snprintf(format, sizeof(format), "%s%s", escape, store ? vec_ops[op].store_opcode : vec_ops[op].opcode);
+		as_template_compile(tmpl, format, NULL);
+	}
+	return tmpl;
+}
+
+// Checks the operands and writes the instruction. src1 is only used by non
+// unary VEX instructions and the reg-reg form of scalar moves. src2 becomes the
+// r/m operand.
+static void as_write_vec(asm_p as, const char* func, asm_vec_op_t op, bool vex, asm_arg_t dest, asm_arg_t src1, asm_arg_t src2, bool has_imm, uint8_t imm) {
+	if (op >= VEC_OP_COUNT) {
+		fprintf(stderr, "%s(): unknown vector operation %d!\n", func, op);
+		abort();
+	}
+	
+	uint32_t flags = vec_ops[op].flags;
+	const char* name = vec_ops[op].name;
+	bool store = as_is_mem_arg(dest);
+	if ( has_imm != ((flags & VF_IMM8) != 0) ) {
+		fprintf(stderr, "%s(): %s %s an imm8!\n", func, name, has_imm ? "doesn't take" : "needs");
+		abort();
+	} else if ( !vex && (flags & VF_AVX_ONLY) ) {
+		fprintf(stderr, "%s(): %s has no legacy SSE encoding, use the as_avx*() functions!\n", func, name);
+		abort();
+	} else if ( store && vec_ops[op].store_opcode == NULL ) {
+		fprintf(stderr, "%s(): %s can't store into memory!\n", func, name);
+		abort();
+	}
+	
+	// dest and the source (src2) have to be vector registers or memory. dest is
+	// a general purpose register for movemask and only moves can write memory.
+	bool dest_valid = (flags & VF_GPR_DEST) ? (dest.type == ASM_ARG_REG && dest.bytes >= 4) : (dest.type == ASM_ARG_VREG || store);
+	bool src_valid = (flags & VF_GPR_DEST) ? (src2.type == ASM_ARG_VREG) : (src2.type == ASM_ARG_VREG || (!store && as_is_mem_arg(src2)));
+	// Scalar moves between registers only replace the low element, the rest
+	// comes from src1 (VEX) or stays as it is (legacy SSE)
+	bool uses_src1 = !(flags & VF_UNARY) || ( (flags & VF_MERGE) && dest.type == ASM_ARG_VREG && src2.type == ASM_ARG_VREG );
+	if (!dest_valid || !src_valid || (vex && uses_src1 && src1.type != ASM_ARG_VREG)) {
+		fprintf(stderr, "%s(): unsupported arg combination for %s!\n", func, name);
+		abort();
+	}
+	
+	// The vector register that defines the operation width (VEX.L)
+	asm_arg_t vreg = (dest.type == ASM_ARG_VREG) ? dest : src2;
+	if (!vex && vreg.bytes != 16) {
+		fprintf(stderr, "%s(): legacy SSE instructions only support XMM registers!\n", func);
+		abort();
+	}
+	
+	asm_template_p opcode = vec_opcode(op, vex, store);
+	if (vex) {
+		as_write_modrm(as, WMRM_VECTOR | WMRM_VEX, opcode, dest, src2, NULL, (uint64_t[OV_COUNT]){
+			[OV_VEX_L]     = (vreg.bytes == 32) ? 1 : 0,
+			[OV_VEX_PP]    = vec_ops[op].prefix,
+			[OV_VEX_MMMMM] = vec_ops[op].map,
+			[OV_VEX_W]     = (flags & VF_VEX_W1) ? 1 : 0,
+			[OV_VEX_VVVV]  = uses_src1 ? src1.reg : 0
+		});
+	} else {
+		// The mandatory prefix goes in front of the REX byte
+		switch(vec_ops[op].prefix) {
+			case VP_66: as_emit_fixed(as, "0110 0110"); break;
+			case VP_F3: as_emit_fixed(as, "1111 0011"); break;
+			case VP_F2: as_emit_fixed(as, "1111 0010"); break;
+		}
+		as_write_modrm(as, WMRM_VECTOR, opcode, dest, src2, NULL, NULL);
+	}
+	
+	if (has_imm)
+		as_emit(as, "%8d", imm);
+}
+
+void as_sse(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src) {
+	as_write_vec(as, "as_sse", op, false, dest, src, src, false, 0);
+}
+
+void as_sse_imm(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src, uint8_t imm) {
+	as_write_vec(as, "as_sse_imm", op, false, dest, src, src, true, imm);
+}
+
+void as_avx(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src1, asm_arg_t src2) {
+	if (op < VEC_OP_COUNT && (vec_ops[op].flags & VF_MERGE)) {
+		if (dest.type != ASM_ARG_VREG || src2.type != ASM_ARG_VREG) {
+			fprintf(stderr, "as_avx(): %s only takes src1 when moving between registers, use as_avx_unary()!\n", vec_ops[op].name);
+			abort();
+		}
+	} else if (op < VEC_OP_COUNT && (vec_ops[op].flags & VF_UNARY)) {
+		fprintf(stderr, "as_avx(): %s only has one source, use as_avx_unary()!\n", vec_ops[op].name);
+		abort();
+	}
+	as_write_vec(as, "as_avx", op, true, dest, src1, src2, false, 0);
+}
+
+void as_avx_imm(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src1, asm_arg_t src2, uint8_t imm) {
+	if (op < VEC_OP_COUNT && (vec_ops[op].flags & VF_UNARY)) {
+		fprintf(stderr, "as_avx_imm(): %s only has one source, use as_avx_unary_imm()!\n", vec_ops[op].name);
+		abort();
+	}
+	as_write_vec(as, "as_avx_imm", op, true, dest, src1, src2, true, imm);
+}
+
+void as_avx_unary(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src) {
+	if (op < VEC_OP_COUNT && !(vec_ops[op].flags & VF_UNARY)) {
+		fprintf(stderr, "as_avx_unary(): %s needs two sources, use as_avx()!\n", vec_ops[op].name);
+		abort();
+	}
+	// Scalar moves between registers keep the upper bits of dest like the
+	// legacy SSE form does
+	asm_arg_t src1 = (vec_ops[op].flags & VF_MERGE) ? dest : src;
+	as_write_vec(as, "as_avx_unary", op, true, dest, src1, src, false, 0);
+}
+
+void as_avx_unary_imm(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src, uint8_t imm) {
+	if (op < VEC_OP_COUNT && !(vec_ops[op].flags & VF_UNARY)) {
+		fprintf(stderr, "as_avx_unary_imm(): %s needs two sources, use as_avx_imm()!\n", vec_ops[op].name);
+		abort();
+	}
+	as_write_vec(as, "as_avx_unary_imm", op, true, dest, src, src, true, imm);
+}
+
+void as_vzeroupper(asm_p as) {
+	// VEX.128.0F.WIG 77
+	as_emit_fixed(as, "1100 0101 : 1111 1000 : 0111 0111");
+}
@@ -2,16 +2,57 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 
+// A jump emitted by as_jmp() or as_jmp_cc() with a displacement. Recorded so
+// as_relax() can shrink it to the short form later on.
+typedef struct {
+	size_t  offset;      // of the first instruction byte
+	size_t  target;      // offset the jump goes to
+	int8_t  condition;   // asm_cond_t of as_jmp_cc(), -1 for as_jmp()
+	bool    is_short;    // rel8 instead of rel32 displacement
+	
+	// Layout before the last as_relax() run, used to translate old offsets
+	size_t  old_offset;
+	uint8_t old_size;
+} asm_jump_t, *asm_jump_p;
+
+// A displacement patched by as_patch_slot(). as_relax() patches it again after
+// the code moved.
+typedef struct {
+	size_t  value_offset;
+	size_t  next_instruction_offset;
+	uint8_t bytes;
+	size_t  target;
+} asm_fixup_t, *asm_fixup_p;
+
 /**
  * Struct is designed to be initialized when zeroed out.
+ * 
+ * The capacity of the code and data buffers grows geometrically so appending
+ * to them only rarely needs a realloc().
  */
 typedef struct {
 	uint8_t* code_ptr;
 	size_t   code_len;
+	size_t   code_cap;
 	uint8_t* data_ptr;
 	size_t   data_len;
+	size_t   data_cap;
+	
+	// Bookkeeping for as_relax()
+	asm_jump_p  jumps_ptr;
+	size_t      jumps_len, jumps_cap;
+	asm_fixup_p fixups_ptr;
+	size_t      fixups_len, fixups_cap;
+	size_t      relaxed_jumps_len;     // jumps that took part in the last as_relax()
+	size_t      relaxed_removed_bytes;  // by the last as_relax()
+	
+	// RIP relative slots that refer to the data segment, target is the offset
+	// in the data segment. See as_patch_data_slot().
+	asm_fixup_p data_fixups_ptr;
+	size_t      data_fixups_len, data_fixups_cap;
 } asm_t, *asm_p;
 
 
@@ -22,6 +63,10 @@ typedef struct {
 static inline asm_t as_empty() { return (asm_t){ 0 }; }
               void  as_free(asm_p as);
 
+// Makes sure the code and data buffers have room for at least the given number
+// of additional bytes. Use it before emitting a known amount of code.
+void as_reserve(asm_p as, size_t code_bytes, size_t data_bytes);
+
 
 //
 // Output functions
@@ -43,6 +88,32 @@ void as_save_code(asm_p as, const char* filename);
 void as_save_data(asm_p as, const char* filename);
 
 
+//
+// In-process execution
+//
+// Maps the code and data into executable memory of the current process so
+// compiled functions can be called directly, without writing and spawning an
+// ELF binary. The pages are never writable and executable at the same time
+// (W^X): Code and data are copied into writable pages and the data slots are
+// patched. Then the code pages become read and execute only and the data
+// pages read only (like the ELF segments).
+//
+
+typedef struct {
+	uint8_t* code_ptr;
+	size_t   code_size;  // multiple of the page size
+	uint8_t* data_ptr;
+	size_t   data_size;  // multiple of the page size
+} asm_jit_t, *asm_jit_p;
+
+asm_jit_t as_jit_map(asm_p as);
+void      as_jit_unmap(asm_jit_p jit);
+
+// Returns a pointer to the code at code_offset. Cast it to the function pointer
+// type of the function, e.g. int64_t (*func)(int64_t) = as_jit_func(&jit, 0);
+void*     as_jit_func(asm_jit_p jit, size_t code_offset);
+
+
 //
 // Data segment functions
 //
@@ -54,10 +125,24 @@ void as_save_data(asm_p as, const char* filename);
 size_t as_data(asm_p as, const void* ptr, size_t size);
 
 
+//
+// Code segment functions
+//
+
+/**
+ * Appends raw bytes (e.g. already encoded instructions) to the code segment
+ * and returns the byte offset where they start.
+ */
+size_t as_code(asm_p as, const void* ptr, size_t size);
+
+
 //
 // printf() like functions for writing bit data into the code segment
 //
-              
+// These parse the format string on every call. Use as_emit() for code that
+// runs often.
+//
+
 void as_write(asm_p as, const char* format, ...);
 
 typedef struct {
@@ -67,6 +152,75 @@ typedef struct {
 void as_write_with_vars(asm_p as, const char* format, asm_var_t vars[]);
 
 
+//
+// Instruction templates
+//
+// A format string like "0100 WRXB : 1011 1bbb : %64d" compiled into a list of
+// bytes. Each byte has its constant bits and the fields that are filled from
+// the arguments with a precomputed mask and shift. %Nd items copy N bits of an
+// argument as little endian data.
+//
+
+#define ASM_TEMPLATE_MAX_ITEMS  12
+#define ASM_TEMPLATE_MAX_FIELDS 8
+#define ASM_TEMPLATE_MAX_ARGS   8
+
+typedef struct {
+	uint8_t arg;    // index of the argument the bits are taken from
+	uint8_t mask;   // applied to the argument value
+	uint8_t shift;  // position of the lowest field bit within the byte
+} asm_template_field_t;
+
+typedef struct {
+	uint8_t fixed_bits;
+	uint8_t field_count;
+	asm_template_field_t fields[ASM_TEMPLATE_MAX_FIELDS];
+	
+	// For %Nd items: Number of bytes copied from argument data_arg. 0 for bit
+	// pattern bytes.
+	uint8_t data_bytes;
+	uint8_t data_arg;
+} asm_template_item_t;
+
+typedef struct {
+	bool     compiled;
+	uint8_t  len;  // bytes written by the template
+	uint8_t  item_count;
+	uint8_t  arg_count;
+	uint8_t  arg_bits[ASM_TEMPLATE_MAX_ARGS];  // 0 for bit fields, N for %Nd
+	uint32_t used_args;                        // bit mask of referenced arguments
+	asm_template_item_t items[ASM_TEMPLATE_MAX_ITEMS];
+} asm_template_t, *asm_template_p;
+
+/**
+ * Compiles format into tmpl. Without var_names each letter group or %Nd takes
+ * the next argument. Otherwise letters are matched against the NULL terminated
+ * var_names list (longest name first) and refer to the argument at the index of
+ * the matching name.
+ */
+void as_template_compile(asm_template_p tmpl, const char* format, const char* var_names[]);
+void as_template_emit(asm_p as, asm_template_p tmpl, const uint64_t args[]);
+
+/**
+ * Compiles format into tmpl on first use and returns tmpl. tmpl has to be zero
+ * initialized (e.g. a static variable) and always be used with the same format.
+ */
+asm_template_p as_template_once(asm_template_p tmpl, const char* format, const char* var_names[]);
+
+// Same as as_write() but the format is only parsed once per call site. Needs at
+// least one argument, use as_emit_fixed() for formats without arguments.
+#define as_emit(as, format, ...)  do {                                    \
+	static asm_template_t template_;                                      \
+	as_template_emit((as), as_template_once(&template_, (format), NULL),  \
+		(uint64_t[ASM_TEMPLATE_MAX_ARGS]){ __VA_ARGS__ });                \
+} while(0)
+
+#define as_emit_fixed(as, format)  do {                                          \
+	static asm_template_t template_;                                             \
+	as_template_emit((as), as_template_once(&template_, (format), NULL), NULL);  \
+} while(0)
+
+
 //
 // Argument types
 //
@@ -76,11 +230,13 @@ typedef enum {
 	ASM_ARG_IMM,
 	ASM_ARG_DISP,
 	ASM_ARG_OP_CODE,
+	ASM_ARG_VREG,  // XMM or YMM register
 	
 	ASM_ARG_MEM_REL_DISP,
 	ASM_ARG_MEM_REG,
 	ASM_ARG_MEM_DISP,
 	ASM_ARG_MEM_REG_DISP,
+	ASM_ARG_MEM_SIB_DISP,
 } asm_arg_type_t;
 
 typedef struct {
@@ -95,9 +251,8 @@ typedef struct {
 			// address = scale * index + base + disp
 			uint8_t base;
 			int32_t disp;
-			// Implemented when needed:
-			//uint8_t scale;
-			//uint8_t index;
+			uint8_t scale;  // 1, 2, 4 or 8, only used by ASM_ARG_MEM_SIB_DISP
+			uint8_t index;
 		} mem;
 	};
 } asm_arg_t, asm_arg_p;
@@ -106,6 +261,8 @@ static inline asm_arg_t as_reg(uint8_t bytes, uint8_t reg_index)        { return
 static inline asm_arg_t as_imm(uint8_t bytes, uint64_t value)           { return (asm_arg_t){ .type = ASM_ARG_IMM,     .bytes = bytes, .imm = value     }; }
 static inline asm_arg_t as_disp(int32_t displacement)                   { return (asm_arg_t){ .type = ASM_ARG_DISP,    .disp = displacement             }; }
 static inline asm_arg_t as_op_code(uint8_t opcode_extention_bits)       { return (asm_arg_t){ .type = ASM_ARG_OP_CODE, .op_code = opcode_extention_bits }; }
+static inline asm_arg_t as_xmm(uint8_t reg_index)                       { return (asm_arg_t){ .type = ASM_ARG_VREG,    .bytes = 16, .reg = reg_index    }; }
+static inline asm_arg_t as_ymm(uint8_t reg_index)                       { return (asm_arg_t){ .type = ASM_ARG_VREG,    .bytes = 32, .reg = reg_index    }; }
 
 // RIP relative memory addressing
 static inline asm_arg_t as_mem_rel(uint8_t target_bytes, int32_t displacement)                { return (asm_arg_t){ .type = ASM_ARG_MEM_REL_DISP, .bytes = target_bytes, .mem = { .disp = displacement } }; }
@@ -116,9 +273,12 @@ static inline asm_arg_t as_mem_rel(uint8_t target_bytes, int32_t displacement)
 static inline asm_arg_t as_mem_r(uint8_t target_bytes, asm_arg_t reg)                         { if(reg.type != ASM_ARG_REG) abort(); return (asm_arg_t){ .type = ASM_ARG_MEM_REG,      .bytes = target_bytes, .mem = { .base = reg.reg } }; }
 static inline asm_arg_t as_mem_d(uint8_t target_bytes, int32_t displacement)                  {                                      return (asm_arg_t){ .type = ASM_ARG_MEM_DISP,     .bytes = target_bytes, .mem = { .disp = displacement } }; }
 static inline asm_arg_t as_mem_rd(uint8_t target_bytes, asm_arg_t reg, int32_t displacement)  { if(reg.type != ASM_ARG_REG) abort(); return (asm_arg_t){ .type = ASM_ARG_MEM_REG_DISP, .bytes = target_bytes, .mem = { .base = reg.reg, .disp = displacement } }; }
-// Implemented when needed
-//static inline asm_arg_t as_mem_rrd(uint8_t target_bytes, asm_arg_t index, asm_arg_t base, int32_t displacement);
-//static inline asm_arg_t as_mem_srrd(uint8_t target_bytes, uint8_t scale, asm_arg_t index, asm_arg_t base, int32_t displacement);
+// RSP can't be used as index. scale has to be 1, 2, 4 or 8.
+static inline asm_arg_t as_mem_srrd(uint8_t target_bytes, uint8_t scale, asm_arg_t index, asm_arg_t base, int32_t displacement) {
+	if (index.type != ASM_ARG_REG || base.type != ASM_ARG_REG || index.reg == 4 || !(scale == 1 || scale == 2 || scale == 4 || scale == 8)) abort();
+	return (asm_arg_t){ .type = ASM_ARG_MEM_SIB_DISP, .bytes = target_bytes, .mem = { .base = base.reg, .disp = displacement, .scale = scale, .index = index.reg } };
+}
+static inline asm_arg_t as_mem_rrd(uint8_t target_bytes, asm_arg_t index, asm_arg_t base, int32_t displacement)                 { return as_mem_srrd(target_bytes, 1, index, base, displacement); }
 
 
 //
@@ -183,6 +343,40 @@ static inline asm_arg_t as_mem_rd(uint8_t target_bytes, asm_arg_t reg, int32_t d
 #define RSIb R6b
 #define RDIb R7b
 
+#define XMM0  as_xmm( 0)
+#define XMM1  as_xmm( 1)
+#define XMM2  as_xmm( 2)
+#define XMM3  as_xmm( 3)
+#define XMM4  as_xmm( 4)
+#define XMM5  as_xmm( 5)
+#define XMM6  as_xmm( 6)
+#define XMM7  as_xmm( 7)
+#define XMM8  as_xmm( 8)
+#define XMM9  as_xmm( 9)
+#define XMM10 as_xmm(10)
+#define XMM11 as_xmm(11)
+#define XMM12 as_xmm(12)
+#define XMM13 as_xmm(13)
+#define XMM14 as_xmm(14)
+#define XMM15 as_xmm(15)
+
+#define YMM0  as_ymm( 0)
+#define YMM1  as_ymm( 1)
+#define YMM2  as_ymm( 2)
+#define YMM3  as_ymm( 3)
+#define YMM4  as_ymm( 4)
+#define YMM5  as_ymm( 5)
+#define YMM6  as_ymm( 6)
+#define YMM7  as_ymm( 7)
+#define YMM8  as_ymm( 8)
+#define YMM9  as_ymm( 9)
+#define YMM10 as_ymm(10)
+#define YMM11 as_ymm(11)
+#define YMM12 as_ymm(12)
+#define YMM13 as_ymm(13)
+#define YMM14 as_ymm(14)
+#define YMM15 as_ymm(15)
+
 
 //
 // Condition codes
@@ -227,15 +421,54 @@ static inline asm_slot_t as_invalid_slot() { return (asm_slot_t){ 0 }; }
 size_t as_next_instr_offset(asm_p as);
 void   as_patch_slot(asm_p as, asm_slot_t slot, size_t target_offset);
 
+/**
+ * Records that a RIP relative displacement slot (e.g. returned by as_mov() or
+ * as_lea() with an as_mem_rel() operand) refers to data_offset in the data
+ * segment. The distance between code and data is only known once they're
+ * placed in memory, so as_save_elf() and as_jit_map() fill in the displacement.
+ */
+void   as_patch_data_slot(asm_p as, asm_slot_t slot, size_t data_offset);
+
+
+//
+// Branch relaxation
+//
+// as_jmp() and as_jmp_cc() with a displacement always emit the rel32 form since
+// the target usually isn't known yet. as_relax() shrinks every such jump whose
+// final displacement fits into a byte to the short form (EB rel8 or 7x rel8).
+// Jumps and slots patched with as_patch_slot() are updated to the new layout.
+// Other displacements (e.g. unpatched as_call() or as_mem_rel() values) are not
+// touched, so emit or patch them after as_relax().
+//
+// Offsets and slots taken before as_relax() are stale afterwards. Pass them
+// through as_relaxed_offset() and as_relaxed_slot() to get the new ones.
+//
+
+void       as_relax(asm_p as);
+size_t     as_relaxed_offset(asm_p as, size_t old_offset);
+asm_slot_t as_relaxed_slot(asm_p as, asm_slot_t old_slot);
+
 
 //
 // Instructions
 //
+// Immediates and displacements are encoded in the shortest form that can hold
+// their value (e.g. imm8 instead of imm32). Those short forms can't hold other
+// values, so the returned slot is invalid then. Use the _slot variants when the
+// value is patched later on. They always use a disp32 and imm32 (imm16 for 2
+// byte operands, imm64 for mov into 8 byte registers).
+//
 
 // Data Transfer Instructions
 asm_slot_t as_mov (asm_p as, asm_arg_t dest, asm_arg_t src);
 asm_slot_t as_push(asm_p as, asm_arg_t src);
 void       as_pop (asm_p as, asm_arg_t dest);
+// Only computes the address of src, the target size of src can be 0
+asm_slot_t as_lea (asm_p as, asm_arg_t dest, asm_arg_t src);
+
+asm_slot_t as_mov_slot (asm_p as, asm_arg_t dest, asm_arg_t src);
+asm_slot_t as_push_slot(asm_p as, asm_arg_t src);
+asm_slot_t as_lea_slot (asm_p as, asm_arg_t dest, asm_arg_t src);
 
 // Binary Arithmetic Instructions
 asm_slot_t as_add(asm_p as, asm_arg_t dest, asm_arg_t src);
@@ -245,6 +478,11 @@ void       as_div(asm_p as, asm_arg_t src);
 
 asm_slot_t as_cmp(asm_p as, asm_arg_t arg1, asm_arg_t arg2);
 
+// Only for immediates, return the slot of the immediate
+asm_slot_t as_add_slot(asm_p as, asm_arg_t dest, asm_arg_t imm);
+asm_slot_t as_sub_slot(asm_p as, asm_arg_t dest, asm_arg_t imm);
+asm_slot_t as_cmp_slot(asm_p as, asm_arg_t arg1, asm_arg_t imm);
+
 // Bit and Byte Instructions
 void       as_set_cc(asm_p as, asm_cond_t condition, asm_arg_t dest);
 
@@ -260,4 +498,75 @@ void as_enter(asm_p as, int16_t stack_size, int8_t level);
 void as_leave(asm_p as);
 
 // Misc instructions
-void as_syscall(asm_p as);
\ No newline at end of file
+void as_syscall(asm_p as);
+
+
+//
+// Vector instructions
+//
+// Each operation can be encoded as legacy SSE instruction with the XMM
+// registers (as_sse(), as_sse_imm()) or as VEX encoded AVX/AVX2 instruction
+// with XMM or YMM registers (as_avx*()). The VEX forms take an additional
+// source register (dest = src1 op src2) except for operations that only have
+// one source (moves, broadcasts, movemask, ...). Use as_avx_unary() for those.
+// Operations marked "AVX only" have no legacy SSE encoding.
+//
+// MOVSS and MOVSD between registers only replace the low element of dest. With
+// as_avx_unary() the rest of dest stays as it is (like the legacy SSE form),
+// as_avx() takes it from src1 (vmovss xmm1, xmm2, xmm3).
+//
+// Moves use the load or store opcode depending on whether dest is a memory
+// operand. The movemask operations write into a general purpose register.
+//
+
+typedef enum {
+	// Moves
+	VEC_MOVUPS, VEC_MOVAPS, VEC_MOVUPD, VEC_MOVAPD, VEC_MOVDQU, VEC_MOVDQA, VEC_MOVSS, VEC_MOVSD,
+	
+	// Float arithmetic
+	VEC_ADDPS, VEC_ADDPD, VEC_ADDSS, VEC_ADDSD,
+	VEC_SUBPS, VEC_SUBPD, VEC_SUBSS, VEC_SUBSD,
+	VEC_MULPS, VEC_MULPD, VEC_MULSS, VEC_MULSD,
+	VEC_DIVPS, VEC_DIVPD, VEC_DIVSS, VEC_DIVSD,
+	VEC_MINPS, VEC_MINPD, VEC_MINSS, VEC_MINSD,
+	VEC_MAXPS, VEC_MAXPD, VEC_MAXSS, VEC_MAXSD,
+	VEC_SQRTPS, VEC_SQRTPD,
+	VEC_ANDPS, VEC_ANDNPS, VEC_ORPS, VEC_XORPS,
+	VEC_CVTDQ2PS, VEC_CVTTPS2DQ,
+	
+	// Integer arithmetic
+	VEC_PADDB, VEC_PADDW, VEC_PADDD, VEC_PADDQ,
+	VEC_PSUBB, VEC_PSUBW, VEC_PSUBD, VEC_PSUBQ,
+	VEC_PMULLW, VEC_PMULLD, VEC_PMULUDQ,
+	VEC_PAND, VEC_PANDN, VEC_POR, VEC_PXOR,
+	
+	// Compares, the imm8 of CMPPS and CMPPD selects the predicate
+	VEC_PCMPEQB, VEC_PCMPEQW, VEC_PCMPEQD, VEC_PCMPEQQ,
+	VEC_PCMPGTB, VEC_PCMPGTW, VEC_PCMPGTD, VEC_PCMPGTQ,
+	VEC_CMPPS, VEC_CMPPD,
+	
+	// Shuffles
+	VEC_PSHUFB, VEC_PSHUFD, VEC_SHUFPS,
+	VEC_PUNPCKLBW, VEC_PUNPCKHBW, VEC_PUNPCKLDQ, VEC_PUNPCKHDQ, VEC_PUNPCKLQDQ, VEC_PUNPCKHQDQ,
+	VEC_UNPCKLPS, VEC_UNPCKHPS,
+	VEC_VPERMD, VEC_VPERMQ, VEC_VPERM2I128, VEC_VPBLENDD,  // AVX only
+	
+	// Broadcasts (AVX only)
+	VEC_VPBROADCASTB, VEC_VPBROADCASTD, VEC_VPBROADCASTQ, VEC_VBROADCASTSS,
+	
+	// Movemask
+	VEC_PMOVMSKB, VEC_MOVMSKPS, VEC_MOVMSKPD,
+	
+	VEC_OP_COUNT
+} asm_vec_op_t;
+
+void as_sse          (asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src);
+void as_sse_imm      (asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src, uint8_t imm);
+void as_avx          (asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src1, asm_arg_t src2);
+void as_avx_imm      (asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src1, asm_arg_t src2, uint8_t imm);
+void as_avx_unary    (asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src);
+void as_avx_unary_imm(asm_p as, asm_vec_op_t op, asm_arg_t dest, asm_arg_t src, uint8_t imm);
+
+// Clears the upper halves of all YMM registers. Use it before running legacy
+// SSE code after AVX code to avoid the transition penalty.
+void as_vzeroupper(asm_p as);
\ No newline at end of file
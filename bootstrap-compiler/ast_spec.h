@@ -42,6 +42,9 @@ END(op_def)
 BEGIN(op_buildin, OP_BUILDIN, NC_NS | NC_NAME | NC_BUILDIN)
 END(op_buildin)
 
+BEGIN(type_buildin, TYPE_BUILDIN, NC_NAME | NC_BUILDIN | NC_TYPE_INFO)
+END(type_buildin)
+
 
 // Represents general key-value node for named expressions (options list, named call args,
 // hash elements, etc.)
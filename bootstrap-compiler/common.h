@@ -102,6 +102,7 @@ node_p parse_cexpr(parser_p parser);
 SH_GEN_DECL(node_ns, str_t, node_p);
 
 node_p ns_lookup(node_p node, str_t name);
+node_p ns_lookup_or_null(node_p node, str_t name);
 
 
 //
@@ -203,9 +204,21 @@ typedef enum {
 	SF_WRITE = (1 << 1)
 } storage_flags_t;
 
+// State of the value.type member, see pass_infer_types()
+typedef enum {
+	TS_UNKNOWN = 0,
+	TS_PENDING,  // waiting on the worklist for the types of other nodes
+	TS_KNOWN,    // value.type is set (NULL if the node has no type)
+	TS_ERROR     // type couldn't be inferred and an error was reported, value.type is NULL
+} type_state_t;
+
 // TODO: update with proper type once we got the compile functions in again
 typedef int (*compile_func_t)(node_p node, int ctx, int out);
 
+// Evaluates a buildin operator on two integer literals at compile time. Returns
+// false if the operation must not be folded (e.g. a division by zero).
+typedef bool (*fold_func_t)(int64_t a, int64_t b, int64_t* result);
+
 
 #define BEGIN(nn, NN, c)           struct {
 #define MEMBER(nn, mn, ct, mt, p)  	ct mn;
@@ -230,7 +243,8 @@ struct node_s {
 	
 	// value component: node represents an interim result
 	struct {
-		node_p type;
+		node_p       type;
+		type_state_t type_state;
 	} value;
 	
 	// storage component: lvalues, node represents a memory block
@@ -247,13 +261,14 @@ struct node_s {
 		list_t(node_addr_slot_t) addr_slots;
 		list_t(asm_slot_t)       return_jump_slots;
 		
-		// TODO: one ASM buffer for compile time execution, one for storage into a binary
+		// TODO: one ASM buffer for compile time execution (run via as_jit_map()), one for storage into a binary
 		bool linked;
 	} exec;
 	
 	// buildin component: node represents functionality the compiler itself provides
 	struct {
 		compile_func_t compile_func;
+		fold_func_t    fold_func;
 		void*          private;
 	} buildin;
 	
@@ -319,5 +334,56 @@ void     ast_replace_node(node_p node, ast_it_t it, node_p new_child);
 //
 
 void   add_buildin_ops_to_module(node_p module);
+void   add_buildin_types_to_module(node_p module);
 node_p pass_resolve_uops(node_p node);
-void   fill_namespaces(node_p node, node_ns_p current_ns);
\ No newline at end of file
+node_p pass_fold_constants(node_p node);
+void   fill_namespaces(node_p node, node_ns_p current_ns);
+size_t pass_infer_types(node_p node, FILE* error_stream, size_t* error_count);
+
+// Hooks of the passes above for the pass manager. They only process the node
+// they're called for.
+void   fill_namespace_of_node(node_p node);
+node_p resolve_uops_node(node_p node);
+node_p fold_constants_node(node_p node);
+
+
+//
+// Pass manager
+//
+
+typedef void   (*pass_pre_hook_t)(node_p node);
+typedef node_p (*pass_post_hook_t)(node_p node);
+
+// A pass is a pre and/or post hook called for every node of the AST. The post
+// hook can return a node that replaces the current one. Passes are fused into
+// one traversal of the tree unless a pass needs the passes it depends on to be
+// done with the entire tree.
+typedef struct {
+	char*            name;
+	char**           depends_on;  // NULL terminated list of pass names, can be NULL
+	bool             needs_whole_tree;
+	pass_pre_hook_t  pre;
+	pass_post_hook_t post;
+} pass_spec_t, *pass_spec_p;
+
+typedef struct {
+	size_t  traversal;  // index of the traversal the pass was run in
+	double  time;       // wall time spent in the passes hooks in seconds
+	size_t  nodes;      // nodes visited
+	ssize_t bytes;      // bytes allocated (minus bytes freed)
+	
+	// Start values of pm_stats_start()
+	double  start_time;
+	size_t  start_bytes;
+} pass_stats_t, *pass_stats_p;
+
+// stats can be NULL. Otherwise it has to point to an array with one element
+// for each pass. Returns the root node (it might got replaced).
+node_p pm_run(node_p node, pass_spec_p passes, size_t pass_count, pass_stats_p stats);
+
+// For steps that are no AST passes (e.g. tokenizing or parsing)
+void pm_stats_start(pass_stats_p stats);
+void pm_stats_stop(pass_stats_p stats);
+
+void pm_print_stats_header(FILE* output);
+void pm_print_stats(FILE* output, const char* name, pass_stats_p stats);
\ No newline at end of file
@@ -1,6 +1,7 @@
 // for getopt()
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <string.h>
 #include "common.h"
 
 
@@ -9,16 +10,19 @@ int buildin_syscall(node_p node, int ctx, int out) { printf("buildin_syscall\n")
 
 int main(int argc, char** argv) {
 	// Process command line arguments
-	const char* usage = "usage: %s [ -tpno ] source-file\n";
+	const char* usage = "usage: %s [ -tpnofyT ] source-file\n";
 	bool show_tokens = false, show_parser_ast = false, show_filled_namespaces = false;
-	bool show_resloved_uops = false;
+	bool show_resloved_uops = false, show_folded_constants = false, show_types = false, show_pass_stats = false;
 	int opt;
-	while ( (opt = getopt(argc, argv, "tpno")) != -1 ) {
+	while ( (opt = getopt(argc, argv, "tpnofyT")) != -1 ) {
 		switch (opt) {
 			case 't': show_tokens = true;            break;
 			case 'p': show_parser_ast = true;        break;
 			case 'n': show_filled_namespaces = true; break;
 			case 'o': show_resloved_uops = true;     break;
+			case 'f': show_folded_constants = true;  break;
+			case 'y': show_types = true;             break;
+			case 'T': show_pass_stats = true;        break;
 			default:
 				fprintf(stderr, usage, argv[0]);
 				return 1;
@@ -42,6 +46,7 @@ int main(int argc, char** argv) {
 		syscall->buildin.private = NULL;
 		
 		add_buildin_ops_to_module(buildins);
+		add_buildin_types_to_module(buildins);
 	fill_namespaces(buildins, NULL);
 	
 	// Initialize module
@@ -54,8 +59,12 @@ int main(int argc, char** argv) {
 	
 	
 	// Step 1 - Tokenize source
+	pass_stats_t tokenizer_stats = { 0 }, parser_stats = { 0 };
 	size_t error_count = 0;
-	if ( (error_count = tokenize(module->module.source, &module->tokens, stderr)) > 0 ) {
+	pm_stats_start(&tokenizer_stats);
+		error_count = tokenize(module->module.source, &module->tokens, stderr);
+	pm_stats_stop(&tokenizer_stats);
+	if (error_count > 0) {
 		// Just output errors and exit
 		for(size_t i = 0; i < module->tokens.len; i++) {
 			token_p t = &module->tokens.ptr[i];
@@ -92,23 +101,57 @@ int main(int argc, char** argv) {
 	
 	
 	// Step 2 - Parse tokens into an AST
-	parse(module, NULL, stderr);
+	pm_stats_start(&parser_stats);
+		parse(module, NULL, stderr);
+	pm_stats_stop(&parser_stats);
 	if (show_parser_ast)
 		node_print(module, P_PARSER, P_PARSER, stdout);
 	//node_print(buildins, P_NAMESPACE, stdout);
 	
-	// Step 3 - Fill namespaces
-	fill_namespaces(module, NULL);
+	// Step 3 - Fill namespaces, resolve uops nodes and fold constant expressions.
+	// All of them only need information from the nodes above the current one so
+	// the pass manager fuses them into one traversal. Hence we can only show the
+	// AST after all of them are done.
+	pass_spec_t passes[] = {
+		{ "namespaces",     NULL,                             false, fill_namespace_of_node, NULL },
+		{ "resolve_uops",   (char*[]){ "namespaces", NULL },   false, NULL, resolve_uops_node },
+		{ "fold_constants", (char*[]){ "resolve_uops", NULL }, false, NULL, fold_constants_node },
+	};
+	size_t pass_count = sizeof(passes) / sizeof(passes[0]);
+	pass_stats_t pass_stats[sizeof(passes) / sizeof(passes[0])];
+	memset(pass_stats, 0, sizeof(pass_stats));
+	
+	module = pm_run(module, passes, pass_count, show_pass_stats ? pass_stats : NULL);
 	if (show_filled_namespaces)
 		node_print(module, P_PARSER, P_NAMESPACE, stdout);
-	
-	// Step 4 - Resolve uops nodes
-	module = pass_resolve_uops(module);
-	if (show_resloved_uops)
+	else if (show_resloved_uops || show_folded_constants)
 		node_print(module, P_PARSER, P_PARSER, stdout);
 	
+	// Step 4 - Infer types. The type of an ID or call comes from nodes anywhere
+	// in the module so this can't be fused with the passes above. It needs all
+	// uops nodes resolved.
+	pass_stats_t type_stats = { .traversal = pass_stats[pass_count - 1].traversal + 1 };
+	pm_stats_start(&type_stats);
+		type_stats.nodes = pass_infer_types(module, stderr, &error_count);
+	pm_stats_stop(&type_stats);
+	if (error_count > 0) {
+		exit_code = 1;
+		goto cleanup_tokenizer;
+	}
+	if (show_types)
+		node_print(module, P_PARSER, P_TYPE, stdout);
+	
+	if (show_pass_stats) {
+		pm_print_stats_header(stderr);
+		pm_print_stats(stderr, "tokenize", &tokenizer_stats);
+		pm_print_stats(stderr, "parse", &parser_stats);
+		for(size_t i = 0; i < pass_count; i++)
+			pm_print_stats(stderr, passes[i].name, &pass_stats[i]);
+		pm_print_stats(stderr, "infer_types", &type_stats);
+	}
+	
 	cleanup_tokenizer:
 		list_destroy(&module->tokens);
-		str_free(&module->module.source);
+		str_funload(&module->module.source);
 	return exit_code;
 }
\ No newline at end of file
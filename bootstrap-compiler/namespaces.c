@@ -44,12 +44,55 @@ void fill_namespaces(node_p node, node_ns_p current_ns) {
 }
 
 
+//
+// Hook for the pass manager
+//
+
+// Puts node and all named nodes below it up to the next namespace boundary
+// into ns. Follows the same rules as fill_namespaces().
+static void hoist_names(node_p node, node_ns_p ns) {
+	if ( (node->spec->components & NC_NAME) && node->name.len > 0 )
+		node_ns_put(ns, node->name, node);
+	
+	if (node->type == NT_IF_STMT) {
+		// The true_case belongs to the namespace of the if statement, the
+		// condition isn't searched for names at all.
+		for(size_t i = 0; i < node->if_stmt.false_case.len; i++)
+			hoist_names(node->if_stmt.false_case.ptr[i], ns);
+		return;
+	} else if (node->spec->components & NC_NS) {
+		return;
+	}
+	
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+		hoist_names(it.node, ns);
+}
+
+/**
+ * Fills the namespace of node with all names defined within it. In contrast to
+ * fill_namespaces() this doesn't recurse into nested namespaces. Instead it's
+ * called as pre hook for every node by the pass manager. Since a namespace
+ * is complete before its children are visited later hooks of the same
+ * traversal can already lookup names, even those defined further down.
+ */
+void fill_namespace_of_node(node_p node) {
+	if (node->type == NT_IF_STMT) {
+		for(size_t i = 0; i < node->if_stmt.true_case.len; i++)
+			hoist_names(node->if_stmt.true_case.ptr[i], &node->ns);
+	} else if (node->spec->components & NC_NS) {
+		for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+			hoist_names(it.node, &node->ns);
+	}
+}
+
+
 
 //
 // Lookup functions for later passes that use the filled namespaces
 //
 
-node_p ns_lookup(node_p node, str_t name) {
+// Returns NULL if name isn't defined in the scope of node
+node_p ns_lookup_or_null(node_p node, str_t name) {
 	node_p current_node = node, child_node = NULL;
 	
 	while (current_node != NULL) {
@@ -73,9 +116,15 @@ node_p ns_lookup(node_p node, str_t name) {
 		current_node = current_node->parent;
 	}
 	
-	// For now print an error. Later on we can add a flags argument and callers
-	// can request if they want NULL or an error.
-	fprintf(stderr, "ns_lookup(): unknown symbol: %.*s\n", name.len, name.ptr);
-	abort();
 	return NULL;
 }
+
+// Same as ns_lookup_or_null() but aborts if name isn't defined
+node_p ns_lookup(node_p node, str_t name) {
+	node_p target = ns_lookup_or_null(node, name);
+	if (target == NULL) {
+		fprintf(stderr, "ns_lookup(): unknown symbol: %.*s\n", name.len, name.ptr);
+		abort();
+	}
+	return target;
+}
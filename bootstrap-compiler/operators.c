@@ -1,29 +1,64 @@
 #include "common.h"
 
+//
+// Compile time evaluation of buildin operators
+//
+
+// Integer literals are 64 bit values. We calculate with unsigned values so
+// overflows wrap around like they do at runtime instead of being undefined
+// behaviour in C. Division and modulo are unsigned as well since that is what
+// the div instruction does. Comparisons are signed like the CC_LESS, etc.
+// condition codes used by the code generator.
+static bool fold_mul(int64_t a, int64_t b, int64_t* result) { *result = (uint64_t)a * (uint64_t)b; return true; }
+static bool fold_add(int64_t a, int64_t b, int64_t* result) { *result = (uint64_t)a + (uint64_t)b; return true; }
+static bool fold_sub(int64_t a, int64_t b, int64_t* result) { *result = (uint64_t)a - (uint64_t)b; return true; }
+
+// Leave divisions by zero in the code. They have to trap at runtime, not
+// crash the compiler.
+static bool fold_div(int64_t a, int64_t b, int64_t* result) {
+	if (b == 0)
+		return false;
+	*result = (uint64_t)a / (uint64_t)b;
+	return true;
+}
+static bool fold_mod(int64_t a, int64_t b, int64_t* result) {
+	if (b == 0)
+		return false;
+	*result = (uint64_t)a % (uint64_t)b;
+	return true;
+}
+
+static bool fold_lt (int64_t a, int64_t b, int64_t* result) { *result = (a <  b); return true; }
+static bool fold_le (int64_t a, int64_t b, int64_t* result) { *result = (a <= b); return true; }
+static bool fold_gt (int64_t a, int64_t b, int64_t* result) { *result = (a >  b); return true; }
+static bool fold_ge (int64_t a, int64_t b, int64_t* result) { *result = (a >= b); return true; }
+static bool fold_eq (int64_t a, int64_t b, int64_t* result) { *result = (a == b); return true; }
+static bool fold_neq(int64_t a, int64_t b, int64_t* result) { *result = (a != b); return true; }
+
+
 // Based on http://en.cppreference.com/w/c/language/operator_precedence
 // Worth a look because of bitwise and comparison ops: http://wiki.dlang.org/Operator_precedence
 // CAUTION: Operators with the same precedence need the same associativity!
 // Otherwise it probably gets complicates... not sure.
-struct { char* name; int precedence; op_assoc_t assoc; } operators[] = {
-	[T_MUL]    = { "mul",  80, LEFT_TO_RIGHT },
-	[T_DIV]    = { "div",  80, LEFT_TO_RIGHT },
-	[T_MOD]    = { "mod",  80, LEFT_TO_RIGHT },
+struct { char* name; int precedence; op_assoc_t assoc; fold_func_t fold_func; } operators[] = {
+	[T_MUL]    = { "mul",  80, LEFT_TO_RIGHT, fold_mul },
+	[T_DIV]    = { "div",  80, LEFT_TO_RIGHT, fold_div },
+	[T_MOD]    = { "mod",  80, LEFT_TO_RIGHT, fold_mod },
 	
-	[T_ADD]    = { "add",  70, LEFT_TO_RIGHT },
-	[T_SUB]    = { "sub",  70, LEFT_TO_RIGHT },
+	[T_ADD]    = { "add",  70, LEFT_TO_RIGHT, fold_add },
+	[T_SUB]    = { "sub",  70, LEFT_TO_RIGHT, fold_sub },
 	
-	[T_LT]     = { "lt",   50, LEFT_TO_RIGHT },
-	[T_LE]     = { "le",   50, LEFT_TO_RIGHT },
-	[T_GT]     = { "gt",   50, LEFT_TO_RIGHT },
-	[T_GE]     = { "ge",   50, LEFT_TO_RIGHT },
+	[T_LT]     = { "lt",   50, LEFT_TO_RIGHT, fold_lt  },
+	[T_LE]     = { "le",   50, LEFT_TO_RIGHT, fold_le  },
+	[T_GT]     = { "gt",   50, LEFT_TO_RIGHT, fold_gt  },
+	[T_GE]     = { "ge",   50, LEFT_TO_RIGHT, fold_ge  },
 	
-	[T_EQ]     = { "eq",   40, LEFT_TO_RIGHT },
-	[T_NEQ]    = { "neq",  40, LEFT_TO_RIGHT },
+	[T_EQ]     = { "eq",   40, LEFT_TO_RIGHT, fold_eq  },
+	[T_NEQ]    = { "neq",  40, LEFT_TO_RIGHT, fold_neq },
 	
-	[T_ASSIGN] = { "assign", 0, RIGHT_TO_LEFT },
+	[T_ASSIGN] = { "assign", 0, RIGHT_TO_LEFT, NULL },
 };
 
-
 void add_buildin_ops_to_module(node_p module) {
 	if (module->type != NT_MODULE) {
 		fprintf(stderr, "add_buildin_ops_to_namespace(): Can only add buildin op definitions to a module!\n");
@@ -43,6 +78,7 @@ void add_buildin_ops_to_module(node_p module) {
 		op->op_def.assoc = operators[i].assoc;
 		
 		op->buildin.compile_func = NULL;
+		op->buildin.fold_func = operators[i].fold_func;
 		op->buildin.private = NULL;
 	}
 }
@@ -62,6 +98,14 @@ node_p pass_resolve_uops(node_p node) {
 			ast_replace_node(node, it, new_child);
 	}
 	
+	return resolve_uops_node(node);
+}
+
+/**
+ * Resolves one uops node whose children are already resolved. Returns the op
+ * node that replaces it. Used as post hook by the pass manager.
+ */
+node_p resolve_uops_node(node_p node) {
 	// Leave non uops nodes untouched
 	if (node->type != NT_UOPS)
 		return node;
@@ -138,4 +182,49 @@ node_p pass_resolve_uops(node_p node) {
 	// recursive iteration code above replaces this uops node with the returned
 	// op node.
 	return node->uops.list.ptr[0];
-}
\ No newline at end of file
+}
+
+
+/**
+ * Replaces op nodes of buildin operators whose operands are both integer
+ * literals with an integer literal of the result. Works bottom up so nested
+ * constant expressions like "1 * 2 + 3 * 4" collapse into one literal. Needs
+ * resolved uops nodes.
+ */
+node_p pass_fold_constants(node_p node) {
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it)) {
+		node_p new_child = pass_fold_constants(it.node);
+		if (new_child != it.node)
+			ast_replace_node(node, it, new_child);
+	}
+	
+	return fold_constants_node(node);
+}
+
+/**
+ * Folds one op node whose children are already folded. Used as post hook by
+ * the pass manager.
+ */
+node_p fold_constants_node(node_p node) {
+	if (node->type != NT_OP)
+		return node;
+	
+	node_p op_def = node->op.def;
+	if ( !(op_def->type == NT_OP_BUILDIN && op_def->buildin.fold_func != NULL) )
+		return node;
+	if ( !(node->op.a->type == NT_INTL && node->op.b->type == NT_INTL) )
+		return node;
+	
+	int64_t result = 0;
+	if ( !op_def->buildin.fold_func(node->op.a->intl.value, node->op.b->intl.value, &result) )
+		return node;
+	
+	node_p literal = node_alloc(NT_INTL);
+	literal->parent = node->parent;
+	literal->intl.value = result;
+	
+	node_first_token(literal, node->tokens.ptr);
+	node_last_token(literal, node->tokens.ptr + node->tokens.len - 1);
+	
+	return literal;
+}
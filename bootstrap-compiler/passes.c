@@ -0,0 +1,180 @@
+// For clock_gettime()
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include "common.h"
+
+
+//
+// Measurement functions
+//
+
+static double current_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t allocated_bytes() {
+	struct mallinfo2 info = mallinfo2();
+	// uordblks only counts the heap, large blocks are mmap()ed separately
+	return info.uordblks + info.hblkhd;
+}
+
+void pm_stats_start(pass_stats_p stats) {
+	stats->start_bytes = allocated_bytes();
+	stats->start_time = current_time();
+}
+
+void pm_stats_stop(pass_stats_p stats) {
+	stats->time += current_time() - stats->start_time;
+	stats->bytes += (ssize_t)(allocated_bytes() - stats->start_bytes);
+}
+
+
+//
+// Traversal
+//
+
+typedef struct {
+	pass_spec_p  passes;
+	pass_stats_p stats;
+	size_t*      group;  // indices of the passes fused into this traversal
+	size_t       group_len;
+} pm_walk_t, *pm_walk_p;
+
+static node_p pm_post_walk(pm_walk_p walk, node_p node, size_t first_hook);
+
+// Runs the post hooks of the traversal starting with the first_hook pass
+static node_p pm_post_hooks(pm_walk_p walk, node_p node, size_t first_hook) {
+	for(size_t i = first_hook; i < walk->group_len; i++) {
+		size_t idx = walk->group[i];
+		pass_spec_p pass = &walk->passes[idx];
+		if (pass->post == NULL)
+			continue;
+		
+		node_p new_node = NULL;
+		if (walk->stats) {
+			pm_stats_start(&walk->stats[idx]);
+			new_node = pass->post(node);
+			pm_stats_stop(&walk->stats[idx]);
+			// Passes with both hooks already counted the node in the pre hook
+			if (pass->pre == NULL)
+				walk->stats[idx].nodes++;
+		} else {
+			new_node = pass->post(node);
+		}
+		
+		// A replacement can be an entirely new subtree (e.g. the op nodes of a
+		// resolved uops node). The later passes of this traversal haven't seen
+		// any of it so run their post hooks over the whole subtree.
+		if (new_node != node)
+			return pm_post_walk(walk, new_node, i + 1);
+	}
+	
+	return node;
+}
+
+static node_p pm_post_walk(pm_walk_p walk, node_p node, size_t first_hook) {
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it)) {
+		node_p new_child = pm_post_walk(walk, it.node, first_hook);
+		if (new_child != it.node)
+			ast_replace_node(node, it, new_child);
+	}
+	
+	return pm_post_hooks(walk, node, first_hook);
+}
+
+static node_p pm_walk(pm_walk_p walk, node_p node) {
+	for(size_t i = 0; i < walk->group_len; i++) {
+		size_t idx = walk->group[i];
+		pass_spec_p pass = &walk->passes[idx];
+		if (pass->pre == NULL)
+			continue;
+		
+		if (walk->stats) {
+			pm_stats_start(&walk->stats[idx]);
+			pass->pre(node);
+			pm_stats_stop(&walk->stats[idx]);
+			walk->stats[idx].nodes++;
+		} else {
+			pass->pre(node);
+		}
+	}
+	
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it)) {
+		node_p new_child = pm_walk(walk, it.node);
+		if (new_child != it.node)
+			ast_replace_node(node, it, new_child);
+	}
+	
+	return pm_post_hooks(walk, node, 0);
+}
+
+
+/**
+ * Runs the passes in the given order. Passes are added to the current
+ * traversal until a pass needs the whole tree processed by a dependency that is
+ * part of the current traversal. Then the current traversal is run and the
+ * pass starts the next one.
+ */
+node_p pm_run(node_p node, pass_spec_p passes, size_t pass_count, pass_stats_p stats) {
+	size_t group[pass_count];
+	pm_walk_t walk = { passes, stats, group, 0 };
+	size_t traversal = 0;
+	
+	for(size_t i = 0; i < pass_count; i++) {
+		bool depends_on_current_traversal = false;
+		
+		for(char** dep = passes[i].depends_on; dep != NULL && *dep != NULL; dep++) {
+			ssize_t dep_idx = -1;
+			for(size_t j = 0; j < i; j++) {
+				if ( strcmp(passes[j].name, *dep) == 0 )
+					dep_idx = j;
+			}
+			
+			if (dep_idx == -1) {
+				fprintf(stderr, "pm_run(): pass %s depends on %s which doesn't run before it!\n", passes[i].name, *dep);
+				abort();
+			}
+			
+			for(size_t j = 0; j < walk.group_len; j++) {
+				if (walk.group[j] == (size_t)dep_idx)
+					depends_on_current_traversal = true;
+			}
+		}
+		
+		if (depends_on_current_traversal && passes[i].needs_whole_tree) {
+			node = pm_walk(&walk, node);
+			walk.group_len = 0;
+			traversal++;
+		}
+		
+		walk.group[walk.group_len++] = i;
+		if (stats)
+			stats[i].traversal = traversal;
+	}
+	
+	if (walk.group_len > 0)
+		node = pm_walk(&walk, node);
+	
+	return node;
+}
+
+
+//
+// Printing
+//
+
+void pm_print_stats_header(FILE* output) {
+	fprintf(output, "%-16s %9s %12s %10s %12s %12s\n", "pass", "traversal", "time (ms)", "nodes", "nodes/s", "bytes");
+}
+
+void pm_print_stats(FILE* output, const char* name, pass_stats_p stats) {
+	// Steps that are no AST passes don't visit any nodes
+	if (stats->nodes > 0)
+		fprintf(output, "%-16s %9zu %12.3f %10zu %12.0f %12zd\n", name, stats->traversal, stats->time * 1000, stats->nodes, stats->nodes / stats->time, stats->bytes);
+	else
+		fprintf(output, "%-16s %9s %12.3f %10s %12s %12zd\n", name, "-", stats->time * 1000, "-", "-", stats->bytes);
+}
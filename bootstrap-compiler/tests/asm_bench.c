@@ -0,0 +1,82 @@
+// For clock_gettime()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include "../asm.h"
+
+
+//
+// Measures how many instructions the assembler can encode per second
+//
+
+#define ROUNDS           1000
+#define INSTR_PER_ROUND  10000
+
+static double current_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, size_t instr_count, double duration) {
+	printf("%-32s %8.2f M instr/s\n", name, instr_count / duration / 1e6);
+}
+
+
+// A mix of instructions a code generator usually emits, 10 per iteration
+static void emit_instruction_mix(asm_p as, size_t i) {
+	uint8_t reg = i % 16;
+	as_mov(as, as_reg(8, reg), RAX);
+	as_mov(as, as_mem_rd(8, RBP, -8 * (int32_t)(i % 8)), as_reg(8, reg));
+	as_add(as, as_reg(8, reg), as_imm(4, i % 128));
+	as_sub(as, RSP, as_imm(4, 16));
+	as_cmp(as, as_reg(8, reg), RCX);
+	as_set_cc(as, CC_LESS, R0b);
+	as_jmp_cc(as, CC_EQUAL, as_disp(-64));
+	as_push(as, as_reg(8, reg));
+	as_pop(as, as_reg(8, reg));
+	as_mul(as, RBX);
+}
+
+void bench_instructions() {
+	asm_t as = as_empty();
+	
+	double start = current_time();
+	for(size_t round = 0; round < ROUNDS; round++) {
+		for(size_t i = 0; i < INSTR_PER_ROUND / 10; i++)
+			emit_instruction_mix(&as, i);
+		as_free(&as);
+	}
+	double duration = current_time() - start;
+	
+	report("instruction functions", ROUNDS * INSTR_PER_ROUND, duration);
+}
+
+// Same encoding once with a format parsed on every call and once with a
+// template compiled on first use.
+void bench_write_vs_emit() {
+	asm_t as = as_empty();
+	
+	double start = current_time();
+	for(size_t round = 0; round < ROUNDS; round++) {
+		for(size_t i = 0; i < INSTR_PER_ROUND; i++)
+			as_write(&as, "0100 WRXB : 1000 1001 : mm rrr bbb : %32d", 1, i & 1, 0, i & 1, 0b10, i & 7, 0b101, (uint32_t)i);
+		as_free(&as);
+	}
+	report("as_write()", ROUNDS * INSTR_PER_ROUND, current_time() - start);
+	
+	start = current_time();
+	for(size_t round = 0; round < ROUNDS; round++) {
+		for(size_t i = 0; i < INSTR_PER_ROUND; i++)
+			as_emit(&as, "0100 WRXB : 1000 1001 : mm rrr bbb : %32d", 1, i & 1, 0, i & 1, 0b10, i & 7, 0b101, (uint32_t)i);
+		as_free(&as);
+	}
+	report("as_emit()", ROUNDS * INSTR_PER_ROUND, current_time() - start);
+}
+
+
+int main() {
+	bench_instructions();
+	bench_write_vs_emit();
+	return 0;
+}
@@ -37,6 +37,35 @@ void test_empty_and_free() {
 	as_free(as2);
 }
 
+void test_buffers() {
+	asm_p as = &(asm_t){ 0 };
+	
+	as_reserve(as, 100, 10);
+	st_check(as->code_cap >= 100);
+	st_check(as->data_cap >= 10);
+	st_check_int(as->code_len, 0);
+	st_check_int(as->data_len, 0);
+	
+	st_check_int(as_code(as, (uint8_t[]){ 0x0f, 0x05 }, 2), 0);
+	st_check_int(as_code(as, (uint8_t[]){ 0xc3 }, 1), 2);
+	st_check( code_cmp(as, (uint8_t[]){ 0x0f, 0x05, 0xc3 }, 3) );
+	as_free(as);
+	st_check_int(as->code_cap, 0);
+	
+	// Emitting a megabyte of code should only need a few reallocations
+	size_t capacity_changes = 0, last_capacity = 0;
+	while (as->code_len < 1024 * 1024) {
+		as_syscall(as);
+		if (as->code_cap != last_capacity) {
+			capacity_changes++;
+			last_capacity = as->code_cap;
+		}
+	}
+	st_check(capacity_changes < 16);
+	st_check(as->code_cap < 2 * as->code_len + 4096);
+	as_free(as);
+}
+
 void test_write() {
 	asm_p as = &(asm_t){ 0 };
 	
@@ -113,6 +142,33 @@ void test_write_with_vars() {
 	as_free(as);
 }
 
+void test_emit() {
+	asm_p as = &(asm_t){ 0 };
+	
+	// The same call site reuses its template, make sure the arguments of each
+	// call end up in the code anyway.
+	for(int i = 0; i < 3; i++)
+		as_emit(as, "0100 WRXB : mm rrr bbb : %16d", 1, 0, 0, i & 1, 0b11, i, 0b001, 0xaa00 + i);
+	st_check( code_cmp(as, (uint8_t[]){
+		0b01001000, 0b11000001, 0x00, 0xaa,
+		0b01001001, 0b11001001, 0x01, 0xaa,
+		0b01001000, 0b11010001, 0x02, 0xaa
+	}, 12) );
+	as_free(as);
+	
+	as_emit_fixed(as, "0000 1111 : 0000 0101");
+	st_check( code_cmp(as, (uint8_t[]){ 0x0f, 0x05 }, 2) );
+	as_free(as);
+	
+	asm_template_t tmpl;
+	as_template_compile(&tmpl, "0100 WRXB : 1011 1bbb : %64d", NULL);
+	st_check_int(tmpl.len, 10);
+	st_check_int(tmpl.arg_count, 6);
+	as_template_emit(as, &tmpl, (uint64_t[]){ 1, 0, 0, 1, 0b1001, 0x1122334455667788 });
+	st_check( code_cmp(as, (uint8_t[]){ 0b01001001, 0b10111001, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 }, 10) );
+	as_free(as);
+}
+
 void test_write_elf() {
 	asm_p as = &(asm_t){ 0 };
 	size_t code_vaddr = 4 * 1024 * 1024;
@@ -809,6 +865,572 @@ void test_instructions_for_if_and_backpatching() {
 	st_check_int(status_code, 17);
 }
 
+void test_shortest_encodings() {
+	asm_p as = &(asm_t){ 0 };
+	char* disassembly = NULL;
+	
+	// Sign extended imm8 instead of imm32 (or imm16)
+	as_free(as);
+		as_add(as, RAX, as_imm(4, 1));
+		as_add(as, RAX, as_imm(4, 0x80));
+		as_sub(as, R9, as_imm(4, (uint64_t)-1));
+		as_sub(as, R9, as_imm(4, (uint64_t)-129));
+		as_cmp(as, as_reg(4, 0), as_imm(4, 0x7f));
+		as_cmp(as, as_reg(2, 0), as_imm(2, 0x1234));
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"add    rax,0x1\n"
+		"add    rax,0x80\n"
+		"sub    r9,0xffffffffffffffff\n"
+		"sub    r9,0xffffffffffffff7f\n"
+		"cmp    eax,0x7f\n"
+		"cmp    ax,0x1234\n"
+	);
+	st_check_int(as->code_len, 4 + 7 + 4 + 7 + 3 + 5);
+	
+	// Zero extended imm32, sign extended imm32 or imm64
+	as_free(as);
+		as_mov(as, RAX, as_imm(8, 5));
+		as_mov(as, R9, as_imm(8, 0xffffffff));
+		as_mov(as, RAX, as_imm(8, (uint64_t)-2));
+		as_mov(as, RAX, as_imm(8, 0x100000000));
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"mov    eax,0x5\n"
+		"mov    r9d,0xffffffff\n"
+		"mov    rax,0xfffffffffffffffe\n"
+		"movabs rax,0x100000000\n"
+	);
+	st_check_int(as->code_len, 5 + 6 + 7 + 10);
+	
+	as_free(as);
+		as_push(as, as_imm(4, 5));
+		as_push(as, as_imm(4, (uint64_t)-5));
+		as_push(as, as_imm(4, 0x1000));
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"push   0x5\n"
+		"push   0xfffffffffffffffb\n"
+		"push   0x1000\n"
+	);
+	st_check_int(as->code_len, 2 + 2 + 5);
+	
+	// No displacement, disp8 or disp32
+	as_free(as);
+		as_mov(as, RAX, as_mem_r(8, RCX));
+		as_mov(as, RAX, as_mem_rd(8, RDX, 0));
+		as_mov(as, RAX, as_mem_rd(8, RDX, 0x10));
+		as_mov(as, RAX, as_mem_rd(8, RDX, -8));
+		as_mov(as, RAX, as_mem_rd(8, RDX, 0x100));
+		as_mov(as, RAX, as_mem_r(8, RSP));
+		as_mov(as, RAX, as_mem_rd(8, R12, 0x10));
+		as_mov(as, RAX, as_mem_r(8, RBP));
+		as_mov(as, RAX, as_mem_r(8, R13));
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"mov    rax,QWORD PTR [rcx]\n"
+		"mov    rax,QWORD PTR [rdx]\n"
+		"mov    rax,QWORD PTR [rdx+0x10]\n"
+		"mov    rax,QWORD PTR [rdx-0x8]\n"
+		"mov    rax,QWORD PTR [rdx+0x100]\n"
+		"mov    rax,QWORD PTR [rsp]\n"
+		"mov    rax,QWORD PTR [r12+0x10]\n"
+		"mov    rax,QWORD PTR [rbp+0x0]\n"
+		"mov    rax,QWORD PTR [r13+0x0]\n"
+	);
+	st_check_int(as->code_len, 3 + 3 + 4 + 4 + 7 + 4 + 5 + 4 + 4);
+	
+	as_free(as);
+	free(disassembly);
+}
+
+void test_slot_encodings() {
+	asm_p as = &(asm_t){ 0 };
+	char* disassembly = NULL;
+	
+	// Short forms return no slot since they can't hold other values
+	as_free(as);
+		st_check_int(as_add(as, RAX, as_imm(4, 1)).bytes, 0);
+		st_check_int(as_push(as, as_imm(4, 5)).bytes, 0);
+		st_check_int(as_mov(as, RAX, as_imm(8, 5)).bytes, 0);
+		st_check_int(as_mov(as, RAX, as_imm(8, (uint64_t)-2)).bytes, 0);
+		st_check_int(as_mov(as, RAX, as_mem_r(8, RCX)).bytes, 0);
+		st_check_int(as_mov(as, RAX, as_mem_rd(8, RDX, 0x10)).bytes, 0);
+		st_check_int(as_mov(as, as_reg(4, 0), as_imm(4, 5)).bytes, 4);
+		st_check_int(as_mov(as, RAX, as_mem_rd(8, RDX, 0x100)).bytes, 4);
+	
+	// The _slot variants always use the wide form, patch the slots afterwards
+	asm_slot_t slots[7];
+	as_free(as);
+		slots[0] = as_add_slot(as, RAX, as_imm(4, 0));
+		slots[1] = as_sub_slot(as, as_reg(2, 0), as_imm(2, 0));
+		slots[2] = as_cmp_slot(as, R9, as_imm(4, 0));
+		slots[3] = as_push_slot(as, as_imm(1, 0));
+		slots[4] = as_mov_slot(as, RAX, as_imm(8, 0));
+		slots[5] = as_mov_slot(as, RAX, as_mem_r(8, RBX));
+		slots[6] = as_lea_slot(as, RCX, as_mem_rd(8, R12, 0));
+	
+	uint8_t expected_bytes[7] = { 4, 2, 4, 4, 8, 4, 4 };
+	uint64_t values[7] = { 0x12345678, 0x1234, 0x1000, 0x7fff0000, 0x1122334455667788, 0x200, 0x10000 };
+	for(size_t i = 0; i < 7; i++) {
+		st_check_int(slots[i].bytes, expected_bytes[i]);
+		memcpy(as->code_ptr + slots[i].value_offset, &values[i], slots[i].bytes);
+	}
+	st_check_int(slots[5].value_type, ASM_ARG_DISP);
+	
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"add    rax,0x12345678\n"
+		"sub    ax,0x1234\n"
+		"cmp    r9,0x1000\n"
+		"push   0x7fff0000\n"
+		"movabs rax,0x1122334455667788\n"
+		"mov    rax,QWORD PTR [rbx+0x200]\n"
+		"lea    rcx,[r12+0x10000]\n"
+	);
+	st_check_int(as->code_len, 7 + 5 + 7 + 5 + 10 + 7 + 8);
+	
+	as_free(as);
+	free(disassembly);
+}
+
+void test_sib_addressing() {
+	asm_p as = &(asm_t){ 0 };
+	char* disassembly = NULL;
+	
+	// All index registers except RSP
+	as_free(as);
+		for(size_t i = 0; i < 16; i++) {
+			if (i != 4)
+				as_mov(as, RAX, as_mem_srrd(8, 8, as_reg(8, i), RBX, 0x10));
+		}
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"mov    rax,QWORD PTR [rbx+rax*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+rcx*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+rdx*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+rbx*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+rbp*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+rsi*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+rdi*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r8*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r9*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r10*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r11*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r12*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r13*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r14*8+0x10]\n"
+		"mov    rax,QWORD PTR [rbx+r15*8+0x10]\n"
+	);
+	
+	// All base registers without displacement, RBP and R13 need a disp8 of 0
+	as_free(as);
+		for(size_t i = 0; i < 16; i++)
+			as_mov(as, as_mem_rrd(8, R9, as_reg(8, i), 0), RDX);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"mov    QWORD PTR [rax+r9*1],rdx\n"
+		"mov    QWORD PTR [rcx+r9*1],rdx\n"
+		"mov    QWORD PTR [rdx+r9*1],rdx\n"
+		"mov    QWORD PTR [rbx+r9*1],rdx\n"
+		"mov    QWORD PTR [rsp+r9*1],rdx\n"
+		"mov    QWORD PTR [rbp+r9*1+0x0],rdx\n"
+		"mov    QWORD PTR [rsi+r9*1],rdx\n"
+		"mov    QWORD PTR [rdi+r9*1],rdx\n"
+		"mov    QWORD PTR [r8+r9*1],rdx\n"
+		"mov    QWORD PTR [r9+r9*1],rdx\n"
+		"mov    QWORD PTR [r10+r9*1],rdx\n"
+		"mov    QWORD PTR [r11+r9*1],rdx\n"
+		"mov    QWORD PTR [r12+r9*1],rdx\n"
+		"mov    QWORD PTR [r13+r9*1+0x0],rdx\n"
+		"mov    QWORD PTR [r14+r9*1],rdx\n"
+		"mov    QWORD PTR [r15+r9*1],rdx\n"
+	);
+	
+	// Scales and displacement sizes
+	as_free(as);
+		as_add(as, as_reg(4, 0), as_mem_srrd(4, 1, RCX, RDX, -1));
+		as_sub(as, as_reg(4, 0), as_mem_srrd(4, 2, RCX, RDX, 0x80));
+		as_cmp(as, as_reg(2, 0), as_mem_srrd(2, 4, RCX, R12, 0));
+		as_mov(as, as_reg(1, 0), as_mem_srrd(1, 8, RCX, RSP, 0x12345678));
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"add    eax,DWORD PTR [rdx+rcx*1-0x1]\n"
+		"sub    eax,DWORD PTR [rdx+rcx*2+0x80]\n"
+		"cmp    ax,WORD PTR [r12+rcx*4]\n"
+		"mov    al,BYTE PTR [rsp+rcx*8+0x12345678]\n"
+	);
+	
+	as_free(as);
+		as_lea(as, RAX, as_mem_srrd(0, 4, RCX, RDX, 8));
+		as_lea(as, R15, as_mem_rrd(0, R8, R13, 0));
+		as_lea(as, as_reg(4, 1), as_mem_rd(8, RSP, -16));
+		as_lea(as, RDI, as_mem_rel(8, 0x100));
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"lea    rax,[rdx+rcx*4+0x8]\n"
+		"lea    r15,[r13+r8*1+0x0]\n"
+		"lea    ecx,[rsp-0x10]\n"
+		"lea    rdi,[rip+0x100]        # 0x400115\n"
+	);
+	
+	as_free(as);
+	free(disassembly);
+}
+
+void test_sse_instructions() {
+	asm_p as = &(asm_t){ 0 };
+	char* disassembly = NULL;
+	
+	as_free(as);
+		as_sse(as, VEC_MOVUPS, XMM0, as_mem_r(16, RSI));
+		as_sse(as, VEC_MOVUPS, as_mem_rd(16, RDI, 16), XMM15);
+		as_sse(as, VEC_MOVDQU, XMM8, as_mem_srrd(16, 4, RAX, R9, 0));
+		as_sse(as, VEC_MOVDQA, as_mem_r(16, R12), XMM1);
+		as_sse(as, VEC_MOVSS, XMM1, as_mem_rd(4, RSP, 4));
+		as_sse(as, VEC_MOVSD, as_mem_rel(8, 0x100), XMM2);
+		as_sse(as, VEC_MOVAPS, XMM3, XMM4);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"movups xmm0,XMMWORD PTR [rsi]\n"
+		"movups XMMWORD PTR [rdi+0x10],xmm15\n"
+		"movdqu xmm8,XMMWORD PTR [r9+rax*4]\n"
+		"movdqa XMMWORD PTR [r12],xmm1\n"
+		"movss  xmm1,DWORD PTR [rsp+0x4]\n"
+		"movsd  QWORD PTR [rip+0x100],xmm2        # 0x400122\n"
+		"movaps xmm3,xmm4\n"
+	);
+	
+	as_free(as);
+		as_sse(as, VEC_ADDPS, XMM0, XMM1);
+		as_sse(as, VEC_ADDSD, XMM2, XMM3);
+		as_sse(as, VEC_MULPD, XMM10, as_mem_r(16, RAX));
+		as_sse(as, VEC_DIVSS, XMM0, XMM15);
+		as_sse(as, VEC_MAXPS, XMM1, XMM2);
+		as_sse(as, VEC_SQRTPS, XMM1, XMM2);
+		as_sse(as, VEC_XORPS, XMM0, XMM0);
+		as_sse(as, VEC_CVTDQ2PS, XMM0, XMM1);
+		as_sse(as, VEC_PADDD, XMM9, XMM10);
+		as_sse(as, VEC_PSUBQ, XMM0, XMM1);
+		as_sse(as, VEC_PMULLD, XMM0, XMM1);
+		as_sse(as, VEC_PAND, XMM0, as_mem_rd(16, RBP, -16));
+		as_sse(as, VEC_PXOR, XMM7, XMM8);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"addps  xmm0,xmm1\n"
+		"addsd  xmm2,xmm3\n"
+		"mulpd  xmm10,XMMWORD PTR [rax]\n"
+		"divss  xmm0,xmm15\n"
+		"maxps  xmm1,xmm2\n"
+		"sqrtps xmm1,xmm2\n"
+		"xorps  xmm0,xmm0\n"
+		"cvtdq2ps xmm0,xmm1\n"
+		"paddd  xmm9,xmm10\n"
+		"psubq  xmm0,xmm1\n"
+		"pmulld xmm0,xmm1\n"
+		"pand   xmm0,XMMWORD PTR [rbp-0x10]\n"
+		"pxor   xmm7,xmm8\n"
+	);
+	
+	as_free(as);
+		as_sse(as, VEC_PCMPEQB, XMM0, XMM1);
+		as_sse(as, VEC_PCMPGTQ, XMM0, XMM1);
+		as_sse_imm(as, VEC_CMPPS, XMM0, XMM1, 1);
+		as_sse(as, VEC_PSHUFB, XMM0, XMM1);
+		as_sse_imm(as, VEC_PSHUFD, XMM0, XMM1, 0x1b);
+		as_sse_imm(as, VEC_SHUFPS, XMM0, XMM1, 0x44);
+		as_sse(as, VEC_PUNPCKLQDQ, XMM0, XMM1);
+		as_sse(as, VEC_UNPCKHPS, XMM0, XMM1);
+		as_sse(as, VEC_PMOVMSKB, as_reg(4, 0), XMM3);
+		as_sse(as, VEC_MOVMSKPS, as_reg(4, 8), XMM9);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"pcmpeqb xmm0,xmm1\n"
+		"pcmpgtq xmm0,xmm1\n"
+		"cmpltps xmm0,xmm1\n"
+		"pshufb xmm0,xmm1\n"
+		"pshufd xmm0,xmm1,0x1b\n"
+		"shufps xmm0,xmm1,0x44\n"
+		"punpcklqdq xmm0,xmm1\n"
+		"unpckhps xmm0,xmm1\n"
+		"pmovmskb eax,xmm3\n"
+		"movmskps r8d,xmm9\n"
+	);
+	
+	as_free(as);
+	free(disassembly);
+}
+
+void test_avx_instructions() {
+	asm_p as = &(asm_t){ 0 };
+	char* disassembly = NULL;
+	
+	as_free(as);
+		as_avx_unary(as, VEC_MOVDQU, YMM0, as_mem_r(32, RSI));
+		as_avx_unary(as, VEC_MOVDQU, as_mem_rd(32, RDI, 32), YMM15);
+		as_avx_unary(as, VEC_MOVUPS, XMM1, as_mem_r(16, R8));
+		as_avx_unary(as, VEC_MOVAPS, YMM2, YMM3);
+		as_avx_unary(as, VEC_MOVSS, XMM1, XMM2);
+		as_avx_unary(as, VEC_MOVSD, XMM3, XMM4);
+		as_avx(as, VEC_MOVSS, XMM1, XMM5, XMM2);
+		as_avx_unary(as, VEC_MOVSS, XMM1, as_mem_r(4, RSI));
+		as_avx_unary(as, VEC_MOVSD, as_mem_r(8, RDI), XMM9);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"vmovdqu ymm0,YMMWORD PTR [rsi]\n"
+		"vmovdqu YMMWORD PTR [rdi+0x20],ymm15\n"
+		"vmovups xmm1,XMMWORD PTR [r8]\n"
+		"vmovaps ymm2,ymm3\n"
+		"vmovss xmm1,xmm1,xmm2\n"
+		"vmovsd xmm3,xmm3,xmm4\n"
+		"vmovss xmm1,xmm5,xmm2\n"
+		"vmovss xmm1,DWORD PTR [rsi]\n"
+		"vmovsd QWORD PTR [rdi],xmm9\n"
+	);
+	
+	as_free(as);
+		as_avx(as, VEC_ADDPS, YMM0, YMM1, YMM2);
+		as_avx(as, VEC_ADDPS, XMM8, XMM9, XMM10);
+		as_avx(as, VEC_MULSD, XMM0, XMM1, as_mem_r(8, RAX));
+		as_avx(as, VEC_PADDD, YMM0, YMM1, as_mem_rd(32, RSI, 32));
+		as_avx(as, VEC_PSUBB, YMM13, YMM14, YMM15);
+		as_avx(as, VEC_PMULLD, YMM0, YMM1, YMM2);
+		as_avx(as, VEC_PXOR, YMM0, YMM0, YMM0);
+		as_avx(as, VEC_PCMPEQB, YMM0, YMM1, YMM2);
+		as_avx_imm(as, VEC_CMPPS, YMM0, YMM1, YMM2, 1);
+		as_avx_unary(as, VEC_SQRTPS, YMM0, YMM1);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"vaddps ymm0,ymm1,ymm2\n"
+		"vaddps xmm8,xmm9,xmm10\n"
+		"vmulsd xmm0,xmm1,QWORD PTR [rax]\n"
+		"vpaddd ymm0,ymm1,YMMWORD PTR [rsi+0x20]\n"
+		"vpsubb ymm13,ymm14,ymm15\n"
+		"vpmulld ymm0,ymm1,ymm2\n"
+		"vpxor  ymm0,ymm0,ymm0\n"
+		"vpcmpeqb ymm0,ymm1,ymm2\n"
+		"vcmpltps ymm0,ymm1,ymm2\n"
+		"vsqrtps ymm0,ymm1\n"
+	);
+	
+	as_free(as);
+		as_avx(as, VEC_PSHUFB, YMM0, YMM1, YMM2);
+		as_avx_unary_imm(as, VEC_PSHUFD, YMM0, YMM1, 0x1b);
+		as_avx(as, VEC_VPERMD, YMM0, YMM1, YMM2);
+		as_avx_unary_imm(as, VEC_VPERMQ, YMM0, YMM1, 0xd8);
+		as_avx_imm(as, VEC_VPERM2I128, YMM0, YMM1, YMM2, 0x21);
+		as_avx_imm(as, VEC_VPBLENDD, YMM0, YMM1, YMM2, 0xf0);
+		as_avx(as, VEC_PUNPCKLBW, YMM0, YMM1, YMM2);
+		as_avx_unary(as, VEC_VPBROADCASTD, YMM0, XMM1);
+		as_avx_unary(as, VEC_VPBROADCASTB, YMM0, as_mem_r(1, RSI));
+		as_avx_unary(as, VEC_VBROADCASTSS, YMM8, as_mem_r(4, R10));
+		as_avx_unary(as, VEC_PMOVMSKB, as_reg(4, 0), YMM1);
+		as_avx_unary(as, VEC_MOVMSKPS, as_reg(4, 9), YMM10);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"vpshufb ymm0,ymm1,ymm2\n"
+		"vpshufd ymm0,ymm1,0x1b\n"
+		"vpermd ymm0,ymm1,ymm2\n"
+		"vpermq ymm0,ymm1,0xd8\n"
+		"vperm2i128 ymm0,ymm1,ymm2,0x21\n"
+		"vpblendd ymm0,ymm1,ymm2,0xf0\n"
+		"vpunpcklbw ymm0,ymm1,ymm2\n"
+		"vpbroadcastd ymm0,xmm1\n"
+		"vpbroadcastb ymm0,BYTE PTR [rsi]\n"
+		"vbroadcastss ymm8,DWORD PTR [r10]\n"
+		"vpmovmskb eax,ymm1\n"
+		"vmovmskps r9d,ymm10\n"
+	);
+	
+	as_free(as);
+		as_vzeroupper(as);
+	st_check( code_cmp(as, (uint8_t[]){ 0xc5, 0xf8, 0x77 }, 3) );
+	
+	as_free(as);
+	free(disassembly);
+}
+
+void test_relax() {
+	asm_p as = &(asm_t){ 0 };
+	char* disassembly = NULL;
+	asm_slot_t back, forward, far;
+	
+	as_free(as);
+		size_t loop = as_next_instr_offset(as);
+		as_add(as, RAX, as_imm(8, 1));
+		as_cmp(as, RAX, as_imm(8, 10));
+		back = as_jmp_cc(as, CC_LESS, as_disp(0));
+		as_patch_slot(as, back, loop);
+		forward = as_jmp(as, as_disp(0));
+		as_mov(as, RAX, RCX);
+		as_patch_slot(as, forward, as_next_instr_offset(as));
+	as_relax(as);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"add    rax,0x1\n"
+		"cmp    rax,0xa\n"
+		"jl     0x400000\n"
+		"jmp    0x40000f\n"
+		"mov    rax,rcx\n"
+	);
+	st_check_int(as_relaxed_offset(as, loop), 0);
+	st_check_int(as_relaxed_offset(as, forward.next_instruction_offset), 0x0c);
+	asm_slot_t new_forward = as_relaxed_slot(as, forward);
+	st_check_int(new_forward.bytes, 1);
+	st_check_int(new_forward.value_offset, 0x0b);
+	st_check_int(new_forward.next_instruction_offset, 0x0c);
+	
+	// far only fits into rel8 after the jump it skips over got shorter
+	as_free(as);
+		far = as_jmp(as, as_disp(0));
+		forward = as_jmp(as, as_disp(0));
+		as_patch_slot(as, forward, as_next_instr_offset(as));
+		for(size_t i = 0; i < 125; i++)
+			as_code(as, (uint8_t[]){ 0x90 }, 1);
+		as_patch_slot(as, far, as_next_instr_offset(as));
+		as_ret(as, 0);
+	as_relax(as);
+	st_check_int(as->code_len, 2 + 2 + 125 + 1);
+	st_check_int(as->code_ptr[0], 0xeb);
+	st_check_int(as->code_ptr[1], 127);
+	st_check_int(as->code_ptr[2], 0xeb);
+	st_check_int(as->code_ptr[3], 0);
+	
+	// One more nop and far has to stay a rel32 jump
+	as_free(as);
+		far = as_jmp(as, as_disp(0));
+		forward = as_jmp(as, as_disp(0));
+		as_patch_slot(as, forward, as_next_instr_offset(as));
+		for(size_t i = 0; i < 126; i++)
+			as_code(as, (uint8_t[]){ 0x90 }, 1);
+		as_patch_slot(as, far, as_next_instr_offset(as));
+		as_ret(as, 0);
+	as_relax(as);
+	st_check_int(as->code_len, 5 + 2 + 126 + 1);
+	st_check_int(as->code_ptr[0], 0xe9);
+	st_check_int(as_relaxed_slot(as, far).bytes, 4);
+	
+	as_free(as);
+	free(disassembly);
+}
+
+void test_relax_and_run() {
+	int status_code;
+	asm_p as = &(asm_t){ 0 };
+	asm_slot_t to_main, to_ret, back, call;
+	
+	// The call is patched before as_relax() and the loop in front of it shrinks,
+	// so the call has to be patched again
+	to_main = as_jmp(as, as_disp(0));
+	size_t func = as_next_instr_offset(as);
+		as_add(as, RDI, as_imm(8, 32));
+		to_ret = as_jmp(as, as_disp(0));
+		for(size_t i = 0; i < 200; i++)
+			as_code(as, (uint8_t[]){ 0x90 }, 1);
+		as_patch_slot(as, to_ret, as_next_instr_offset(as));
+		as_ret(as, 0);
+	as_patch_slot(as, to_main, as_next_instr_offset(as));
+	
+	as_mov(as, RDI, as_imm(8, 0));
+	size_t loop = as_next_instr_offset(as);
+		as_add(as, RDI, as_imm(8, 1));
+		as_cmp(as, RDI, as_imm(8, 10));
+		back = as_jmp_cc(as, CC_LESS, as_disp(0));
+		as_patch_slot(as, back, loop);
+	call = as_call(as, as_disp(0));
+	as_patch_slot(as, call, func);
+	as_mov(as, RAX, as_imm(8, 60));
+	as_syscall(as);
+	
+	size_t code_len_before = as->code_len;
+	as_relax(as);
+	st_check_int(as->code_len, code_len_before - 4);
+	
+	as_save_elf(as, 4 * 1024 * 1024, 512 * 1024 * 1024, "test_relax_and_run.elf");
+	as_free(as);
+	
+	status_code = run_and_delete("test_relax_and_run.elf", "./test_relax_and_run.elf", NULL);
+	st_check_int(status_code, 42);
+}
+
+void test_data_slots() {
+	int status_code;
+	asm_p as = &(asm_t){ 0 };
+	asm_slot_t slot;
+	
+	size_t values = as_data(as, (uint64_t[]){ 17, 42 }, 2 * sizeof(uint64_t));
+	slot = as_mov(as, RDI, as_mem_rel(8, 0));
+	as_patch_data_slot(as, slot, values + 8);
+	as_mov(as, RAX, as_imm(8, 60));
+	as_syscall(as);
+	
+	as_save_elf(as, 4 * 1024 * 1024, 512 * 1024 * 1024, "test_data_slots.elf");
+	as_free(as);
+	
+	status_code = run_and_delete("test_data_slots.elf", "./test_data_slots.elf", NULL);
+	st_check_int(status_code, 42);
+}
+
+// Returns the permissions of the mapping that contains ptr as listed in
+// /proc/self/maps, e.g. "r-xp"
+static char* mapping_permissions(void* ptr) {
+	static char perms[5] = "";
+	FILE* maps = fopen("/proc/self/maps", "r");
+	unsigned long start, end;
+	while ( fscanf(maps, "%lx-%lx %4s%*[^\n]", &start, &end, perms) == 3 ) {
+		if ((unsigned long)ptr >= start && (unsigned long)ptr < end)
+			break;
+		perms[0] = '\0';
+	}
+	fclose(maps);
+	return perms;
+}
+
+void test_jit() {
+	asm_p as = &(asm_t){ 0 };
+	asm_slot_t slot;
+	
+	// int64_t add_second_value(int64_t a) { return a + values[1]; }
+	size_t values = as_data(as, (int64_t[]){ 10, 32 }, 2 * sizeof(int64_t));
+	slot = as_lea(as, RCX, as_mem_rel(0, 0));
+	as_patch_data_slot(as, slot, values);
+	as_mov(as, RAX, as_mem_rd(8, RCX, 8));
+	as_add(as, RAX, RDI);
+	as_ret(as, 0);
+	
+	// int64_t factorial(int64_t n), with a loop that gets relaxed
+	size_t factorial_offset = as_next_instr_offset(as);
+	as_mov(as, RAX, as_imm(8, 1));
+	size_t loop = as_next_instr_offset(as);
+		as_cmp(as, RDI, as_imm(8, 1));
+		asm_slot_t to_end = as_jmp_cc(as, CC_BELOW_OR_EQUAL, as_disp(0));
+		as_mul(as, RDI);
+		as_sub(as, RDI, as_imm(8, 1));
+		as_patch_slot(as, as_jmp(as, as_disp(0)), loop);
+	as_patch_slot(as, to_end, as_next_instr_offset(as));
+	as_ret(as, 0);
+	
+	as_relax(as);
+	factorial_offset = as_relaxed_offset(as, factorial_offset);
+	
+	asm_jit_t jit = as_jit_map(as);
+	as_free(as);
+	
+	int64_t (*add_second_value)(int64_t) = as_jit_func(&jit, 0);
+	int64_t (*factorial)(int64_t) = as_jit_func(&jit, factorial_offset);
+	st_check_int(add_second_value(5), 37);
+	st_check_int(add_second_value(-32), 0);
+	st_check_int(factorial(5), 120);
+	st_check_int(factorial(10), 3628800);
+	
+	// W^X: Code isn't writable, data neither writable nor executable
+	st_check_str(mapping_permissions(jit.code_ptr), "r-xp");
+	st_check_str(mapping_permissions(jit.data_ptr), "r--p");
+	
+	as_jit_unmap(&jit);
+	st_check_null(jit.code_ptr);
+}
+
 void test_instructions_for_call() {
 	asm_p as = &(asm_t){ 0 };
 	char* disassembly = NULL;
@@ -877,22 +1499,22 @@ void test_byte_registers() {
 			as_mov(as, as_reg(1, i), as_mem_rel(1, 0x7abbccdd));
 	disassembly = disassemble(as);
 	st_check_str(disassembly,
-		"mov    al,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcce4\n"
-		"mov    cl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcceb\n"
-		"mov    dl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccf2\n"
-		"mov    bl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccf9\n"
-		"mov    spl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd00\n"
-		"mov    bpl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd07\n"
-		"mov    sil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd0e\n"
-		"mov    dil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd15\n"
-		"mov    r8b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd1c\n"
-		"mov    r9b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd23\n"
-		"mov    r10b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd2a\n"
-		"mov    r11b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd31\n"
-		"mov    r12b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd38\n"
-		"mov    r13b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd3f\n"
-		"mov    r14b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd46\n"
-		"mov    r15b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd4d\n"
+		"mov    al,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcce3\n"
+		"mov    cl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcce9\n"
+		"mov    dl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccef\n"
+		"mov    bl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccf5\n"
+		"mov    spl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccfc\n"
+		"mov    bpl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd03\n"
+		"mov    sil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd0a\n"
+		"mov    dil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd11\n"
+		"mov    r8b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd18\n"
+		"mov    r9b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd1f\n"
+		"mov    r10b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd26\n"
+		"mov    r11b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd2d\n"
+		"mov    r12b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd34\n"
+		"mov    r13b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd3b\n"
+		"mov    r14b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd42\n"
+		"mov    r15b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd49\n"
 	);
 	
 	// reg [displ]
@@ -994,22 +1616,22 @@ void test_byte_registers() {
 			as_cmp(as, as_reg(1, i), as_mem_rel(1, 0x7abbccdd));
 	disassembly = disassemble(as);
 	st_check_str(disassembly,
-		"cmp    al,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcce4\n"
-		"cmp    cl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcceb\n"
-		"cmp    dl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccf2\n"
-		"cmp    bl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccf9\n"
-		"cmp    spl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd00\n"
-		"cmp    bpl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd07\n"
-		"cmp    sil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd0e\n"
-		"cmp    dil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd15\n"
-		"cmp    r8b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd1c\n"
-		"cmp    r9b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd23\n"
-		"cmp    r10b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd2a\n"
-		"cmp    r11b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd31\n"
-		"cmp    r12b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd38\n"
-		"cmp    r13b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd3f\n"
-		"cmp    r14b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd46\n"
-		"cmp    r15b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd4d\n"
+		"cmp    al,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcce3\n"
+		"cmp    cl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcce9\n"
+		"cmp    dl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccef\n"
+		"cmp    bl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccf5\n"
+		"cmp    spl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbccfc\n"
+		"cmp    bpl,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd03\n"
+		"cmp    sil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd0a\n"
+		"cmp    dil,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd11\n"
+		"cmp    r8b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd18\n"
+		"cmp    r9b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd1f\n"
+		"cmp    r10b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd26\n"
+		"cmp    r11b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd2d\n"
+		"cmp    r12b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd34\n"
+		"cmp    r13b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd3b\n"
+		"cmp    r14b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd42\n"
+		"cmp    r15b,BYTE PTR [rip+0x7abbccdd]        # 0x7afbcd49\n"
 	);
 	
 	as_free(as);
@@ -1138,7 +1760,7 @@ void test_16bit_registers() {
 		"mul    r14w\n"
 		"mul    r15w\n"
 	);
-		
+	
 	as_free(as);
 	free(disassembly);
 }
@@ -1265,15 +1887,17 @@ void test_32bit_registers() {
 		"mul    r14d\n"
 		"mul    r15d\n"
 	);
-		
+	
 	as_free(as);
 	free(disassembly);
 }
 
 int main() {
 	st_run(test_empty_and_free);
+	st_run(test_buffers);
 	st_run(test_write);
 	st_run(test_write_with_vars);
+	st_run(test_emit);
 	st_run(test_write_elf);
 	st_run(test_basic_instructions);
 	st_run(test_arithmetic_instructions);
@@ -1283,6 +1907,15 @@ int main() {
 	st_run(test_conditional_instructions);
 	st_run(test_stack_instructions);
 	st_run(test_instructions_for_if_and_backpatching);
+	st_run(test_shortest_encodings);
+	st_run(test_slot_encodings);
+	st_run(test_sib_addressing);
+	st_run(test_sse_instructions);
+	st_run(test_avx_instructions);
+	st_run(test_relax);
+	st_run(test_relax_and_run);
+	st_run(test_data_slots);
+	st_run(test_jit);
 	st_run(test_instructions_for_call);
 	st_run(test_byte_registers);
 	st_run(test_16bit_registers);
@@ -0,0 +1,103 @@
+// For open_memstream
+#define _GNU_SOURCE
+
+#include "../common.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+
+struct { char* code; char* expected_ast_dump; } samples[] = {
+	{ "1 * 2 + 3 * 4",
+		"intl: 14\n"
+	},
+	{ "x + 2 * 3",
+		"op: \n"
+		"  def: op_buildin: \"add\"\n"
+		"  a: id: \"x\"\n"
+		"  id: id: \"add\"\n"
+		"  b: intl: 6\n"
+	},
+	{ "x * 2 * 3",
+		"op: \n"
+		"  def: op_buildin: \"mul\"\n"
+		"  a: op: \n"
+		"    def: op_buildin: \"mul\"\n"
+		"    a: id: \"x\"\n"
+		"    id: id: \"mul\"\n"
+		"    b: intl: 2\n"
+		"  id: id: \"mul\"\n"
+		"  b: intl: 3\n"
+	},
+	{ "7 / 2 - 7 % 2",
+		"intl: 2\n"
+	},
+	{ "3 - 5",
+		"intl: -2\n"
+	},
+	{ "65536 * 65536 * 65536 * 65536",
+		"intl: 0\n"
+	},
+	{ "1 + 2 < 4",
+		"intl: 1\n"
+	},
+	{ "2 * 2 == 5",
+		"intl: 0\n"
+	},
+	{ "1 / 0",
+		"op: \n"
+		"  def: op_buildin: \"div\"\n"
+		"  a: intl: 1\n"
+		"  id: id: \"div\"\n"
+		"  b: intl: 0\n"
+	},
+	{ "x = 1 + 2",
+		"op: \n"
+		"  def: op_buildin: \"assign\"\n"
+		"  a: id: \"x\"\n"
+		"  id: id: \"assign\"\n"
+		"  b: intl: 3\n"
+	},
+};
+
+void test_samples() {
+	char*  output_ptr = NULL;
+	size_t output_len = 0;
+	FILE*  output = NULL;
+	
+	for(size_t i = 0; i < sizeof(samples) / sizeof(samples[0]); i++) {
+		// Initialize buildin stuff
+		node_p buildins = node_alloc(NT_MODULE);
+		buildins->name = str_from_c("buildins");
+			add_buildin_ops_to_module(buildins);
+		fill_namespaces(buildins, NULL);
+		
+		node_p module = node_alloc_append(NT_MODULE, buildins, &buildins->module.body);
+		module->module.filename = str_from_c("fold_constants_test.c/test_samples");
+		module->module.source = str_from_c(samples[i].code);
+		
+		size_t errors = tokenize(module->module.source, &module->tokens, stderr);
+		st_check_int(errors, 0);
+		
+		parse(module, parse_expr, stderr);
+		pass_resolve_uops(module);
+		pass_fold_constants(module);
+		st_check_int(module->module.body.len, 1);
+		
+		output = open_memstream(&output_ptr, &output_len);
+			node_print(module->module.body.ptr[0], P_PARSER, P_PARSER, output);
+		fclose(output);
+		
+		st_check_str(output_ptr, samples[i].expected_ast_dump);
+		
+		list_destroy(&module->tokens);
+	}
+	
+	free(output_ptr);
+}
+
+
+int main() {
+	st_run(test_samples);
+	return st_show_report();
+}
@@ -0,0 +1,151 @@
+// For open_memstream
+#define _GNU_SOURCE
+
+#include <string.h>
+#include "../common.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+
+char* sample_code =
+	"func main in(int argc) out(int) {\n"
+	"	ubyte b = 7\n"
+	"	int a = argc + b * 3\n"
+	"	helper(b) + a\n"
+	"}\n"
+	"func helper in(ubyte x) out(ubyte) {\n"
+	"	x = x + 1\n"
+	"}\n";
+
+node_p parse_sample(char* code) {
+	node_p buildins = node_alloc(NT_MODULE);
+	buildins->name = str_from_c("buildins");
+		add_buildin_ops_to_module(buildins);
+		add_buildin_types_to_module(buildins);
+	fill_namespaces(buildins, NULL);
+
+	node_p module = node_alloc_append(NT_MODULE, buildins, &buildins->module.body);
+	module->module.filename = str_from_c("infer_types_test.c");
+	module->module.source = str_from_c(code);
+
+	tokenize(module->module.source, &module->tokens, stderr);
+	parse(module, NULL, stderr);
+	fill_namespaces(module, NULL);
+	return pass_resolve_uops(module);
+}
+
+size_t count_value_nodes(node_p node) {
+	size_t count = (node->spec->components & NC_VALUE) ? 1 : 0;
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+		count += count_value_nodes(it.node);
+	return count;
+}
+
+bool has_type(node_p node, const char* type_name) {
+	node_p type = node->value.type;
+	return node->value.type_state == TS_KNOWN && type != NULL && str_eqc(&type->name, type_name);
+}
+
+
+void test_types() {
+	node_p module = parse_sample(sample_code);
+	size_t error_count = 0;
+	pass_infer_types(module, stderr, &error_count);
+	st_check_int(error_count, 0);
+
+	node_p main_func = module->module.body.ptr[0], helper = module->module.body.ptr[1];
+	st_check(has_type(main_func->func_def.in.ptr[0], "int"));
+	st_check(has_type(helper->func_def.out.ptr[0], "ubyte"));
+
+	// ubyte b = 7
+	node_p var_b = main_func->func_def.body.ptr[0]->var.bindings.ptr[0];
+	st_check(has_type(var_b, "ubyte"));
+	st_check(has_type(var_b->binding.value, "int"));
+
+	// int a = argc + b * 3: the ubyte is widened
+	node_p sum = main_func->func_def.body.ptr[1]->var.bindings.ptr[0]->binding.value;
+	st_check_int(sum->type, NT_OP);
+	st_check(has_type(sum, "int"));
+	st_check(has_type(sum->op.a, "int"));
+	st_check(has_type(sum->op.b, "int"));
+	st_check(has_type(sum->op.b->op.a, "ubyte"));
+
+	// helper(b) + a: call of a function further down the module
+	node_p call_op = main_func->func_def.body.ptr[2];
+	st_check_int(call_op->op.a->type, NT_CALL);
+	st_check(has_type(call_op->op.a, "ubyte"));
+	st_check(has_type(call_op, "int"));
+
+	// IDs of operators and functions have no type
+	st_check(call_op->op.id->value.type_state == TS_KNOWN && call_op->op.id->value.type == NULL);
+	st_check(call_op->op.a->call.target_expr->value.type == NULL);
+
+	// x = x + 1: assignments have the type of their target
+	node_p assign = helper->func_def.body.ptr[0];
+	st_check(has_type(assign, "ubyte"));
+	st_check(has_type(assign->op.b, "int"));
+
+	list_destroy(&module->tokens);
+}
+
+void test_each_node_resolved_once() {
+	node_p module = parse_sample(sample_code);
+	size_t value_nodes = count_value_nodes(module);
+	st_check(value_nodes > 0);
+
+	// IDs and calls reference other nodes but those are only resolved once
+	size_t error_count = 0;
+	st_check_int(pass_infer_types(module, stderr, &error_count), value_nodes);
+	st_check_int(pass_infer_types(module, stderr, &error_count), 0);
+	st_check_int(error_count, 0);
+
+	list_destroy(&module->tokens);
+}
+
+void test_unknown_names() {
+	node_p module = parse_sample(
+		"func main in() out(int r) {\n"
+		"	ulong x = 3\n"
+		"	r = x + y\n"
+		"	undefined(r)\n"
+		"}\n"
+	);
+	
+	char*  output_ptr = NULL;
+	size_t output_len = 0;
+	size_t error_count = 0;
+	FILE* output = open_memstream(&output_ptr, &output_len);
+		pass_infer_types(module, output, &error_count);
+	fclose(output);
+	
+	// ulong isn't a buildin type (yet), y and undefined aren't defined at all
+	st_check_int(error_count, 3);
+	st_check_not_null( strstr(output_ptr, "infer_types_test.c:2:2: unknown type\n") );
+	st_check_not_null( strstr(output_ptr, "infer_types_test.c:3:10: unknown name\n") );
+	st_check_not_null( strstr(output_ptr, "infer_types_test.c:4:2: unknown function\n") );
+	free(output_ptr);
+	
+	node_p main_func = module->module.body.ptr[0];
+	node_p var_x = main_func->func_def.body.ptr[0]->var.bindings.ptr[0];
+	st_check_int(var_x->value.type_state, TS_ERROR);
+	st_check_null(var_x->value.type);
+	
+	// Nodes that depend on the failed ones have no type but are done
+	node_p assign = main_func->func_def.body.ptr[1];
+	st_check_int(assign->value.type_state, TS_KNOWN);
+	st_check(has_type(assign->op.a, "int"));
+	st_check_int(assign->op.b->value.type_state, TS_KNOWN);
+	st_check_null(assign->op.b->value.type);
+	st_check_int(assign->op.b->op.b->value.type_state, TS_ERROR);
+	
+	list_destroy(&module->tokens);
+}
+
+
+int main() {
+	st_run(test_types);
+	st_run(test_each_node_resolved_once);
+	st_run(test_unknown_names);
+	return st_show_report();
+}
@@ -0,0 +1,106 @@
+// For clock_gettime()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../asm.h"
+
+
+//
+// Compares how long it takes to run freshly assembled code once: Written into
+// an ELF binary and spawned as a new process vs. mapped into the current
+// process and called directly.
+//
+
+#define ROUNDS  200
+
+static double current_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* name, double duration) {
+	printf("%-24s %10.3f ms per run\n", name, duration / ROUNDS * 1000);
+}
+
+
+// Sums up the values in the data segment into RAX
+static void emit_sum(asm_p as) {
+	int64_t values[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	size_t values_offset = as_data(as, values, sizeof(values));
+	
+	as_patch_data_slot(as, as_lea(as, RSI, as_mem_rel(0, 0)), values_offset);
+	as_mov(as, RAX, as_imm(8, 0));
+	as_mov(as, RCX, as_imm(8, 0));
+	size_t loop = as_next_instr_offset(as);
+		as_add(as, RAX, as_mem_srrd(8, 8, RCX, RSI, 0));
+		as_add(as, RCX, as_imm(8, 1));
+		as_cmp(as, RCX, as_imm(8, 8));
+		as_patch_slot(as, as_jmp_cc(as, CC_BELOW, as_disp(0)), loop);
+}
+
+void bench_elf() {
+	int64_t result = 0;
+	
+	double start = current_time();
+	for(size_t round = 0; round < ROUNDS; round++) {
+		asm_t as = as_empty();
+		emit_sum(&as);
+		as_mov(&as, RDI, RAX);
+		as_mov(&as, RAX, as_imm(8, 60));
+		as_syscall(&as);
+		as_relax(&as);
+		as_save_elf(&as, 4 * 1024 * 1024, 512 * 1024 * 1024, "jit_bench.elf");
+		as_free(&as);
+		
+		chmod("jit_bench.elf", S_IRUSR | S_IWUSR | S_IXUSR);
+		pid_t pid = fork();
+		if (pid == 0) {
+			execl("./jit_bench.elf", "./jit_bench.elf", NULL);
+			_exit(127);
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		result = WEXITSTATUS(status);
+	}
+	double duration = current_time() - start;
+	unlink("jit_bench.elf");
+	
+	report("ELF, fork and exec", duration);
+	if (result != 36)
+		fprintf(stderr, "bench_elf(): wrong result %ld!\n", result);
+}
+
+void bench_jit() {
+	int64_t result = 0;
+	
+	double start = current_time();
+	for(size_t round = 0; round < ROUNDS; round++) {
+		asm_t as = as_empty();
+		emit_sum(&as);
+		as_ret(&as, 0);
+		as_relax(&as);
+		asm_jit_t jit = as_jit_map(&as);
+		as_free(&as);
+		
+		int64_t (*sum)() = as_jit_func(&jit, 0);
+		result = sum();
+		as_jit_unmap(&jit);
+	}
+	double duration = current_time() - start;
+	
+	report("as_jit_map() and call", duration);
+	if (result != 36)
+		fprintf(stderr, "bench_jit(): wrong result %ld!\n", result);
+}
+
+
+int main() {
+	bench_elf();
+	bench_jit();
+	return 0;
+}
@@ -0,0 +1,119 @@
+// For open_memstream
+#define _GNU_SOURCE
+
+#include "../common.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+
+char* sample_code =
+	"func main in(int argc) out(int) {\n"
+	"	int a = argc + 2 * 3\n"
+	"	if a > 1 + 1 { int b = a * 2 } else { int c = 4 - 1 }\n"
+	"	helper(a < 3 * 4)\n"
+	"}\n"
+	"func helper in(int x) {\n"
+	"	x = x % 5\n"
+	"}\n";
+
+node_p parse_sample() {
+	node_p buildins = node_alloc(NT_MODULE);
+	buildins->name = str_from_c("buildins");
+		add_buildin_ops_to_module(buildins);
+	fill_namespaces(buildins, NULL);
+	
+	node_p module = node_alloc_append(NT_MODULE, buildins, &buildins->module.body);
+	module->module.filename = str_from_c("passes_test.c");
+	module->module.source = str_from_c(sample_code);
+	
+	tokenize(module->module.source, &module->tokens, stderr);
+	parse(module, NULL, stderr);
+	
+	return module;
+}
+
+char* dump_module(node_p module) {
+	char*  output_ptr = NULL;
+	size_t output_len = 0;
+	FILE* output = open_memstream(&output_ptr, &output_len);
+		node_print(module, P_PARSER, P_NAMESPACE, output);
+	fclose(output);
+	return output_ptr;
+}
+
+
+void test_fused_passes_match_separate_passes() {
+	node_p module = parse_sample();
+	fill_namespaces(module, NULL);
+	module = pass_resolve_uops(module);
+	module = pass_fold_constants(module);
+	char* expected = dump_module(module);
+	list_destroy(&module->tokens);
+	
+	module = parse_sample();
+	pass_spec_t passes[] = {
+		{ "namespaces",     NULL,                             false, fill_namespace_of_node, NULL },
+		{ "resolve_uops",   (char*[]){ "namespaces", NULL },   false, NULL, resolve_uops_node },
+		{ "fold_constants", (char*[]){ "resolve_uops", NULL }, false, NULL, fold_constants_node },
+	};
+	pass_stats_t stats[3] = { { 0 } };
+	module = pm_run(module, passes, 3, stats);
+	char* fused = dump_module(module);
+	list_destroy(&module->tokens);
+	
+	st_check_str(fused, expected);
+	
+	// All passes should run in the same traversal and visit nodes
+	for(size_t i = 0; i < 3; i++) {
+		st_check_int(stats[i].traversal, 0);
+		st_check(stats[i].nodes > 0);
+	}
+	
+	free(expected);
+	free(fused);
+}
+
+
+size_t visited_nodes = 0;
+size_t visited_nodes_at_first_count = 0;
+
+void count_node(node_p node) {
+	visited_nodes++;
+}
+
+void remember_count(node_p node) {
+	if (visited_nodes_at_first_count == 0)
+		visited_nodes_at_first_count = visited_nodes;
+}
+
+void test_whole_tree_dependency() {
+	node_p module = parse_sample();
+	
+	pass_spec_t passes[] = {
+		{ "count",    NULL,                        false, count_node,     NULL },
+		{ "fused",    (char*[]){ "count", NULL },  false, NULL,           NULL },
+		{ "separate", (char*[]){ "count", NULL },  true,  remember_count, NULL },
+	};
+	pass_stats_t stats[3] = { { 0 } };
+	pm_run(module, passes, 3, stats);
+	
+	st_check_int(stats[0].traversal, 0);
+	st_check_int(stats[1].traversal, 0);
+	st_check_int(stats[2].traversal, 1);
+	
+	// The separate pass has to see the counter of the whole tree
+	st_check(visited_nodes > 0);
+	st_check_int(visited_nodes_at_first_count, visited_nodes);
+	st_check_int(stats[0].nodes, visited_nodes);
+	st_check_int(stats[2].nodes, visited_nodes);
+	
+	list_destroy(&module->tokens);
+}
+
+
+int main() {
+	st_run(test_fused_passes_match_separate_passes);
+	st_run(test_whole_tree_dependency);
+	return st_show_report();
+}
@@ -2,6 +2,7 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <unistd.h>
 #include "../common.h"
 
 #define SLIM_TEST_IMPLEMENTATION
@@ -345,6 +346,61 @@ void test_print_functions() {
 	st_check_not_null( strstr(output_ptr, "\"next\\nline\"") );
 }
 
+// str_fload() maps files directly into memory, so there is no zero terminator
+// after the source. With a file size of a multiple of the page size the next
+// byte isn't even mapped. Errors on the first and last char must still work.
+void test_error_location_in_mapped_file() {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char* code = malloc(page_size);
+	memset(code, 'a', page_size);
+	code[page_size - 2] = ' ';
+	code[page_size - 1] = '$';
+	code[0] = '$';
+	code[1] = ' ';
+	
+	char filename[] = "/tmp/tokenizer_test.XXXXXX";
+	int fd = mkstemp(filename);
+	st_check_int(write(fd, code, page_size), (ssize_t)page_size);
+	close(fd);
+	free(code);
+	
+	node_p module = node_alloc(NT_MODULE);
+	module->module.filename = str_from_c(filename);
+	module->module.source = str_fload(filename);
+	unlink(filename);
+	st_check_int(module->module.source.len, (int)page_size);
+	
+	tokenize(module->module.source, &module->tokens, stderr);
+	st_check_int(module->tokens.len, 6);
+	token_p first_error = &module->tokens.ptr[0];
+	token_p last_error = &module->tokens.ptr[4];
+	token_p eof = &module->tokens.ptr[5];
+	st_check_int(first_error->type, T_ERROR);
+	st_check_int(last_error->type, T_ERROR);
+	st_check_int(eof->type, T_EOF);
+	
+	st_check_int(token_line(module, first_error), 1);
+	st_check_int(token_col(module, first_error), 1);
+	st_check_int(token_line(module, last_error), 1);
+	st_check_int(token_col(module, last_error), (int)page_size);
+	st_check_int(token_line(module, eof), 1);
+	st_check_int(token_col(module, eof), (int)page_size + 1);
+	
+	char*  output_ptr = NULL;
+	size_t output_len = 0;
+	FILE* output = open_memstream(&output_ptr, &output_len);
+		token_print_line(output, module, first_error);
+		token_print_line(output, module, last_error);
+	fclose(output);
+	st_check_int(output_len, 2 * (page_size + 1 + strlen("\e[1;4m\e[0m")));
+	free(output_ptr);
+	
+	for(size_t i = 0; i < module->tokens.len; i++)
+		token_cleanup(&module->tokens.ptr[i]);
+	list_destroy(&module->tokens);
+	str_funload(&module->module.source);
+}
+
 void test_token_type_name() {
 	st_check_str( token_type_name(T_COMMENT), "T_COMMENT" );
 	st_check_str( token_type_name(T_SL_ASSIGN), "T_SL_ASSIGN" );
@@ -363,6 +419,7 @@ void test_token_desc() {
 int main() {
 	st_run(test_samples);
 	st_run(test_print_functions);
+	st_run(test_error_location_in_mapped_file);
 	st_run(test_token_type_name);
 	st_run(test_token_desc);
 	return st_show_report();
@@ -1,3 +1,7 @@
+// For mkstemp()
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
 #include "../utils.h"
 
 #define SLIM_TEST_IMPLEMENTATION
@@ -90,6 +94,72 @@ void test_list_shift() {
 }
 
 
+//
+// Ring buffer deque
+//
+
+void test_deque_push_and_pop() {
+	deque_t(int) deque;
+	deque_new(&deque);
+	
+	deque_push_back(&deque, 1);
+	deque_push_back(&deque, 2);
+	deque_push_front(&deque, 0);
+	st_check_int(deque.len, 3);
+	st_check_int(deque_front(&deque), 0);
+	st_check_int(deque_at(&deque, 1), 1);
+	st_check_int(deque_back(&deque), 2);
+	
+	deque_pop_front(&deque);
+	st_check_int(deque.len, 2);
+	st_check_int(deque_front(&deque), 1);
+	
+	deque_pop_back(&deque);
+	st_check_int(deque.len, 1);
+	st_check_int(deque_front(&deque), 1);
+	st_check_int(deque_back(&deque), 1);
+	
+	deque_pop_front(&deque);
+	st_check_int(deque.len, 0);
+	
+	deque_destroy(&deque);
+	st_check_int(deque.cap, 0);
+	st_check_null(deque.ptr);
+}
+
+void test_deque_grow_when_wrapped() {
+	deque_t(int) deque;
+	deque_new(&deque);
+	
+	// Use the deque as FIFO queue so the elements wrap around the end of the
+	// buffer a few times before it has to grow.
+	int next_in = 0, next_out = 0;
+	for(int round = 0; round < 50; round++) {
+		for(int i = 0; i < 7; i++)
+			deque_push_back(&deque, next_in++);
+		for(int i = 0; i < 5; i++) {
+			st_check_int(deque_front(&deque), next_out++);
+			deque_pop_front(&deque);
+		}
+	}
+	st_check_int(deque.len, (size_t)(next_in - next_out));
+	
+	for(size_t i = 0; i < deque.len; i++)
+		st_check_int(deque_at(&deque, i), next_out + (int)i);
+	
+	// Same for pushing to the front and popping from the back
+	for(int i = 0; i < 200; i++)
+		deque_push_front(&deque, next_out - 1 - i);
+	for(int i = next_in - 1; i >= next_out - 200; i--) {
+		st_check_int(deque_back(&deque), i);
+		deque_pop_back(&deque);
+	}
+	st_check_int(deque.len, 0);
+	
+	deque_destroy(&deque);
+}
+
+
 //
 // Not zero-terminated strings
 //
@@ -180,11 +250,44 @@ void test_str_fload() {
 	str_t content = str_fload(__FILE__);
 	st_check(content.len > 0);
 	st_check_not_null(content.ptr);
-	str_free(&content);
+	st_check(strncmp(content.ptr, "// For", 6) == 0);
+	str_funload(&content);
+	st_check_int(content.len, 0);
+	st_check_null(content.ptr);
 	
 	content = str_fload("not_existing_file.foobar");
 	st_check_int(content.len, 0);
 	st_check_null(content.ptr);
+	
+	char empty_file[] = "/tmp/utils_test.XXXXXX";
+	int fd = mkstemp(empty_file);
+	close(fd);
+	content = str_fload(empty_file);
+	st_check_int(content.len, 0);
+	st_check_null(content.ptr);
+	unlink(empty_file);
+}
+
+void test_str_fload_pipe() {
+	// Larger than one page so the read buffer has to grow but smaller than the
+	// pipe buffer so we can write it all before reading.
+	char data[10000];
+	for(size_t i = 0; i < sizeof(data); i++)
+		data[i] = 'a' + i % 26;
+	
+	int fds[2];
+	st_check_int(pipe(fds), 0);
+	st_check_int(write(fds[1], data, sizeof(data)), (ssize_t)sizeof(data));
+	close(fds[1]);
+	
+	char path[64];
+	snprintf(path, sizeof(path), "/dev/fd/%d", fds[0]);
+	str_t content = str_fload(path);
+	close(fds[0]);
+	
+	st_check_int(content.len, (int)sizeof(data));
+	st_check(memcmp(content.ptr, data, sizeof(data)) == 0);
+	str_funload(&content);
 }
 
 
@@ -193,9 +296,12 @@ int main() {
 	st_run(test_list_resize);
 	st_run(test_list_append);
 	st_run(test_list_shift);
+	st_run(test_deque_push_and_pop);
+	st_run(test_deque_grow_when_wrapped);
 	st_run(test_str_from_mem_and_free);
 	st_run(test_str_putc);
 	st_run(test_str_eq_and_eqc);
 	st_run(test_str_fload);
+	st_run(test_str_fload_pipe);
 	return st_show_report();
 }
\ No newline at end of file
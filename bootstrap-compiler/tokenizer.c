@@ -392,9 +392,12 @@ void token_cleanup(token_p token) {
 
 int token_line(node_p module, token_p token) {
 	assert(module->type == NT_MODULE);
+	// The source isn't zero terminated (e.g. an mmap()ed file), so check the
+	// bounds before reading a char. The EOF token points right after the end.
+	char* source_end = module->module.source.ptr + module->module.source.len;
 	int line = 1;
 	for(char* c = token->source.ptr; c >= module->module.source.ptr; c--) {
-		if (*c == '\n')
+		if (c < source_end && *c == '\n')
 			line++;
 	}
 	return line;
@@ -402,8 +405,9 @@ int token_line(node_p module, token_p token) {
 
 int token_col(node_p module, token_p token) {
 	assert(module->type == NT_MODULE);
+	char* source_end = module->module.source.ptr + module->module.source.len;
 	int col = 0;
-	for(char* c = token->source.ptr; *c != '\n' && c >= module->module.source.ptr; c--)
+	for(char* c = token->source.ptr; c >= module->module.source.ptr && (c >= source_end || *c != '\n'); c--)
 		col++;
 	return col;
 }
@@ -513,7 +517,7 @@ void token_print_range(FILE* stream, node_p module, size_t token_start_idx, size
 	while (line_start > module->module.source.ptr && *(line_start-1) != '\n')
 		line_start--;
 	char* line_end = code_end;
-	while (*line_end != '\n' && line_end < module->module.source.ptr + module->module.source.len)
+	while (line_end < module->module.source.ptr + module->module.source.len && *line_end != '\n')
 		line_end++;
 	
 	fprintf(stream, "%.*s\e[1;4m%.*s\e[0m%.*s\n",
@@ -0,0 +1,271 @@
+#include <string.h>
+#include "common.h"
+
+//
+// Buildin types
+//
+
+struct { char* name; size_t size; } buildin_types[] = {
+	{ "int",   8 },
+	{ "ubyte", 1 },
+};
+
+void add_buildin_types_to_module(node_p module) {
+	if (module->type != NT_MODULE) {
+		fprintf(stderr, "add_buildin_types_to_module(): Can only add buildin types to a module!\n");
+		abort();
+	}
+	
+	for(size_t i = 0; i < sizeof(buildin_types) / sizeof(buildin_types[0]); i++) {
+		node_p type = node_alloc_append(NT_TYPE_BUILDIN, module, &module->module.body);
+		type->name = str_from_c(buildin_types[i].name);
+		type->type_info.size = buildin_types[i].size;
+	}
+}
+
+
+//
+// Type inference pass
+//
+// Fills value.type of all nodes with a value component. The type of a node can
+// depend on the types of nodes anywhere in the module (an ID has the type of
+// the binding or arg it refers to, a call the type of the first out arg of the
+// function). Instead of recursing into those nodes we put them on a worklist
+// and come back to the node once their types are known. value.type_state
+// remembers which nodes are done so every node is resolved exactly once, no
+// matter how often it is referenced.
+//
+// Unknown names are reported to the error stream when their ID is resolved.
+// The ID and nodes that need the name (e.g. a binding with an unknown type) are
+// marked as TS_ERROR. Nodes that depend on those get no type but no further
+// error either.
+//
+
+typedef struct {
+	node_p* ptr;
+	size_t  len, cap;
+	size_t  resolved, errors;
+	FILE*   error_stream;
+} type_worklist_t, *type_worklist_p;
+
+static void type_push(type_worklist_p worklist, node_p node) {
+	if (worklist->len == worklist->cap) {
+		worklist->cap = (worklist->cap == 0) ? 64 : worklist->cap * 2;
+		worklist->ptr = realloc(worklist->ptr, worklist->cap * sizeof(worklist->ptr[0]));
+	}
+	worklist->ptr[worklist->len++] = node;
+}
+
+// Returns true if the type of dep is known (or it failed). Otherwise dep is put
+// on the worklist and the caller has to try again later.
+static bool type_require(type_worklist_p worklist, node_p dep) {
+	if (dep->value.type_state == TS_KNOWN || dep->value.type_state == TS_ERROR)
+		return true;
+	
+	// Everything above a pending node on the worklist was put there because
+	// that node needs it. Hence we got a cycle if it needs the pending node.
+	if (dep->value.type_state == TS_PENDING) {
+		node_error(stderr, dep, "pass_infer_types(): type depends on itself!\n");
+		abort();
+	}
+	
+	type_push(worklist, dep);
+	return false;
+}
+
+// Reports an error at culprit, the type of node stays unknown
+static void type_error(type_worklist_p worklist, node_p node, node_p culprit, const char* message) {
+	node_error(worklist->error_stream, culprit, message);
+	node->value.type = NULL;
+	node->value.type_state = TS_ERROR;
+	worklist->errors++;
+}
+
+// Type named by a type expression (e.g. the type_expr of a var). Returns NULL
+// and marks node as TS_ERROR if there is no such type.
+static node_p type_from_expr(type_worklist_p worklist, node_p node, node_p expr) {
+	if (expr->type != NT_ID) {
+		node_error(stderr, expr, "pass_infer_types(): only type names are supported as type expressions for now!\n");
+		abort();
+	}
+	
+	node_p type = ns_lookup_or_null(expr, expr->id.name);
+	if (type == NULL) {
+		// Reported by the ID itself
+		node->value.type_state = TS_ERROR;
+		return NULL;
+	} else if ( !(type->spec->components & NC_TYPE_INFO) ) {
+		type_error(worklist, node, expr, "name doesn't refer to a type\n");
+		return NULL;
+	}
+	
+	return type;
+}
+
+// Args in the in and out lists of definitions are declarations, their expr is
+// the type. Other args (e.g. options) have the type of their expr.
+static bool type_arg_is_decl(node_p arg) {
+	node_p parent = arg->parent;
+	if (parent->type == NT_FUNC_DEF)
+		return true;
+	if (parent->type == NT_OP_DEF)
+		return !node_list_contains_node(&parent->op_def.options, arg);
+	return false;
+}
+
+// Error for an ID with an unknown name, depends on what the name is used for
+static const char* type_unknown_name_message(node_p id) {
+	node_p parent = id->parent;
+	if (parent->type == NT_CALL && parent->call.target_expr == id)
+		return "unknown function\n";
+	if (parent->type == NT_VAR && parent->var.type_expr == id)
+		return "unknown type\n";
+	if (parent->type == NT_ARG && parent->arg.expr == id && type_arg_is_decl(parent))
+		return "unknown type\n";
+	return "unknown name\n";
+}
+
+/**
+ * Sets the type of node if the types it depends on are known. Otherwise puts
+ * the missing ones on the worklist and returns false. Returns true as well when
+ * an error was reported for node, it's done either way.
+ */
+static bool type_resolve(type_worklist_p worklist, node_p node) {
+	node_p type = NULL;
+	
+	switch(node->type) {
+		case NT_INTL:
+			type = ns_lookup(node, str_from_c("int"));
+			break;
+		
+		case NT_BINDING:
+			type = type_from_expr(worklist, node, node->parent->var.type_expr);
+			if (type == NULL)
+				return true;
+			break;
+		
+		case NT_ARG: {
+			if ( type_arg_is_decl(node) ) {
+				type = type_from_expr(worklist, node, node->arg.expr);
+				if (type == NULL)
+					return true;
+			} else if (node->arg.expr->spec->components & NC_VALUE) {
+				if ( !type_require(worklist, node->arg.expr) )
+					return false;
+				type = node->arg.expr->value.type;
+			}
+			} break;
+		
+		case NT_ID: {
+			// IDs of types, functions and operators don't have a value
+			node_p target = ns_lookup_or_null(node, node->id.name);
+			if (target == NULL) {
+				type_error(worklist, node, node, type_unknown_name_message(node));
+				return true;
+			} else if (target->spec->components & NC_VALUE) {
+				if ( !type_require(worklist, target) )
+					return false;
+				type = target->value.type;
+			}
+			} break;
+		
+		case NT_UNARY_OP:
+			if ( !type_require(worklist, node->unary_op.arg) )
+				return false;
+			type = node->unary_op.arg->value.type;
+			break;
+		
+		case NT_OP: {
+			// Require both so they get on the worklist together
+			bool known_a = type_require(worklist, node->op.a);
+			bool known_b = type_require(worklist, node->op.b);
+			if ( !(known_a && known_b) )
+				return false;
+			
+			node_p type_a = node->op.a->value.type, type_b = node->op.b->value.type;
+			if ( str_eqc(&node->op.def->name, "assign") ) {
+				type = type_a;
+			} else if (type_a && type_b) {
+				// Take the larger type
+				type = (type_a->type_info.size >= type_b->type_info.size) ? type_a : type_b;
+			}
+			} break;
+		
+		case NT_CALL: {
+			// Type of the first out arg of the target function
+			if (node->call.target_expr->type != NT_ID)
+				break;
+			node_p target = ns_lookup_or_null(node, node->call.target_expr->id.name);
+			if (target == NULL) {
+				// Reported by the target ID
+				node->value.type_state = TS_ERROR;
+				return true;
+			} else if (target->type == NT_FUNC_DEF && target->func_def.out.len > 0) {
+				node_p out = target->func_def.out.ptr[0];
+				if ( !type_require(worklist, out) )
+					return false;
+				type = out->value.type;
+			} else if (target->type == NT_FUNC_BUILDIN) {
+				// syscall, returns the raw register value
+				type = ns_lookup(node, str_from_c("int"));
+			}
+			} break;
+		
+		case NT_UOPS:
+			node_error(stderr, node, "pass_infer_types(): got an uops node! Those should all have been resolved in a prior pass!\n");
+			abort();
+		
+		// No string, aggregate or array types yet
+		default:
+			break;
+	}
+	
+	node->value.type = type;
+	node->value.type_state = TS_KNOWN;
+	worklist->resolved++;
+	return true;
+}
+
+static void type_run_worklist(type_worklist_p worklist, node_p node) {
+	type_push(worklist, node);
+	
+	while (worklist->len > 0) {
+		node_p current = worklist->ptr[worklist->len - 1];
+		// A node can end up on the worklist more than once when several nodes
+		// need it before it's resolved
+		if (current->value.type_state == TS_KNOWN || current->value.type_state == TS_ERROR) {
+			worklist->len--;
+			continue;
+		}
+		
+		// type_resolve() only pushes something when it fails. Then the node
+		// stays on the worklist below its dependencies and is resolved once
+		// they're done.
+		if ( type_resolve(worklist, current) )
+			worklist->len--;
+		else
+			current->value.type_state = TS_PENDING;
+	}
+}
+
+static void type_walk(type_worklist_p worklist, node_p node) {
+	if ( (node->spec->components & NC_VALUE) && node->value.type_state != TS_KNOWN && node->value.type_state != TS_ERROR )
+		type_run_worklist(worklist, node);
+	
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+		type_walk(worklist, it.node);
+}
+
+/**
+ * Infers the type of all value nodes below node. Needs filled namespaces and
+ * resolved uops nodes. Nodes that already have a known type are left alone.
+ * Errors (e.g. unknown type names) are written to error_stream and counted in
+ * error_count. Returns the number of nodes whose type was resolved.
+ */
+size_t pass_infer_types(node_p node, FILE* error_stream, size_t* error_count) {
+	type_worklist_t worklist = { NULL, 0, 0, 0, 0, error_stream };
+	type_walk(&worklist, node);
+	free(worklist.ptr);
+	*error_count = worklist.errors;
+	return worklist.resolved;
+}
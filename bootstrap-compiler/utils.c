@@ -1,7 +1,14 @@
+// For mremap()
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "utils.h"
 
 
@@ -39,37 +46,122 @@ bool str_eqc(str_p a, const char* b) {
 // File I/O
 //
 
+// Reads everything from fd into an anonymous mapping that is doubled in size
+// when full. The mapping is trimmed to the used pages at the end so
+// str_funload() can unmap it just like a file mapping.
+static str_t fload_by_reading(int fd) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t len = 0, capacity = page_size;
+	
+	char* data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return str_empty();
+	
+	while (true) {
+		if (len == capacity) {
+			char* new_data = mremap(data, capacity, capacity * 2, MREMAP_MAYMOVE);
+			if (new_data == MAP_FAILED)
+				goto fail;
+			data = new_data;
+			capacity *= 2;
+		}
+		
+		ssize_t bytes_read = read(fd, data + len, capacity - len);
+		if (bytes_read == 0)
+			break;
+		if (bytes_read == -1) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		
+		len += bytes_read;
+		if (len > INT_MAX) {
+			errno = EFBIG;
+			goto fail;
+		}
+	}
+	
+	if (len == 0) {
+		munmap(data, capacity);
+		return str_empty();
+	}
+	
+	size_t used_capacity = (len + page_size - 1) / page_size * page_size;
+	if (used_capacity < capacity) {
+		munmap(data + used_capacity, capacity - used_capacity);
+		capacity = used_capacity;
+	}
+	mprotect(data, capacity, PROT_READ);
+	
+	return str_from_mem(data, len);
+	
+	fail: {
+		int error = errno;
+		munmap(data, capacity);
+		errno = error;
+		return str_empty();
+	}
+}
+
+/**
+ * Maps regular files directly into memory. The str_t points into that
+ * mapping so the file isn't copied and concurrent processes share the same
+ * page cache. Pipes, stdin ("-"), etc. are read into memory instead.
+ * 
+ * The string is read only and has to be released with str_funload(). On
+ * error an empty string is returned and errno is set. Empty files result in
+ * an empty string as well.
+ */
 str_t str_fload(const char* filename) {
 	str_t str = str_empty();
-	long filesize = 0;
-	char* data = NULL;
-	int error = -1;
+	bool is_stdin = (strcmp(filename, "-") == 0);
+	int error = 0;
 	
-	FILE* f = fopen(filename, "rb");
-	if (f == NULL)
+	int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+	if (fd == -1)
 		return str;
 	
-	if ( fseek(f, 0, SEEK_END)              == -1       ) goto fail;
-	if ( (filesize = ftell(f))              == -1       ) goto fail;
-	if ( fseek(f, 0, SEEK_SET)              == -1       ) goto fail;
-	if ( (data = malloc(filesize))          == NULL     ) goto fail;
-	// TODO: proper error detection for fread and get proper error code with ferror
-	if ( (long)fread(data, 1, filesize, f)  != filesize ) goto free_and_fail;
-	fclose(f);
+	struct stat info;
+	if ( fstat(fd, &info) == -1 )
+		goto fail;
 	
-	str.len = filesize;
-	str.ptr = data;
-	return str;
+	if ( S_ISREG(info.st_mode) ) {
+		if (info.st_size > INT_MAX) {
+			errno = EFBIG;
+			goto fail;
+		}
+		
+		if (info.st_size > 0) {
+			char* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data == MAP_FAILED)
+				goto fail;
+			// The tokenizer walks through the source once from start to end
+			madvise(data, info.st_size, MADV_SEQUENTIAL);
+			str = str_from_mem(data, info.st_size);
+		}
+	} else {
+		errno = 0;
+		str = fload_by_reading(fd);
+		if (str.ptr == NULL && errno != 0)
+			goto fail;
+	}
 	
-	free_and_fail:
-		error = errno;
-		free(data);
+	if (!is_stdin)
+		close(fd);
+	return str;
 	
 	fail:
-		if (error == -1)
-			error = errno;
-		fclose(f);
-	
-	errno = error;
-	return str;
-}
\ No newline at end of file
+		error = errno;
+		if (!is_stdin)
+			close(fd);
+		errno = error;
+		return str_empty();
+}
+
+void str_funload(str_p str) {
+	if (str->ptr)
+		munmap(str->ptr, str->len);
+	str->ptr = NULL;
+	str->len = 0;
+}
@@ -38,6 +38,69 @@
 }
 
 
+//
+// Generic ring buffer deque
+//
+// Elements live in a power of two sized buffer that wraps around. Pushing and
+// popping at both ends is O(1), amortized when the buffer has to grow.
+//
+
+#define deque_t(content_type_t)  struct { size_t start, len, cap; content_type_t* ptr; }
+
+#define deque_new(deque_ptr)  do {  \
+    (deque_ptr)->start = 0;         \
+    (deque_ptr)->len = 0;           \
+    (deque_ptr)->cap = 0;           \
+    (deque_ptr)->ptr = NULL;        \
+} while(0)
+
+#define deque_destroy(deque_ptr)  do {  \
+    free( (deque_ptr)->ptr );           \
+    deque_new(deque_ptr);               \
+} while(0)
+
+// Element i counted from the front, can be used as lvalue
+#define deque_at(deque_ptr, i)  (deque_ptr)->ptr[ ((deque_ptr)->start + (i)) & ((deque_ptr)->cap - 1) ]
+#define deque_front(deque_ptr)  deque_at((deque_ptr), 0)
+#define deque_back(deque_ptr)   deque_at((deque_ptr), (deque_ptr)->len - 1)
+
+// Doubles the buffer when it's full. A full buffer wraps around exactly at
+// start so the elements before start are moved behind the old end.
+#define deque_grow(deque_ptr)  do {                                                                    \
+    if ( (deque_ptr)->len == (deque_ptr)->cap ) {                                                      \
+        size_t old_cap = (deque_ptr)->cap;                                                             \
+        (deque_ptr)->cap = (old_cap > 0) ? old_cap * 2 : 8;                                            \
+        (deque_ptr)->ptr = realloc((deque_ptr)->ptr, (deque_ptr)->cap * sizeof((deque_ptr)->ptr[0]));  \
+        for(size_t i = 0; i < (deque_ptr)->start; i++)                                                 \
+            (deque_ptr)->ptr[old_cap + i] = (deque_ptr)->ptr[i];                                       \
+    }                                                                                                  \
+} while(0)
+
+#define deque_push_back(deque_ptr, value)  do {         \
+    deque_grow(deque_ptr);                              \
+    deque_at((deque_ptr), (deque_ptr)->len) = (value);  \
+    (deque_ptr)->len++;                                 \
+} while(0)
+
+#define deque_push_front(deque_ptr, value)  do {                                                \
+    deque_grow(deque_ptr);                                                                      \
+    (deque_ptr)->start = ((deque_ptr)->start + (deque_ptr)->cap - 1) & ((deque_ptr)->cap - 1);  \
+    (deque_ptr)->ptr[(deque_ptr)->start] = (value);                                             \
+    (deque_ptr)->len++;                                                                         \
+} while(0)
+
+// Removes the first element, read it with deque_front() before
+#define deque_pop_front(deque_ptr)  do {                                     \
+    (deque_ptr)->start = ((deque_ptr)->start + 1) & ((deque_ptr)->cap - 1);  \
+    (deque_ptr)->len--;                                                      \
+} while(0)
+
+// Removes the last element, read it with deque_back() before
+#define deque_pop_back(deque_ptr)  do {  \
+    (deque_ptr)->len--;                  \
+} while(0)
+
+
 
 //
 // Not zero-terminated strings
@@ -66,4 +129,5 @@ bool str_eqc(const str_p a, const char* b);
 // File I/O
 //
 
-str_t str_fload(const char* filename);
\ No newline at end of file
+str_t str_fload(const char* filename);
+void  str_funload(str_p str);
\ No newline at end of file
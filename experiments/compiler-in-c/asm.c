@@ -66,6 +66,14 @@ size_t as_data(asm_p as, const void* ptr, size_t size) {
 	return as->data_vaddr + as->data_len - size;
 }
 
+// Appends already assembled code (e.g. from another buffer), returns its offset
+size_t as_code(asm_p as, const void* ptr, size_t size) {
+	as->code_len += size;
+	as->code_ptr = realloc(as->code_ptr, as->code_len);
+	memcpy(as->code_ptr + as->code_len - size, ptr, size);
+	return as->code_len - size;
+}
+
 
 //
 // ELF stuff
@@ -120,7 +128,7 @@ void as_save_elf(asm_p as, const char* filename) {
 	
 	Elf64_Phdr data_prog_header = (Elf64_Phdr){
 		.p_type = PT_LOAD,
-		.p_flags = PF_R,
+		.p_flags = PF_R | PF_W,  // writable for the counters of --profile
 		
 		// source
 		.p_offset = code_segment_end + 4096 - (code_segment_end % 4096),  // file offset
@@ -419,7 +427,7 @@ Encoded by ModR/M stuff:
 
 	Actually not something for the as_write_modrm() function! Just use as_write() in the
 	instruction function directly.
-
+	
 	REX         opcode      ModRM
 	0100 W00B : opcode    : 11 opc bbb
 	0100 100B : 0000 1111 : 11 001 bbb  (BSWAP - Byte Swap, Volume 2C - Instruction Set Reference, p92)
@@ -464,8 +472,8 @@ Encoded by ModR/M stuff:
 
 	ModRM
 	00 rrr bbb
-	
-	
+
+
 
 // Volume 2C - Instruction Set Reference, p93 (B.2.1 General Purpose Instruction Formats and Encodings for 64-Bit Mode)
 as_call(as, addr(0x11223344));
@@ -500,7 +508,7 @@ as_call(as, addr_mem(0x11223344));
 	[:reg, :mem (:reg) ]               # register indirect
 	[:reg, :mem (:reg, :imm) ]         # register indirect + displacement
 	[:reg, :mem (:reg, :reg, :imm) ]   # register indirect (base) + register indirect (index) + displacement
-	  
+
 **/
 
 #define WMRM_NO_REX_W_BIT (1 << 0)
@@ -682,7 +690,7 @@ bool as_write_modrm(asm_p as, uint32_t flags, const char* format, asm_arg_t dest
 	size_t user_supplied_var_count = 0;
 	for(size_t i = 0; vars != NULL && vars[i].name != NULL; i++)
 		user_supplied_var_count++;
-	asm_var_t all_vars[user_supplied_var_count + 2];
+	asm_var_t all_vars[user_supplied_var_count + 3];
 	memcpy(all_vars, vars, user_supplied_var_count * sizeof(asm_var_t));
 	all_vars[user_supplied_var_count + 0] = (asm_var_t){ "d", op_d };
 	all_vars[user_supplied_var_count + 1] = (asm_var_t){ "w", op_w };
@@ -722,6 +730,11 @@ void as_syscall(asm_p as) {
 	as_write(as, "0000 1111 : 0000 0101");
 }
 
+void as_rdtsc(asm_p as) {
+	// Volume 2C - Instruction Set Reference, p107, EDX:EAX ← time stamp counter
+	as_write(as, "0000 1111 : 0011 0001");
+}
+
 
 ssize_t as_add(asm_p as, asm_arg_t dest, asm_arg_t src) {
 	// Volume 2C - Instruction Set Reference, p90
@@ -797,6 +810,104 @@ void as_div(asm_p as, asm_arg_t src) {
 	abort();
 }
 
+ssize_t as_and(asm_p as, asm_arg_t dest, asm_arg_t src) {
+	// Volume 2C - Instruction Set Reference, p91
+	if (src.type == ASM_T_IMM) {
+		// 1000 00sw : mm 100, same sign extention problem as with ADD
+		if (src.imm & 0x80000000) {
+			fprintf(stderr, "as_and(): can't encode unsigned immediates larget than 31 bits!\n");
+			abort();
+		}
+		if (dest.bits < 32) {
+			fprintf(stderr, "as_and(): can't put immediates into smaller register!\n");
+			abort();
+		}
+		as_write_modrm(as, 0, "1000 000w", op(0b100), dest, NULL);
+		as_write(as, "%32d", src.imm);
+		return as_target(as) - 4;
+	} else if ( as_write_modrm(as, 0, "0010 00dw", dest, src, NULL) ) {
+		return -1;
+	}
+	
+	fprintf(stderr, "as_and(): unsupported arg combination!\n");
+	abort();
+}
+
+void as_shl(asm_p as, asm_arg_t dest, uint8_t count) {
+	// Volume 2C - Instruction Set Reference, p104, register by immediate count
+	// 0100 000B : 1100 000w : 11 100 reg : imm8
+	if ( as_write_modrm(as, 0, "1100 000w", op(0b100), dest, NULL) ) {
+		as_write(as, "%8d", count);
+		return;
+	}
+	
+	fprintf(stderr, "as_shl(): unsupported arg combination!\n");
+	abort();
+}
+
+void as_shr(asm_p as, asm_arg_t dest, uint8_t count) {
+	// Volume 2C - Instruction Set Reference, p105, register by immediate count
+	// 0100 000B : 1100 000w : 11 101 reg : imm8
+	if ( as_write_modrm(as, 0, "1100 000w", op(0b101), dest, NULL) ) {
+		as_write(as, "%8d", count);
+		return;
+	}
+	
+	fprintf(stderr, "as_shr(): unsupported arg combination!\n");
+	abort();
+}
+
+void as_imul(asm_p as, asm_arg_t dest, asm_arg_t src, int32_t factor) {
+	// Volume 2C - Instruction Set Reference, p96
+	// qwordregister1 with qwordregister2 and immediate  0100 1R0B : 0110 1001 : 11 qwordreg1 qwordreg2 : imm32
+	// The lower 64 bits of the result are the same for signed and unsigned
+	// operands so we can use it for our unsigned integers, too.
+	if (dest.type == ASM_T_REG && as_write_modrm(as, 0, "0110 1001", dest, src, NULL)) {
+		as_write(as, "%32d", factor);
+		return;
+	}
+	
+	fprintf(stderr, "as_imul(): unsupported arg combination!\n");
+	abort();
+}
+
+void as_lea(asm_p as, asm_arg_t dest, asm_arg_t base, asm_arg_t index, uint8_t scale, int32_t disp) {
+	// Volume 2C - Instruction Set Reference, p97
+	// dest = base + index * scale + disp, encoded with an SIB byte
+	// 0100 1RXB : 1000 1101 : mod qwordreg 100 : ss index base : disp
+	if (dest.type != ASM_T_REG || base.type != ASM_T_REG || index.type != ASM_T_REG || index.reg == RSP.reg) {
+		fprintf(stderr, "as_lea(): unsupported arg combination!\n");
+		abort();
+	}
+	
+	uint8_t ss;
+	switch(scale) {
+		case 1: ss = 0b00; break;
+		case 2: ss = 0b01; break;
+		case 4: ss = 0b10; break;
+		case 8: ss = 0b11; break;
+		default:
+			fprintf(stderr, "as_lea(): scale has to be 1, 2, 4 or 8!\n");
+			abort();
+	}
+	
+	// With mod = 00 a base of 101 (RBP or R13) means no base but a disp32. So
+	// use mod = 01 with a disp8 of 0 for those.
+	uint8_t mod;
+	if (disp == 0 && (base.reg & 0b111) != 0b101)
+		mod = 0b00;
+	else if (disp >= -128 && disp <= 127)
+		mod = 0b01;
+	else
+		mod = 0b10;
+	as_write(as, "0100 1RXB : 1000 1101 : mm rrr 100 : ss xxx bbb",
+		dest.reg >> 3, index.reg >> 3, base.reg >> 3, mod, dest.reg, ss, index.reg, base.reg);
+	if (mod == 0b01)
+		as_write(as, "%8d", disp);
+	else if (mod == 0b10)
+		as_write(as, "%32d", disp);
+}
+
 void as_mov(asm_p as, asm_arg_t dest, asm_arg_t src) {
 	if (dest.type == ASM_T_REG && src.type == ASM_T_IMM) {
 		// Volume 2C - Instruction Set Reference, p97 (B.2.1 General Purpose Instruction Formats and Encodings for 64-Bit Mode)
@@ -824,7 +935,11 @@ void as_cmp(asm_p as, asm_arg_t arg1, asm_arg_t arg2) {
 			fprintf(stderr, "as_cmp(): can't compare immediates with smaller register!\n");
 			abort();
 		}
-		as_write(as, "0100 100B : 1000 0001 : 11 111 bbb : %32d", arg1.reg >> 3, arg1.reg, arg2.imm);
+		// Small immediates fit into the sign extended imm8 form (0x83)
+		if (arg2.imm < 0x80)
+			as_write(as, "0100 100B : 1000 0011 : 11 111 bbb : %8d", arg1.reg >> 3, arg1.reg, arg2.imm);
+		else
+			as_write(as, "0100 100B : 1000 0001 : 11 111 bbb : %32d", arg1.reg >> 3, arg1.reg, arg2.imm);
 		return;
 	} else if ( as_write_modrm(as, 0, "0011 10dw", arg1, arg2, NULL) ) {
 		// memory64 with qwordregister  0100 1RXB : 0011 1001  : mod qwordreg r/m
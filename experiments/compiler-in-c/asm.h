@@ -23,6 +23,7 @@ void as_save_data(asm_p as, const char* filename);
 void as_save_elf(asm_p as, const char* filename);
 
 size_t as_data(asm_p as, const void* ptr, size_t size);
+size_t as_code(asm_p as, const void* ptr, size_t size);
 
 void as_write(asm_p as, const char* format, ...);
 
@@ -160,12 +161,18 @@ typedef struct {
 } asm_jump_slot_t, *asm_jump_slot_p;
 
 void as_syscall(asm_p as);
+void as_rdtsc(asm_p as);
 
 // Return code position of the immidiate argument (if one is used as src)
 ssize_t as_add(asm_p as, asm_arg_t dest, asm_arg_t src);
 ssize_t as_sub(asm_p as, asm_arg_t dest, asm_arg_t src);
 void as_mul(asm_p as, asm_arg_t src);
 void as_div(asm_p as, asm_arg_t src);
+ssize_t as_and(asm_p as, asm_arg_t dest, asm_arg_t src);
+void as_shl(asm_p as, asm_arg_t dest, uint8_t count);
+void as_shr(asm_p as, asm_arg_t dest, uint8_t count);
+void as_imul(asm_p as, asm_arg_t dest, asm_arg_t src, int32_t factor);
+void as_lea(asm_p as, asm_arg_t dest, asm_arg_t base, asm_arg_t index, uint8_t scale, int32_t disp);
 
 void as_mov(asm_p as, asm_arg_t dest, asm_arg_t src);
 
@@ -126,7 +126,9 @@ struct node_s {
 			node_ns_t ns;
 			
 			bool compiled, linked;
+			bool queued;  // claimed by a worker of the parallel compiler
 			size_t as_offset;
+			size_t profile_vaddr;  // see place_profile_table()
 			size_t stack_frame_size;
 			list_t(node_addr_slot_t) addr_slots;
 			list_t(asm_jump_slot_t)  return_jump_slots;
@@ -163,6 +165,7 @@ struct node_s {
 		
 		struct {
 			node_p cond, body;
+			size_t profile_vaddr;  // see place_profile_table()
 		} while_stmt;
 		
 		struct {
@@ -184,6 +187,7 @@ struct node_s {
 		
 		struct {
 			str_t value;
+			size_t data_vaddr;  // see place_string_data()
 			
 			type_p type;
 		} strl;
@@ -0,0 +1,2175 @@
+#include <string.h>
+#include "ir.h"
+
+
+static const char* ir_op_names[IR_OP_COUNT] = {
+	[IR_NOP] = "nop",
+	[IR_CONST] = "const", [IR_ARG] = "arg", [IR_PHI] = "phi",
+	[IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div", [IR_REM] = "rem",
+	[IR_LT] = "lt", [IR_LE] = "le", [IR_GT] = "gt", [IR_GE] = "ge", [IR_EQ] = "eq", [IR_NEQ] = "neq",
+	[IR_CAST] = "cast",
+	[IR_CALL] = "call", [IR_SYSCALL] = "syscall", [IR_PROFILE_COUNT] = "profile_count",
+	[IR_JMP] = "jmp", [IR_BRANCH] = "branch", [IR_RET] = "ret"
+};
+
+static const char* ir_type_names[] = { [IR_VOID] = "void", [IR_U8] = "u8", [IR_U64] = "u64" };
+
+
+void ir_new(ir_func_p f, const char* name, int name_len, size_t in_count, size_t out_count) {
+	memset(f, 0, sizeof(*f));
+	f->name = name;
+	f->name_len = name_len;
+	f->in_count = in_count;
+	f->out_count = out_count;
+	f->first_block = IR_NO_BLOCK;
+	f->last_block = IR_NO_BLOCK;
+	
+	// Index 0 is IR_NO_VAL, the first real instruction starts at 1
+	f->instr_cap = 64;
+	f->instrs = calloc(f->instr_cap, sizeof(f->instrs[0]));
+	f->instr_count = 1;
+}
+
+void ir_destroy(ir_func_p f) {
+	free(f->instrs);
+	free(f->blocks);
+	free(f->pool);
+	list_free(&f->call_slots);
+	memset(f, 0, sizeof(*f));
+}
+
+
+//
+// Operand lists
+//
+
+static uint32_t ir_pool_alloc(ir_func_p f, uint32_t count) {
+	if (f->pool_len + count > f->pool_cap) {
+		while (f->pool_len + count > f->pool_cap)
+			f->pool_cap = (f->pool_cap == 0) ? 256 : f->pool_cap * 2;
+		f->pool = realloc(f->pool, f->pool_cap * sizeof(f->pool[0]));
+	}
+	
+	uint32_t start = f->pool_len;
+	f->pool_len += count;
+	return start;
+}
+
+void ir_list_append(ir_func_p f, ir_list_p list, uint32_t value) {
+	if (list->len == list->cap) {
+		uint32_t cap = (list->cap == 0) ? 2 : list->cap * 2;
+		uint32_t start = ir_pool_alloc(f, cap);
+		memcpy(f->pool + start, f->pool + list->start, list->len * sizeof(f->pool[0]));
+		list->start = start;
+		list->cap = cap;
+	}
+	
+	f->pool[list->start + list->len] = value;
+	list->len++;
+}
+
+void ir_list_remove(ir_func_p f, ir_list_p list, size_t index) {
+	uint32_t* ptr = f->pool + list->start;
+	memmove(ptr + index, ptr + index + 1, (list->len - index - 1) * sizeof(ptr[0]));
+	list->len--;
+}
+
+
+//
+// Builder
+//
+
+uint32_t ir_block_new(ir_func_p f) {
+	if (f->block_count == f->block_cap) {
+		f->block_cap = (f->block_cap == 0) ? 16 : f->block_cap * 2;
+		f->blocks = realloc(f->blocks, f->block_cap * sizeof(f->blocks[0]));
+	}
+	
+	uint32_t block = f->block_count++;
+	f->blocks[block] = (ir_block_t){
+		.first = IR_NO_VAL, .last = IR_NO_VAL,
+		.prev = f->last_block, .next = IR_NO_BLOCK
+	};
+	
+	// New blocks go to the end of the code layout
+	if (f->last_block != IR_NO_BLOCK)
+		f->blocks[f->last_block].next = block;
+	else
+		f->first_block = block;
+	f->last_block = block;
+	
+	return block;
+}
+
+static void ir_block_unlink(ir_func_p f, uint32_t block) {
+	ir_block_p b = &f->blocks[block];
+	if (b->prev != IR_NO_BLOCK)
+		f->blocks[b->prev].next = b->next;
+	else
+		f->first_block = b->next;
+	if (b->next != IR_NO_BLOCK)
+		f->blocks[b->next].prev = b->prev;
+	else
+		f->last_block = b->prev;
+	b->prev = IR_NO_BLOCK;
+	b->next = IR_NO_BLOCK;
+}
+
+/**
+ * Moves the block right behind the block after in the code layout. Builders
+ * use it to place blocks in the order they're filled in, so the fall through
+ * case of a jump is usually the next block.
+ */
+void ir_block_move_after(ir_func_p f, uint32_t block, uint32_t after) {
+	if (block == after)
+		return;
+	
+	ir_block_unlink(f, block);
+	ir_block_p b = &f->blocks[block];
+	b->prev = after;
+	b->next = f->blocks[after].next;
+	f->blocks[after].next = block;
+	if (b->next != IR_NO_BLOCK)
+		f->blocks[b->next].prev = block;
+	else
+		f->last_block = block;
+}
+
+bool ir_is_terminator(ir_op_t op) {
+	return op == IR_JMP || op == IR_BRANCH || op == IR_RET;
+}
+
+bool ir_block_terminated(ir_func_p f, uint32_t block) {
+	ir_val_t last = f->blocks[block].last;
+	return last != IR_NO_VAL && ir_is_terminator(f->instrs[last].op);
+}
+
+size_t ir_block_succs(ir_func_p f, uint32_t block, uint32_t succs[2]) {
+	if ( !ir_block_terminated(f, block) )
+		return 0;
+	
+	ir_instr_p term = &f->instrs[f->blocks[block].last];
+	switch(term->op) {
+		case IR_JMP:
+			succs[0] = term->targets[0];
+			return 1;
+		case IR_BRANCH:
+			succs[0] = term->targets[0];
+			succs[1] = term->targets[1];
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+static ir_val_t ir_instr_new(ir_func_p f, uint32_t block, ir_op_t op, ir_type_t type, const ir_val_t args[], size_t arg_count) {
+	if (f->instr_count == f->instr_cap) {
+		f->instr_cap *= 2;
+		f->instrs = realloc(f->instrs, f->instr_cap * sizeof(f->instrs[0]));
+	}
+	
+	ir_val_t val = f->instr_count++;
+	f->instrs[val] = (ir_instr_t){
+		.op = op, .type = type, .block = block,
+		.prev = IR_NO_VAL, .next = IR_NO_VAL,
+		.targets = { IR_NO_BLOCK, IR_NO_BLOCK }
+	};
+	
+	if (arg_count > 0) {
+		uint32_t start = ir_pool_alloc(f, arg_count);
+		memcpy(f->pool + start, args, arg_count * sizeof(args[0]));
+		f->instrs[val].args = (ir_list_t){ start, arg_count, arg_count };
+	}
+	
+	return val;
+}
+
+// Links the instruction into its block before the instruction before (or at
+// the end if before is IR_NO_VAL)
+static void ir_link(ir_func_p f, ir_val_t val, ir_val_t before) {
+	ir_instr_p instr = &f->instrs[val];
+	ir_block_p b = &f->blocks[instr->block];
+	
+	instr->next = before;
+	instr->prev = (before != IR_NO_VAL) ? f->instrs[before].prev : b->last;
+	if (instr->prev != IR_NO_VAL)
+		f->instrs[instr->prev].next = val;
+	else
+		b->first = val;
+	if (before != IR_NO_VAL)
+		f->instrs[before].prev = val;
+	else
+		b->last = val;
+}
+
+static void ir_unlink(ir_func_p f, ir_val_t val) {
+	ir_instr_p instr = &f->instrs[val];
+	ir_block_p b = &f->blocks[instr->block];
+	if (instr->prev != IR_NO_VAL)
+		f->instrs[instr->prev].next = instr->next;
+	else
+		b->first = instr->next;
+	if (instr->next != IR_NO_VAL)
+		f->instrs[instr->next].prev = instr->prev;
+	else
+		b->last = instr->prev;
+	instr->prev = IR_NO_VAL;
+	instr->next = IR_NO_VAL;
+}
+
+ir_val_t ir_append(ir_func_p f, uint32_t block, ir_op_t op, ir_type_t type, const ir_val_t args[], size_t arg_count) {
+	bool terminated = ir_block_terminated(f, block);
+	if (terminated && ir_is_terminator(op)) {
+		fprintf(stderr, "ir_append(): block b%u already has a terminator!\n", block);
+		abort();
+	}
+	
+	ir_val_t val = ir_instr_new(f, block, op, type, args, arg_count);
+	ir_link(f, val, terminated ? f->blocks[block].last : IR_NO_VAL);
+	return val;
+}
+
+ir_val_t ir_const(ir_func_p f, uint32_t block, ir_type_t type, int64_t value) {
+	ir_val_t val = ir_append(f, block, IR_CONST, type, NULL, 0);
+	f->instrs[val].imm = value;
+	return val;
+}
+
+ir_val_t ir_in_arg(ir_func_p f, uint32_t block, ir_type_t type, size_t index) {
+	ir_val_t val = ir_append(f, block, IR_ARG, type, NULL, 0);
+	f->instrs[val].imm = index;
+	return val;
+}
+
+ir_val_t ir_binary(ir_func_p f, uint32_t block, ir_op_t op, ir_type_t type, ir_val_t a, ir_val_t b) {
+	return ir_append(f, block, op, type, (ir_val_t[]){ a, b }, 2);
+}
+
+ir_val_t ir_cast(ir_func_p f, uint32_t block, ir_type_t type, ir_val_t val) {
+	return ir_append(f, block, IR_CAST, type, &val, 1);
+}
+
+ir_val_t ir_call(ir_func_p f, uint32_t block, ir_type_t type, void* target, size_t target_out_count, const ir_val_t args[], size_t arg_count) {
+	ir_val_t val = ir_append(f, block, IR_CALL, type, args, arg_count);
+	f->instrs[val].target = target;
+	f->instrs[val].imm = target_out_count;
+	return val;
+}
+
+ir_val_t ir_phi(ir_func_p f, uint32_t block, ir_type_t type) {
+	// Phis stay together at the start of the block
+	ir_val_t before = f->blocks[block].first;
+	while (before != IR_NO_VAL && f->instrs[before].op == IR_PHI)
+		before = f->instrs[before].next;
+	
+	ir_val_t val = ir_instr_new(f, block, IR_PHI, type, NULL, 0);
+	ir_link(f, val, before);
+	return val;
+}
+
+void ir_jmp(ir_func_p f, uint32_t block, uint32_t target) {
+	ir_val_t val = ir_append(f, block, IR_JMP, IR_VOID, NULL, 0);
+	f->instrs[val].targets[0] = target;
+	ir_list_append(f, &f->blocks[target].preds, block);
+}
+
+void ir_branch(ir_func_p f, uint32_t block, ir_val_t cond, uint32_t true_target, uint32_t false_target) {
+	// Both ways lead to the same block, the condition doesn't matter then
+	if (true_target == false_target) {
+		ir_jmp(f, block, true_target);
+		return;
+	}
+	
+	ir_val_t val = ir_append(f, block, IR_BRANCH, IR_VOID, &cond, 1);
+	f->instrs[val].targets[0] = true_target;
+	f->instrs[val].targets[1] = false_target;
+	ir_list_append(f, &f->blocks[true_target].preds, block);
+	ir_list_append(f, &f->blocks[false_target].preds, block);
+}
+
+void ir_ret(ir_func_p f, uint32_t block, const ir_val_t values[], size_t value_count) {
+	ir_append(f, block, IR_RET, IR_VOID, values, value_count);
+}
+
+/**
+ * Unlinks the instruction from its block. The caller has to make sure nothing
+ * uses the value anymore.
+ */
+void ir_remove(ir_func_p f, ir_val_t val) {
+	ir_unlink(f, val);
+	f->instrs[val].op = IR_NOP;
+	f->instrs[val].args.len = 0;
+}
+
+void ir_replace_uses(ir_func_p f, ir_val_t old_val, ir_val_t new_val) {
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		ir_instr_p instr = &f->instrs[val];
+		uint32_t* args = ir_list_ptr(f, instr->args);
+		for(size_t i = 0; i < instr->args.len; i++) {
+			if (args[i] == old_val)
+				args[i] = new_val;
+		}
+	}
+}
+
+
+//
+// Debug output
+//
+
+void ir_print(ir_func_p f, FILE* stream) {
+	fprintf(stream, "func %.*s (%zu in, %zu out)\n", f->name_len, f->name, f->in_count, f->out_count);
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		ir_block_p b = &f->blocks[block];
+		fprintf(stream, "b%u:", block);
+		for(size_t i = 0; i < b->preds.len; i++)
+			fprintf(stream, "%s b%u", (i == 0) ? "  preds" : ",", ir_list_ptr(f, b->preds)[i]);
+		fprintf(stream, "\n");
+		
+		for(ir_val_t val = b->first; val != IR_NO_VAL; val = f->instrs[val].next) {
+			ir_instr_p instr = &f->instrs[val];
+			if (instr->type != IR_VOID)
+				fprintf(stream, "  v%u = %s %s", val, ir_op_names[instr->op], ir_type_names[instr->type]);
+			else
+				fprintf(stream, "  %s", ir_op_names[instr->op]);
+			
+			if (instr->op == IR_CONST || instr->op == IR_ARG)
+				fprintf(stream, " %ld", instr->imm);
+			else if (instr->op == IR_PROFILE_COUNT)
+				fprintf(stream, " 0x%lx", instr->imm);
+			for(size_t i = 0; i < instr->args.len; i++)
+				fprintf(stream, "%s v%u", (i == 0) ? "" : ",", ir_arg(f, val, i));
+			for(size_t i = 0; i < 2 && instr->targets[i] != IR_NO_BLOCK; i++)
+				fprintf(stream, "%s b%u", (i == 0 && instr->args.len == 0) ? "" : ",", instr->targets[i]);
+			fprintf(stream, "\n");
+		}
+	}
+}
+
+
+//
+// Verifier and pass manager
+//
+
+static void ir_verify_fail(ir_func_p f, const char* after_pass, const char* message, uint32_t id) {
+	fprintf(stderr, "ir_verify(): %s (%u) after %s in function %.*s!\n", message, id, after_pass, f->name_len, f->name);
+	ir_print(f, stderr);
+	abort();
+}
+
+/**
+ * Checks the structure of the function and aborts with a dump of the function
+ * if something is broken: Every block in the layout ends with exactly one
+ * terminator, phis are at the start of blocks and have one operand per
+ * predecessor, operands are existing values and the predecessor lists match
+ * the jumps.
+ */
+void ir_verify(ir_func_p f, const char* after_pass) {
+	size_t layout_blocks = 0;
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		ir_block_p b = &f->blocks[block];
+		layout_blocks++;
+		if (b->removed)
+			ir_verify_fail(f, after_pass, "removed block in layout", block);
+		if ( !ir_block_terminated(f, block) )
+			ir_verify_fail(f, after_pass, "block without terminator", block);
+		
+		bool phis_done = false;
+		for(ir_val_t val = b->first; val != IR_NO_VAL; val = f->instrs[val].next) {
+			ir_instr_p instr = &f->instrs[val];
+			if (instr->block != block || instr->op == IR_NOP)
+				ir_verify_fail(f, after_pass, "instruction linked into wrong block", val);
+			if (ir_is_terminator(instr->op) && val != b->last)
+				ir_verify_fail(f, after_pass, "terminator in the middle of a block", val);
+			if (instr->op == IR_JMP && instr->targets[1] != IR_NO_BLOCK)
+				ir_verify_fail(f, after_pass, "jump with two targets", val);
+			if (instr->op == IR_PHI && phis_done)
+				ir_verify_fail(f, after_pass, "phi after other instructions", val);
+			if (instr->op == IR_PHI && instr->args.len != b->preds.len)
+				ir_verify_fail(f, after_pass, "phi operand count doesn't match predecessors", val);
+			phis_done = (instr->op != IR_PHI);
+			
+			for(size_t i = 0; i < instr->args.len; i++) {
+				ir_val_t arg = ir_arg(f, val, i);
+				if (arg == IR_NO_VAL || arg >= f->instr_count || f->instrs[arg].op == IR_NOP || f->instrs[arg].type == IR_VOID)
+					ir_verify_fail(f, after_pass, "operand isn't a value", val);
+			}
+		}
+		
+		// Each edge has one entry in the predecessors of its target
+		uint32_t succs[2];
+		size_t succ_count = ir_block_succs(f, block, succs);
+		for(size_t i = 0; i < succ_count; i++) {
+			ir_block_p s = &f->blocks[succs[i]];
+			size_t edges = 0, preds = 0;
+			for(size_t j = 0; j < succ_count; j++)
+				edges += (succs[j] == succs[i]);
+			for(size_t j = 0; j < s->preds.len; j++)
+				preds += (ir_list_ptr(f, s->preds)[j] == block);
+			if (s->removed || edges != preds)
+				ir_verify_fail(f, after_pass, "predecessors don't match the jump", succs[i]);
+		}
+	}
+	
+	size_t live_blocks = 0;
+	for(uint32_t block = 0; block < f->block_count; block++)
+		live_blocks += !f->blocks[block].removed;
+	if (layout_blocks != live_blocks)
+		ir_verify_fail(f, after_pass, "blocks missing in layout", live_blocks);
+}
+
+void ir_run_passes(ir_func_p f, const ir_pass_t passes[], size_t pass_count, ir_stats_p stats) {
+	ir_verify(f, "construction");
+	for(size_t i = 0; i < pass_count; i++) {
+		if ( passes[i].run(f) )
+			stats->pass_changes++;
+		ir_verify(f, passes[i].name);
+	}
+}
+
+const ir_pass_t ir_default_passes[] = {
+	{ "fold constants",            ir_fold_constants },
+	{ "remove unreachable blocks", ir_remove_unreachable_blocks },
+	{ "remove trivial phis",       ir_remove_trivial_phis },
+	{ "merge blocks",              ir_merge_blocks },
+	{ "hoist loop invariants",     ir_hoist_loop_invariants },
+	{ "reduce induction vars",     ir_reduce_induction_vars },
+	{ "fold constants",            ir_fold_constants },
+	{ "remove dead values",        ir_remove_dead_values },
+	{ "split critical edges",      ir_split_critical_edges },
+};
+const size_t ir_default_pass_count = sizeof(ir_default_passes) / sizeof(ir_default_passes[0]);
+
+
+//
+// Passes
+//
+
+// Removes an entry from the predecessors of the block along with the matching
+// operand of every phi
+static void ir_remove_pred(ir_func_p f, uint32_t block, size_t index) {
+	ir_list_remove(f, &f->blocks[block].preds, index);
+	for(ir_val_t val = f->blocks[block].first; val != IR_NO_VAL && f->instrs[val].op == IR_PHI; val = f->instrs[val].next)
+		ir_list_remove(f, &f->instrs[val].args, index);
+}
+
+/**
+ * Removes blocks that can't be reached from the entry block (e.g. code after a
+ * return statement). Their outgoing edges go away so phis in the remaining
+ * blocks lose the operands of those edges.
+ */
+bool ir_remove_unreachable_blocks(ir_func_p f) {
+	bool reachable[f->block_count];
+	uint32_t stack[f->block_count];
+	size_t stack_len = 0;
+	memset(reachable, 0, sizeof(reachable));
+	
+	reachable[0] = true;
+	stack[stack_len++] = 0;
+	while (stack_len > 0) {
+		uint32_t succs[2];
+		size_t succ_count = ir_block_succs(f, stack[--stack_len], succs);
+		for(size_t i = 0; i < succ_count; i++) {
+			if (!reachable[succs[i]]) {
+				reachable[succs[i]] = true;
+				stack[stack_len++] = succs[i];
+			}
+		}
+	}
+	
+	bool changed = false;
+	for(uint32_t block = 0; block < f->block_count; block++) {
+		ir_block_p b = &f->blocks[block];
+		if (reachable[block] || b->removed)
+			continue;
+		
+		uint32_t succs[2];
+		size_t succ_count = ir_block_succs(f, block, succs);
+		for(size_t i = 0; i < succ_count; i++) {
+			ir_block_p s = &f->blocks[succs[i]];
+			for(size_t j = s->preds.len; j-- > 0; ) {
+				if (ir_list_ptr(f, s->preds)[j] == block)
+					ir_remove_pred(f, succs[i], j);
+			}
+		}
+		
+		while (b->first != IR_NO_VAL)
+			ir_remove(f, b->first);
+		ir_block_unlink(f, block);
+		b->removed = true;
+		changed = true;
+	}
+	
+	return changed;
+}
+
+/**
+ * Replaces phis that only merge one value (besides themselves) with that
+ * value. Repeated until nothing changes since removing a phi can make phis
+ * using it trivial, too.
+ */
+bool ir_remove_trivial_phis(ir_func_p f) {
+	bool changed = false, repeat = true;
+	while (repeat) {
+		repeat = false;
+		for(ir_val_t val = 1; val < f->instr_count; val++) {
+			ir_instr_p instr = &f->instrs[val];
+			if (instr->op != IR_PHI)
+				continue;
+			
+			ir_val_t same = IR_NO_VAL;
+			bool trivial = true;
+			for(size_t i = 0; i < instr->args.len && trivial; i++) {
+				ir_val_t arg = ir_arg(f, val, i);
+				if (arg == same || arg == val)
+					continue;
+				trivial = (same == IR_NO_VAL);
+				same = arg;
+			}
+			if (!trivial)
+				continue;
+			
+			// A phi that only references itself is never defined, it's 0 like
+			// other undefined values
+			if (same == IR_NO_VAL)
+				same = ir_const(f, 0, instr->type, 0);
+			ir_replace_uses(f, val, same);
+			ir_remove(f, val);
+			changed = repeat = true;
+		}
+	}
+	
+	return changed;
+}
+
+// Evaluates a binary op on constants, returns false if it can't be folded
+// (division by zero is left to happen at runtime)
+static bool ir_eval_binary(ir_op_t op, uint64_t a, uint64_t b, uint64_t* result) {
+	switch(op) {
+		case IR_ADD: *result = a + b; return true;
+		case IR_SUB: *result = a - b; return true;
+		case IR_MUL: *result = a * b; return true;
+		case IR_DIV: if (b == 0) return false; *result = a / b; return true;
+		case IR_REM: if (b == 0) return false; *result = a % b; return true;
+		// Compares are signed like in the code generators
+		case IR_LT:  *result = (int64_t)a <  (int64_t)b; return true;
+		case IR_LE:  *result = (int64_t)a <= (int64_t)b; return true;
+		case IR_GT:  *result = (int64_t)a >  (int64_t)b; return true;
+		case IR_GE:  *result = (int64_t)a >= (int64_t)b; return true;
+		case IR_EQ:  *result = (a == b); return true;
+		case IR_NEQ: *result = (a != b); return true;
+		default:     return false;
+	}
+}
+
+/**
+ * Replaces operations on constants with their result and branches on a
+ * constant with a jump. The edge that is never taken goes away, its target
+ * might become unreachable then (see ir_remove_unreachable_blocks()).
+ */
+bool ir_fold_constants(ir_func_p f) {
+	bool changed = false, repeat = true;
+	while (repeat) {
+		repeat = false;
+		for(ir_val_t val = 1; val < f->instr_count; val++) {
+			ir_instr_p instr = &f->instrs[val];
+			if (instr->op == IR_BRANCH && f->instrs[ir_arg(f, val, 0)].op == IR_CONST) {
+				bool taken = (f->instrs[ir_arg(f, val, 0)].imm != 0);
+				uint32_t target = instr->targets[taken ? 0 : 1], dropped = instr->targets[taken ? 1 : 0];
+				ir_block_p d = &f->blocks[dropped];
+				for(size_t i = 0; i < d->preds.len; i++) {
+					if (ir_list_ptr(f, d->preds)[i] == instr->block) {
+						ir_remove_pred(f, dropped, i);
+						break;
+					}
+				}
+				
+				instr->op = IR_JMP;
+				instr->args.len = 0;
+				instr->targets[0] = target;
+				instr->targets[1] = IR_NO_BLOCK;
+				changed = repeat = true;
+			} else if (instr->op >= IR_ADD && instr->op <= IR_NEQ && instr->args.len == 2) {
+				ir_instr_p a = &f->instrs[ir_arg(f, val, 0)], b = &f->instrs[ir_arg(f, val, 1)];
+				
+				// x + 0, x - 0 and x * 1 are just x
+				ir_val_t same = IR_NO_VAL;
+				if ( (instr->op == IR_ADD || instr->op == IR_MUL) && a->op == IR_CONST && a->imm == (instr->op == IR_MUL) )
+					same = ir_arg(f, val, 1);
+				else if ( (instr->op == IR_ADD || instr->op == IR_SUB || instr->op == IR_MUL) && b->op == IR_CONST && b->imm == (instr->op == IR_MUL) )
+					same = ir_arg(f, val, 0);
+				if (same != IR_NO_VAL && f->instrs[same].type == instr->type) {
+					ir_replace_uses(f, val, same);
+					ir_remove(f, val);
+					changed = repeat = true;
+					continue;
+				}
+				
+				// x * 0 is 0 no matter what x is
+				uint64_t result;
+				if ( instr->op == IR_MUL && ((a->op == IR_CONST && a->imm == 0) || (b->op == IR_CONST && b->imm == 0)) )
+					result = 0;
+				else if ( a->op != IR_CONST || b->op != IR_CONST || !ir_eval_binary(instr->op, a->imm, b->imm, &result) )
+					continue;
+				
+				instr->op = IR_CONST;
+				instr->imm = (instr->type == IR_U8) ? (result & 0xff) : result;
+				instr->args.len = 0;
+				changed = repeat = true;
+			} else if (instr->op == IR_CAST && f->instrs[ir_arg(f, val, 0)].op == IR_CONST) {
+				int64_t value = f->instrs[ir_arg(f, val, 0)].imm;
+				instr->op = IR_CONST;
+				instr->imm = (instr->type == IR_U8) ? (value & 0xff) : value;
+				instr->args.len = 0;
+				changed = repeat = true;
+			}
+		}
+	}
+	
+	return changed;
+}
+
+static bool ir_has_side_effects(ir_op_t op) {
+	return op == IR_CALL || op == IR_SYSCALL || op == IR_PROFILE_COUNT || ir_is_terminator(op);
+}
+
+/**
+ * Removes instructions whose value is never used and that don't do anything
+ * else (everything except calls, syscalls and terminators). In SSA form that
+ * covers dead stores to variables, too: The value assigned is just never used.
+ * Values only used by other dead values (e.g. a phi cycle of a loop counter
+ * nobody reads) are removed as well.
+ */
+bool ir_remove_dead_values(ir_func_p f) {
+	bool* live = calloc(f->instr_count, sizeof(live[0]));
+	ir_val_t* worklist = malloc(f->instr_count * sizeof(worklist[0]));
+	size_t worklist_len = 0;
+	
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		if ( ir_has_side_effects(f->instrs[val].op) ) {
+			live[val] = true;
+			worklist[worklist_len++] = val;
+		}
+	}
+	while (worklist_len > 0) {
+		ir_val_t val = worklist[--worklist_len];
+		for(size_t i = 0; i < f->instrs[val].args.len; i++) {
+			ir_val_t arg = ir_arg(f, val, i);
+			if (!live[arg]) {
+				live[arg] = true;
+				worklist[worklist_len++] = arg;
+			}
+		}
+	}
+	
+	// Unused values don't have users that are still around, so the order of
+	// removal doesn't matter
+	bool changed = false;
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		if (!live[val] && f->instrs[val].op != IR_NOP) {
+			ir_remove(f, val);
+			changed = true;
+		}
+	}
+	
+	free(worklist);
+	free(live);
+	return changed;
+}
+
+/**
+ * Merges a block into its predecessor when that's the only way to get there
+ * and the predecessor jumps nowhere else. Cleans up the chains of blocks left
+ * behind by inlining and folded branches.
+ */
+bool ir_merge_blocks(ir_func_p f) {
+	bool changed = false;
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		while (f->instrs[f->blocks[block].last].op == IR_JMP) {
+			ir_val_t jmp = f->blocks[block].last;
+			uint32_t succ = f->instrs[jmp].targets[0];
+			if (succ == block || f->blocks[succ].preds.len != 1)
+				break;
+			
+			// Phis with only one predecessor just pass on their operand
+			ir_remove(f, jmp);
+			for(ir_val_t val = f->blocks[succ].first, next; val != IR_NO_VAL; val = next) {
+				next = f->instrs[val].next;
+				if (f->instrs[val].op == IR_PHI) {
+					ir_replace_uses(f, val, ir_arg(f, val, 0));
+					ir_remove(f, val);
+				} else {
+					ir_unlink(f, val);
+					f->instrs[val].block = block;
+					ir_link(f, val, IR_NO_VAL);
+				}
+			}
+			
+			uint32_t succs[2];
+			size_t succ_count = ir_block_succs(f, block, succs);
+			for(size_t i = 0; i < succ_count; i++) {
+				uint32_t* preds = ir_list_ptr(f, f->blocks[succs[i]].preds);
+				for(size_t j = 0; j < f->blocks[succs[i]].preds.len; j++) {
+					if (preds[j] == succ)
+						preds[j] = block;
+				}
+			}
+			
+			ir_block_unlink(f, succ);
+			f->blocks[succ].removed = true;
+			changed = true;
+		}
+	}
+	
+	return changed;
+}
+
+/**
+ * An edge is critical when it leaves a block with several successors and
+ * enters a block with several predecessors. The moves of phis for that edge
+ * can't be put into either block, so a new block is put on the edge. Only
+ * done for edges into blocks with phis.
+ */
+bool ir_split_critical_edges(ir_func_p f) {
+	bool changed = false;
+	uint32_t block_count = f->block_count;
+	for(uint32_t block = 0; block < block_count; block++) {
+		ir_block_p b = &f->blocks[block];
+		if (b->removed || b->preds.len < 2 || b->first == IR_NO_VAL || f->instrs[b->first].op != IR_PHI)
+			continue;
+		
+		for(size_t i = 0; i < f->blocks[block].preds.len; i++) {
+			uint32_t pred = ir_list_ptr(f, f->blocks[block].preds)[i];
+			uint32_t succs[2];
+			if (ir_block_succs(f, pred, succs) < 2)
+				continue;
+			
+			// The new block takes the place of pred in the predecessors so the
+			// phi operands stay in the same order
+			uint32_t split = ir_block_new(f);
+			ir_block_move_after(f, split, (f->blocks[block].prev != IR_NO_BLOCK) ? f->blocks[block].prev : pred);
+			ir_val_t jmp = ir_append(f, split, IR_JMP, IR_VOID, NULL, 0);
+			f->instrs[jmp].targets[0] = block;
+			ir_list_append(f, &f->blocks[split].preds, pred);
+			f->blocks[split].sealed = true;
+			ir_list_ptr(f, f->blocks[block].preds)[i] = split;
+			
+			ir_instr_p term = &f->instrs[f->blocks[pred].last];
+			for(size_t j = 0; j < 2; j++) {
+				if (term->targets[j] == block)
+					term->targets[j] = split;
+			}
+			changed = true;
+		}
+	}
+	
+	return changed;
+}
+
+//
+// Loops
+//
+// A loop is found by its back edge: A jump from a block (the latch) to a block
+// that dominates it (the header). The blocks of the loop are the ones that
+// reach the latch without going through the header. Each loop gets a
+// preheader, a block outside the loop that jumps to the header and is the only
+// way into it. Code that doesn't change during the loop is moved there.
+//
+
+typedef struct {
+	uint32_t header, latch, preheader;
+	bool* blocks;       // true for blocks in the loop, indexed by block
+	size_t block_count;
+} ir_loop_t, *ir_loop_p;
+
+// Dominator sets as bitsets, dom[block * words + ...]. Iterates until nothing
+// changes, good enough for the small functions we have.
+static uint64_t* ir_dominators(ir_func_p f, size_t* words_out) {
+	size_t words = (f->block_count + 63) / 64;
+	uint64_t* dom = malloc(f->block_count * words * sizeof(dom[0]));
+	for(uint32_t block = 0; block < f->block_count; block++)
+		memset(dom + block * words, (block == 0) ? 0 : 0xff, words * sizeof(dom[0]));
+	dom[0] = 1;
+	
+	uint64_t new_dom[words];
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+			if (block == 0)
+				continue;
+			
+			memset(new_dom, 0xff, sizeof(new_dom));
+			for(size_t i = 0; i < f->blocks[block].preds.len; i++) {
+				uint64_t* pred_dom = dom + ir_list_ptr(f, f->blocks[block].preds)[i] * words;
+				for(size_t w = 0; w < words; w++)
+					new_dom[w] &= pred_dom[w];
+			}
+			new_dom[block / 64] |= 1ULL << (block % 64);
+			
+			if ( memcmp(new_dom, dom + block * words, sizeof(new_dom)) != 0 ) {
+				memcpy(dom + block * words, new_dom, sizeof(new_dom));
+				changed = true;
+			}
+		}
+	}
+	
+	*words_out = words;
+	return dom;
+}
+
+// Gives the loop a preheader. Returns false if the loop has several entries
+// (can't happen with while loops).
+static bool ir_loop_preheader(ir_func_p f, ir_loop_p loop) {
+	size_t outside_index = SIZE_MAX;
+	for(size_t i = 0; i < f->blocks[loop->header].preds.len; i++) {
+		if ( !loop->blocks[ir_list_ptr(f, f->blocks[loop->header].preds)[i]] ) {
+			if (outside_index != SIZE_MAX)
+				return false;
+			outside_index = i;
+		}
+	}
+	if (outside_index == SIZE_MAX)
+		return false;
+	
+	uint32_t pred = ir_list_ptr(f, f->blocks[loop->header].preds)[outside_index];
+	if (f->instrs[f->blocks[pred].last].op == IR_JMP) {
+		loop->preheader = pred;
+		return true;
+	}
+	
+	// The block before the loop goes somewhere else, too. Put a new block on
+	// the edge into the loop.
+	uint32_t preheader = ir_block_new(f);
+	ir_block_move_after(f, preheader, pred);
+	ir_val_t jmp = ir_append(f, preheader, IR_JMP, IR_VOID, NULL, 0);
+	f->instrs[jmp].targets[0] = loop->header;
+	ir_list_append(f, &f->blocks[preheader].preds, pred);
+	f->blocks[preheader].sealed = true;
+	ir_list_ptr(f, f->blocks[loop->header].preds)[outside_index] = preheader;
+	
+	ir_instr_p term = &f->instrs[f->blocks[pred].last];
+	for(size_t i = 0; i < 2; i++) {
+		if (term->targets[i] == loop->header)
+			term->targets[i] = preheader;
+	}
+	
+	loop->preheader = preheader;
+	return true;
+}
+
+/**
+ * Finds all loops with one back edge and one entry and gives them a
+ * preheader. Inner loops come first. Free the result with ir_free_loops().
+ */
+static size_t ir_find_loops(ir_func_p f, ir_loop_p* loops_out) {
+	size_t words;
+	uint64_t* dom = ir_dominators(f, &words);
+	
+	list_t(ir_loop_t) loops = { 0, NULL };
+	for(uint32_t latch = f->first_block; latch != IR_NO_BLOCK; latch = f->blocks[latch].next) {
+		uint32_t succs[2];
+		size_t succ_count = ir_block_succs(f, latch, succs);
+		for(size_t i = 0; i < succ_count; i++) {
+			uint32_t header = succs[i];
+			if ( !(dom[latch * words + header / 64] & (1ULL << (header % 64))) )
+				continue;
+			
+			// Only loops with one back edge
+			size_t back_edges = 0;
+			for(size_t j = 0; j < f->blocks[header].preds.len; j++) {
+				uint32_t pred = ir_list_ptr(f, f->blocks[header].preds)[j];
+				back_edges += (dom[pred * words + header / 64] & (1ULL << (header % 64))) != 0;
+			}
+			if (back_edges != 1)
+				continue;
+			
+			// Walk backwards from the latch up to the header
+			ir_loop_t loop = { .header = header, .latch = latch, .preheader = IR_NO_BLOCK };
+			loop.blocks = calloc(2 * f->block_count, sizeof(loop.blocks[0]));
+			uint32_t stack[f->block_count];
+			size_t stack_len = 0;
+			loop.blocks[header] = true;
+			loop.block_count = 1;
+			if (!loop.blocks[latch]) {
+				loop.blocks[latch] = true;
+				loop.block_count++;
+				stack[stack_len++] = latch;
+			}
+			while (stack_len > 0) {
+				uint32_t block = stack[--stack_len];
+				for(size_t j = 0; j < f->blocks[block].preds.len; j++) {
+					uint32_t pred = ir_list_ptr(f, f->blocks[block].preds)[j];
+					if (!loop.blocks[pred]) {
+						loop.blocks[pred] = true;
+						loop.block_count++;
+						stack[stack_len++] = pred;
+					}
+				}
+			}
+			
+			list_append(&loops, loop);
+		}
+	}
+	free(dom);
+	
+	// Inner loops are smaller than the loops around them
+	for(size_t i = 1; i < loops.len; i++) {
+		for(size_t j = i; j > 0 && loops.ptr[j - 1].block_count > loops.ptr[j].block_count; j--) {
+			ir_loop_t temp = loops.ptr[j];
+			loops.ptr[j] = loops.ptr[j - 1];
+			loops.ptr[j - 1] = temp;
+		}
+	}
+	
+	// New preheaders are blocks of the loops around the loop. There is at most
+	// one new block per loop, so there is room for them in the loop sets.
+	size_t kept = 0;
+	for(size_t i = 0; i < loops.len; i++) {
+		ir_loop_p loop = &loops.ptr[i];
+		uint32_t block_count = f->block_count;
+		if ( !ir_loop_preheader(f, loop) ) {
+			free(loop->blocks);
+			continue;
+		}
+		if (f->block_count > block_count) {
+			for(size_t j = i + 1; j < loops.len; j++) {
+				if (loops.ptr[j].blocks[loop->header])
+					loops.ptr[j].blocks[loop->preheader] = true;
+			}
+		}
+		loops.ptr[kept++] = *loop;
+	}
+	
+	*loops_out = loops.ptr;
+	return kept;
+}
+
+static void ir_free_loops(ir_loop_p loops, size_t count) {
+	for(size_t i = 0; i < count; i++)
+		free(loops[i].blocks);
+	free(loops);
+}
+
+static bool ir_in_loop(ir_func_p f, ir_loop_p loop, ir_val_t val) {
+	return loop->blocks[f->instrs[val].block];
+}
+
+// Moves the instruction to the end of the block (before its terminator)
+static void ir_move_to_end(ir_func_p f, ir_val_t val, uint32_t block) {
+	ir_unlink(f, val);
+	f->instrs[val].block = block;
+	ir_link(f, val, f->blocks[block].last);
+}
+
+/**
+ * Moves computations whose operands don't change during a loop into the
+ * preheader, so they're done once instead of every iteration. Only pure
+ * instructions are moved. They might not have been executed at all (e.g.
+ * when the loop runs zero times), so divisions are only moved when they
+ * can't divide by zero.
+ */
+bool ir_hoist_loop_invariants(ir_func_p f) {
+	ir_loop_p loops;
+	size_t loop_count = ir_find_loops(f, &loops);
+	
+	bool changed = false;
+	for(size_t i = 0; i < loop_count; i++) {
+		ir_loop_p loop = &loops[i];
+		bool repeat = true;
+		while (repeat) {
+			repeat = false;
+			for(ir_val_t val = 1; val < f->instr_count; val++) {
+				ir_instr_p instr = &f->instrs[val];
+				bool pure = (instr->op == IR_CONST) || (instr->op >= IR_ADD && instr->op <= IR_CAST);
+				if ( !pure || !ir_in_loop(f, loop, val) )
+					continue;
+				if (instr->op == IR_DIV || instr->op == IR_REM) {
+					ir_instr_p divisor = &f->instrs[ir_arg(f, val, 1)];
+					if (divisor->op != IR_CONST || divisor->imm == 0)
+						continue;
+				}
+				
+				bool invariant = true;
+				for(size_t j = 0; j < instr->args.len && invariant; j++)
+					invariant = !ir_in_loop(f, loop, ir_arg(f, val, j));
+				if (!invariant)
+					continue;
+				
+				ir_move_to_end(f, val, loop->preheader);
+				changed = repeat = true;
+			}
+		}
+	}
+	
+	ir_free_loops(loops, loop_count);
+	return changed;
+}
+
+/**
+ * Replaces multiplications of an induction variable (a phi in the loop header
+ * that is increased by the same amount every iteration) with a new induction
+ * variable that is increased by the product every iteration. That turns
+ * i * k into an addition per iteration.
+ */
+bool ir_reduce_induction_vars(ir_func_p f) {
+	ir_loop_p loops;
+	size_t loop_count = ir_find_loops(f, &loops);
+	
+	bool changed = false;
+	for(size_t i = 0; i < loop_count; i++) {
+		ir_loop_p loop = &loops[i];
+		uint32_t header = loop->header;
+		if (f->blocks[header].preds.len != 2)
+			continue;
+		size_t latch_index = (ir_list_ptr(f, f->blocks[header].preds)[0] == loop->latch) ? 0 : 1;
+		
+		for(ir_val_t iv = f->blocks[header].first; iv != IR_NO_VAL && f->instrs[iv].op == IR_PHI; iv = f->instrs[iv].next) {
+			// iv = phi(init, next) with next = iv + step or iv - step
+			ir_val_t init = ir_arg(f, iv, 1 - latch_index), next = ir_arg(f, iv, latch_index);
+			ir_instr_p next_instr = &f->instrs[next];
+			if ( f->instrs[iv].type != IR_U64 || (next_instr->op != IR_ADD && next_instr->op != IR_SUB) || !ir_in_loop(f, loop, next) )
+				continue;
+			ir_val_t step;
+			if (ir_arg(f, next, 0) == iv)
+				step = ir_arg(f, next, 1);
+			else if (next_instr->op == IR_ADD && ir_arg(f, next, 1) == iv)
+				step = ir_arg(f, next, 0);
+			else
+				continue;
+			if ( ir_in_loop(f, loop, step) )
+				continue;
+			
+			for(ir_val_t val = 1; val < f->instr_count; val++) {
+				ir_instr_p mul = &f->instrs[val];
+				if ( mul->op != IR_MUL || mul->type != IR_U64 || !ir_in_loop(f, loop, val) )
+					continue;
+				ir_val_t factor;
+				if (ir_arg(f, val, 0) == iv)
+					factor = ir_arg(f, val, 1);
+				else if (ir_arg(f, val, 1) == iv)
+					factor = ir_arg(f, val, 0);
+				else
+					continue;
+				if ( ir_in_loop(f, loop, factor) )
+					continue;
+				
+				// reduced = phi(init * factor, reduced_next), the next value is
+				// computed right after the next value of iv
+				ir_op_t step_op = f->instrs[next].op;
+				ir_val_t reduced_init = ir_binary(f, loop->preheader, IR_MUL, IR_U64, init, factor);
+				ir_val_t reduced_step = ir_binary(f, loop->preheader, IR_MUL, IR_U64, step, factor);
+				ir_val_t reduced = ir_phi(f, header, IR_U64);
+				ir_val_t reduced_next = ir_instr_new(f, f->instrs[next].block, step_op, IR_U64, (ir_val_t[]){ reduced, reduced_step }, 2);
+				ir_link(f, reduced_next, f->instrs[next].next);
+				ir_list_append(f, &f->instrs[reduced].args, (latch_index == 0) ? reduced_next : reduced_init);
+				ir_list_append(f, &f->instrs[reduced].args, (latch_index == 0) ? reduced_init : reduced_next);
+				
+				ir_replace_uses(f, val, reduced);
+				ir_remove(f, val);
+				changed = true;
+			}
+		}
+	}
+	
+	ir_free_loops(loops, loop_count);
+	return changed;
+}
+
+
+//
+// Inlining
+//
+
+/**
+ * Cost of inlining the function: The number of instructions that end up as
+ * code. Constants become immediates and args are replaced by the operands of
+ * the call, so they don't count.
+ */
+size_t ir_inline_cost(ir_func_p f) {
+	size_t cost = 0;
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		for(ir_val_t val = f->blocks[block].first; val != IR_NO_VAL; val = f->instrs[val].next) {
+			if (f->instrs[val].op != IR_CONST && f->instrs[val].op != IR_ARG)
+				cost++;
+		}
+	}
+	return cost;
+}
+
+/**
+ * Replaces the call with a copy of the callee. The block of the call is split
+ * in two: The first part jumps to the copied entry block and the copied
+ * returns jump to the second part. Args of the callee become the operands of
+ * the call, the returned values are merged by a phi if there are several
+ * returns. The callee itself isn't changed.
+ * 
+ * The copied instructions are appended to the instruction array, so they're
+ * all at indices from the old instr_count on.
+ */
+void ir_inline_call(ir_func_p f, ir_val_t call, ir_func_p callee) {
+	uint32_t block = f->instrs[call].block;
+	if (callee->blocks[0].preds.len != 0) {
+		fprintf(stderr, "ir_inline_call(): entry block of callee has predecessors!\n");
+		abort();
+	}
+	
+	// Everything after the call moves into a new block. Its successors get
+	// their edge from there now.
+	uint32_t rest = ir_block_new(f);
+	ir_block_move_after(f, rest, block);
+	f->blocks[rest].sealed = true;
+	for(ir_val_t val = f->instrs[call].next, next; val != IR_NO_VAL; val = next) {
+		next = f->instrs[val].next;
+		ir_unlink(f, val);
+		f->instrs[val].block = rest;
+		ir_link(f, val, IR_NO_VAL);
+	}
+	uint32_t succs[2];
+	size_t succ_count = ir_block_succs(f, rest, succs);
+	for(size_t i = 0; i < succ_count; i++) {
+		uint32_t* preds = ir_list_ptr(f, f->blocks[succs[i]].preds);
+		for(size_t j = 0; j < f->blocks[succs[i]].preds.len; j++) {
+			if (preds[j] == block)
+				preds[j] = rest;
+		}
+	}
+	
+	// Copy the blocks (in layout order between the two parts) and the
+	// instructions. Operands are filled in later since phis can use values
+	// defined further down.
+	uint32_t* block_map = malloc(callee->block_count * sizeof(block_map[0]));
+	ir_val_t* val_map = calloc(callee->instr_count, sizeof(val_map[0]));
+	list_t(ir_val_t) ret_values = { 0, NULL };
+	uint32_t layout_prev = block;
+	for(uint32_t b = callee->first_block; b != IR_NO_BLOCK; b = callee->blocks[b].next) {
+		block_map[b] = ir_block_new(f);
+		ir_block_move_after(f, block_map[b], layout_prev);
+		f->blocks[block_map[b]].sealed = true;
+		layout_prev = block_map[b];
+	}
+	
+	for(uint32_t b = callee->first_block; b != IR_NO_BLOCK; b = callee->blocks[b].next) {
+		for(size_t i = 0; i < callee->blocks[b].preds.len; i++)
+			ir_list_append(f, &f->blocks[block_map[b]].preds, block_map[ir_list_ptr(callee, callee->blocks[b].preds)[i]]);
+		
+		for(ir_val_t val = callee->blocks[b].first; val != IR_NO_VAL; val = callee->instrs[val].next) {
+			ir_instr_p instr = &callee->instrs[val];
+			if (instr->op == IR_ARG) {
+				val_map[val] = ir_arg(f, call, instr->imm);
+			} else if (instr->op == IR_RET) {
+				list_append(&ret_values, (instr->args.len > 0) ? ir_arg(callee, val, 0) : IR_NO_VAL);
+				ir_jmp(f, block_map[b], rest);
+			} else {
+				ir_val_t copy = ir_append(f, block_map[b], instr->op, instr->type, NULL, 0);
+				f->instrs[copy].imm = instr->imm;
+				f->instrs[copy].target = instr->target;
+				for(size_t i = 0; i < 2; i++) {
+					if (instr->targets[i] != IR_NO_BLOCK)
+						f->instrs[copy].targets[i] = block_map[instr->targets[i]];
+				}
+				val_map[val] = copy;
+			}
+		}
+	}
+	
+	for(ir_val_t val = 1; val < callee->instr_count; val++) {
+		ir_instr_p instr = &callee->instrs[val];
+		if (instr->op == IR_NOP || instr->op == IR_ARG || instr->op == IR_RET)
+			continue;
+		for(size_t i = 0; i < instr->args.len; i++)
+			ir_list_append(f, &f->instrs[val_map[val]].args, val_map[ir_arg(callee, val, i)]);
+	}
+	
+	// The result of the call is the first returned value. The preds of the
+	// second part are the returns in the order they were copied.
+	if (f->instrs[call].type != IR_VOID) {
+		ir_val_t result;
+		if (ret_values.len == 0) {
+			// Callee never returns, the rest is unreachable
+			result = ir_const(f, rest, f->instrs[call].type, 0);
+		} else if (ret_values.len == 1) {
+			result = val_map[ret_values.ptr[0]];
+		} else {
+			result = ir_phi(f, rest, f->instrs[call].type);
+			for(size_t i = 0; i < ret_values.len; i++)
+				ir_list_append(f, &f->instrs[result].args, val_map[ret_values.ptr[i]]);
+		}
+		ir_replace_uses(f, call, result);
+	}
+	
+	ir_remove(f, call);
+	ir_jmp(f, block, block_map[callee->first_block]);
+	
+	list_free(&ret_values);
+	free(val_map);
+	free(block_map);
+}
+
+
+//
+// Backend
+//
+// The blocks are put in a line (the code layout) and every instruction gets a
+// position on it. Liveness analysis tells which values are live at the start
+// and end of each block. From that each value gets a live interval from the
+// first to the last position it's live at (loops included). A linear scan then
+// hands out registers to the intervals in order of their start. Intervals that
+// don't get a register live in a stack frame slot the whole time. Instructions
+// that overwrite registers (calls, syscalls, MUL and DIV) keep intervals that
+// live across them away from those registers.
+//
+// Constants don't get a location, they're used as immediates. A compare that
+// is only used by the branch right after it is fused with the branch (CMP and
+// Jcc). R10 and R11 are never handed out, the code generator uses them as
+// scratch registers. Phis are resolved by parallel moves at the end of the
+// predecessors. That's why critical edges are split first.
+//
+
+typedef struct {
+	uint32_t start, end;  // positions, start is UINT32_MAX for values without location
+	uint16_t avoid;       // registers overwritten while the value is live
+	int8_t   hint;        // register the value ends up in anyway, -1 if none
+	int8_t   reg;         // -1 if the value lives in a spill slot
+	int32_t  slot;        // index of the spill slot, -1 if none
+	uint32_t uses;
+	bool     fused;       // compare that is emitted with its branch
+} ir_interval_t, *ir_interval_p;
+
+typedef struct {
+	asm_jump_slot_t slot;
+	uint32_t block;
+} ir_jump_t;
+
+typedef struct {
+	ir_func_p f;
+	asm_p as;
+	ir_stats_p stats;
+	ir_interval_p intervals;
+	uint32_t* pos;  // position of each instruction
+	
+	asm_arg_t frame;
+	int32_t args_displ;  // displacement of the stack args (after the return address)
+	uint16_t saved_regs;
+	int32_t saved_displs[16];
+	size_t saved_count;
+	
+	asm_arg_t profile_slot;  // time stamp of the function start (see profile.h)
+	
+	size_t* block_offsets;
+	list_t(ir_jump_t) jumps;
+} ir_codegen_t, *ir_codegen_p;
+
+// Registers handed out in order of preference, caller saved ones first (those
+// don't need to be saved). R10 and R11 are the scratch registers.
+static const int8_t ir_alloc_regs[] = { 1, 6, 7, 8, 9, 2, 0, 3, 12, 13, 14, 15 };
+#define IR_ALLOC_REG_COUNT (sizeof(ir_alloc_regs) / sizeof(ir_alloc_regs[0]))
+
+// RAX, RDI, RSI, RDX, R10, R8 and R9
+static const int8_t ir_syscall_regs[7] = { 0, 7, 6, 2, 10, 8, 9 };
+
+static uint16_t ir_reg_mask(const int8_t regs[], size_t count) {
+	uint16_t mask = 0;
+	for(size_t i = 0; i < count; i++)
+		mask |= 1 << regs[i];
+	return mask;
+}
+
+// Immediates have to fit into 31 bits (see as_add())
+static bool ir_fits_imm(ir_func_p f, ir_val_t val) {
+	ir_instr_p instr = &f->instrs[val];
+	return instr->op == IR_CONST && (uint64_t)instr->imm < 0x80000000;
+}
+
+static bool ir_is_power_of_two_const(ir_func_p f, ir_val_t val) {
+	uint64_t c = f->instrs[val].imm;
+	return ir_fits_imm(f, val) && c != 0 && (c & (c - 1)) == 0;
+}
+
+// MUL, DIV and REM that need the RAX and RDX form of the instruction. With a
+// constant (power of two for DIV and REM) cheaper instructions are used.
+static bool ir_needs_rax_rdx(ir_func_p f, ir_val_t val) {
+	ir_instr_p instr = &f->instrs[val];
+	ir_val_t a = ir_arg(f, val, 0), b = ir_arg(f, val, 1);
+	switch(instr->op) {
+		case IR_MUL:
+			return !ir_fits_imm(f, a) && !ir_fits_imm(f, b);
+		case IR_DIV: case IR_REM:
+			return !ir_is_power_of_two_const(f, b);
+		default:
+			return false;
+	}
+}
+
+// Registers the instruction overwrites (not counting its own result)
+static uint16_t ir_clobbers(ir_func_p f, ir_val_t val) {
+	ir_instr_p instr = &f->instrs[val];
+	switch(instr->op) {
+		case IR_CALL: {
+			int8_t caller_saved_regs[] = CALLER_SAVED_REGS;
+			return ir_reg_mask(caller_saved_regs, sizeof(caller_saved_regs) / sizeof(caller_saved_regs[0]));
+		}
+		case IR_SYSCALL:
+			return ir_reg_mask(ir_syscall_regs, instr->args.len) | (1 << RAX.reg) | (1 << RCX.reg) | (1 << R11.reg);
+		case IR_MUL: case IR_DIV: case IR_REM:
+			return ir_needs_rax_rdx(f, val) ? (1 << RAX.reg) | (1 << RDX.reg) : 0;
+		default:
+			return 0;
+	}
+}
+
+static bool ir_has_location(ir_codegen_p cg, ir_val_t val) {
+	ir_instr_p instr = &cg->f->instrs[val];
+	return instr->type != IR_VOID && instr->op != IR_CONST && instr->op != IR_NOP && !cg->intervals[val].fused;
+}
+
+// Args not passed in registers stay in their stack slot
+static bool ir_is_stack_arg(ir_codegen_p cg, ir_val_t val) {
+	ir_instr_p instr = &cg->f->instrs[val];
+	return instr->op == IR_ARG && instr->imm >= CALL_IN_REG_COUNT;
+}
+
+static size_t ir_pred_index(ir_func_p f, uint32_t block, uint32_t pred) {
+	for(size_t i = 0; i < f->blocks[block].preds.len; i++) {
+		if (ir_list_ptr(f, f->blocks[block].preds)[i] == pred)
+			return i;
+	}
+	
+	fprintf(stderr, "ir_pred_index(): b%u isn't a predecessor of b%u!\n", pred, block);
+	abort();
+}
+
+static void ir_cg_number(ir_codegen_p cg, uint32_t* block_start, uint32_t* block_end) {
+	ir_func_p f = cg->f;
+	
+	// Phis and args are defined at the start of their block. They get the
+	// position of the block start, everything else one of its own.
+	uint32_t pos = 0;
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		block_start[block] = pos;
+		pos += 2;
+		for(ir_val_t val = f->blocks[block].first; val != IR_NO_VAL; val = f->instrs[val].next) {
+			ir_instr_p instr = &f->instrs[val];
+			if (instr->op == IR_PHI || instr->op == IR_ARG) {
+				cg->pos[val] = block_start[block];
+			} else {
+				cg->pos[val] = pos;
+				pos += 2;
+			}
+			block_end[block] = cg->pos[val];
+			
+			for(size_t i = 0; i < instr->args.len; i++)
+				cg->intervals[ir_arg(f, val, i)].uses++;
+		}
+	}
+	
+	// Compares only used by the branch right after them
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		ir_val_t term = f->blocks[block].last;
+		if (f->instrs[term].op != IR_BRANCH)
+			continue;
+		ir_val_t cond = ir_arg(f, term, 0);
+		ir_op_t op = f->instrs[cond].op;
+		if (op >= IR_LT && op <= IR_NEQ && f->instrs[term].prev == cond && cg->intervals[cond].uses == 1)
+			cg->intervals[cond].fused = true;
+	}
+}
+
+static void ir_cg_liveness(ir_codegen_p cg, uint64_t* live_in, uint64_t* live_out, size_t words) {
+	ir_func_p f = cg->f;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for(uint32_t block = f->last_block; block != IR_NO_BLOCK; block = f->blocks[block].prev) {
+			uint64_t* out = live_out + block * words;
+			uint64_t live[words];
+			memset(live, 0, sizeof(live));
+			
+			// Live at the end: everything live into the successors and the
+			// phi operands for the edge to them
+			uint32_t succs[2];
+			size_t succ_count = ir_block_succs(f, block, succs);
+			for(size_t i = 0; i < succ_count; i++) {
+				for(size_t w = 0; w < words; w++)
+					live[w] |= live_in[succs[i] * words + w];
+				
+				ir_val_t phi = f->blocks[succs[i]].first;
+				if (phi == IR_NO_VAL || f->instrs[phi].op != IR_PHI)
+					continue;
+				size_t index = ir_pred_index(f, succs[i], block);
+				for(; phi != IR_NO_VAL && f->instrs[phi].op == IR_PHI; phi = f->instrs[phi].next) {
+					ir_val_t arg = ir_arg(f, phi, index);
+					if ( ir_has_location(cg, arg) )
+						live[arg / 64] |= 1ull << (arg % 64);
+				}
+			}
+			memcpy(out, live, sizeof(live));
+			
+			for(ir_val_t val = f->blocks[block].last; val != IR_NO_VAL; val = f->instrs[val].prev) {
+				ir_instr_p instr = &f->instrs[val];
+				live[val / 64] &= ~(1ull << (val % 64));
+				if (instr->op == IR_PHI)
+					continue;
+				for(size_t i = 0; i < instr->args.len; i++) {
+					ir_val_t arg = ir_arg(f, val, i);
+					if ( ir_has_location(cg, arg) )
+						live[arg / 64] |= 1ull << (arg % 64);
+				}
+			}
+			
+			if ( memcmp(live_in + block * words, live, sizeof(live)) != 0 ) {
+				memcpy(live_in + block * words, live, sizeof(live));
+				changed = true;
+			}
+		}
+	}
+}
+
+static void ir_extend(ir_interval_p interval, uint32_t from, uint32_t to) {
+	if (from < interval->start)
+		interval->start = from;
+	if (to > interval->end)
+		interval->end = to;
+}
+
+static void ir_cg_build_intervals(ir_codegen_p cg, uint32_t* block_start, uint32_t* block_end) {
+	ir_func_p f = cg->f;
+	size_t words = (f->instr_count + 63) / 64;
+	uint64_t* live_in = calloc(f->block_count * words, sizeof(uint64_t));
+	uint64_t* live_out = calloc(f->block_count * words, sizeof(uint64_t));
+	ir_cg_liveness(cg, live_in, live_out, words);
+	
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		for(ir_val_t val = 1; val < f->instr_count; val++) {
+			if ( live_in[block * words + val / 64] & (1ull << (val % 64)) )
+				ir_extend(&cg->intervals[val], block_start[block], block_start[block]);
+			if ( live_out[block * words + val / 64] & (1ull << (val % 64)) )
+				ir_extend(&cg->intervals[val], block_start[block], block_end[block]);
+		}
+		
+		for(ir_val_t val = f->blocks[block].first; val != IR_NO_VAL; val = f->instrs[val].next) {
+			ir_instr_p instr = &f->instrs[val];
+			if ( ir_has_location(cg, val) ) {
+				ir_extend(&cg->intervals[val], cg->pos[val], cg->pos[val]);
+				// Phis and args of a block are all defined at once, they have to
+				// overlap each other even when they're never used
+				if (instr->op == IR_PHI || instr->op == IR_ARG)
+					ir_extend(&cg->intervals[val], cg->pos[val], cg->pos[val] + 1);
+			}
+			if (instr->op == IR_PHI)
+				continue;
+			for(size_t i = 0; i < instr->args.len; i++) {
+				ir_val_t arg = ir_arg(f, val, i);
+				if ( ir_has_location(cg, arg) )
+					ir_extend(&cg->intervals[arg], cg->pos[val], cg->pos[val]);
+			}
+		}
+	}
+	
+	free(live_in);
+	free(live_out);
+}
+
+// Hints for values that are moved into fixed registers anyway
+static void ir_cg_set_hints(ir_codegen_p cg) {
+	ir_func_p f = cg->f;
+	int8_t in_regs[] = CALL_IN_REGS, out_regs[] = CALL_OUT_REGS;
+	
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		ir_instr_p instr = &f->instrs[val];
+		switch(instr->op) {
+			case IR_ARG:
+				if (instr->imm < CALL_IN_REG_COUNT)
+					cg->intervals[val].hint = in_regs[instr->imm];
+				break;
+			case IR_CALL: case IR_SYSCALL: case IR_DIV:
+				cg->intervals[val].hint = RAX.reg;
+				break;
+			case IR_REM:
+				cg->intervals[val].hint = RDX.reg;
+				break;
+			case IR_MUL:
+				if ( ir_needs_rax_rdx(f, val) )
+					cg->intervals[val].hint = RAX.reg;
+				break;
+			default:
+				break;
+		}
+		
+		for(size_t i = 0; i < instr->args.len; i++) {
+			ir_interval_p arg = &cg->intervals[ir_arg(f, val, i)];
+			if (arg->hint != -1)
+				continue;
+			if (instr->op == IR_CALL && i < CALL_IN_REG_COUNT)
+				arg->hint = in_regs[i];
+			else if (instr->op == IR_SYSCALL)
+				arg->hint = ir_syscall_regs[i];
+			else if (instr->op == IR_RET && i < CALL_OUT_REG_COUNT)
+				arg->hint = out_regs[i];
+		}
+	}
+}
+
+static void ir_cg_allocate(ir_codegen_p cg, size_t* slot_count) {
+	ir_func_p f = cg->f;
+	
+	// Intervals sorted by their start (insertion sort, most are in order
+	// already)
+	ir_val_t* sorted = malloc(f->instr_count * sizeof(sorted[0]));
+	size_t count = 0;
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		if ( !ir_has_location(cg, val) || ir_is_stack_arg(cg, val) || cg->intervals[val].start == UINT32_MAX )
+			continue;
+		size_t i = count++;
+		while (i > 0 && cg->intervals[sorted[i-1]].start > cg->intervals[val].start) {
+			sorted[i] = sorted[i-1];
+			i--;
+		}
+		sorted[i] = val;
+	}
+	
+	ir_val_t active[IR_ALLOC_REG_COUNT];
+	size_t active_count = 0;
+	uint16_t used_regs = 0;
+	for(size_t i = 0; i < count; i++) {
+		ir_val_t val = sorted[i];
+		ir_interval_p interval = &cg->intervals[val];
+		
+		// Intervals that ended hand back their registers. An interval ending
+		// where this one starts is an operand of the instruction that defines
+		// this one, so they can share a register.
+		uint16_t taken = 0;
+		for(size_t j = 0; j < active_count; ) {
+			if (cg->intervals[active[j]].end <= interval->start) {
+				active[j] = active[--active_count];
+			} else {
+				taken |= 1 << cg->intervals[active[j]].reg;
+				j++;
+			}
+		}
+		
+		int8_t reg_index = -1;
+		uint16_t blocked = taken | interval->avoid;
+		if ( interval->hint != -1 && !(blocked & (1 << interval->hint)) && interval->hint != R10.reg && interval->hint != R11.reg ) {
+			reg_index = interval->hint;
+		} else {
+			for(size_t j = 0; j < IR_ALLOC_REG_COUNT && reg_index == -1; j++) {
+				if ( !(blocked & (1 << ir_alloc_regs[j])) )
+					reg_index = ir_alloc_regs[j];
+			}
+		}
+		
+		if (reg_index == -1) {
+			// No register left. Spill the interval that lives the longest,
+			// either an active one (with a register this one can use) or this
+			// one.
+			ssize_t victim = -1;
+			for(size_t j = 0; j < active_count; j++) {
+				ir_interval_p other = &cg->intervals[active[j]];
+				if ( !(interval->avoid & (1 << other->reg)) && (victim == -1 || other->end > cg->intervals[active[victim]].end) )
+					victim = j;
+			}
+			
+			if (victim != -1 && cg->intervals[active[victim]].end > interval->end) {
+				ir_interval_p other = &cg->intervals[active[victim]];
+				reg_index = other->reg;
+				other->reg = -1;
+				other->slot = (*slot_count)++;
+				active[victim] = active[--active_count];
+			} else {
+				interval->slot = (*slot_count)++;
+				continue;
+			}
+		}
+		
+		interval->reg = reg_index;
+		active[active_count++] = val;
+		used_regs |= 1 << reg_index;
+		
+		// Values flowing into a phi try to use the same register, that saves
+		// the moves at the end of the predecessors
+		if (f->instrs[val].op == IR_PHI) {
+			for(size_t j = 0; j < f->instrs[val].args.len; j++) {
+				ir_interval_p arg = &cg->intervals[ir_arg(f, val, j)];
+				if (arg->hint == -1 && arg->reg == -1 && arg->slot == -1)
+					arg->hint = reg_index;
+			}
+		}
+	}
+	
+	free(sorted);
+	
+	int8_t callee_saved_regs[] = CALLEE_SAVED_REGS;
+	for(size_t i = 0; i < sizeof(callee_saved_regs) / sizeof(callee_saved_regs[0]); i++) {
+		if (used_regs & (1 << callee_saved_regs[i])) {
+			cg->saved_regs |= 1 << callee_saved_regs[i];
+			cg->saved_displs[callee_saved_regs[i]] = -(int32_t)(++cg->saved_count) * 8;
+		}
+	}
+}
+
+
+//
+// Code generation
+//
+
+static asm_arg_t ir_loc(ir_codegen_p cg, ir_val_t val) {
+	ir_instr_p instr = &cg->f->instrs[val];
+	if (instr->op == IR_CONST)
+		return imm(instr->imm);
+	if ( ir_is_stack_arg(cg, val) )
+		return memrd(cg->frame, cg->args_displ + (cg->f->in_count - 1 - instr->imm) * 8);
+	
+	ir_interval_p interval = &cg->intervals[val];
+	if (interval->reg != -1)
+		return reg(interval->reg);
+	return memrd(cg->frame, -(int32_t)(cg->saved_count + interval->slot + 1) * 8);
+}
+
+static bool ir_loc_eq(asm_arg_t a, asm_arg_t b) {
+	if (a.type != b.type)
+		return false;
+	switch(a.type) {
+		case ASM_T_REG:          return a.reg == b.reg;
+		case ASM_T_IMM:          return a.imm == b.imm;
+		case ASM_T_MEM_REG_DISP: return a.mem_reg == b.mem_reg && a.mem_disp == b.mem_disp;
+		default:                 return false;
+	}
+}
+
+static bool ir_is_reg(asm_arg_t arg, int8_t reg_index) {
+	return arg.type == ASM_T_REG && (reg_index == -1 || arg.reg == reg_index);
+}
+
+static void ir_cg_move(ir_codegen_p cg, asm_arg_t dest, asm_arg_t src) {
+	if ( ir_loc_eq(dest, src) )
+		return;
+	
+	if (dest.type == ASM_T_REG || src.type == ASM_T_REG) {
+		as_mov(cg->as, dest, src);
+	} else {
+		// Memory to memory and immediates into memory go through R10
+		as_mov(cg->as, R10, src);
+		as_mov(cg->as, dest, R10);
+	}
+}
+
+/**
+ * Moves all sources into their destinations at once, a source is read before
+ * any move overwrites it. Moves whose destination isn't needed by another move
+ * go first. When only cycles are left one destination is saved in R11 and the
+ * moves reading it take it from there.
+ */
+static void ir_cg_parallel_move(ir_codegen_p cg, asm_arg_t dests[], asm_arg_t srcs[], size_t count) {
+	bool done[count];
+	size_t left = 0;
+	for(size_t i = 0; i < count; i++) {
+		done[i] = ir_loc_eq(dests[i], srcs[i]);
+		left += !done[i];
+	}
+	cg->stats->moves += left;
+	
+	while (left > 0) {
+		bool progress = false;
+		for(size_t i = 0; i < count; i++) {
+			if (done[i])
+				continue;
+			bool blocked = false;
+			for(size_t j = 0; j < count && !blocked; j++)
+				blocked = (j != i && !done[j] && ir_loc_eq(srcs[j], dests[i]));
+			if (blocked)
+				continue;
+			
+			ir_cg_move(cg, dests[i], srcs[i]);
+			done[i] = true;
+			left--;
+			progress = true;
+		}
+		
+		if (!progress) {
+			size_t i = 0;
+			while (done[i])
+				i++;
+			as_mov(cg->as, R11, dests[i]);
+			for(size_t j = 0; j < count; j++) {
+				if ( !done[j] && ir_loc_eq(srcs[j], dests[i]) )
+					srcs[j] = R11;
+			}
+		}
+	}
+}
+
+static void ir_cg_jump(ir_codegen_p cg, uint32_t block, uint32_t target, uint8_t cc, bool conditional) {
+	// Jumps to the next block fall through
+	if (!conditional && cg->f->blocks[block].next == target)
+		return;
+	
+	asm_jump_slot_t slot = conditional ? as_jmp_cc(cg->as, cc, 0) : as_jmp(cg->as, reld(0));
+	list_append(&cg->jumps, ((ir_jump_t){ slot, target }));
+}
+
+static void ir_cg_phi_moves(ir_codegen_p cg, uint32_t block, uint32_t target) {
+	ir_func_p f = cg->f;
+	ir_val_t phi = f->blocks[target].first;
+	if (phi == IR_NO_VAL || f->instrs[phi].op != IR_PHI)
+		return;
+	
+	size_t index = ir_pred_index(f, target, block), count = 0;
+	for(ir_val_t val = phi; val != IR_NO_VAL && f->instrs[val].op == IR_PHI; val = f->instrs[val].next)
+		count++;
+	
+	asm_arg_t dests[count], srcs[count];
+	count = 0;
+	for(ir_val_t val = phi; val != IR_NO_VAL && f->instrs[val].op == IR_PHI; val = f->instrs[val].next) {
+		if (cg->intervals[val].uses == 0)
+			continue;
+		dests[count] = ir_loc(cg, val);
+		srcs[count] = ir_loc(cg, ir_arg(f, val, index));
+		count++;
+	}
+	ir_cg_parallel_move(cg, dests, srcs, count);
+}
+
+static uint8_t ir_cg_compare(ir_codegen_p cg, ir_val_t val) {
+	ir_func_p f = cg->f;
+	uint8_t cc;
+	switch(f->instrs[val].op) {
+		case IR_LT:  cc = CC_LESS;             break;
+		case IR_LE:  cc = CC_LESS_OR_EQUAL;    break;
+		case IR_GT:  cc = CC_GREATER;          break;
+		case IR_GE:  cc = CC_GREATER_OR_EQUAL; break;
+		case IR_EQ:  cc = CC_EQUAL;            break;
+		case IR_NEQ: cc = CC_NOT_EQUAL;        break;
+		default:     abort();
+	}
+	
+	// CMP takes an immediate only on the right side and needs a register on
+	// one side
+	asm_arg_t a = ir_loc(cg, ir_arg(f, val, 0)), b = ir_loc(cg, ir_arg(f, val, 1));
+	if (a.type == ASM_T_IMM) {
+		asm_arg_t temp = a;
+		a = b;
+		b = temp;
+		switch(cc) {
+			case CC_LESS:             cc = CC_GREATER;          break;
+			case CC_LESS_OR_EQUAL:    cc = CC_GREATER_OR_EQUAL; break;
+			case CC_GREATER:          cc = CC_LESS;             break;
+			case CC_GREATER_OR_EQUAL: cc = CC_LESS_OR_EQUAL;    break;
+		}
+	}
+	if (a.type != ASM_T_REG && b.type != ASM_T_REG) {
+		ir_cg_move(cg, R10, a);
+		a = R10;
+	}
+	if (b.type == ASM_T_IMM && b.imm >= 0x80000000) {
+		as_mov(cg->as, R11, b);
+		b = R11;
+	}
+	
+	as_cmp(cg->as, a, b);
+	return cc;
+}
+
+// MUL, DIV and REM with RDX:RAX
+static void ir_cg_mul_div(ir_codegen_p cg, ir_val_t val, asm_arg_t dest, asm_arg_t a, asm_arg_t b) {
+	ir_op_t op = cg->f->instrs[val].op;
+	if ( b.type == ASM_T_IMM || ir_is_reg(b, RAX.reg) || ir_is_reg(b, RDX.reg) ) {
+		as_mov(cg->as, R11, b);
+		b = R11;
+	}
+	
+	ir_cg_move(cg, RAX, a);
+	if (op == IR_MUL) {
+		as_mul(cg->as, b);
+	} else {
+		// RDX holds the upper 64 bits of the dividend
+		as_mov(cg->as, RDX, imm(0));
+		as_div(cg->as, b);
+	}
+	ir_cg_move(cg, dest, (op == IR_REM) ? RDX : RAX);
+}
+
+static void ir_cg_arith(ir_codegen_p cg, ir_val_t val) {
+	ir_func_p f = cg->f;
+	ir_op_t op = f->instrs[val].op;
+	ir_val_t a_val = ir_arg(f, val, 0), b_val = ir_arg(f, val, 1);
+	asm_arg_t dest = ir_loc(cg, val), a = ir_loc(cg, a_val), b = ir_loc(cg, b_val);
+	
+	if ( ir_needs_rax_rdx(f, val) ) {
+		ir_cg_mul_div(cg, val, dest, a, b);
+		return;
+	}
+	
+	// Compute in the destination register (or R10 for spilled values). The
+	// right side is moved out of the way when it's in that register.
+	asm_arg_t t = ir_is_reg(dest, -1) ? dest : R10;
+	bool commutative = (op == IR_ADD || op == IR_MUL);
+	if ( commutative && (a.type == ASM_T_IMM || (ir_is_reg(b, t.reg) && !ir_is_reg(a, t.reg))) ) {
+		asm_arg_t temp = a;
+		a = b;
+		b = temp;
+		ir_val_t temp_val = a_val;
+		a_val = b_val;
+		b_val = temp_val;
+	}
+	
+	switch(op) {
+		case IR_ADD: case IR_SUB:
+			if ( (b.type == ASM_T_IMM && b.imm >= 0x80000000) || (ir_is_reg(b, t.reg) && !ir_is_reg(a, t.reg)) ) {
+				as_mov(cg->as, R11, b);
+				b = R11;
+			}
+			ir_cg_move(cg, t, a);
+			if (op == IR_ADD)
+				as_add(cg->as, t, b);
+			else
+				as_sub(cg->as, t, b);
+			break;
+		
+		case IR_MUL: {
+			uint64_t c = b.imm;
+			if (a.type == ASM_T_IMM) {
+				ir_cg_move(cg, t, a);
+				a = t;
+			}
+			if (c == 0) {
+				as_mov(cg->as, t, imm(0));
+			} else if ( (c & (c - 1)) == 0 ) {
+				ir_cg_move(cg, t, a);
+				if (c > 1)
+					as_shl(cg->as, t, __builtin_ctzll(c));
+			} else {
+				as_imul(cg->as, t, a, c);
+			}
+			break;
+		}
+		
+		case IR_DIV: case IR_REM: {
+			// Power of two divisor
+			uint64_t c = b.imm;
+			ir_cg_move(cg, t, a);
+			if (op == IR_DIV && c > 1)
+				as_shr(cg->as, t, __builtin_ctzll(c));
+			else if (op == IR_REM)
+				as_and(cg->as, t, imm(c - 1));
+			break;
+		}
+		
+		default:
+			abort();
+	}
+	
+	ir_cg_move(cg, dest, t);
+}
+
+static void ir_cg_cast(ir_codegen_p cg, ir_val_t val) {
+	ir_func_p f = cg->f;
+	ir_val_t src_val = ir_arg(f, val, 0);
+	asm_arg_t dest = ir_loc(cg, val), t = ir_is_reg(dest, -1) ? dest : R10;
+	ir_cg_move(cg, t, ir_loc(cg, src_val));
+	// Smaller values are kept zero extended, only truncation needs code
+	if (f->instrs[val].type == IR_U8 && f->instrs[src_val].type != IR_U8)
+		as_and(cg->as, t, imm(0xff));
+	ir_cg_move(cg, dest, t);
+}
+
+static void ir_cg_call(ir_codegen_p cg, ir_val_t val) {
+	ir_func_p f = cg->f;
+	ir_instr_p instr = &f->instrs[val];
+	int8_t in_regs[] = CALL_IN_REGS;
+	size_t arg_count = instr->args.len;
+	size_t stack_in_count = (arg_count > CALL_IN_REG_COUNT) ? arg_count - CALL_IN_REG_COUNT : 0;
+	size_t stack_out_count = (instr->imm > CALL_OUT_REG_COUNT) ? instr->imm - CALL_OUT_REG_COUNT : 0;
+	
+	// Space for the out args, then the in args that don't fit into registers
+	if (stack_out_count > 0)
+		as_sub(cg->as, RSP, imm(stack_out_count * 8));
+	for(size_t i = CALL_IN_REG_COUNT; i < arg_count; i++) {
+		asm_arg_t arg = ir_loc(cg, ir_arg(f, val, i));
+		if (arg.type == ASM_T_IMM && arg.imm >= 0x80000000) {
+			as_mov(cg->as, R11, arg);
+			arg = R11;
+		}
+		as_push(cg->as, arg);
+	}
+	
+	size_t reg_arg_count = (arg_count < CALL_IN_REG_COUNT) ? arg_count : CALL_IN_REG_COUNT;
+	asm_arg_t dests[CALL_IN_REG_COUNT], srcs[CALL_IN_REG_COUNT];
+	for(size_t i = 0; i < reg_arg_count; i++) {
+		dests[i] = reg(in_regs[i]);
+		srcs[i] = ir_loc(cg, ir_arg(f, val, i));
+	}
+	ir_cg_parallel_move(cg, dests, srcs, reg_arg_count);
+	
+	size_t offset = as_call(cg->as, reld(0));
+	list_append(&f->call_slots, ((ir_call_slot_t){ offset, instr->target }));
+	if (stack_in_count + stack_out_count > 0)
+		as_add(cg->as, RSP, imm((stack_in_count + stack_out_count) * 8));
+	
+	if (instr->type == IR_VOID || cg->intervals[val].uses == 0)
+		return;
+	// Clear the upper bits of smaller values
+	if (instr->type == IR_U8)
+		as_and(cg->as, RAX, imm(0xff));
+	ir_cg_move(cg, ir_loc(cg, val), RAX);
+}
+
+static void ir_cg_syscall(ir_codegen_p cg, ir_val_t val) {
+	ir_func_p f = cg->f;
+	size_t arg_count = f->instrs[val].args.len;
+	if (arg_count < 1 || arg_count > 7) {
+		fprintf(stderr, "ir_cg_syscall(): need 1 to 7 args, got %zu\n", arg_count);
+		abort();
+	}
+	
+	asm_arg_t dests[7], srcs[7];
+	for(size_t i = 0; i < arg_count; i++) {
+		dests[i] = reg(ir_syscall_regs[i]);
+		srcs[i] = ir_loc(cg, ir_arg(f, val, i));
+	}
+	ir_cg_parallel_move(cg, dests, srcs, arg_count);
+	
+	// Write the profile before the program exits
+	ir_val_t number = ir_arg(f, val, 0);
+	if ( f->profile.exit_func != NULL && f->instrs[number].op == IR_CONST && profile_is_exit_syscall(f->instrs[number].imm) ) {
+		size_t offset = as_call(cg->as, reld(0));
+		list_append(&f->call_slots, ((ir_call_slot_t){ offset, f->profile.exit_func }));
+	}
+	as_syscall(cg->as);
+	
+	if (cg->intervals[val].uses > 0)
+		ir_cg_move(cg, ir_loc(cg, val), RAX);
+}
+
+static void ir_cg_ret(ir_codegen_p cg, ir_val_t val) {
+	ir_func_p f = cg->f;
+	int8_t out_regs[] = CALL_OUT_REGS;
+	size_t out_count = f->instrs[val].args.len;
+	size_t stack_in_count = (f->in_count > CALL_IN_REG_COUNT) ? f->in_count - CALL_IN_REG_COUNT : 0;
+	
+	// Out args on the stack first, the moves into the out registers might
+	// overwrite their values
+	for(size_t i = CALL_OUT_REG_COUNT; i < out_count; i++) {
+		asm_arg_t dest = memrd(cg->frame, cg->args_displ + (stack_in_count + i - CALL_OUT_REG_COUNT) * 8);
+		ir_cg_move(cg, dest, ir_loc(cg, ir_arg(f, val, i)));
+	}
+	
+	size_t reg_out_count = (out_count < CALL_OUT_REG_COUNT) ? out_count : CALL_OUT_REG_COUNT;
+	asm_arg_t dests[CALL_OUT_REG_COUNT], srcs[CALL_OUT_REG_COUNT];
+	for(size_t i = 0; i < reg_out_count; i++) {
+		dests[i] = reg(out_regs[i]);
+		srcs[i] = ir_loc(cg, ir_arg(f, val, i));
+	}
+	ir_cg_parallel_move(cg, dests, srcs, reg_out_count);
+	
+	// The out args are in RAX and RDX already, keep them in the scratch
+	// registers while the cycles are counted
+	if (f->profile.entry != 0) {
+		as_mov(cg->as, R10, RAX);
+		as_mov(cg->as, R11, RDX);
+		profile_emit_leave(cg->as, cg->profile_slot, f->profile);
+		as_mov(cg->as, RAX, R10);
+		as_mov(cg->as, RDX, R11);
+	}
+	
+	// Epilogue: restore callee saved registers, the callers stack and base
+	// pointer
+	for(int8_t i = 0; i < 16; i++) {
+		if (cg->saved_regs & (1 << i))
+			as_mov(cg->as, reg(i), memrd(cg->frame, cg->saved_displs[i]));
+	}
+	if (cg->frame.reg == RBP.reg) {
+		as_mov(cg->as, RSP, RBP);
+		as_pop(cg->as, RBP);
+	}
+	as_ret(cg->as, 0);
+}
+
+static void ir_cg_branch(ir_codegen_p cg, uint32_t block, ir_val_t val) {
+	ir_func_p f = cg->f;
+	ir_instr_p instr = &f->instrs[val];
+	uint32_t true_target = instr->targets[0], false_target = instr->targets[1];
+	for(size_t i = 0; i < 2; i++) {
+		ir_val_t first = f->blocks[instr->targets[i]].first;
+		if (f->instrs[first].op == IR_PHI) {
+			fprintf(stderr, "ir_cg_branch(): branch into a block with phis, split critical edges first!\n");
+			abort();
+		}
+	}
+	
+	uint8_t cc;
+	ir_val_t cond = ir_arg(f, val, 0);
+	if (cg->intervals[cond].fused) {
+		cc = ir_cg_compare(cg, cond);
+	} else {
+		asm_arg_t c = ir_loc(cg, cond);
+		if (c.type == ASM_T_IMM) {
+			ir_cg_jump(cg, block, c.imm ? true_target : false_target, 0, false);
+			return;
+		}
+		if (c.type != ASM_T_REG) {
+			as_mov(cg->as, R10, c);
+			c = R10;
+		}
+		as_cmp(cg->as, c, imm(0));
+		cc = CC_NOT_EQUAL;
+	}
+	
+	// Condition codes come in pairs, the lowest bit negates the condition
+	uint32_t next = f->blocks[block].next;
+	if (true_target == next) {
+		ir_cg_jump(cg, block, false_target, cc ^ 1, true);
+	} else {
+		ir_cg_jump(cg, block, true_target, cc, true);
+		ir_cg_jump(cg, block, false_target, 0, false);
+	}
+}
+
+static void ir_cg_block(ir_codegen_p cg, uint32_t block) {
+	ir_func_p f = cg->f;
+	for(ir_val_t val = f->blocks[block].first; val != IR_NO_VAL; val = f->instrs[val].next) {
+		ir_instr_p instr = &f->instrs[val];
+		switch(instr->op) {
+			case IR_NOP: case IR_CONST: case IR_ARG: case IR_PHI:
+				break;
+			case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV: case IR_REM:
+				ir_cg_arith(cg, val);
+				break;
+			case IR_LT: case IR_LE: case IR_GT: case IR_GE: case IR_EQ: case IR_NEQ:
+				if (!cg->intervals[val].fused) {
+					// SETcc only writes the lowest byte so clear the register
+					// first. MOV doesn't touch the flags.
+					uint8_t cc = ir_cg_compare(cg, val);
+					asm_arg_t dest = ir_loc(cg, val), t = ir_is_reg(dest, -1) ? dest : R10;
+					as_mov(cg->as, t, imm(0));
+					as_set_cc(cg->as, cc, regb(t.reg));
+					ir_cg_move(cg, dest, t);
+				}
+				break;
+			case IR_CAST:
+				ir_cg_cast(cg, val);
+				break;
+			case IR_CALL:
+				ir_cg_call(cg, val);
+				break;
+			case IR_SYSCALL:
+				ir_cg_syscall(cg, val);
+				break;
+			case IR_PROFILE_COUNT:
+				profile_emit_count(cg->as, instr->imm);
+				break;
+			case IR_JMP:
+				ir_cg_phi_moves(cg, block, instr->targets[0]);
+				ir_cg_jump(cg, block, instr->targets[0], 0, false);
+				break;
+			case IR_BRANCH:
+				ir_cg_branch(cg, block, val);
+				break;
+			case IR_RET:
+				ir_cg_ret(cg, val);
+				break;
+			case IR_OP_COUNT:
+				abort();
+		}
+	}
+}
+
+void ir_compile(ir_func_p f, asm_p as, ir_stats_p stats) {
+	ir_split_critical_edges(f);
+	
+	ir_codegen_t cg = (ir_codegen_t){
+		.f = f,
+		.as = as,
+		.stats = stats,
+		.intervals = malloc(f->instr_count * sizeof(ir_interval_t)),
+		.pos = calloc(f->instr_count, sizeof(uint32_t)),
+		.block_offsets = calloc(f->block_count, sizeof(size_t)),
+	};
+	for(ir_val_t val = 0; val < f->instr_count; val++)
+		cg.intervals[val] = (ir_interval_t){ .start = UINT32_MAX, .end = 0, .hint = -1, .reg = -1, .slot = -1 };
+	
+	uint32_t* block_start = calloc(f->block_count, sizeof(uint32_t));
+	uint32_t* block_end = calloc(f->block_count, sizeof(uint32_t));
+	ir_cg_number(&cg, block_start, block_end);
+	ir_cg_build_intervals(&cg, block_start, block_end);
+	
+	// Registers overwritten during an interval are off limits for it
+	bool has_calls = false;
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		uint16_t clobbers = ir_clobbers(f, val);
+		has_calls = has_calls || (f->instrs[val].op == IR_CALL);
+		if (clobbers == 0 || f->instrs[val].op == IR_NOP)
+			continue;
+		for(ir_val_t other = 1; other < f->instr_count; other++) {
+			ir_interval_p interval = &cg.intervals[other];
+			if (interval->start < cg.pos[val] && cg.pos[val] < interval->end)
+				interval->avoid |= clobbers;
+		}
+	}
+	
+	size_t slot_count = 0;
+	ir_cg_set_hints(&cg);
+	ir_cg_allocate(&cg, &slot_count);
+	stats->spilled_values += slot_count;
+	
+	// Leaf functions with a small frame use the red zone below the stack
+	// pointer instead of a frame (see compile_func() in main.c). The time
+	// stamp for the profile gets the frame slot after the spill slots.
+	size_t frame_size = (cg.saved_count + slot_count + (f->profile.entry != 0)) * 8;
+	cg.frame = (!has_calls && frame_size <= 128) ? RSP : RBP;
+	cg.args_displ = (cg.frame.reg == RBP.reg) ? 16 : 8;
+	cg.profile_slot = memrd(cg.frame, -(int32_t)frame_size);
+	
+	// Prologue: set up the frame, save the callee saved registers we use and
+	// move the args into their locations
+	if (cg.frame.reg == RBP.reg) {
+		as_push(as, RBP);
+		as_mov(as, RBP, RSP);
+		if (frame_size > 0)
+			as_sub(as, RSP, imm(frame_size));
+	}
+	for(int8_t i = 0; i < 16; i++) {
+		if (cg.saved_regs & (1 << i))
+			as_mov(as, memrd(cg.frame, cg.saved_displs[i]), reg(i));
+	}
+	
+	// RDX might be an in arg, RAX isn't
+	if (f->profile.entry != 0) {
+		as_mov(as, R11, RDX);
+		profile_emit_enter(as, cg.profile_slot, f->profile);
+		as_mov(as, RDX, R11);
+	}
+	
+	int8_t in_regs[] = CALL_IN_REGS;
+	asm_arg_t dests[CALL_IN_REG_COUNT], srcs[CALL_IN_REG_COUNT];
+	size_t arg_move_count = 0;
+	for(ir_val_t val = f->blocks[0].first; val != IR_NO_VAL; val = f->instrs[val].next) {
+		ir_instr_p instr = &f->instrs[val];
+		if (instr->op != IR_ARG || ir_is_stack_arg(&cg, val) || cg.intervals[val].uses == 0)
+			continue;
+		dests[arg_move_count] = ir_loc(&cg, val);
+		srcs[arg_move_count] = reg(in_regs[instr->imm]);
+		arg_move_count++;
+	}
+	ir_cg_parallel_move(&cg, dests, srcs, arg_move_count);
+	
+	for(uint32_t block = f->first_block; block != IR_NO_BLOCK; block = f->blocks[block].next) {
+		cg.block_offsets[block] = as_target(as);
+		ir_cg_block(&cg, block);
+		
+		stats->blocks++;
+		for(ir_val_t val = f->blocks[block].first; val != IR_NO_VAL; val = f->instrs[val].next)
+			stats->instructions++;
+	}
+	stats->functions++;
+	
+	for(size_t i = 0; i < cg.jumps.len; i++)
+		as_set_jmp_slot_target(as, cg.jumps.ptr[i].slot, cg.block_offsets[cg.jumps.ptr[i].block]);
+	
+	list_free(&cg.jumps);
+	free(block_start);
+	free(block_end);
+	free(cg.block_offsets);
+	free(cg.pos);
+	free(cg.intervals);
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "common.h"
+#include "asm.h"
+#include "profile.h"
+
+
+//
+// SSA intermediate representation
+//
+// A function is a set of basic blocks. Each block is a list of instructions
+// that ends with exactly one terminator (jump, branch or return). Every
+// instruction defines at most one value and a value is never assigned again
+// (static single assignment). Where control flow merges phi instructions at
+// the start of the block pick the value of the predecessor we came from.
+//
+// All instructions, blocks and operand lists of a function are stored in a few
+// arrays owned by the function. They're referred to by their index so the
+// arrays can grow without breaking references and everything is freed at once.
+// The value defined by an instruction is just the index of that instruction.
+// Removed instructions are unlinked from their block and become IR_NOP.
+//
+
+typedef uint32_t ir_val_t;  // index of the instruction that defines the value
+
+#define IR_NO_VAL   0           // index 0 is reserved, no instruction lives there
+#define IR_NO_BLOCK UINT32_MAX
+
+typedef enum {
+	IR_VOID,
+	IR_U8,
+	IR_U64
+} ir_type_t;
+
+typedef enum {
+	IR_NOP,
+	
+	// Values
+	IR_CONST,    // imm
+	IR_ARG,      // in arg number imm of the function
+	IR_PHI,      // one operand per predecessor of the block (same order)
+	IR_ADD, IR_SUB, IR_MUL, IR_DIV, IR_REM,
+	IR_LT, IR_LE, IR_GT, IR_GE, IR_EQ, IR_NEQ,  // 1 if true, 0 otherwise
+	IR_CAST,     // operand truncated or zero extended to the type of the instruction
+	IR_CALL,     // calls target with the operands as in args, value is the first out arg, imm is the out arg count of target
+	IR_SYSCALL,  // first operand is the syscall number
+	IR_PROFILE_COUNT,  // adds 1 to the loop counter at address imm (see profile.h)
+	
+	// Terminators
+	IR_JMP,      // to targets[0]
+	IR_BRANCH,   // to targets[0] if the operand isn't 0, otherwise to targets[1]
+	IR_RET,      // operands are the out args
+	
+	IR_OP_COUNT
+} ir_op_t;
+
+// Range of elements in ir_func_t.pool. A list that grows beyond its capacity is
+// moved to the end of the pool, the old space is left behind.
+typedef struct {
+	uint32_t start, len, cap;
+} ir_list_t, *ir_list_p;
+
+typedef struct {
+	ir_op_t   op;
+	ir_type_t type;
+	uint32_t  block;
+	ir_val_t  prev, next;  // neighbours in the block, IR_NO_VAL at the ends
+	int64_t   imm;
+	void*     target;      // IR_CALL: function that is called (opaque to the IR)
+	ir_list_t args;        // operands
+	uint32_t  targets[2];  // successor blocks of IR_JMP and IR_BRANCH
+} ir_instr_t, *ir_instr_p;
+
+typedef struct {
+	ir_val_t  first, last;  // instructions, the last one is the terminator
+	ir_list_t preds;
+	uint32_t  prev, next;   // neighbours in the code layout, IR_NO_BLOCK at the ends
+	bool      sealed;       // all predecessors are known (used during SSA construction)
+	bool      removed;
+} ir_block_t, *ir_block_p;
+
+typedef struct {
+	size_t offset;  // code offset of the call displacement
+	void*  target;
+} ir_call_slot_t;
+
+typedef struct {
+	const char* name;
+	int         name_len;
+	size_t      in_count, out_count;
+	
+	ir_instr_p instrs;
+	uint32_t   instr_count, instr_cap;
+	ir_block_p blocks;
+	uint32_t   block_count, block_cap;
+	uint32_t*  pool;
+	uint32_t   pool_len, pool_cap;
+	uint32_t   first_block, last_block;  // code layout, block 0 is the entry
+	
+	// Instrumentation for --profile, set before ir_compile()
+	profile_func_t profile;
+	
+	// Filled by ir_compile()
+	list_t(ir_call_slot_t) call_slots;
+} ir_func_t, *ir_func_p;
+
+typedef struct {
+	size_t functions, blocks, instructions;
+	size_t pass_changes;    // passes that changed something
+	size_t spilled_values;  // values that live in a stack frame slot
+	size_t moves;           // moves for phis, args and call results
+	size_t inlined_calls;
+} ir_stats_t, *ir_stats_p;
+
+// Calling convention: The first 6 in args are passed in RDI, RSI, RDX, RCX, R8
+// and R9, the first 2 out args are returned in RAX and RDX. Further args are
+// passed on the stack. The caller reserves space for the out args and then
+// pushes the in args (from first to last) before the call. A function has to
+// preserve RBX, RBP and R12 to R15, all other registers can be overwritten.
+// The IR backend and the tree compiler in main.c both follow it.
+#define CALL_IN_REGS      { RDI.reg, RSI.reg, RDX.reg, RCX.reg, R8.reg, R9.reg }
+#define CALL_IN_REG_COUNT 6
+#define CALL_OUT_REGS     { RAX.reg, RDX.reg }
+#define CALL_OUT_REG_COUNT 2
+#define CALLER_SAVED_REGS { RAX.reg, RCX.reg, RDX.reg, RSI.reg, RDI.reg, R8.reg, R9.reg, R10.reg, R11.reg }
+#define CALLEE_SAVED_REGS { RBX.reg, R12.reg, R13.reg, R14.reg, R15.reg }
+
+
+void ir_new(ir_func_p f, const char* name, int name_len, size_t in_count, size_t out_count);
+void ir_destroy(ir_func_p f);
+
+// Access by index, the pointers are only valid until the next instruction or
+// block is added
+static inline ir_instr_p ir_instr(ir_func_p f, ir_val_t val)     { return &f->instrs[val]; }
+static inline ir_block_p ir_block(ir_func_p f, uint32_t block)   { return &f->blocks[block]; }
+static inline uint32_t*  ir_list_ptr(ir_func_p f, ir_list_t list) { return f->pool + list.start; }
+static inline ir_val_t   ir_arg(ir_func_p f, ir_val_t val, size_t i) { return f->pool[f->instrs[val].args.start + i]; }
+
+void ir_list_append(ir_func_p f, ir_list_p list, uint32_t value);
+void ir_list_remove(ir_func_p f, ir_list_p list, size_t index);
+
+//
+// Builder
+//
+// Instructions are appended to the end of a block. When the block already has
+// a terminator they're inserted before it. Phis are put at the start of the
+// block and get their operands later on (see ir_list_append()). Jumps and
+// branches add their block to the predecessors of the targets.
+//
+
+uint32_t ir_block_new(ir_func_p f);
+void     ir_block_move_after(ir_func_p f, uint32_t block, uint32_t after);
+bool     ir_block_terminated(ir_func_p f, uint32_t block);
+size_t   ir_block_succs(ir_func_p f, uint32_t block, uint32_t succs[2]);
+
+ir_val_t ir_append(ir_func_p f, uint32_t block, ir_op_t op, ir_type_t type, const ir_val_t args[], size_t arg_count);
+ir_val_t ir_const(ir_func_p f, uint32_t block, ir_type_t type, int64_t value);
+ir_val_t ir_in_arg(ir_func_p f, uint32_t block, ir_type_t type, size_t index);
+ir_val_t ir_binary(ir_func_p f, uint32_t block, ir_op_t op, ir_type_t type, ir_val_t a, ir_val_t b);
+ir_val_t ir_cast(ir_func_p f, uint32_t block, ir_type_t type, ir_val_t val);
+ir_val_t ir_call(ir_func_p f, uint32_t block, ir_type_t type, void* target, size_t target_out_count, const ir_val_t args[], size_t arg_count);
+ir_val_t ir_phi(ir_func_p f, uint32_t block, ir_type_t type);
+void     ir_jmp(ir_func_p f, uint32_t block, uint32_t target);
+void     ir_branch(ir_func_p f, uint32_t block, ir_val_t cond, uint32_t true_target, uint32_t false_target);
+void     ir_ret(ir_func_p f, uint32_t block, const ir_val_t values[], size_t value_count);
+
+void     ir_remove(ir_func_p f, ir_val_t val);
+void     ir_replace_uses(ir_func_p f, ir_val_t old_val, ir_val_t new_val);
+bool     ir_is_terminator(ir_op_t op);
+
+void     ir_print(ir_func_p f, FILE* stream);
+
+//
+// Passes
+//
+// A pass returns true if it changed the function. ir_run_passes() runs them in
+// order and verifies the function after each one so a broken pass is caught
+// right where it happens.
+//
+
+typedef bool (*ir_pass_func_t)(ir_func_p f);
+typedef struct {
+	const char*    name;
+	ir_pass_func_t run;
+} ir_pass_t;
+
+void ir_verify(ir_func_p f, const char* after_pass);
+void ir_run_passes(ir_func_p f, const ir_pass_t passes[], size_t pass_count, ir_stats_p stats);
+
+bool ir_remove_unreachable_blocks(ir_func_p f);
+bool ir_remove_trivial_phis(ir_func_p f);
+bool ir_fold_constants(ir_func_p f);
+bool ir_remove_dead_values(ir_func_p f);
+bool ir_merge_blocks(ir_func_p f);
+bool ir_hoist_loop_invariants(ir_func_p f);
+bool ir_reduce_induction_vars(ir_func_p f);
+bool ir_split_critical_edges(ir_func_p f);
+
+size_t ir_inline_cost(ir_func_p f);
+void   ir_inline_call(ir_func_p f, ir_val_t call, ir_func_p callee);
+
+extern const ir_pass_t ir_default_passes[];
+extern const size_t ir_default_pass_count;
+
+//
+// Backend
+//
+// Compiles the function to the end of the code buffer. Call displacements are
+// left for the linker and recorded in f->call_slots.
+//
+
+void ir_compile(ir_func_p f, asm_p as, ir_stats_p stats);
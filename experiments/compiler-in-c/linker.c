@@ -0,0 +1,130 @@
+#include <string.h>
+#include <pthread.h>
+
+#define SLIM_HASH_IMPLEMENTATION
+#include "slim_hash.h"
+
+#include "linker.h"
+
+
+// Symbol table: function → index into the symbol offsets
+SH_GEN_DECL(link_symtab, node_p, uint32_t);
+SH_GEN_HASH_DEF(link_symtab, node_p, uint32_t);
+
+typedef struct {
+	size_t   offset;  // code offset of the 32 bit displacement
+	uint32_t symbol;  // index into the symbol table
+} link_reloc_t, *link_reloc_p;
+
+typedef struct {
+	uint8_t*            code;
+	const size_t*       symbol_offsets;
+	const link_reloc_t* relocs;
+	size_t              reloc_count;
+} link_chunk_t, *link_chunk_p;
+
+static int link_reloc_cmp(const void* a, const void* b) {
+	size_t offset_a = ((const link_reloc_t*)a)->offset, offset_b = ((const link_reloc_t*)b)->offset;
+	return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+static void* link_patch_chunk(void* arg) {
+	link_chunk_p chunk = arg;
+	for(size_t i = 0; i < chunk->reloc_count; i++) {
+		size_t offset = chunk->relocs[i].offset;
+		int32_t call_displ = chunk->symbol_offsets[chunk->relocs[i].symbol] - (offset + 4);
+		memcpy(chunk->code + offset, &call_displ, sizeof(call_displ));
+	}
+	return NULL;
+}
+
+bool link_funcs(node_p funcs[], size_t func_count, uint8_t* code, size_t chunk_size, FILE* error_stream, link_stats_p stats) {
+	// The offsets are kept in a separate array so the patch loop only touches
+	// what it needs
+	link_symtab_t symtab;
+	link_symtab_new(&symtab);
+	size_t* symbol_offsets = malloc(func_count * sizeof(symbol_offsets[0]));
+	size_t reloc_count = 0;
+	for(size_t i = 0; i < func_count; i++) {
+		link_symtab_put(&symtab, funcs[i], i);
+		symbol_offsets[i] = funcs[i]->func.as_offset;
+		reloc_count += funcs[i]->func.addr_slots.len;
+	}
+	
+	link_reloc_p relocs = malloc(reloc_count * sizeof(relocs[0]));
+	list_t(node_addr_slot_t) unresolved = { 0, NULL };
+	size_t n = 0;
+	for(size_t i = 0; i < func_count; i++) {
+		for(size_t j = 0; j < funcs[i]->func.addr_slots.len; j++) {
+			node_addr_slot_t slot = funcs[i]->func.addr_slots.ptr[j];
+			uint32_t* symbol = link_symtab_get_ptr(&symtab, slot.target);
+			if (symbol == NULL) {
+				list_append(&unresolved, slot);
+				continue;
+			}
+			relocs[n++] = (link_reloc_t){ .offset = slot.offset, .symbol = *symbol };
+		}
+	}
+	reloc_count = n;
+	
+	size_t thread_count = 0;
+	if (unresolved.len > 0) {
+		fprintf(error_stream, "link_funcs(): %zu unresolved symbols!\n", unresolved.len);
+		for(size_t i = 0; i < unresolved.len; i++) {
+			node_p target = unresolved.ptr[i].target;
+			if (target->type == NT_FUNC)
+				fprintf(error_stream, "  %.*s", target->func.name.len, target->func.name.ptr);
+			else
+				fprintf(error_stream, "  <%s node>", target->spec->name);
+			fprintf(error_stream, " referenced at code offset %zu\n", unresolved.ptr[i].offset);
+		}
+		goto done;
+	}
+	
+	// Functions are compiled one after the other so the list is usually sorted
+	// already, but the peephole optimizer or a different compile order might
+	// change that
+	qsort(relocs, reloc_count, sizeof(relocs[0]), link_reloc_cmp);
+	
+	thread_count = reloc_count / chunk_size;
+	if (thread_count > LINK_MAX_THREADS)
+		thread_count = LINK_MAX_THREADS;
+	if (thread_count < 1)
+		thread_count = 1;
+	
+	if (thread_count == 1) {
+		link_patch_chunk(&(link_chunk_t){ code, symbol_offsets, relocs, reloc_count });
+	} else {
+		pthread_t threads[thread_count];
+		bool started[thread_count];
+		link_chunk_t chunks[thread_count];
+		size_t relocs_per_thread = (reloc_count + thread_count - 1) / thread_count;
+		for(size_t i = 0; i < thread_count; i++) {
+			size_t start = i * relocs_per_thread;
+			size_t end = (start + relocs_per_thread < reloc_count) ? start + relocs_per_thread : reloc_count;
+			chunks[i] = (link_chunk_t){ code, symbol_offsets, relocs + start, end - start };
+			started[i] = ( pthread_create(&threads[i], NULL, link_patch_chunk, &chunks[i]) == 0 );
+			// No thread, just do it ourselves
+			if (!started[i])
+				link_patch_chunk(&chunks[i]);
+		}
+		for(size_t i = 0; i < thread_count; i++) {
+			if (started[i])
+				pthread_join(threads[i], NULL);
+		}
+	}
+	
+	for(size_t i = 0; i < func_count; i++)
+		funcs[i]->func.linked = true;
+	
+	done:
+		stats->relocations = reloc_count;
+		stats->threads = thread_count;
+		stats->unresolved = unresolved.len;
+		
+		list_free(&unresolved);
+		free(relocs);
+		free(symbol_offsets);
+		link_symtab_destroy(&symtab);
+	return (stats->unresolved == 0);
+}
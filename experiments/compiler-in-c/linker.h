@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "ast.h"
+
+
+//
+// Linker
+//
+// Resolves the call displacements of all compiled functions in one go. The
+// code offsets of the functions are collected into a symbol table first, then
+// the address slots of all functions are gathered into one relocation list
+// sorted by code offset. That list is patched in a single pass over the code
+// buffer. Large programs split it into chunks that are patched by several
+// threads (the chunks never touch the same bytes). Address slots that point
+// to functions that weren't compiled are collected and reported together.
+//
+
+#define LINK_CHUNK_SIZE  4096  // min. relocations patched by one thread
+#define LINK_MAX_THREADS 8
+
+typedef struct {
+	size_t relocations;
+	size_t threads;     // that patched the code, 1 if it was done without extra threads
+	size_t unresolved;  // address slots with a target that isn't in the function list
+} link_stats_t, *link_stats_p;
+
+/**
+ * Patches the address slots of funcs (in the order they were compiled) in
+ * code. Each thread patches at least chunk_size relocations (LINK_CHUNK_SIZE
+ * unless you want to test the threads with small programs). If a function
+ * calls something that isn't in funcs all unresolved symbols are written to
+ * error_stream, the code is left untouched and false is returned.
+ */
+bool link_funcs(node_p funcs[], size_t func_count, uint8_t* code, size_t chunk_size, FILE* error_stream, link_stats_p stats);
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 
 #define SLIM_HASH_IMPLEMENTATION
 #include "slim_hash.h"
@@ -12,20 +13,56 @@
 #include "lexer.h"
 #include "parser.h"
 #include "reg_alloc.h"
+#include "peephole.h"
+#include "ir.h"
+#include "pool.h"
+#include "profile.h"
+#include "linker.h"
 
 
 void   fill_namespaces(node_p node, node_ns_p current_ns);
 node_p expand_uops(node_p node, uint32_t level, uint32_t flags, void* private);
-void   compile(node_p node, const char* filename);
+void   compile(node_p node, const char* filename, bool use_ir, bool inline_report, size_t jobs, bool profile);
 void   setup_builtin_types();
 void   infere_types(node_p node);
+void   eliminate_dead_code(node_p module);
 
 typedef struct compiler_ctx_s compiler_ctx_t, *compiler_ctx_p;
 
 
 int main(int argc, char** argv) {
+	// --ir compiles functions through the SSA IR instead of directly from the
+	// AST, --inline-report shows why calls were inlined or not (needs --ir),
+	// --jobs N compiles functions on N threads, --profile instruments the
+	// program to write main.prof when it exits (see profile.h)
+	bool use_ir = false, inline_report = false, profile = false;
+	size_t jobs = 1;
+	while (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+		if ( strcmp(argv[1], "--ir") == 0 ) {
+			use_ir = true;
+		} else if ( strcmp(argv[1], "--inline-report") == 0 ) {
+			inline_report = true;
+		} else if ( strcmp(argv[1], "--profile") == 0 ) {
+			profile = true;
+		} else if ( strcmp(argv[1], "--jobs") == 0 && argc >= 3 && atoi(argv[2]) > 0 ) {
+			jobs = atoi(argv[2]);
+			argc--;
+			argv++;
+		} else {
+			fprintf(stderr, "unknown option: %s\n", argv[1]);
+			return 1;
+		}
+		argc--;
+		argv++;
+	}
+	
 	if (argc < 2) {
-		fprintf(stderr, "usage: %s source-file\n", argv[0]);
+		fprintf(stderr, "usage: %s [--ir] [--inline-report] [--jobs N] [--profile] source-file\n", argv[0]);
+		return 1;
+	}
+	
+	if (inline_report && !use_ir) {
+		fprintf(stderr, "--inline-report only works with --ir\n");
 		return 1;
 	}
 	
@@ -90,7 +127,10 @@ int main(int argc, char** argv) {
 	infere_types(tree);
 	node_print(tree, stdout);
 	
-	compile(tree, "main.elf");
+	printf("PASS: eliminate dead code...\n");
+	eliminate_dead_code(tree);
+	
+	compile(tree, "main.elf", use_ir, inline_report, jobs, profile);
 	
 	node_ns_destroy(&global_ns);
 	lex_free(list);
@@ -166,6 +206,7 @@ typedef enum {
 	OP_ADD, OP_SUB,
 	OP_LT, OP_LE, OP_GT, OP_GE,
 	OP_EQ, OP_NEQ,
+	OP_AND, OP_OR,
 	OP_ASSIGN,
 	
 	OP_COUNT  // last ID is reserved to represent the number of existing operators
@@ -188,6 +229,9 @@ struct { char* name; int precedence; op_assoc_t assoc; } operators[] = {
 	[OP_EQ]     = { "==", 40, LEFT_TO_RIGHT },
 	[OP_NEQ]    = { "!=", 40, LEFT_TO_RIGHT },
 	
+	[OP_AND]    = { "and", 30, LEFT_TO_RIGHT },
+	[OP_OR]     = { "or",  20, LEFT_TO_RIGHT },
+	
 	[OP_ASSIGN] = { "=",   0, RIGHT_TO_LEFT },
 };
 
@@ -428,8 +472,10 @@ void infere_types(node_p node) {
 				fprintf(stderr, "infere_types(): Call target isn't a function node!\n");
 				abort();
 			}
-			// Make sure the target root has its type member set
-			infere_types(target);
+			// Only the out args are needed. Recursing into the whole target
+			// function would never end for recursive functions.
+			for(size_t i = 0; i < target->func.out.len; i++)
+				infere_types(target->func.out.ptr[i]);
 			
 			if (target->func.out.len >= 1)
 				node->call.type = target->func.out.ptr[0]->arg.type;
@@ -456,6 +502,138 @@ void infere_types(node_p node) {
 	}
 }
 
+//
+// Dead code elimination
+//
+// Removes statements that can never run or don't do anything: The rest of a
+// statement list after a return, if and while statements with a constant
+// condition and expression statements without side effects. Calls in removed
+// code don't put their target into the compile queue, so functions only called
+// from dead code aren't compiled at all. Runs after type inference since
+// folding needs the types of the operators.
+//
+
+typedef struct {
+	size_t stmts_removed;
+	size_t conds_folded;
+} dce_stats_t, *dce_stats_p;
+
+// True if evaluating the node doesn't change any variables (no assignments,
+// no calls)
+static bool is_pure_expr(node_p node) {
+	switch(node->type) {
+		case NT_INTL: case NT_STRL: case NT_ID:
+			return true;
+		case NT_OP:
+			return node->op.idx != OP_ASSIGN && is_pure_expr(node->op.a) && is_pure_expr(node->op.b);
+		default:
+			return false;
+	}
+}
+
+// Evaluates expressions made up of literals and operators. Returns false if
+// the value isn't known at compile time.
+static bool dce_const_value(node_p node, int64_t* value) {
+	if (node->type == NT_INTL) {
+		*value = node->intl.value;
+		return true;
+	}
+	
+	int64_t a, b;
+	if ( node->type != NT_OP || node->op.idx == OP_ASSIGN || !dce_const_value(node->op.a, &a) || !dce_const_value(node->op.b, &b) )
+		return false;
+	
+	uint64_t ua = a, ub = b, result;
+	switch(node->op.idx) {
+		case OP_MUL: result = ua * ub; break;
+		case OP_DIV: if (ub == 0) return false; result = ua / ub; break;
+		case OP_REM: if (ub == 0) return false; result = ua % ub; break;
+		case OP_ADD: result = ua + ub; break;
+		case OP_SUB: result = ua - ub; break;
+		// Compares are signed like in the code generators
+		case OP_LT:  result = (a <  b); break;
+		case OP_LE:  result = (a <= b); break;
+		case OP_GT:  result = (a >  b); break;
+		case OP_GE:  result = (a >= b); break;
+		case OP_EQ:  result = (a == b); break;
+		case OP_NEQ: result = (a != b); break;
+		case OP_AND: result = (a != 0 && b != 0); break;
+		case OP_OR:  result = (a != 0 || b != 0); break;
+		default:     return false;
+	}
+	
+	*value = (node->op.type == type_ubyte) ? (result & 0xff) : result;
+	return true;
+}
+
+// Replaces if and while statements with a constant condition by the code that
+// actually runs. Returns NULL if nothing of the statement is left.
+static node_p dce_fold_stmt(node_p stmt, dce_stats_p stats) {
+	int64_t cond;
+	while (stmt != NULL && stmt->type == NT_IF && dce_const_value(stmt->if_stmt.cond, &cond)) {
+		node_p taken = (cond != 0) ? stmt->if_stmt.true_case : stmt->if_stmt.false_case;
+		if (taken != NULL)
+			taken->parent = stmt->parent;
+		stmt = taken;
+		stats->conds_folded++;
+	}
+	
+	if (stmt != NULL && stmt->type == NT_WHILE && dce_const_value(stmt->while_stmt.cond, &cond) && cond == 0) {
+		stmt = NULL;
+		stats->conds_folded++;
+	}
+	
+	return stmt;
+}
+
+static void dce_node(node_p node, dce_stats_p stats);
+
+// keep_last_value: The value of the last statement is used (it's the result of
+// a function), so it stays even if it's a pure expression.
+static void dce_stmts(node_list_p stmts, bool keep_last_value, dce_stats_p stats) {
+	size_t kept = 0;
+	for(size_t i = 0; i < stmts->len; i++) {
+		node_p stmt = dce_fold_stmt(stmts->ptr[i], stats);
+		bool is_last = (i == stmts->len - 1);
+		if ( stmt == NULL || (is_pure_expr(stmt) && !(is_last && keep_last_value)) ) {
+			stats->stmts_removed++;
+			continue;
+		}
+		
+		dce_node(stmt, stats);
+		stmts->ptr[kept++] = stmt;
+		
+		// Nothing after a return is ever executed
+		if (stmt->type == NT_RETURN) {
+			stats->stmts_removed += stmts->len - i - 1;
+			break;
+		}
+	}
+	
+	stmts->len = kept;
+}
+
+static void dce_node(node_p node, dce_stats_p stats) {
+	switch(node->type) {
+		case NT_FUNC:
+			dce_stmts(&node->func.body, node->func.out.len > 0, stats);
+			break;
+		case NT_SCOPE:
+			dce_stmts(&node->scope.stmts, false, stats);
+			break;
+		default:
+			for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+				dce_node(it.node, stats);
+			break;
+	}
+}
+
+void eliminate_dead_code(node_p module) {
+	dce_stats_t stats = { 0, 0 };
+	dce_node(module, &stats);
+	printf("dead code: %zu statements removed, %zu conditions folded\n", stats.stmts_removed, stats.conds_folded);
+}
+
 
 //
 // Compiler helper functions
@@ -478,6 +656,19 @@ static int32_t get_var_frame_displ(node_p node) {
 	return stack_offset;
 }
 
+// True if the node calls other functions (syscalls don't count)
+static bool contains_calls(node_p node) {
+	if ( node->type == NT_CALL && !str_eqc(&node->call.name, "syscall") )
+		return true;
+	
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it)) {
+		if ( contains_calls(it.node) )
+			return true;
+	}
+	
+	return false;
+}
+
 //
 // Compiler stuff (tree to asm)
 // 
@@ -488,18 +679,81 @@ static int32_t get_var_frame_displ(node_p node) {
 // referenced by this function.
 //
 
+// Function node → index (symbol table of the linker, results of the parallel
+// compiler)
+SH_GEN_DECL(func_map, node_p, uint32_t);
+SH_GEN_HASH_DEF(func_map, node_p, uint32_t);
+
+// Lowered function kept around for inlining (see inline_calls())
+typedef struct {
+	node_p func;
+	ir_func_p ir;
+} inline_callee_t;
+
+// Function compiled by a worker of the parallel compiler (see compile_parallel())
+typedef struct {
+	node_p func;
+	size_t worker;
+	size_t code_start, code_len;  // code of the function in the buffer of the worker
+	list_t(node_p) callees;       // compile queue entries in the order they were added
+	char*  log;                   // output of the function (IR dump, inline report)
+	size_t log_len;
+} compile_result_t, *compile_result_p;
+
 struct compiler_ctx_s {
 	asm_p as;
 	ra_p ra;
-	list_t(node_p) compile_queue;
+	deque_t(node_p) compile_queue;
+	ph_stats_t peephole_stats;
+	
+	// Frame of the function that is currently compiled
+	asm_arg_t frame_reg;   // RBP or RSP for leaf functions without a frame
+	uint16_t saved_regs;   // callee saved registers the function has to preserve
+	
+	// Compile functions through the IR (see compile_func_ir())
+	bool use_ir;
+	ir_stats_t ir_stats;
+	bool inline_report;
+	list_t(inline_callee_t) inline_callees;
+	
+	// Functions in the order they were compiled (see link_funcs())
+	list_t(node_p) compiled_funcs;
+	
+	// Instrumentation for --profile (see place_profile_table()), the table is
+	// 0 if the program isn't profiled
+	size_t profile_table, profile_table_size;
+	size_t profile_path;  // vaddr of the file name
+	node_p profile_exit;
+	
+	// Output of the function that is currently compiled (stdout or the log
+	// of a compile_result_t)
+	FILE* log;
+	
+	// Parallel compilation: each worker has its own context, pool is NULL
+	// for the serial compiler
+	pool_p pool;
+	size_t worker;
+	compile_result_p result;                // of the current function
+	list_t(compile_result_p) results;       // all functions compiled by this worker
 };
 
+typedef list_t(asm_jump_slot_t) jump_slot_list_t, *jump_slot_list_p;
+
 raa_t compile_node(node_p node, compiler_ctx_p ctx, int8_t requested_result_register);
 raa_t compile_func(node_p node, compiler_ctx_p ctx);
+raa_t compile_func_ir(node_p node, compiler_ctx_p ctx);
+void  compile_enqueue(compiler_ctx_p ctx, node_p func);
+void  compile_parallel(node_p main_func_node, compiler_ctx_p ctx, size_t jobs);
+void  place_string_data(node_p node, asm_p as);
+void  place_profile_table(node_p module, compiler_ctx_p ctx, const char* path);
+profile_func_t compile_profile_of(node_p func, compiler_ctx_p ctx);
+void  inline_free_callees(compiler_ctx_p ctx);
+void  compile_func_code(node_p node, compiler_ctx_p ctx);
 raa_t compile_scope(node_p node, compiler_ctx_p ctx);
 raa_t compile_var(node_p node, compiler_ctx_p ctx);
 raa_t compile_if(node_p node, compiler_ctx_p ctx);
 raa_t compile_while(node_p node, compiler_ctx_p ctx);
+void  compile_cond_jump(node_p node, compiler_ctx_p ctx, bool jump_if, jump_slot_list_p slots);
 raa_t compile_return(node_p node, compiler_ctx_p ctx);
 raa_t compile_call(node_p node, compiler_ctx_p ctx, int8_t req_reg);
 raa_t compile_syscall(node_p node, compiler_ctx_p ctx, int8_t req_reg);
@@ -508,32 +762,59 @@ raa_t compile_intl(node_p node, compiler_ctx_p ctx, int8_t req_reg);
 raa_t compile_strl(node_p node, compiler_ctx_p ctx, int8_t req_reg);
 raa_t compile_id(node_p node, compiler_ctx_p ctx, int8_t req_reg);
 
+raa_t   isel_compile_expr(node_p node, compiler_ctx_p ctx, int8_t req_reg);
+uint8_t isel_compile_cond(node_p node, compiler_ctx_p ctx);
+
 uint8_t type_get_bits(node_p node, str_t type_name);
-void resolve_addr_slots(node_p node, compiler_ctx_p ctx);
 
 
-void compile(node_p module, const char* filename) {
+void compile(node_p module, const char* filename, bool use_ir, bool inline_report, size_t jobs, bool profile) {
 	printf("starting compilation pass...\n");
 	
 	compiler_ctx_t ctx = (compiler_ctx_t){
 		.as = &(asm_t){ 0 },
 		.ra = &(ra_t){ 0 },
-		.compile_queue = { 0, NULL }
+		.compile_queue = { 0, 0, 0, NULL },
+		.peephole_stats = { 0 },
+		.frame_reg = RBP,
+		.saved_regs = 0,
+		.use_ir = use_ir,
+		.ir_stats = { 0 },
+		.inline_report = inline_report,
+		.inline_callees = { 0, NULL },
+		.compiled_funcs = { 0, NULL },
+		.profile_table = 0,
+		.profile_table_size = 0,
+		.profile_path = 0,
+		.profile_exit = NULL,
+		.log = stdout,
+		.pool = NULL
 	};
 	as_new(ctx.as);
 	ra_new(ctx.ra);
-	list_new(&ctx.compile_queue);
+	deque_new(&ctx.compile_queue);
 	
 	node_p main_func_node = ns_lookup(module, str_from_c("main"));
 	if (main_func_node == NULL) {
 		fprintf(stderr, "compile(): Failed to find main func!\n");
 		abort();
 	}
-	list_append(&ctx.compile_queue, main_func_node);
+	
+	// The code of a function shouldn't depend on the compile order (see
+	// compile_parallel()). So all string literals get their data before any
+	// function is compiled.
+	place_string_data(module, ctx.as);
+	if (profile)
+		place_profile_table(module, &ctx, "main.prof");
+	
+	if (jobs > 1)
+		compile_parallel(main_func_node, &ctx, jobs);
+	else
+		deque_push_back(&ctx.compile_queue, main_func_node);
 	
 	while (ctx.compile_queue.len > 0) {
-		node_p node_to_compile = ctx.compile_queue.ptr[0];
-		list_shift(&ctx.compile_queue, 1);
+		node_p node_to_compile = deque_front(&ctx.compile_queue);
+		deque_pop_front(&ctx.compile_queue);
 		
 		/*
 		fprintf(stderr, "COMPILE %.*s %s\n",
@@ -548,25 +829,302 @@ void compile(node_p module, const char* filename) {
 		
 		raa_t a = compile_node(node_to_compile, &ctx, -1);
 		ra_free_reg(ctx.ra, ctx.as, a);
+		if (node_to_compile->type == NT_FUNC)
+			list_append(&ctx.compiled_funcs, node_to_compile);
+	}
+	
+	// The exit function is linked like the compiled functions
+	if (profile) {
+		ctx.profile_exit->func.as_offset = as_target(ctx.as);
+		profile_emit_exit_func(ctx.as, ctx.profile_table, ctx.profile_table_size, ctx.profile_path);
+		list_append(&ctx.compiled_funcs, ctx.profile_exit);
 	}
 	
-	// TODO: call linker pass before we throw the asm code away!
-	// Then save the linked code into a binary.
 	printf("compilation pass done...\n");
+	printf("peephole optimizer: %zu instructions before, %zu after (%zu rewrites, %zu functions skipped)\n",
+		ctx.peephole_stats.instructions_before, ctx.peephole_stats.instructions_after,
+		ctx.peephole_stats.rewrites, ctx.peephole_stats.skipped_functions);
+	if (use_ir) {
+		printf("ir: %zu functions, %zu blocks, %zu instructions, %zu passes changed something, %zu spilled values, %zu moves, %zu calls inlined\n",
+			ctx.ir_stats.functions, ctx.ir_stats.blocks, ctx.ir_stats.instructions,
+			ctx.ir_stats.pass_changes, ctx.ir_stats.spilled_values, ctx.ir_stats.moves,
+			ctx.ir_stats.inlined_calls);
+	} else {
+		printf("register allocator: %zu spills, %zu reloads\n", ctx.ra->spill_count, ctx.ra->reload_count);
+	}
 	node_print(module, stdout);
-	resolve_addr_slots(main_func_node, &ctx);
+	link_stats_t link_stats = { 0 };
+	if ( !link_funcs(ctx.compiled_funcs.ptr, ctx.compiled_funcs.len, ctx.as->code_ptr, LINK_CHUNK_SIZE, stderr, &link_stats) )
+		abort();
+	printf("linker: %zu symbols, %zu relocations, %zu threads\n", ctx.compiled_funcs.len, link_stats.relocations, link_stats.threads);
 	
 	as_save_elf(ctx.as, filename);
 	
-	list_free(&ctx.compile_queue);
+	inline_free_callees(&ctx);
+	list_free(&ctx.compiled_funcs);
+	deque_destroy(&ctx.compile_queue);
 	ra_destroy(ctx.ra);
 	as_destroy(ctx.as);
 }
 
+/**
+ * Puts the data of all string literals below node into the data section.
+ * Compiled code only refers to node->strl.data_vaddr.
+ */
+void place_string_data(node_p node, asm_p as) {
+	if (node->type == NT_STRL)
+		node->strl.data_vaddr = as_data(as, node->strl.value.ptr, node->strl.value.len);
+	
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+		place_string_data(it.node, as);
+}
+
+// Entries of the profile table and where their addresses go
+typedef struct {
+	list_t(profile_entry_t) entries;
+	list_t(size_t*) vaddrs;
+} profile_table_t, *profile_table_p;
+
+static void profile_collect(node_p node, node_p func, size_t* loop_count, profile_table_p table) {
+	profile_entry_t entry = { 0 };
+	if (node->type == NT_FUNC) {
+		func = node;
+		*loop_count = 0;
+		entry.kind = PROFILE_FUNC;
+		snprintf(entry.name, sizeof(entry.name), "%.*s", func->func.name.len, func->func.name.ptr);
+		list_append(&table->entries, entry);
+		list_append(&table->vaddrs, &node->func.profile_vaddr);
+	} else if (node->type == NT_WHILE && func != NULL) {
+		entry.kind = PROFILE_LOOP;
+		snprintf(entry.name, sizeof(entry.name), "%.*s loop %zu", func->func.name.len, func->func.name.ptr, ++(*loop_count));
+		list_append(&table->entries, entry);
+		list_append(&table->vaddrs, &node->while_stmt.profile_vaddr);
+	}
+	
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+		profile_collect(it.node, func, loop_count, table);
+}
+
+/**
+ * Puts the profile table (see profile.h) into the data section: One entry for
+ * each function and while loop below module, in AST order. Compiled code only
+ * refers to func.profile_vaddr and while_stmt.profile_vaddr. Also creates the
+ * exit function node that the linker resolves calls to.
+ */
+void place_profile_table(node_p module, compiler_ctx_p ctx, const char* path) {
+	profile_table_t table = { { 0, NULL }, { 0, NULL } };
+	size_t loop_count = 0;
+	profile_collect(module, NULL, &loop_count, &table);
+	
+	size_t header_size = sizeof(profile_header_t), entries_size = table.entries.len * sizeof(profile_entry_t);
+	uint8_t* buffer = calloc(1, header_size + entries_size);
+	profile_header_t header = { .magic = PROFILE_MAGIC, .entry_count = table.entries.len };
+	memcpy(buffer, &header, header_size);
+	memcpy(buffer + header_size, table.entries.ptr, entries_size);
+	
+	// Keep the counters aligned
+	uint8_t padding[8] = { 0 };
+	as_data(ctx->as, padding, (8 - ctx->as->data_len % 8) % 8);
+	ctx->profile_table = as_data(ctx->as, buffer, header_size + entries_size);
+	ctx->profile_table_size = header_size + entries_size;
+	ctx->profile_path = as_data(ctx->as, path, strlen(path) + 1);
+	for(size_t i = 0; i < table.vaddrs.len; i++)
+		*table.vaddrs.ptr[i] = ctx->profile_table + header_size + i * sizeof(profile_entry_t);
+	
+	ctx->profile_exit = node_alloc(NT_FUNC);
+	ctx->profile_exit->func.name = str_from_c("profile_exit");
+	
+	free(buffer);
+	list_free(&table.entries);
+	list_free(&table.vaddrs);
+}
+
+/**
+ * Instrumentation of a function for the code generators, everything is 0 if
+ * the program isn't profiled.
+ */
+profile_func_t compile_profile_of(node_p func, compiler_ctx_p ctx) {
+	if (ctx->profile_table == 0)
+		return (profile_func_t){ 0, 0, NULL };
+	
+	// main is where the program starts
+	bool is_main = str_eqc(&func->func.name, "main");
+	return (profile_func_t){
+		.entry = func->func.profile_vaddr,
+		.start_tsc = is_main ? ctx->profile_table + offsetof(profile_header_t, start_tsc) : 0,
+		.exit_func = ctx->profile_exit
+	};
+}
+
+/**
+ * Adds a function called by the current one to the compile queue. The
+ * parallel compiler hands it to the first worker that claims it and records
+ * the call so the serial order can be rebuilt later on.
+ */
+void compile_enqueue(compiler_ctx_p ctx, node_p func) {
+	if (ctx->pool == NULL) {
+		if (!func->func.compiled)
+			deque_push_back(&ctx->compile_queue, func);
+		return;
+	}
+	
+	// Functions are compiled up to 3 times (see compile_func()), record each
+	// call only once
+	compile_result_p result = ctx->result;
+	bool recorded = false;
+	for(size_t i = 0; i < result->callees.len && !recorded; i++)
+		recorded = (result->callees.ptr[i] == func);
+	if (!recorded)
+		list_append(&result->callees, func);
+	
+	if ( !__atomic_exchange_n(&func->func.queued, true, __ATOMIC_SEQ_CST) )
+		pool_push(ctx->pool, ctx->worker, func);
+}
+
+static void isel_parse_rules();
+
+static void compile_task(pool_p pool, size_t worker, void* task) {
+	compiler_ctx_p ctx = (compiler_ctx_p)pool->private + worker;
+	compile_result_p result = calloc(1, sizeof(compile_result_t));
+	result->func = task;
+	result->worker = worker;
+	result->code_start = as_target(ctx->as);
+	
+	ctx->result = result;
+	ctx->log = open_memstream(&result->log, &result->log_len);
+	raa_t a = compile_node(result->func, ctx, -1);
+	ra_free_reg(ctx->ra, ctx->as, a);
+	fclose(ctx->log);
+	ctx->log = NULL;
+	ctx->result = NULL;
+	
+	result->code_len = as_target(ctx->as) - result->code_start;
+	list_append(&ctx->results, result);
+}
+
+/**
+ * Compiles all functions reachable from main on a pool of jobs threads. Each
+ * worker compiles into its own code buffer. The code of a function doesn't
+ * depend on where it ends up: jumps are relative to the function, calls are
+ * patched by the linker and string literals are placed up front. Afterwards
+ * the functions are copied into ctx->as in the order the serial compiler would
+ * have compiled them, so the output is the same byte for byte. That order is
+ * rebuilt by replaying the compile queue with the calls each function recorded.
+ */
+void compile_parallel(node_p main_func_node, compiler_ctx_p ctx, size_t jobs) {
+	// Shared state that is initialized on first use
+	isel_parse_rules();
+	
+	compiler_ctx_t workers[jobs];
+	for(size_t i = 0; i < jobs; i++) {
+		workers[i] = *ctx;
+		workers[i].as = calloc(1, sizeof(asm_t));
+		workers[i].ra = calloc(1, sizeof(ra_t));
+		as_new(workers[i].as);
+		ra_new(workers[i].ra);
+		deque_new(&workers[i].compile_queue);
+		workers[i].peephole_stats = (ph_stats_t){ 0 };
+		workers[i].ir_stats = (ir_stats_t){ 0 };
+		list_new(&workers[i].inline_callees);
+		list_new(&workers[i].compiled_funcs);
+		list_new(&workers[i].results);
+		workers[i].worker = i;
+	}
+	
+	pool_t pool;
+	pool_new(&pool, jobs, compile_task, workers);
+	for(size_t i = 0; i < jobs; i++)
+		workers[i].pool = &pool;
+	main_func_node->func.queued = true;
+	pool_push(&pool, 0, main_func_node);
+	pool_run(&pool);
+	
+	// Index the results by function
+	func_map_t result_index;
+	func_map_new(&result_index);
+	list_t(compile_result_p) results = { 0, NULL };
+	for(size_t i = 0; i < jobs; i++) {
+		for(size_t j = 0; j < workers[i].results.len; j++) {
+			func_map_put(&result_index, workers[i].results.ptr[j]->func, results.len);
+			list_append(&results, workers[i].results.ptr[j]);
+		}
+	}
+	
+	// Replay the compile queue of the serial compiler and append the code of
+	// each function when it would have been compiled
+	bool done[results.len];
+	memset(done, 0, sizeof(done));
+	deque_t(node_p) queue;
+	deque_new(&queue);
+	deque_push_back(&queue, main_func_node);
+	while (queue.len > 0) {
+		node_p func = deque_front(&queue);
+		deque_pop_front(&queue);
+		uint32_t index = func_map_get(&result_index, func, UINT32_MAX);
+		if (index == UINT32_MAX) {
+			fprintf(stderr, "compile_parallel(): function %.*s was never compiled!\n", func->func.name.len, func->func.name.ptr);
+			abort();
+		}
+		if (done[index])
+			continue;
+		done[index] = true;
+		
+		compile_result_p result = results.ptr[index];
+		fwrite(result->log, 1, result->log_len, stdout);
+		size_t offset = as_code(ctx->as, workers[result->worker].as->code_ptr + result->code_start, result->code_len);
+		func->func.as_offset = offset;
+		for(size_t i = 0; i < func->func.addr_slots.len; i++)
+			func->func.addr_slots.ptr[i].offset = func->func.addr_slots.ptr[i].offset - result->code_start + offset;
+		list_append(&ctx->compiled_funcs, func);
+		
+		for(size_t i = 0; i < result->callees.len; i++)
+			deque_push_back(&queue, result->callees.ptr[i]);
+	}
+	deque_destroy(&queue);
+	
+	// Statistics over all workers
+	for(size_t i = 0; i < jobs; i++) {
+		compiler_ctx_p w = &workers[i];
+		ctx->peephole_stats.instructions_before += w->peephole_stats.instructions_before;
+		ctx->peephole_stats.instructions_after += w->peephole_stats.instructions_after;
+		ctx->peephole_stats.rewrites += w->peephole_stats.rewrites;
+		ctx->peephole_stats.skipped_functions += w->peephole_stats.skipped_functions;
+		ctx->ir_stats.functions += w->ir_stats.functions;
+		ctx->ir_stats.blocks += w->ir_stats.blocks;
+		ctx->ir_stats.instructions += w->ir_stats.instructions;
+		ctx->ir_stats.pass_changes += w->ir_stats.pass_changes;
+		ctx->ir_stats.spilled_values += w->ir_stats.spilled_values;
+		ctx->ir_stats.moves += w->ir_stats.moves;
+		ctx->ir_stats.inlined_calls += w->ir_stats.inlined_calls;
+		ctx->ra->spill_count += w->ra->spill_count;
+		ctx->ra->reload_count += w->ra->reload_count;
+	}
+	// On stderr so the log on stdout is the same as the one of the serial compiler
+	fprintf(stderr, "parallel compiler: %zu functions on %zu threads, %zu steals\n", results.len, jobs, pool.steals);
+	
+	for(size_t i = 0; i < results.len; i++) {
+		list_free(&results.ptr[i]->callees);
+		free(results.ptr[i]->log);
+		free(results.ptr[i]);
+	}
+	list_free(&results);
+	func_map_destroy(&result_index);
+	pool_destroy(&pool);
+	for(size_t i = 0; i < jobs; i++) {
+		inline_free_callees(&workers[i]);
+		list_free(&workers[i].results);
+		deque_destroy(&workers[i].compile_queue);
+		ra_destroy(workers[i].ra);
+		as_destroy(workers[i].as);
+		free(workers[i].ra);
+		free(workers[i].as);
+	}
+}
+
 raa_t compile_node(node_p node, compiler_ctx_p ctx, int8_t requested_result_register) {
 	switch(node->type) {
 		case NT_FUNC:
-			return compile_func(node, ctx);
+			return ctx->use_ir ? compile_func_ir(node, ctx) : compile_func(node, ctx);
 		case NT_SCOPE:
 			return compile_scope(node, ctx);
 		case NT_VAR:
@@ -608,6 +1166,19 @@ raa_t compile_node(node_p node, compiler_ctx_p ctx, int8_t requested_result_regi
 	return ra_empty();
 }
 
+// Compiles the function into a scratch buffer that is thrown away afterwards
+static void compile_func_scratch(node_p node, compiler_ctx_p ctx) {
+	asm_p code_as = ctx->as;
+	ctx->as = &(asm_t){ 0 };
+	as_new(ctx->as);
+	compile_func_code(node, ctx);
+	as_destroy(ctx->as);
+	ctx->as = code_as;
+	
+	list_free(&node->func.addr_slots);
+	list_free(&node->func.return_jump_slots);
+}
+
 raa_t compile_func(node_p node, compiler_ctx_p ctx) {
 	// Mark this function as compiled and set this functions offset into the
 	// assembler code to the place where we're going to generate the
@@ -615,32 +1186,117 @@ raa_t compile_func(node_p node, compiler_ctx_p ctx) {
 	// If we don't do this at the start calls to our own function (recursion)
 	// would add this function to the compile queue over and over again.
 	node->func.compiled = true;
+	
+	// Compile the function into a scratch buffer first. That code is thrown
+	// away, it's only done to record the live intervals of all register
+	// allocations. Then do the assignment once into a scratch buffer to see
+	// which callee saved registers the function uses and how large the frame
+	// gets (spill slots included).
+	size_t spill_count = ctx->ra->spill_count, reload_count = ctx->ra->reload_count;
+	ctx->frame_reg = RBP;
+	ctx->saved_regs = 0;
+	ra_begin_func(ctx->ra, &node->func.stack_frame_size);
+	compile_func_scratch(node, ctx);
+	node->func.stack_frame_size = 0;
+	ra_assign(ctx->ra, ctx->frame_reg.reg);
+	compile_func_scratch(node, ctx);
+	ctx->ra->spill_count = spill_count;
+	ctx->ra->reload_count = reload_count;
+	
+	int8_t callee_saved_regs[] = CALLEE_SAVED_REGS;
+	size_t frame_size = node->func.stack_frame_size;
+	for(size_t i = 0; i < sizeof(callee_saved_regs) / sizeof(callee_saved_regs[0]); i++) {
+		if (ctx->ra->used_regs & (1 << callee_saved_regs[i])) {
+			ctx->saved_regs |= 1 << callee_saved_regs[i];
+			frame_size += 8;
+		}
+	}
+	// Leaf functions don't need a frame pointer. The stack pointer doesn't
+	// move so the frame can be addressed relative to it. It's not allocated
+	// either, it has to fit into the 128 byte red zone below the stack pointer
+	// (signal handlers leave it alone).
+	if ( !contains_calls(node) && frame_size <= 128 )
+		ctx->frame_reg = RSP;
+	
+	// Now compile it for real with the registers assigned by the allocator
+	node->func.stack_frame_size = 0;
+	ra_assign(ctx->ra, ctx->frame_reg.reg);
 	node->func.as_offset = as_target(ctx->as);
+	compile_func_code(node, ctx);
 	
-	// Prologue: preserver callee saved regs rbx, rsp, rbp, r12, r13, r14, r15
-	as_push(ctx->as, RBX);
-	as_push(ctx->as, R12);
-	as_push(ctx->as, R13);
-	as_push(ctx->as, R14);
-	as_push(ctx->as, R15);
-	// Prologue: preserve callers base pointer and use stack pointer as out base pointer
-	as_push(ctx->as, RBP);
-	as_mov(ctx->as, RBP, RSP);
-	ssize_t frame_size_offset = as_sub(ctx->as, RSP, imm(0));
-	
-	// Wire up frame offsets of input and output arguments. The BP points to the
-	// saved BP, so we don't have to skip that, thats what the -1 is for.
-	// Remember, stack grows downwards, so the SP always contains the address of
-	// the highest byte allocated on the stack.
-	// We want to skip 7 64 bit values (1 saved BP, 5 callee saved regs and 1
-	// return address). The -1 offset accounts for the stack growing towards
-	// smaller addresses.
-	// in(n)  = [RBP + (7-1 + in.argc - n)*8]
-	// out(n) = [RBP + (7-1 + in.argc + out.argc - n)*8]
-	for(size_t i = 0; i < node->func.in.len; i++)
-		node->func.in.ptr[i]->arg.frame_displ = (7-1 + node->func.in.len - i) * 8;
-	for(size_t i = 0; i < node->func.out.len; i++)
-		node->func.out.ptr[i]->arg.frame_displ = (7-1 + node->func.in.len + node->func.out.len - i) * 8;
+	// The function is the last thing in the code buffer. So clean up the
+	// obvious waste of the code generation before the next function is
+	// compiled after it. Call displacements move along with their calls.
+	size_t* slot_offsets[node->func.addr_slots.len];
+	for(size_t i = 0; i < node->func.addr_slots.len; i++)
+		slot_offsets[i] = &node->func.addr_slots.ptr[i].offset;
+	ph_optimize(ctx->as, node->func.as_offset, slot_offsets, node->func.addr_slots.len, &ctx->peephole_stats);
+	
+	return ra_empty();
+}
+
+void compile_func_code(node_p node, compiler_ctx_p ctx) {
+	asm_arg_t frame = ctx->frame_reg;
+	int8_t in_regs[] = CALL_IN_REGS, out_regs[] = CALL_OUT_REGS;
+	int8_t callee_saved_regs[] = CALLEE_SAVED_REGS;
+	size_t stack_in_count = (node->func.in.len > CALL_IN_REG_COUNT) ? node->func.in.len - CALL_IN_REG_COUNT : 0;
+	
+	// Prologue: preserve callers base pointer and use stack pointer as our base
+	// pointer. Functions using the red zone leave both alone.
+	ssize_t frame_size_offset = -1;
+	if (frame.reg == RBP.reg) {
+		as_push(ctx->as, RBP);
+		as_mov(ctx->as, RBP, RSP);
+		frame_size_offset = as_sub(ctx->as, RSP, imm(0));
+	}
+	
+	// Prologue: preserve the callee saved registers we use in the first slots
+	// of the frame
+	int64_t saved_displs[sizeof(callee_saved_regs) / sizeof(callee_saved_regs[0])];
+	for(size_t i = 0; i < sizeof(callee_saved_regs) / sizeof(callee_saved_regs[0]); i++) {
+		if ( !(ctx->saved_regs & (1 << callee_saved_regs[i])) )
+			continue;
+		node->func.stack_frame_size += 8;
+		saved_displs[i] = -node->func.stack_frame_size;
+		as_mov(ctx->as, memrd(frame, saved_displs[i]), reg(callee_saved_regs[i]));
+	}
+	
+	// Wire up frame offsets of input and output arguments. Arguments passed in
+	// registers get a frame slot like variables. Arguments on the stack are
+	// above the return address (and the saved RBP): the in args in reverse
+	// order and after them the space for the out args.
+	// in(n)  = [frame + args_displ + (in.argc - 1 - n)*8]
+	// out(n) = [frame + args_displ + (in.argc - 6 + n - 2)*8]
+	int64_t args_displ = (frame.reg == RBP.reg) ? 16 : 8;
+	for(size_t i = 0; i < node->func.in.len; i++) {
+		node_p arg = node->func.in.ptr[i];
+		if (i < CALL_IN_REG_COUNT) {
+			node->func.stack_frame_size += 8;
+			arg->arg.frame_displ = -node->func.stack_frame_size;
+			as_mov(ctx->as, memrd(frame, arg->arg.frame_displ), reg(in_regs[i]));
+		} else {
+			arg->arg.frame_displ = args_displ + (node->func.in.len - 1 - i) * 8;
+		}
+	}
+	for(size_t i = 0; i < node->func.out.len; i++) {
+		node_p arg = node->func.out.ptr[i];
+		if (i < CALL_OUT_REG_COUNT) {
+			node->func.stack_frame_size += 8;
+			arg->arg.frame_displ = -node->func.stack_frame_size;
+		} else {
+			arg->arg.frame_displ = args_displ + (stack_in_count + i - CALL_OUT_REG_COUNT) * 8;
+		}
+	}
+	
+	// Prologue: count the call and remember when it started in a frame slot
+	// (the in args are out of RDX already)
+	profile_func_t profile = compile_profile_of(node, ctx);
+	asm_arg_t tsc_slot = { 0 };
+	if (profile.entry != 0) {
+		node->func.stack_frame_size += 8;
+		tsc_slot = memrd(frame, -(int32_t)node->func.stack_frame_size);
+		profile_emit_enter(ctx->as, tsc_slot, profile);
+	}
 	
 	// Compile function body
 	raa_t last_stmt_result;
@@ -662,14 +1318,16 @@ raa_t compile_func(node_p node, compiler_ctx_p ctx) {
 	if (last_stmt_result.reg_index != -1 && node->func.out.len >= 1) {
 		// The last statement actually returned a result, write it into the first
 		// output arg of the function (if the func has at least one out arg).
-		as_mov(ctx->as, memrd(RBP, node->func.out.ptr[0]->arg.frame_displ), reg(last_stmt_result.reg_index));
+		as_mov(ctx->as, memrd(frame, node->func.out.ptr[0]->arg.frame_displ), reg(last_stmt_result.reg_index));
 	}
 	ra_free_reg(ctx->ra, ctx->as, last_stmt_result);
 	
 	// Now we know the size of the functions stack frame so patch the stack
 	// frame allocation in the prologue.
-	uint32_t* frame_size_ptr = (uint32_t*)(ctx->as->code_ptr + frame_size_offset);
-	*frame_size_ptr = node->func.stack_frame_size;
+	if (frame_size_offset != -1) {
+		uint32_t* frame_size_ptr = (uint32_t*)(ctx->as->code_ptr + frame_size_offset);
+		*frame_size_ptr = node->func.stack_frame_size;
+	}
 	
 	// We're at the end of the function code and at the start of the epilogue.
 	// This is where return statements jump to. So patch all the return jump
@@ -677,19 +1335,24 @@ raa_t compile_func(node_p node, compiler_ctx_p ctx) {
 	for(size_t i = 0; i < node->func.return_jump_slots.len; i++)
 		as_mark_jmp_slot_target(ctx->as, node->func.return_jump_slots.ptr[i]);
 	
-	// Epilogue: restore callers stack and base pointer
-	as_mov(ctx->as, RSP, RBP);
-	as_pop(ctx->as, RBP);
+	// Epilogue: add the cycles of the call to the profile
+	if (profile.entry != 0)
+		profile_emit_leave(ctx->as, tsc_slot, profile);
+	// Epilogue: load the out args passed in registers
+	for(size_t i = 0; i < node->func.out.len && i < CALL_OUT_REG_COUNT; i++)
+		as_mov(ctx->as, reg(out_regs[i]), memrd(frame, node->func.out.ptr[i]->arg.frame_displ));
 	// Epilogue: restore callee saved registeres
-	as_pop(ctx->as, R15);
-	as_pop(ctx->as, R14);
-	as_pop(ctx->as, R13);
-	as_pop(ctx->as, R12);
-	as_pop(ctx->as, RBX);
+	for(size_t i = 0; i < sizeof(callee_saved_regs) / sizeof(callee_saved_regs[0]); i++) {
+		if (ctx->saved_regs & (1 << callee_saved_regs[i]))
+			as_mov(ctx->as, reg(callee_saved_regs[i]), memrd(frame, saved_displs[i]));
+	}
+	// Epilogue: restore callers stack and base pointer
+	if (frame.reg == RBP.reg) {
+		as_mov(ctx->as, RSP, RBP);
+		as_pop(ctx->as, RBP);
+	}
 	
 	as_ret(ctx->as, 0);
-	
-	return ra_empty();
 }
 
 raa_t compile_scope(node_p node, compiler_ctx_p ctx) {
@@ -721,8 +1384,7 @@ raa_t compile_call(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 	}
 	
 	// Add target function to compile queue if it's not already compiled
-	if (!target->func.compiled)
-		list_append(&ctx->compile_queue, target);
+	compile_enqueue(ctx, target);
 	/*
 	fprintf(stderr, "ADD CALL %.*s %s\n",
 		target->func.name.len, target->func.name.ptr,
@@ -731,38 +1393,47 @@ raa_t compile_call(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 	fprintf(stderr, "  queue:");
 	for(size_t i = 0; i < ctx->compile_queue.len; i++)
 		fprintf(stderr, " %.*s",
-			ctx->compile_queue.ptr[i]->func.name.len,
-			ctx->compile_queue.ptr[i]->func.name.ptr
+			deque_at(&ctx->compile_queue, i)->func.name.len,
+			deque_at(&ctx->compile_queue, i)->func.name.ptr
 		);
 	fprintf(stderr, "\n");
 	*/
 	
-	// Allocate stack space for currently allocated caller saved regs (that need to be saved)
-	// Caller saved regs: rax, rdi, rsi, rdx, rcx, r8, r9, r10, r11
-	asm_arg_t caller_saved_regs[] = { RAX, RDI, RSI, RDX, RCX, R8, R9, R10, R11 };
-	uint8_t csr_ptr[9];
-	size_t  csr_len = 0;
-	for(size_t i = 0; i < sizeof(caller_saved_regs) / sizeof(caller_saved_regs[0]); i++) {
-		if ( ra_reg_allocated(ctx->ra, caller_saved_regs[i].reg) )
-			csr_ptr[csr_len++] = caller_saved_regs[i].reg;
-	}
-	as_sub(ctx->as, RSP, imm(csr_len * 8));
-	
-	// Allocate stack space for output arguments
-	if (target->func.out.len > 0)
-		as_sub(ctx->as, RSP, imm(target->func.out.len * 8));
-	
-	// Push input arguments
-	for(size_t i = 0; i < node->call.args.len; i++) {
-		raa_t a = compile_node(node->call.args.ptr[i], ctx, -1);
-		as_push(ctx->as, reg(a.reg_index));
-		ra_free_reg(ctx->ra, ctx->as, a);
+	// Compile args into any register first and move them into the argument
+	// registers afterwards (see compile_syscall()). Arguments that don't fit
+	// into registers are pushed after the space for the out args on the stack
+	// has been reserved.
+	int8_t in_regs[] = CALL_IN_REGS;
+	size_t arg_count = node->call.args.len;
+	size_t stack_in_count = (arg_count > CALL_IN_REG_COUNT) ? arg_count - CALL_IN_REG_COUNT : 0;
+	size_t stack_out_count = (target->func.out.len > CALL_OUT_REG_COUNT) ? target->func.out.len - CALL_OUT_REG_COUNT : 0;
+	raa_t arg_allocs[arg_count];
+	for(size_t i = 0; i < arg_count; i++)
+		arg_allocs[i] = compile_node(node->call.args.ptr[i], ctx, -1);
+	
+	if (stack_out_count > 0)
+		as_sub(ctx->as, RSP, imm(stack_out_count * 8));
+	for(size_t i = CALL_IN_REG_COUNT; i < arg_count; i++) {
+		as_push(ctx->as, reg(arg_allocs[i].reg_index));
+		ra_free_reg(ctx->ra, ctx->as, arg_allocs[i]);
+	}
+	for(size_t i = 0; i < arg_count && i < CALL_IN_REG_COUNT; i++)
+		arg_allocs[i] = ra_move_to(ctx->ra, ctx->as, arg_allocs[i], in_regs[i]);
+	
+	// The call overwrites all caller saved registers. Allocate the ones not
+	// used by args so the allocator saves values that are still needed.
+	int8_t caller_saved_regs[] = CALLER_SAVED_REGS;
+	size_t caller_saved_count = sizeof(caller_saved_regs) / sizeof(caller_saved_regs[0]);
+	raa_t scratch_allocs[caller_saved_count];
+	for(size_t i = 0; i < caller_saved_count; i++) {
+		bool used_by_arg = false;
+		for(size_t j = 0; j < arg_count && j < CALL_IN_REG_COUNT; j++)
+			used_by_arg = used_by_arg || (in_regs[j] == caller_saved_regs[i]);
+		
+		scratch_allocs[i] = ra_empty();
+		if (!used_by_arg)
+			scratch_allocs[i] = ra_alloc_reg(ctx->ra, ctx->as, caller_saved_regs[i], 64);
 	}
-	
-	// Preserve caller saved regs into the space we allocated for them
-	size_t args_on_stack = node->call.args.len + target->func.out.len;
-	for(size_t i = 0; i < csr_len; i++)
-		as_mov(ctx->as, memrd(RSP, (args_on_stack + i)*8), reg(csr_ptr[i]));
 	
 	// Call the target function and remember the displacement.
 	// We create an address slot with it in the enclosing function so the linker
@@ -778,33 +1449,35 @@ raa_t compile_call(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 		.target = target
 	} ));
 	
-	// Cleanup input and unused output args.
-	// For now we only use the first output argument (if there is one) and free the rest.
-	size_t args_to_free = target->func.in.len + (target->func.out.len > 1 ? target->func.out.len - 1 : 0);
-	as_add(ctx->as, RSP, imm(args_to_free * 8));
+	// Cleanup args on the stack. For now we only use the first output argument
+	// (if there is one).
+	if (stack_in_count + stack_out_count > 0)
+		as_add(ctx->as, RSP, imm((stack_in_count + stack_out_count) * 8));
 	
-	int8_t out_arg_reg = -1;
-	// But if it has at least one out arg pop that value into the requested output arg
-	if (target->func.out.len > 0) {
-		// Pop the out arg into any free and not-caller-saved register
-		out_arg_reg = ra_find_free_reg(ctx->ra);
-		as_pop(ctx->as, reg(out_arg_reg));
+	// Keep RAX for the result (if the called func has an output argument) and
+	// free everything else
+	raa_t a = ra_empty();
+	for(size_t i = caller_saved_count; i-- > 0; ) {
+		if (caller_saved_regs[i] == RAX.reg && target->func.out.len > 0)
+			a = scratch_allocs[i];
+		else
+			ra_free_reg(ctx->ra, ctx->as, scratch_allocs[i]);
 	}
+	for(size_t i = arg_count < CALL_IN_REG_COUNT ? arg_count : CALL_IN_REG_COUNT; i-- > 0; )
+		ra_free_reg(ctx->ra, ctx->as, arg_allocs[i]);
 	
-	// Restore caller saved regs
-	for(size_t i = 0; i < csr_len; i++)
-		as_pop(ctx->as, reg(csr_ptr[i]));
+	if (a.reg_index == -1)
+		return a;
 	
-	// Return nothing if the called func has no output argument
-	raa_t a = ra_empty();
-	// But if it has we allocate the requested register and put the out arg in there
-	if (out_arg_reg != -1) {
-		uint8_t bits = node_expr_bits(target->func.out.ptr[0]);
-		a = ra_alloc_reg(ctx->ra, ctx->as, req_reg, bits);
-		as_mov(ctx->as, regx(a.reg_index, bits), regx(out_arg_reg, bits));
+	uint8_t bits = node_expr_bits(target->func.out.ptr[0]);
+	a.bits = bits;
+	// Clear the upper bits of smaller values so 64 bit operations on the value
+	// (e.g. shifts) see the right value.
+	if (bits < 64) {
+		as_shl(ctx->as, reg(a.reg_index), 64 - bits);
+		as_shr(ctx->as, reg(a.reg_index), 64 - bits);
 	}
-	
-	return a;
+	return ra_move_to(ctx->ra, ctx->as, a, req_reg);
 }
 
 raa_t compile_syscall(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
@@ -823,7 +1496,7 @@ raa_t compile_syscall(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 		R9
 	Scratch:
 		All input regs
-		R10
+		RCX
 		R11
 	Output:
 		RAX
@@ -843,35 +1516,51 @@ raa_t compile_syscall(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 		abort();
 	}
 	
-	// Compile args
+	// Compile args into any register and move them into the argument
+	// registers afterwards. Otherwise the argument registers would be blocked
+	// while the following args are compiled.
 	for(size_t i = 0; i < node->call.args.len; i++)
-		arg_allocs[i] = compile_node(node->call.args.ptr[i], ctx, arg_regs[i]);
+		arg_allocs[i] = compile_node(node->call.args.ptr[i], ctx, -1);
+	for(size_t i = 0; i < node->call.args.len; i++)
+		arg_allocs[i] = ra_move_to(ctx->ra, ctx->as, arg_allocs[i], arg_regs[i]);
 	
 	// Allocate scratch registers
-	for(size_t i = node->call.args.len; i < 7; i++)
-		arg_allocs[i] = ra_alloc_reg(ctx->ra, ctx->as, arg_regs[i], 64);
-	raa_t a1 = ra_alloc_reg(ctx->ra, ctx->as, R10.reg, 64);
+	raa_t a1 = ra_alloc_reg(ctx->ra, ctx->as, RCX.reg, 64);
 	raa_t a2 = ra_alloc_reg(ctx->ra, ctx->as, R11.reg, 64);
 	
+	// Write the profile before the program exits. The exit function keeps all
+	// registers and the frame isn't needed anymore so it doesn't matter that
+	// the call uses the red zone.
+	node_p number = node->call.args.ptr[0];
+	if ( ctx->profile_table != 0 && number->type == NT_INTL && profile_is_exit_syscall(number->intl.value) ) {
+		ssize_t target_displ_offset = as_call(ctx->as, reld(0));
+		node_p encl_func = node->parent;
+		while (encl_func != NULL && encl_func->type != NT_FUNC)
+			encl_func = encl_func->parent;
+		list_append(&encl_func->func.addr_slots, ( (node_addr_slot_t){
+			.offset = target_displ_offset,
+			.target = ctx->profile_exit
+		} ));
+	}
+	
 	as_syscall(ctx->as);
 	
 	// Free scratch registers and argument registers (but leave RAX allocated
 	// since it's the result)
 	ra_free_reg(ctx->ra, ctx->as, a2);
 	ra_free_reg(ctx->ra, ctx->as, a1);
-	for(size_t i = 6; i >= 1; i--)
+	for(size_t i = node->call.args.len - 1; i >= 1; i--)
 		ra_free_reg(ctx->ra, ctx->as, arg_allocs[i]);
+	arg_allocs[0].bits = 64;
 	
-	// If the result is requested in RAX or it doesn't matter where we're done
-	// But set the return type to 64 bits
-	if (req_reg == RAX.reg || req_reg == -1) {
-		arg_allocs[0].bits = 64;
+	// If the result is requested in RAX we're done
+	if (req_reg == RAX.reg)
 		return arg_allocs[0];
-	}
 	
-	// Otherwise move it to the target register
+	// Otherwise move it out of RAX. RAX might hold a value of an enclosing
+	// expression that was spilled for the syscall.
 	raa_t a = ra_alloc_reg(ctx->ra, ctx->as, req_reg, 64);
-	as_mov(ctx->as, reg(req_reg), RAX);
+	as_mov(ctx->as, reg(a.reg_index), RAX);
 	ra_free_reg(ctx->ra, ctx->as, arg_allocs[0]);
 	return a;
 }
@@ -893,7 +1582,7 @@ raa_t compile_return(node_p node, compiler_ctx_p ctx) {
 	for(size_t i = 0; i < node->return_stmt.args.len; i++) {
 		node_p out_arg = func->func.out.ptr[i];
 		raa_t a = compile_node(node->return_stmt.args.ptr[i], ctx, -1);
-		as_mov(ctx->as, memrd(RBP, get_var_frame_displ(out_arg)), reg(a.reg_index));
+		as_mov(ctx->as, memrd(ctx->frame_reg, get_var_frame_displ(out_arg)), reg(a.reg_index));
 		ra_free_reg(ctx->ra, ctx->as, a);
 	}
 	
@@ -915,169 +1604,733 @@ raa_t compile_var(node_p node, compiler_ctx_p ctx) {
 	// Get stack frame offset for this var by "allocating" it on the enclosing
 	// functions stack frame. The frame displacement is negative since local
 	// variables are allocated below the base pointer.
-	node->var.frame_displ = -func->func.stack_frame_size;
+	// The BP points to the saved BP so the first var is at -8.
 	func->func.stack_frame_size += 8;
+	node->var.frame_displ = -func->func.stack_frame_size;
 	
 	// Compile value expr if there is one
 	if (node->var.value != NULL) {
 		raa_t a = compile_node(node->var.value, ctx, -1);
-		as_mov(ctx->as, memrd(RBP, node->var.frame_displ), reg(a.reg_index));
+		as_mov(ctx->as, memrd(ctx->frame_reg, node->var.frame_displ), reg(a.reg_index));
 		ra_free_reg(ctx->ra, ctx->as, a);
 	}
 	
 	return ra_empty();
 }
 
+/**
+ * Compiles a condition into conditional jumps. If the condition is equal to
+ * jump_if the code jumps to one of the slots added to the list, otherwise it
+ * continues after the conditional jumps. Comparisons become a cmp and a jcc,
+ * "and" and "or" skip their right side when the left side already decides
+ * the result.
+ */
+void compile_cond_jump(node_p node, compiler_ctx_p ctx, bool jump_if, jump_slot_list_p slots) {
+	if ( node->type == NT_OP && (node->op.idx == OP_AND || node->op.idx == OP_OR) ) {
+		// "and" is false as soon as one side is false, "or" is true as soon as
+		// one side is true. When we jump on exactly that both sides jump to
+		// the target. Otherwise the left side skips the right one.
+		bool decisive_value = (node->op.idx == OP_OR);
+		if (jump_if == decisive_value) {
+			compile_cond_jump(node->op.a, ctx, jump_if, slots);
+			compile_cond_jump(node->op.b, ctx, jump_if, slots);
+		} else {
+			jump_slot_list_t to_skip = { 0, NULL };
+			compile_cond_jump(node->op.a, ctx, !jump_if, &to_skip);
+			compile_cond_jump(node->op.b, ctx, jump_if, slots);
+			for(size_t i = 0; i < to_skip.len; i++)
+				as_mark_jmp_slot_target(ctx->as, to_skip.ptr[i]);
+			list_free(&to_skip);
+		}
+		return;
+	}
+	
+	// Condition codes come in pairs, the lowest bit negates the condition
+	uint8_t cc = isel_compile_cond(node, ctx);
+	list_append(slots, as_jmp_cc(ctx->as, jump_if ? cc : cc ^ 1, 0));
+}
+
 raa_t compile_if(node_p node, compiler_ctx_p ctx) {
-	raa_t a = compile_node(node->if_stmt.cond, ctx, -1);
-	as_cmp(ctx->as, reg(a.reg_index), imm(0));
-	// freeing might add a MOV or POP here to restore the previous value of a
-	// register but nither effects the Flags. So it's safe to use here.
-	ra_free_reg(ctx->ra, ctx->as, a);
+	raa_t a;
+	// We jump to the false case (or the end) if the condition is false
+	jump_slot_list_t to_false_case = { 0, NULL };
+	compile_cond_jump(node->if_stmt.cond, ctx, false, &to_false_case);
 	
 	asm_jump_slot_t to_end;
-	if (node->if_stmt.false_case == NULL) {
-		// An if without an else (false case). Just execute the true case or
-		// jump to the code after it.
-		to_end = as_jmp_cc(ctx->as, CC_EQUAL, 0);
-		a = compile_node(node->if_stmt.true_case, ctx, -1);
-		ra_free_reg(ctx->ra, ctx->as, a);
-	} else {
-		// A full if with else (false case)
-		// We jump to the false case if the condition is equal to 0 (false)
-		asm_jump_slot_t to_false_case = as_jmp_cc(ctx->as, CC_EQUAL, 0);
-		
-		a = compile_node(node->if_stmt.true_case, ctx, -1);
-		ra_free_reg(ctx->ra, ctx->as, a);
+	bool has_false_case = (node->if_stmt.false_case != NULL);
+	a = compile_node(node->if_stmt.true_case, ctx, -1);
+	ra_free_reg(ctx->ra, ctx->as, a);
+	if (has_false_case)
 		to_end = as_jmp(ctx->as, reld(0));
-		
-		as_mark_jmp_slot_target(ctx->as, to_false_case);
+	
+	for(size_t i = 0; i < to_false_case.len; i++)
+		as_mark_jmp_slot_target(ctx->as, to_false_case.ptr[i]);
+	list_free(&to_false_case);
+	
+	if (has_false_case) {
 		a = compile_node(node->if_stmt.false_case, ctx, -1);
 		ra_free_reg(ctx->ra, ctx->as, a);
+		as_mark_jmp_slot_target(ctx->as, to_end);
 	}
 	
-	as_mark_jmp_slot_target(ctx->as, to_end);
-	
 	return ra_empty();
 }
 
 raa_t compile_while(node_p node, compiler_ctx_p ctx) {
 	raa_t a;
 	
-	// Compile condition
-	size_t cond_target = as_target(ctx->as);
-	a = compile_node(node->while_stmt.cond, ctx, -1);
-	as_cmp(ctx->as, reg(a.reg_index), imm(0));
-	// freeing might add a MOV here to restore the previous value of a register
-	// but a MOV doesn't effect the Flags. So it's safe to use here.
-	ra_free_reg(ctx->ra, ctx->as, a);
-	// We jump to the end of the loop if the condition is equal to 0 (false)
-	asm_jump_slot_t to_end = as_jmp_cc(ctx->as, CC_EQUAL, 0);
-	
-	// Compile body, then jump back to condition
+	// The condition is placed after the body. Then each iteration only needs
+	// one conditional jump back to the body. We enter the loop by jumping to
+	// the condition.
+	asm_jump_slot_t to_cond = as_jmp(ctx->as, reld(0));
+	size_t body_target = as_target(ctx->as);
+	if (node->while_stmt.profile_vaddr != 0)
+		profile_emit_count(ctx->as, node->while_stmt.profile_vaddr);
 	a = compile_node(node->while_stmt.body, ctx, -1);
 	ra_free_reg(ctx->ra, ctx->as, a);
-	asm_jump_slot_t to_cond = as_jmp(ctx->as, reld(0));
-	as_set_jmp_slot_target(ctx->as, to_cond, cond_target);
 	
-	as_mark_jmp_slot_target(ctx->as, to_end);
+	as_mark_jmp_slot_target(ctx->as, to_cond);
+	jump_slot_list_t to_body = { 0, NULL };
+	compile_cond_jump(node->while_stmt.cond, ctx, true, &to_body);
+	for(size_t i = 0; i < to_body.len; i++)
+		as_set_jmp_slot_target(ctx->as, to_body.ptr[i], body_target);
+	list_free(&to_body);
+	
 	return ra_empty();
 }
 
 
-raa_t compile_op(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
-	size_t op = node->op.idx;
-	node_p a = node->op.a, b = node->op.b;
+//
+// Instruction selection for expressions
+//
+// Bottom up tree pattern matching (BURS). Each rule covers a pattern of
+// expression nodes with a few instructions and has a cost (roughly the number
+// of instructions). The labeler computes the cheapest rule for every node and
+// nonterminal, the reducer then emits the instructions of the chosen rules.
+// Nonterminals are where a value can end up:
+// 
+// reg: value in a register
+// imm: constant that fits into an imm32
+// mem: variable on the stack frame, [RBP + disp] (or RSP)
+// cc:  result of a compare in the flags
+// 
+// Rules are written down as strings (e.g. "reg: ADD(reg, imm)") and parsed
+// into pattern trees the first time they're needed.
+//
+
+typedef enum { ISEL_REG, ISEL_IMM, ISEL_MEM, ISEL_CC, ISEL_NT_COUNT } isel_nt_t;
+typedef enum { ISEL_T_ADD, ISEL_T_SUB, ISEL_T_CMP, ISEL_T_INT, ISEL_T_ID, ISEL_T_OTHER, ISEL_T_COUNT } isel_term_t;
+
+static const char* isel_nt_names[ISEL_NT_COUNT] = { "reg", "imm", "mem", "cc" };
+static const char* isel_term_names[ISEL_T_COUNT] = { "ADD", "SUB", "CMP", "INT", "ID", "OTHER" };
+
+typedef struct {
+	isel_nt_t nt;
+	raa_t     reg;   // ISEL_REG
+	int64_t   imm;   // ISEL_IMM
+	asm_arg_t mem;   // ISEL_MEM
+	uint8_t   cc;    // ISEL_CC
+} isel_value_t;
+
+typedef struct isel_pattern_s isel_pattern_t, *isel_pattern_p;
+struct isel_pattern_s {
+	bool is_nt;
+	uint8_t symbol;  // isel_nt_t or isel_term_t
+	isel_pattern_p kids[2];
+};
+
+// Gets the node at the root of the pattern and the values of the nonterminals
+// in the pattern (from left to right).
+typedef isel_value_t (*isel_emit_func_t)(node_p node, isel_value_t ops[], compiler_ctx_p ctx);
+
+typedef struct {
+	const char*      description;
+	uint8_t          cost;
+	isel_emit_func_t emit;
+	bool             (*predicate)(node_p node);  // optional, rule only matches if it returns true
+	
+	isel_nt_t        lhs;
+	isel_pattern_p   pattern;
+} isel_rule_t, *isel_rule_p;
+
+#define ISEL_NO_COST UINT16_MAX
+
+typedef struct isel_label_s isel_label_t, *isel_label_p;
+struct isel_label_s {
+	node_p node;
+	isel_term_t term;
+	uint16_t cost[ISEL_NT_COUNT];
+	isel_rule_p rule[ISEL_NT_COUNT];
+	isel_label_p kids[2];
+};
+
+
+// Helpers for the rules
+
+static asm_arg_t isel_arg(isel_value_t value) {
+	switch(value.nt) {
+		case ISEL_REG: return reg(value.reg.reg_index);
+		case ISEL_IMM: return imm(value.imm);
+		case ISEL_MEM: return value.mem;
+		default: break;
+	}
 	
-	switch(op) {
-		case OP_ADD: case OP_SUB:
-		{
-			raa_t a1 = compile_node(a, ctx, req_reg);
-			raa_t a2 = compile_node(b, ctx, -1);
-			
-			switch(op) {
-				case OP_ADD:  as_add(ctx->as, reg(a1.reg_index), reg(a2.reg_index));  break;
-				case OP_SUB:  as_sub(ctx->as, reg(a1.reg_index), reg(a2.reg_index));  break;
-			}
-			
-			ra_free_reg(ctx->ra, ctx->as, a2);
-			return a1;
-		}
-		
-		case OP_MUL: case OP_DIV: case OP_REM:
-		{
-			raa_t arg_dest = compile_node(a, ctx, RAX.reg);
-			raa_t arg_src = compile_node(b, ctx, -1);
-			// Reserve RDX since MUL and DIV overwrite it
-			// For MUL it's the upper 64 bits of the result
-			// For DIV it's the remainder of the division
-			uint8_t bits = node_expr_bits(node);
-			raa_t arg_up_rem = ra_alloc_reg(ctx->ra, ctx->as, RDX.reg, bits);
-			
-			switch(op) {
-				case OP_MUL:
-					as_mul(ctx->as, reg(arg_src.reg_index));
-					break;
-				case OP_DIV:
-				case OP_REM:
-					// Set RDX to 0 since DIV takes it as input as the upper
-					// 64 bits of the operand.
-					as_mov(ctx->as, RDX, imm(0));
-					as_div(ctx->as, reg(arg_src.reg_index));
-					if (op == OP_DIV)
-						break;
-					
-					// For REM we use RDX as destination operand since it
-					// contains the remainer. Instead we free RAX. Basically
-					// arg_dest and arg_up_rem switch roles here.
-					{
-						raa_t temp = arg_dest;
-						arg_dest = arg_up_rem;
-						arg_up_rem = temp;
-					}
-					break;
-			}
-			
-			ra_free_reg(ctx->ra, ctx->as, arg_up_rem);
-			ra_free_reg(ctx->ra, ctx->as, arg_src);
+	fprintf(stderr, "isel_arg(): value can't be used as instruction operand!\n");
+	abort();
+}
+
+static isel_value_t isel_reg(raa_t allocation) {
+	return (isel_value_t){ .nt = ISEL_REG, .reg = allocation };
+}
+
+static bool isel_fits_imm32(node_p node) {
+	return node->intl.value >= 0 && node->intl.value <= 0x7fffffff;
+}
+
+// Only if the right side doesn't change any variables a variable on the left
+// side can be read after the right side was evaluated
+static bool isel_right_is_pure(node_p node) {
+	return is_pure_expr(node->op.b);
+}
+
+
+// Rules
+
+static isel_value_t isel_emit_imm(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	return (isel_value_t){ .nt = ISEL_IMM, .imm = node->intl.value };
+}
+
+static isel_value_t isel_emit_mem(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	node_p target = ns_lookup(node, node->id.name);
+	return (isel_value_t){ .nt = ISEL_MEM, .mem = memrd(ctx->frame_reg, get_var_frame_displ(target)) };
+}
+
+static isel_value_t isel_emit_load_int(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	return isel_reg( compile_intl(node, ctx, -1) );
+}
+
+static isel_value_t isel_emit_load_mem(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	raa_t a = ra_alloc_reg(ctx->ra, ctx->as, -1, node_expr_bits(node));
+	as_mov(ctx->as, reg(a.reg_index), ops[0].mem);
+	return isel_reg(a);
+}
+
+static isel_value_t isel_emit_other(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	return isel_reg( compile_node(node, ctx, -1) );
+}
+
+// ADD and SUB with a register, immediate or memory operand. ADD also accepts
+// the register on the right side.
+static isel_value_t isel_emit_arith(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	isel_value_t dest = ops[0], src = ops[1];
+	if (dest.nt != ISEL_REG) {
+		dest = ops[1];
+		src = ops[0];
+	}
+	
+	if (node->op.idx == OP_ADD)
+		as_add(ctx->as, reg(dest.reg.reg_index), isel_arg(src));
+	else
+		as_sub(ctx->as, reg(dest.reg.reg_index), isel_arg(src));
+	
+	if (src.nt == ISEL_REG)
+		ra_free_reg(ctx->ra, ctx->as, src.reg);
+	dest.reg.bits = node_expr_bits(node);
+	return dest;
+}
+
+// (a + b) + imm
+static isel_value_t isel_emit_lea(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	as_lea(ctx->as, reg(ops[0].reg.reg_index), reg(ops[0].reg.reg_index), reg(ops[1].reg.reg_index), 1, ops[2].imm);
+	ra_free_reg(ctx->ra, ctx->as, ops[1].reg);
+	ops[0].reg.bits = node_expr_bits(node);
+	return ops[0];
+}
+
+static isel_value_t isel_emit_cmp(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	uint8_t cc;
+	switch(node->op.idx) {
+		case OP_LT:  cc = CC_LESS;             break;
+		case OP_LE:  cc = CC_LESS_OR_EQUAL;    break;
+		case OP_GT:  cc = CC_GREATER;          break;
+		case OP_GE:  cc = CC_GREATER_OR_EQUAL; break;
+		case OP_EQ:  cc = CC_EQUAL;            break;
+		case OP_NEQ: cc = CC_NOT_EQUAL;        break;
+		default:     abort();
+	}
+	
+	// CMP needs the register on the left side, so swap the operands and the
+	// condition if necessary
+	isel_value_t a = ops[0], b = ops[1];
+	if (a.nt != ISEL_REG) {
+		a = ops[1];
+		b = ops[0];
+		switch(cc) {
+			case CC_LESS:             cc = CC_GREATER;          break;
+			case CC_LESS_OR_EQUAL:    cc = CC_GREATER_OR_EQUAL; break;
+			case CC_GREATER:          cc = CC_LESS;             break;
+			case CC_GREATER_OR_EQUAL: cc = CC_LESS_OR_EQUAL;    break;
+		}
+	}
+	
+	as_cmp(ctx->as, reg(a.reg.reg_index), isel_arg(b));
+	// Freeing might add a MOV to restore a spilled value but that doesn't
+	// touch the flags
+	if (b.nt == ISEL_REG)
+		ra_free_reg(ctx->ra, ctx->as, b.reg);
+	ra_free_reg(ctx->ra, ctx->as, a.reg);
+	return (isel_value_t){ .nt = ISEL_CC, .cc = cc };
+}
+
+static isel_value_t isel_emit_setcc(node_p node, isel_value_t ops[], compiler_ctx_p ctx) {
+	// SETcc only writes the lowest byte so clear the register first. MOV
+	// doesn't touch the flags.
+	raa_t a = ra_alloc_reg(ctx->ra, ctx->as, -1, node_expr_bits(node));
+	as_mov(ctx->as, reg(a.reg_index), imm(0));
+	as_set_cc(ctx->as, ops[0].cc, regb(a.reg_index));
+	return isel_reg(a);
+}
+
+// The parsed lhs and pattern are filled in by isel_parse_rules()
+#define ISEL_RULE(description_, cost_, emit_, predicate_) \
+	{ .description = description_, .cost = cost_, .emit = emit_, .predicate = predicate_ }
+
+static isel_rule_t isel_rules[] = {
+	ISEL_RULE( "imm: INT",                      0,  isel_emit_imm,       isel_fits_imm32 ),
+	ISEL_RULE( "mem: ID",                       0,  isel_emit_mem,       NULL ),
+	ISEL_RULE( "reg: INT",                      1,  isel_emit_load_int,  NULL ),
+	ISEL_RULE( "reg: mem",                      1,  isel_emit_load_mem,  NULL ),
+	ISEL_RULE( "reg: OTHER",                    1,  isel_emit_other,     NULL ),
+	ISEL_RULE( "reg: cc",                       2,  isel_emit_setcc,     NULL ),
+	
+	ISEL_RULE( "reg: ADD(reg, reg)",            1,  isel_emit_arith,     NULL ),
+	ISEL_RULE( "reg: ADD(reg, imm)",            1,  isel_emit_arith,     NULL ),
+	ISEL_RULE( "reg: ADD(reg, mem)",            1,  isel_emit_arith,     NULL ),
+	ISEL_RULE( "reg: ADD(imm, reg)",            1,  isel_emit_arith,     NULL ),
+	ISEL_RULE( "reg: ADD(mem, reg)",            1,  isel_emit_arith,     isel_right_is_pure ),
+	ISEL_RULE( "reg: ADD(ADD(reg, reg), imm)",  1,  isel_emit_lea,       NULL ),
+	ISEL_RULE( "reg: SUB(reg, reg)",            1,  isel_emit_arith,     NULL ),
+	ISEL_RULE( "reg: SUB(reg, imm)",            1,  isel_emit_arith,     NULL ),
+	ISEL_RULE( "reg: SUB(reg, mem)",            1,  isel_emit_arith,     NULL ),
+	
+	ISEL_RULE( "cc: CMP(reg, reg)",             1,  isel_emit_cmp,       NULL ),
+	ISEL_RULE( "cc: CMP(reg, imm)",             1,  isel_emit_cmp,       NULL ),
+	ISEL_RULE( "cc: CMP(reg, mem)",             1,  isel_emit_cmp,       NULL ),
+	ISEL_RULE( "cc: CMP(imm, reg)",             1,  isel_emit_cmp,       NULL ),
+	ISEL_RULE( "cc: CMP(mem, reg)",             1,  isel_emit_cmp,       isel_right_is_pure ),
+};
+#define ISEL_RULE_COUNT (sizeof(isel_rules) / sizeof(isel_rules[0]))
+
+
+// Rule parser
+
+static isel_pattern_t isel_pattern_pool[64];
+static size_t isel_pattern_pool_len = 0;
+
+static const char* isel_parse_symbol(const char* c, bool* is_nt, uint8_t* symbol) {
+	while (*c == ' ')
+		c++;
+	size_t len = 0;
+	while ( isalpha(c[len]) )
+		len++;
+	
+	for(size_t i = 0; i < ISEL_NT_COUNT; i++) {
+		if ( strlen(isel_nt_names[i]) == len && strncmp(c, isel_nt_names[i], len) == 0 ) {
+			*is_nt = true, *symbol = i;
+			return c + len;
+		}
+	}
+	for(size_t i = 0; i < ISEL_T_COUNT; i++) {
+		if ( strlen(isel_term_names[i]) == len && strncmp(c, isel_term_names[i], len) == 0 ) {
+			*is_nt = false, *symbol = i;
+			return c + len;
+		}
+	}
+	
+	fprintf(stderr, "isel_parse_symbol(): unknown symbol at: %s!\n", c);
+	abort();
+}
+
+static const char* isel_parse_pattern(const char* c, isel_pattern_p* pattern) {
+	if (isel_pattern_pool_len >= sizeof(isel_pattern_pool) / sizeof(isel_pattern_pool[0])) {
+		fprintf(stderr, "isel_parse_pattern(): too many pattern nodes, increase the pool size!\n");
+		abort();
+	}
+	isel_pattern_p p = &isel_pattern_pool[isel_pattern_pool_len++];
+	*p = (isel_pattern_t){ 0 };
+	c = isel_parse_symbol(c, &p->is_nt, &p->symbol);
+	
+	if (*c == '(') {
+		c = isel_parse_pattern(c + 1, &p->kids[0]);
+		if (*c != ',') {
+			fprintf(stderr, "isel_parse_pattern(): expected , at: %s!\n", c);
+			abort();
+		}
+		c = isel_parse_pattern(c + 1, &p->kids[1]);
+		if (*c != ')') {
+			fprintf(stderr, "isel_parse_pattern(): expected ) at: %s!\n", c);
+			abort();
+		}
+		c++;
+	}
+	
+	*pattern = p;
+	return c;
+}
+
+static void isel_parse_rules() {
+	if (isel_pattern_pool_len > 0)
+		return;
+	
+	for(size_t i = 0; i < ISEL_RULE_COUNT; i++) {
+		bool is_nt = false;
+		uint8_t symbol = 0;
+		const char* c = isel_parse_symbol(isel_rules[i].description, &is_nt, &symbol);
+		if (!is_nt || *c != ':') {
+			fprintf(stderr, "isel_parse_rules(): rule has to start with a nonterminal and a colon: %s!\n", isel_rules[i].description);
+			abort();
+		}
+		isel_rules[i].lhs = symbol;
+		c = isel_parse_pattern(c + 1, &isel_rules[i].pattern);
+		if (*c != '\0') {
+			fprintf(stderr, "isel_parse_rules(): garbage at the end of rule: %s!\n", isel_rules[i].description);
+			abort();
+		}
+	}
+}
+
+
+// Labeler and reducer
+
+static isel_term_t isel_term_of(node_p node) {
+	if (node->type == NT_INTL)
+		return ISEL_T_INT;
+	if (node->type == NT_ID)
+		return ISEL_T_ID;
+	if (node->type == NT_OP) {
+		switch(node->op.idx) {
+			case OP_ADD: return ISEL_T_ADD;
+			case OP_SUB: return ISEL_T_SUB;
+			case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NEQ:
+				return ISEL_T_CMP;
+		}
+	}
+	return ISEL_T_OTHER;
+}
+
+// Cost of the nonterminals covered by the pattern or ISEL_NO_COST if the
+// pattern doesn't match
+static uint32_t isel_match(isel_pattern_p pattern, isel_label_p label) {
+	if (pattern->is_nt)
+		return label->cost[pattern->symbol];
+	if (pattern->symbol != label->term)
+		return ISEL_NO_COST;
+	
+	uint32_t cost = 0;
+	for(size_t i = 0; i < 2 && pattern->kids[i] != NULL; i++) {
+		uint32_t kid_cost = isel_match(pattern->kids[i], label->kids[i]);
+		if (kid_cost == ISEL_NO_COST)
+			return ISEL_NO_COST;
+		cost += kid_cost;
+	}
+	return cost;
+}
+
+static isel_label_p isel_label(node_p node) {
+	isel_label_p label = calloc(1, sizeof(isel_label_t));
+	label->node = node;
+	label->term = isel_term_of(node);
+	for(size_t i = 0; i < ISEL_NT_COUNT; i++)
+		label->cost[i] = ISEL_NO_COST;
+	
+	// Nodes we don't have rules for are compiled as a whole
+	if (label->term == ISEL_T_ADD || label->term == ISEL_T_SUB || label->term == ISEL_T_CMP) {
+		label->kids[0] = isel_label(node->op.a);
+		label->kids[1] = isel_label(node->op.b);
+	}
+	
+	// Rules that match the node itself, then chain rules (e.g. "reg: mem")
+	// until nothing gets cheaper anymore
+	bool changed = true;
+	for(size_t pass = 0; pass == 0 || changed; pass++) {
+		changed = false;
+		for(size_t i = 0; i < ISEL_RULE_COUNT; i++) {
+			isel_rule_p rule = &isel_rules[i];
+			if ( rule->pattern->is_nt != (pass > 0) )
+				continue;
 			
-			if (req_reg == -1 || req_reg == arg_dest.reg_index) {
-				// Caller either doesn't care in which register the result is
-				// returned or he wants it in the one it's alread in. Either way
-				// we're done.
-				arg_dest.bits = bits;
-				return arg_dest;
-			} else {
-				// Caller wants the result in a differen register. Allocate it
-				// and move the result there.
-				raa_t target_reg = ra_alloc_reg(ctx->ra, ctx->as, req_reg, bits);
-				as_mov(ctx->as, reg(req_reg), reg(arg_dest.reg_index));
-				ra_free_reg(ctx->ra, ctx->as, arg_dest);
-				return target_reg;
+			uint32_t cost = isel_match(rule->pattern, label);
+			if (cost == ISEL_NO_COST || (rule->predicate != NULL && !rule->predicate(node)))
+				continue;
+			if (cost + rule->cost < label->cost[rule->lhs]) {
+				label->cost[rule->lhs] = cost + rule->cost;
+				label->rule[rule->lhs] = rule;
+				changed = true;
 			}
 		}
-		
+	}
+	
+	return label;
+}
+
+static void isel_free_label(isel_label_p label) {
+	if (label == NULL)
+		return;
+	isel_free_label(label->kids[0]);
+	isel_free_label(label->kids[1]);
+	free(label);
+}
+
+static isel_value_t isel_reduce(isel_label_p label, isel_nt_t nt, compiler_ctx_p ctx);
+
+// Reduces the nonterminals of the pattern from left to right
+static void isel_reduce_kids(isel_pattern_p pattern, isel_label_p label, isel_value_t ops[], size_t* op_count, compiler_ctx_p ctx) {
+	if (pattern->is_nt) {
+		ops[(*op_count)++] = isel_reduce(label, pattern->symbol, ctx);
+		return;
+	}
+	for(size_t i = 0; i < 2 && pattern->kids[i] != NULL; i++)
+		isel_reduce_kids(pattern->kids[i], label->kids[i], ops, op_count, ctx);
+}
+
+static isel_value_t isel_reduce(isel_label_p label, isel_nt_t nt, compiler_ctx_p ctx) {
+	isel_rule_p rule = label->rule[nt];
+	if (rule == NULL) {
+		fprintf(stderr, "isel_reduce(): no rule to get a %s out of the node!\n", isel_nt_names[nt]);
+		abort();
+	}
+	
+	isel_value_t ops[4];
+	size_t op_count = 0;
+	isel_reduce_kids(rule->pattern, label, ops, &op_count, ctx);
+	return rule->emit(label->node, ops, ctx);
+}
+
+/**
+ * Compiles an expression with the instruction selector into a register.
+ */
+raa_t isel_compile_expr(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
+	isel_parse_rules();
+	isel_label_p label = isel_label(node);
+	isel_value_t value = isel_reduce(label, ISEL_REG, ctx);
+	isel_free_label(label);
+	return ra_move_to(ctx->ra, ctx->as, value.reg, req_reg);
+}
+
+/**
+ * Compiles a condition into the flags. Returns the condition code that is
+ * set when the condition is true. Comparisons are used directly, everything
+ * else is compared against 0.
+ */
+uint8_t isel_compile_cond(node_p node, compiler_ctx_p ctx) {
+	isel_parse_rules();
+	isel_label_p label = isel_label(node);
+	
+	uint8_t cc;
+	if (label->cost[ISEL_CC] != ISEL_NO_COST) {
+		cc = isel_reduce(label, ISEL_CC, ctx).cc;
+	} else {
+		raa_t a = isel_reduce(label, ISEL_REG, ctx).reg;
+		as_cmp(ctx->as, reg(a.reg_index), imm(0));
+		ra_free_reg(ctx->ra, ctx->as, a);
+		cc = CC_NOT_EQUAL;
+	}
+	
+	isel_free_label(label);
+	return cc;
+}
+
+/**
+ * Divides x by the constant d (not a power of two) without DIV. Instead it's
+ * multiplied with a magic number and shifted right (Granlund and Montgomery,
+ * "Division by Invariant Integers using Multiplication"). Returns the
+ * allocation of the quotient, x is left untouched.
+ */
+static raa_t compile_udiv_by_const(compiler_ctx_p ctx, raa_t x, uint64_t d) {
+	// ceil(log2(d)), at least 2 since d isn't a power of two
+	uint8_t l = 64 - __builtin_clzll(d - 1);
+	
+	// Look for the smallest shift s where m = ceil(2^(64+s) / d) fits into 64
+	// bits and m*d - 2^(64+s) <= 2^s. Then the quotient is (m*x) >> (64+s) for
+	// all 64 bit x.
+	uint64_t magic = 0;
+	int8_t shift = -1;
+	for(uint8_t s = 0; s <= l; s++) {
+		unsigned __int128 p = (unsigned __int128)1 << (64 + s);
+		unsigned __int128 m = (p + d - 1) / d;
+		if ( (m >> 64) == 0 && m * d - p <= ((unsigned __int128)1 << s) ) {
+			magic = m;
+			shift = s;
+			break;
+		}
+	}
+	// Otherwise we need a 65 bit magic number. We multiply by the lower 64 bits
+	// and add the dividend back in: t = (m*x) >> 64, q = (t + ((x - t) >> 1)) >> (l-1)
+	if (shift == -1) {
+		unsigned __int128 p = (unsigned __int128)1 << (64 + l);
+		magic = (uint64_t)((p + d - 1) / d);
+	}
+	
+	// RDX:RAX = RAX * x, we only need the upper 64 bits in RDX
+	raa_t rax = ra_alloc_reg(ctx->ra, ctx->as, RAX.reg, 64);
+	raa_t rdx = ra_alloc_reg(ctx->ra, ctx->as, RDX.reg, 64);
+	as_mov(ctx->as, RAX, imm(magic));
+	as_mul(ctx->as, reg(x.reg_index));
+	ra_free_reg(ctx->ra, ctx->as, rax);
+	
+	if (shift != -1) {
+		if (shift > 0)
+			as_shr(ctx->as, RDX, shift);
+		return rdx;
+	}
+	
+	raa_t q = ra_alloc_reg(ctx->ra, ctx->as, -1, 64);
+	as_mov(ctx->as, reg(q.reg_index), reg(x.reg_index));
+	as_sub(ctx->as, reg(q.reg_index), RDX);
+	as_shr(ctx->as, reg(q.reg_index), 1);
+	as_add(ctx->as, reg(q.reg_index), RDX);
+	as_shr(ctx->as, reg(q.reg_index), l - 1);
+	ra_free_reg(ctx->ra, ctx->as, rdx);
+	return q;
+}
+
+/**
+ * Compiles MUL, DIV and REM with a constant right side (or left side for MUL)
+ * into shifts, masks, LEA or multiplications. Those don't need RAX and RDX
+ * and are way cheaper than DIV. Returns false if there is no constant
+ * (nothing is compiled then).
+ */
+static bool compile_op_with_const(node_p node, compiler_ctx_p ctx, raa_p result) {
+	size_t op = node->op.idx;
+	node_p a = node->op.a, b = node->op.b;
+	if (op == OP_MUL && a->type == NT_INTL && b->type != NT_INTL) {
+		node_p temp = a;
+		a = b;
+		b = temp;
+	}
+	
+	// Constants have to fit into 31 bit immediates (see as_add()), 0 is left to
+	// DIV so it traps like it should
+	if (b->type != NT_INTL || b->intl.value <= 0 || b->intl.value > 0x7fffffff)
+		return false;
+	uint64_t c = b->intl.value;
+	uint8_t log2_c = __builtin_ctzll(c);
+	bool power_of_two = (c & (c - 1)) == 0;
+	
+	raa_t x = compile_node(a, ctx, -1);
+	switch(op) {
+		case OP_MUL:
+			if (power_of_two) {
+				if (log2_c > 0)
+					as_shl(ctx->as, reg(x.reg_index), log2_c);
+			} else if ( (c >> log2_c) == 3 || (c >> log2_c) == 5 || (c >> log2_c) == 9 ) {
+				// x * (2^k * 3, 5 or 9) = (x + x * (2, 4 or 8)) << k
+				as_lea(ctx->as, reg(x.reg_index), reg(x.reg_index), reg(x.reg_index), (c >> log2_c) - 1, 0);
+				if (log2_c > 0)
+					as_shl(ctx->as, reg(x.reg_index), log2_c);
+			} else {
+				as_imul(ctx->as, reg(x.reg_index), reg(x.reg_index), c);
+			}
+			break;
+		case OP_DIV:
+			if (power_of_two) {
+				if (log2_c > 0)
+					as_shr(ctx->as, reg(x.reg_index), log2_c);
+			} else {
+				raa_t q = compile_udiv_by_const(ctx, x, c);
+				ra_free_reg(ctx->ra, ctx->as, x);
+				x = q;
+			}
+			break;
+		case OP_REM:
+			if (power_of_two) {
+				as_and(ctx->as, reg(x.reg_index), imm(c - 1));
+			} else {
+				// x % c = x - (x / c) * c
+				raa_t q = compile_udiv_by_const(ctx, x, c);
+				as_imul(ctx->as, reg(q.reg_index), reg(q.reg_index), c);
+				as_sub(ctx->as, reg(x.reg_index), reg(q.reg_index));
+				ra_free_reg(ctx->ra, ctx->as, q);
+			}
+			break;
+	}
+	
+	x.bits = node_expr_bits(node);
+	*result = x;
+	return true;
+}
+
+raa_t compile_op(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
+	size_t op = node->op.idx;
+	node_p a = node->op.a, b = node->op.b;
+	
+	switch(op) {
+		case OP_ADD: case OP_SUB:
 		case OP_LT: case OP_LE: case OP_GT: case OP_GE:
 		case OP_EQ: case OP_NEQ:
+			return isel_compile_expr(node, ctx, req_reg);
+		
+		case OP_AND: case OP_OR:
 		{
-			uint8_t condition_code;
+			// The value of a logical op (0 or 1). Conditions of if and while
+			// statements don't get here, they're compiled into jumps directly.
+			raa_t result = ra_alloc_reg(ctx->ra, ctx->as, req_reg, node_expr_bits(node));
+			jump_slot_list_t to_false = { 0, NULL };
+			compile_cond_jump(node, ctx, false, &to_false);
+			as_mov(ctx->as, reg(result.reg_index), imm(1));
+			asm_jump_slot_t to_end = as_jmp(ctx->as, reld(0));
+			for(size_t i = 0; i < to_false.len; i++)
+				as_mark_jmp_slot_target(ctx->as, to_false.ptr[i]);
+			list_free(&to_false);
+			as_mov(ctx->as, reg(result.reg_index), imm(0));
+			as_mark_jmp_slot_target(ctx->as, to_end);
+			return result;
+		}
+		
+		case OP_MUL: case OP_DIV: case OP_REM:
+		{
+			raa_t result;
+			if ( compile_op_with_const(node, ctx, &result) )
+				return ra_move_to(ctx->ra, ctx->as, result, req_reg);
+			
+			raa_t arg_dest = compile_node(a, ctx, RAX.reg);
+			raa_t arg_src = compile_node(b, ctx, -1);
+			// Reserve RDX since MUL and DIV overwrite it
+			// For MUL it's the upper 64 bits of the result
+			// For DIV it's the remainder of the division
+			uint8_t bits = node_expr_bits(node);
+			raa_t arg_up_rem = ra_alloc_reg(ctx->ra, ctx->as, RDX.reg, bits);
+			
 			switch(op) {
-				case OP_LT:  condition_code = CC_LESS;             break;
-				case OP_LE:  condition_code = CC_LESS_OR_EQUAL;    break;
-				case OP_GT:  condition_code = CC_GREATER;          break;
-				case OP_GE:  condition_code = CC_GREATER_OR_EQUAL; break;
-				case OP_EQ:  condition_code = CC_EQUAL;            break;
-				case OP_NEQ: condition_code = CC_NOT_EQUAL;        break;
-				default:     abort();
+				case OP_MUL:
+					as_mul(ctx->as, reg(arg_src.reg_index));
+					break;
+				case OP_DIV:
+				case OP_REM:
+					// Set RDX to 0 since DIV takes it as input as the upper
+					// 64 bits of the operand.
+					as_mov(ctx->as, RDX, imm(0));
+					as_div(ctx->as, reg(arg_src.reg_index));
+					if (op == OP_DIV)
+						break;
+					
+					// For REM we use RDX as destination operand since it
+					// contains the remainer. Instead we free RAX. Basically
+					// arg_dest and arg_up_rem switch roles here.
+					{
+						raa_t temp = arg_dest;
+						arg_dest = arg_up_rem;
+						arg_up_rem = temp;
+					}
+					break;
 			}
 			
-			raa_t a1 = compile_node(a, ctx, req_reg);
-			raa_t a2 = compile_node(b, ctx, -1);
-			as_cmp(ctx->as, reg(a1.reg_index), reg(a2.reg_index));
-			ra_free_reg(ctx->ra, ctx->as, a2);
+			ra_free_reg(ctx->ra, ctx->as, arg_up_rem);
+			ra_free_reg(ctx->ra, ctx->as, arg_src);
 			
-			as_set_cc(ctx->as, condition_code, regb(a1.reg_index));
-			return a1;
+			// Move the result to the requested register (if the caller cares)
+			arg_dest.bits = bits;
+			return ra_move_to(ctx->ra, ctx->as, arg_dest, req_reg);
 		}
 		
 		case OP_ASSIGN:
@@ -1091,8 +2344,8 @@ raa_t compile_op(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 			int32_t stack_offset = get_var_frame_displ(target);
 			
 			raa_t a = compile_node(b, ctx, -1);
-			as_mov(ctx->as, memrd(RBP, stack_offset), reg(a.reg_index));
-			return a;
+			as_mov(ctx->as, memrd(ctx->frame_reg, stack_offset), reg(a.reg_index));
+			return ra_move_to(ctx->ra, ctx->as, a, req_reg);
 			/*
 			char* terminated_name = strndup(a->id.name.ptr, a->id.name.len);
 			
@@ -1121,10 +2374,9 @@ raa_t compile_intl(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 }
 
 raa_t compile_strl(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
-	size_t str_vaddr = as_data(ctx->as, node->strl.value.ptr, node->strl.value.len);
 	uint8_t bits = node_expr_bits(node);
 	raa_t a = ra_alloc_reg(ctx->ra, ctx->as, req_reg, bits);
-	as_mov(ctx->as, reg(a.reg_index), imm(str_vaddr));
+	as_mov(ctx->as, reg(a.reg_index), imm(node->strl.data_vaddr));
 	return a;
 }
 
@@ -1134,40 +2386,564 @@ raa_t compile_id(node_p node, compiler_ctx_p ctx, int8_t req_reg) {
 	
 	uint8_t bits = node_expr_bits(node);
 	raa_t a = ra_alloc_reg(ctx->ra, ctx->as, req_reg, bits);
-	as_mov(ctx->as, reg(a.reg_index), memrd(RBP, stack_offset));
+	as_mov(ctx->as, reg(a.reg_index), memrd(ctx->frame_reg, stack_offset));
 	
 	return a;
 }
 
 
-
 //
-// Linker pass
+// Lowering to IR
+//
+// Turns the AST of a function into SSA form in one walk over it (Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form"). Every
+// block remembers the current value of each variable. Reading a variable that
+// isn't assigned in the block looks through the predecessors and puts a phi
+// where they disagree. Blocks whose predecessors aren't all known yet (the
+// body of a loop) get incomplete phis that are filled in when the block is
+// sealed. Phis that only merge one value are removed right away.
 //
 
-void resolve_addr_slots(node_p node, compiler_ctx_p ctx) {
-	if (node->type != NT_FUNC) {
-		fprintf(stderr, "resolve_addr_slots(): Can only link func nodes for now!\n");
+typedef struct {
+	uint32_t block;
+	size_t var;
+	ir_val_t phi;
+} lower_incomplete_phi_t;
+
+typedef struct {
+	ir_func_p f;
+	compiler_ctx_p ctx;
+	uint32_t block;        // block the code is appended to
+	node_list_t vars;      // NT_VAR and NT_ARG nodes, the index is the variable number
+	ir_val_t* defs;        // current value of each variable per block, [block * vars.len + var]
+	size_t defs_block_cap;
+	list_t(lower_incomplete_phi_t) incomplete_phis;
+} lower_ctx_t, *lower_ctx_p;
+
+static const ir_op_t lower_ops[OP_COUNT] = {
+	[OP_MUL] = IR_MUL, [OP_DIV] = IR_DIV, [OP_REM] = IR_REM,
+	[OP_ADD] = IR_ADD, [OP_SUB] = IR_SUB,
+	[OP_LT] = IR_LT, [OP_LE] = IR_LE, [OP_GT] = IR_GT, [OP_GE] = IR_GE,
+	[OP_EQ] = IR_EQ, [OP_NEQ] = IR_NEQ,
+};
+
+ir_val_t lower_node(node_p node, lower_ctx_p l);
+void     lower_cond(node_p node, lower_ctx_p l, uint32_t true_block, uint32_t false_block);
+
+static ir_type_t lower_type(type_p type) {
+	return (type == type_ubyte) ? IR_U8 : IR_U64;
+}
+
+static void lower_collect_vars(node_p node, lower_ctx_p l) {
+	if (node->type == NT_VAR)
+		list_append(&l->vars, node);
+	for(ast_it_t it = ast_start(node); it.node != NULL; it = ast_next(node, it))
+		lower_collect_vars(it.node, l);
+}
+
+static size_t lower_var_index(lower_ctx_p l, node_p var) {
+	for(size_t i = 0; i < l->vars.len; i++) {
+		if (l->vars.ptr[i] == var)
+			return i;
+	}
+	
+	fprintf(stderr, "lower_var_index(): ID references unknown variable!\n");
+	abort();
+}
+
+static ir_type_t lower_var_type(lower_ctx_p l, size_t var) {
+	node_p node = l->vars.ptr[var];
+	return lower_type( (node->type == NT_VAR) ? node->var.type : node->arg.type );
+}
+
+static uint32_t lower_new_block(lower_ctx_p l) {
+	uint32_t block = ir_block_new(l->f);
+	if (block >= l->defs_block_cap) {
+		size_t old_cap = l->defs_block_cap;
+		l->defs_block_cap = (old_cap == 0) ? 16 : old_cap * 2;
+		l->defs = realloc(l->defs, l->defs_block_cap * l->vars.len * sizeof(l->defs[0]));
+		memset(l->defs + old_cap * l->vars.len, 0, (l->defs_block_cap - old_cap) * l->vars.len * sizeof(l->defs[0]));
+	}
+	return block;
+}
+
+// Continues the code in the block, it's placed right after the current block
+// in the code layout
+static void lower_switch_to(lower_ctx_p l, uint32_t block) {
+	ir_block_move_after(l->f, block, l->block);
+	l->block = block;
+}
+
+// Converts the value when it's stored somewhere with a different type
+static ir_val_t lower_convert(lower_ctx_p l, ir_val_t value, ir_type_t type) {
+	if (l->f->instrs[value].type == type)
+		return value;
+	return ir_cast(l->f, l->block, type, value);
+}
+
+static void lower_write_var(lower_ctx_p l, size_t var, uint32_t block, ir_val_t value) {
+	l->defs[block * l->vars.len + var] = value;
+}
+
+static ir_val_t lower_read_var(lower_ctx_p l, size_t var, uint32_t block);
+
+static ir_val_t lower_try_remove_trivial_phi(lower_ctx_p l, ir_val_t phi) {
+	ir_func_p f = l->f;
+	ir_val_t same = IR_NO_VAL;
+	for(size_t i = 0; i < ir_instr(f, phi)->args.len; i++) {
+		ir_val_t arg = ir_arg(f, phi, i);
+		if (arg == same || arg == phi)
+			continue;
+		if (same != IR_NO_VAL)
+			return phi;
+		same = arg;
+	}
+	
+	// Undefined (e.g. a variable that is never assigned), those are 0
+	if (same == IR_NO_VAL)
+		same = ir_const(f, 0, ir_instr(f, phi)->type, 0);
+	
+	// Phis using this one might become trivial, too. They're left to the
+	// ir_remove_trivial_phis() pass.
+	ir_replace_uses(f, phi, same);
+	for(size_t i = 0; i < f->block_count * l->vars.len; i++) {
+		if (l->defs[i] == phi)
+			l->defs[i] = same;
+	}
+	ir_remove(f, phi);
+	return same;
+}
+
+static ir_val_t lower_add_phi_operands(lower_ctx_p l, size_t var, ir_val_t phi) {
+	ir_func_p f = l->f;
+	uint32_t block = ir_instr(f, phi)->block;
+	for(size_t i = 0; i < ir_block(f, block)->preds.len; i++) {
+		ir_val_t value = lower_read_var(l, var, ir_list_ptr(f, ir_block(f, block)->preds)[i]);
+		ir_list_append(f, &ir_instr(f, phi)->args, value);
+	}
+	return lower_try_remove_trivial_phi(l, phi);
+}
+
+static ir_val_t lower_read_var(lower_ctx_p l, size_t var, uint32_t block) {
+	ir_func_p f = l->f;
+	ir_val_t value = l->defs[block * l->vars.len + var];
+	if (value != IR_NO_VAL)
+		return value;
+	
+	ir_block_p b = ir_block(f, block);
+	ir_type_t type = lower_var_type(l, var);
+	if (!b->sealed) {
+		value = ir_phi(f, block, type);
+		list_append(&l->incomplete_phis, ((lower_incomplete_phi_t){ block, var, value }));
+	} else if (b->preds.len == 0) {
+		// Never assigned, undefined variables are 0
+		value = ir_const(f, 0, type, 0);
+	} else if (b->preds.len == 1) {
+		value = lower_read_var(l, var, ir_list_ptr(f, b->preds)[0]);
+	} else {
+		// Loops lead back here, the phi breaks the cycle
+		value = ir_phi(f, block, type);
+		lower_write_var(l, var, block, value);
+		value = lower_add_phi_operands(l, var, value);
+	}
+	
+	lower_write_var(l, var, block, value);
+	return value;
+}
+
+// All predecessors of the block are known, fill in the incomplete phis
+static void lower_seal_block(lower_ctx_p l, uint32_t block) {
+	for(size_t i = 0; i < l->incomplete_phis.len; i++) {
+		lower_incomplete_phi_t incomplete = l->incomplete_phis.ptr[i];
+		if (incomplete.block != block)
+			continue;
+		lower_add_phi_operands(l, incomplete.var, incomplete.phi);
+		l->incomplete_phis.ptr[i] = l->incomplete_phis.ptr[--l->incomplete_phis.len];
+		i--;
+	}
+	ir_block(l->f, block)->sealed = true;
+}
+
+/**
+ * Lowers the AST of the function into f.
+ */
+void lower_func(node_p node, compiler_ctx_p ctx, ir_func_p f) {
+	lower_ctx_t l = (lower_ctx_t){ .f = f, .ctx = ctx };
+	for(size_t i = 0; i < node->func.in.len; i++)
+		list_append(&l.vars, node->func.in.ptr[i]);
+	for(size_t i = 0; i < node->func.out.len; i++)
+		list_append(&l.vars, node->func.out.ptr[i]);
+	for(size_t i = 0; i < node->func.body.len; i++)
+		lower_collect_vars(node->func.body.ptr[i], &l);
+	
+	l.block = lower_new_block(&l);
+	lower_seal_block(&l, l.block);
+	for(size_t i = 0; i < node->func.in.len; i++)
+		lower_write_var(&l, i, l.block, ir_in_arg(f, l.block, lower_var_type(&l, i), i));
+	
+	ir_val_t last_stmt_value = IR_NO_VAL;
+	for(size_t i = 0; i < node->func.body.len; i++)
+		last_stmt_value = lower_node(node->func.body.ptr[i], &l);
+	
+	// The value of the last statement becomes the first out arg (if there is
+	// one)
+	if (last_stmt_value != IR_NO_VAL && ir_instr(f, last_stmt_value)->type != IR_VOID && node->func.out.len >= 1)
+		lower_write_var(&l, node->func.in.len, l.block, lower_convert(&l, last_stmt_value, lower_var_type(&l, node->func.in.len)));
+	
+	ir_val_t out_values[node->func.out.len];
+	for(size_t i = 0; i < node->func.out.len; i++)
+		out_values[i] = lower_read_var(&l, node->func.in.len + i, l.block);
+	ir_ret(f, l.block, out_values, node->func.out.len);
+	
+	list_free(&l.incomplete_phis);
+	list_free(&l.vars);
+	free(l.defs);
+}
+
+static ir_val_t lower_call(node_p node, lower_ctx_p l) {
+	ir_val_t args[node->call.args.len];
+	for(size_t i = 0; i < node->call.args.len; i++)
+		args[i] = lower_node(node->call.args.ptr[i], l);
+	
+	if ( str_eqc(&node->call.name, "syscall") )
+		return ir_append(l->f, l->block, IR_SYSCALL, IR_U64, args, node->call.args.len);
+	
+	node_p target = ns_lookup(node, node->call.name);
+	if (node->call.args.len != target->func.in.len) {
+		fprintf(stderr, "lower_call(): function %.*s expected %zu arguments but %zu given!\n",
+			target->func.name.len, target->func.name.ptr, target->func.in.len, node->call.args.len);
+		abort();
+	}
+	ir_type_t type = (target->func.out.len > 0) ? lower_type(target->func.out.ptr[0]->arg.type) : IR_VOID;
+	return ir_call(l->f, l->block, type, target, target->func.out.len, args, node->call.args.len);
+}
+
+static ir_val_t lower_op(node_p node, lower_ctx_p l) {
+	ir_func_p f = l->f;
+	ir_type_t type = lower_type(node->op.type);
+	switch(node->op.idx) {
+		case OP_ASSIGN: {
+			if (node->op.a->type != NT_ID) {
+				fprintf(stderr, "lower_op(): right side of assigment has to be an ID for now!\n");
+				abort();
+			}
+			node_p target = ns_lookup(node, node->op.a->id.name);
+			size_t var = lower_var_index(l, target);
+			ir_val_t value = lower_convert(l, lower_node(node->op.b, l), lower_var_type(l, var));
+			lower_write_var(l, var, l->block, value);
+			return value;
+		}
+		
+		case OP_AND: case OP_OR: {
+			// The value of a logical op (0 or 1). Conditions of if and while
+			// statements don't get here, they become branches directly.
+			uint32_t true_block = lower_new_block(l), false_block = lower_new_block(l), end = lower_new_block(l);
+			lower_cond(node, l, true_block, false_block);
+			lower_seal_block(l, true_block);
+			lower_seal_block(l, false_block);
+			
+			lower_switch_to(l, true_block);
+			ir_val_t one = ir_const(f, l->block, type, 1);
+			ir_jmp(f, l->block, end);
+			lower_switch_to(l, false_block);
+			ir_val_t zero = ir_const(f, l->block, type, 0);
+			ir_jmp(f, l->block, end);
+			
+			lower_seal_block(l, end);
+			lower_switch_to(l, end);
+			ir_val_t phi = ir_phi(f, end, type);
+			ir_list_append(f, &ir_instr(f, phi)->args, one);
+			ir_list_append(f, &ir_instr(f, phi)->args, zero);
+			return phi;
+		}
+		
+		default: {
+			ir_val_t a = lower_node(node->op.a, l);
+			ir_val_t b = lower_node(node->op.b, l);
+			return ir_binary(f, l->block, lower_ops[node->op.idx], type, a, b);
+		}
+	}
+}
+
+/**
+ * Lowers a condition into branches to true_block or false_block. "and" and
+ * "or" skip their right side when the left side already decides the result.
+ */
+void lower_cond(node_p node, lower_ctx_p l, uint32_t true_block, uint32_t false_block) {
+	if ( node->type == NT_OP && (node->op.idx == OP_AND || node->op.idx == OP_OR) ) {
+		uint32_t right_block = lower_new_block(l);
+		if (node->op.idx == OP_AND)
+			lower_cond(node->op.a, l, right_block, false_block);
+		else
+			lower_cond(node->op.a, l, true_block, right_block);
+		lower_seal_block(l, right_block);
+		lower_switch_to(l, right_block);
+		lower_cond(node->op.b, l, true_block, false_block);
+		return;
+	}
+	
+	ir_val_t cond = lower_node(node, l);
+	ir_branch(l->f, l->block, cond, true_block, false_block);
+}
+
+static void lower_if(node_p node, lower_ctx_p l) {
+	bool has_false_case = (node->if_stmt.false_case != NULL);
+	uint32_t true_block = lower_new_block(l), end = lower_new_block(l);
+	uint32_t false_block = has_false_case ? lower_new_block(l) : end;
+	lower_cond(node->if_stmt.cond, l, true_block, false_block);
+	
+	lower_seal_block(l, true_block);
+	lower_switch_to(l, true_block);
+	lower_node(node->if_stmt.true_case, l);
+	ir_jmp(l->f, l->block, end);
+	
+	if (has_false_case) {
+		lower_seal_block(l, false_block);
+		lower_switch_to(l, false_block);
+		lower_node(node->if_stmt.false_case, l);
+		ir_jmp(l->f, l->block, end);
+	}
+	
+	lower_seal_block(l, end);
+	lower_switch_to(l, end);
+}
+
+static void lower_while(node_p node, lower_ctx_p l) {
+	// Same layout as compile_while(): The condition is placed after the body
+	// so each iteration only needs one conditional jump back to the body. The
+	// body isn't sealed until the condition branches to it.
+	uint32_t body = lower_new_block(l), cond = lower_new_block(l), end = lower_new_block(l);
+	ir_jmp(l->f, l->block, cond);
+	
+	lower_switch_to(l, body);
+	if (node->while_stmt.profile_vaddr != 0) {
+		ir_val_t count = ir_append(l->f, body, IR_PROFILE_COUNT, IR_VOID, NULL, 0);
+		l->f->instrs[count].imm = node->while_stmt.profile_vaddr;
+	}
+	lower_node(node->while_stmt.body, l);
+	ir_jmp(l->f, l->block, cond);
+	
+	lower_seal_block(l, cond);
+	lower_switch_to(l, cond);
+	lower_cond(node->while_stmt.cond, l, body, end);
+	lower_seal_block(l, body);
+	
+	lower_seal_block(l, end);
+	lower_switch_to(l, end);
+}
+
+static void lower_return(node_p node, lower_ctx_p l) {
+	node_p func = node->parent;
+	while (func != NULL && func->type != NT_FUNC)
+		func = func->parent;
+	
+	if (node->return_stmt.args.len != func->func.out.len) {
+		fprintf(stderr, "lower_return(): got %zu args, but function has %zu out args!\n",
+			node->return_stmt.args.len, func->func.out.len);
 		abort();
 	}
 	
-	printf("linking %.*s\n", node->func.name.len, node->func.name.ptr);
+	ir_val_t values[node->return_stmt.args.len];
+	for(size_t i = 0; i < node->return_stmt.args.len; i++)
+		values[i] = lower_convert(l, lower_node(node->return_stmt.args.ptr[i], l), lower_type(func->func.out.ptr[i]->arg.type));
+	ir_ret(l->f, l->block, values, node->return_stmt.args.len);
 	
-	// Set the flag right at the start so we don't get an endless recursion on
-	// self recursive function calls.
-	node->func.linked = true;
+	// Code after the return goes into a block without predecessors. It's
+	// removed along with other unreachable blocks.
+	uint32_t unreachable = lower_new_block(l);
+	lower_seal_block(l, unreachable);
+	lower_switch_to(l, unreachable);
+}
+
+/**
+ * Lowers a statement or expression. Returns the value of expressions,
+ * IR_NO_VAL for statements.
+ */
+ir_val_t lower_node(node_p node, lower_ctx_p l) {
+	switch(node->type) {
+		case NT_SCOPE:
+			for(size_t i = 0; i < node->scope.stmts.len; i++)
+				lower_node(node->scope.stmts.ptr[i], l);
+			return IR_NO_VAL;
+		case NT_VAR:
+			if (node->var.value != NULL) {
+				size_t var = lower_var_index(l, node);
+				lower_write_var(l, var, l->block, lower_convert(l, lower_node(node->var.value, l), lower_var_type(l, var)));
+			}
+			return IR_NO_VAL;
+		case NT_IF:
+			lower_if(node, l);
+			return IR_NO_VAL;
+		case NT_WHILE:
+			lower_while(node, l);
+			return IR_NO_VAL;
+		case NT_RETURN:
+			lower_return(node, l);
+			return IR_NO_VAL;
+		case NT_CALL:
+			return lower_call(node, l);
+		case NT_OP:
+			return lower_op(node, l);
+		case NT_INTL:
+			return ir_const(l->f, l->block, IR_U64, node->intl.value);
+		case NT_STRL:
+			return ir_const(l->f, l->block, IR_U64, node->strl.data_vaddr);
+		case NT_ID: {
+			node_p target = ns_lookup(node, node->id.name);
+			return lower_read_var(l, lower_var_index(l, target), l->block);
+		}
+		
+		default:
+			fprintf(stderr, "lower_node(): can't lower node type %d yet!\n", node->type);
+			abort();
+	}
+}
+
+//
+// Inlining
+//
+// Calls to small functions are replaced by a copy of the called function (see
+// ir_inline_call()). That saves the call, the prologue and epilogue and the
+// moves of the args into place. Constant args often fold away in the copy, so
+// calls with constant args may inline bigger functions. Functions calling
+// themselves are never inlined. Mutual recursion is stopped by a depth limit:
+// Calls copied along with an inlined function are inlined only up to
+// INLINE_MAX_DEPTH levels deep.
+//
+// Called functions are lowered (and run through the IR passes) once and kept
+// around for all call sites. When all calls to a function are inlined it isn't
+// compiled at all.
+//
+
+#define INLINE_MAX_COST         8   // cost of a callee (see ir_inline_cost()) that is always inlined
+#define INLINE_CONST_ARG_BONUS  4   // additional cost allowed per constant arg
+#define INLINE_MAX_DEPTH        3
+#define INLINE_MAX_CALLER_COST  400 // stop inlining into functions that got that big
+
+// Returns the lowered IR of the function, lowers it on first use
+static ir_func_p inline_get_callee(node_p func, compiler_ctx_p ctx) {
+	for(size_t i = 0; i < ctx->inline_callees.len; i++) {
+		if (ctx->inline_callees.ptr[i].func == func)
+			return ctx->inline_callees.ptr[i].ir;
+	}
 	
-	for(size_t i = 0; i < node->func.addr_slots.len; i++) {
-		node_p target = node->func.addr_slots.ptr[i].target;
-		size_t offset = node->func.addr_slots.ptr[i].offset;
-		size_t rip_after_call = offset + 4;
+	ir_func_p ir = malloc(sizeof(ir_func_t));
+	ir_new(ir, func->func.name.ptr, func->func.name.len, func->func.in.len, func->func.out.len);
+	lower_func(func, ctx, ir);
+	ir_run_passes(ir, ir_default_passes, ir_default_pass_count, &ctx->ir_stats);
+	list_append(&ctx->inline_callees, ((inline_callee_t){ func, ir }));
+	return ir;
+}
+
+// True if the function calls itself directly
+static bool inline_is_recursive(node_p func, ir_func_p ir) {
+	for(ir_val_t val = 1; val < ir->instr_count; val++) {
+		if (ir->instrs[val].op == IR_CALL && ir->instrs[val].target == func)
+			return true;
+	}
+	return false;
+}
+
+static void inline_report(compiler_ctx_p ctx, node_p caller, node_p callee, const char* decision, size_t cost, size_t limit) {
+	if (!ctx->inline_report)
+		return;
+	fprintf(ctx->log, "inline: %.*s -> %.*s: %s (cost %zu, limit %zu)\n",
+		caller->func.name.len, caller->func.name.ptr,
+		callee->func.name.len, callee->func.name.ptr,
+		decision, cost, limit);
+}
+
+/**
+ * Inlines the calls in f (the IR of func) the heuristic picks. Calls that are
+ * copied along are looked at, too.
+ */
+void inline_calls(node_p func, ir_func_p f, compiler_ctx_p ctx) {
+	// Inline depth of every instruction, 0 for the ones of the function itself
+	uint8_t* depths = calloc(f->instr_count, sizeof(depths[0]));
+	
+	for(ir_val_t val = 1; val < f->instr_count; val++) {
+		if (f->instrs[val].op != IR_CALL)
+			continue;
 		
-		int32_t call_displ = target->func.as_offset - rip_after_call;
+		node_p target = f->instrs[val].target;
+		ir_func_p callee = inline_get_callee(target, ctx);
+		size_t cost = ir_inline_cost(callee), limit = INLINE_MAX_COST;
+		for(size_t i = 0; i < f->instrs[val].args.len; i++) {
+			if (f->instrs[ir_arg(f, val, i)].op == IR_CONST)
+				limit += INLINE_CONST_ARG_BONUS;
+		}
+		
+		const char* rejected = NULL;
+		if ( target == func || inline_is_recursive(target, callee) )
+			rejected = "not inlined, recursive";
+		else if (depths[val] >= INLINE_MAX_DEPTH)
+			rejected = "not inlined, depth limit reached";
+		else if (cost > limit)
+			rejected = "not inlined, too big";
+		else if (ir_inline_cost(f) > INLINE_MAX_CALLER_COST)
+			rejected = "not inlined, caller too big";
+		inline_report(ctx, func, target, rejected ? rejected : "inlined", cost, limit);
+		if (rejected)
+			continue;
 		
-		int32_t* call_displ_ptr = (int32_t*)(ctx->as->code_ptr + offset);
-		*call_displ_ptr = call_displ;
+		uint8_t depth = depths[val];
+		ir_val_t first_new = f->instr_count;
+		ir_inline_call(f, val, callee);
+		ctx->ir_stats.inlined_calls++;
 		
-		if (!target->func.linked)
-			resolve_addr_slots(target, ctx);
+		depths = realloc(depths, f->instr_count * sizeof(depths[0]));
+		for(ir_val_t new_val = first_new; new_val < f->instr_count; new_val++)
+			depths[new_val] = depth + 1;
+	}
+	
+	free(depths);
+}
+
+void inline_free_callees(compiler_ctx_p ctx) {
+	for(size_t i = 0; i < ctx->inline_callees.len; i++) {
+		ir_destroy(ctx->inline_callees.ptr[i].ir);
+		free(ctx->inline_callees.ptr[i].ir);
+	}
+	list_free(&ctx->inline_callees);
+}
+
+
+/**
+ * Compiles the function through the IR: lowering, the IR passes and the IR
+ * backend. Used instead of compile_func() with the --ir option.
+ */
+raa_t compile_func_ir(node_p node, compiler_ctx_p ctx) {
+	node->func.compiled = true;
+	
+	ir_func_t f;
+	ir_new(&f, node->func.name.ptr, node->func.name.len, node->func.in.len, node->func.out.len);
+	lower_func(node, ctx, &f);
+	ir_run_passes(&f, ir_default_passes, ir_default_pass_count, &ctx->ir_stats);
+	inline_calls(node, &f, ctx);
+	ir_run_passes(&f, ir_default_passes, ir_default_pass_count, &ctx->ir_stats);
+	ir_print(&f, ctx->log);
+	
+	// Functions that are still called have to be compiled, too
+	for(ir_val_t val = 1; val < f.instr_count; val++) {
+		if (f.instrs[val].op == IR_CALL)
+			compile_enqueue(ctx, f.instrs[val].target);
 	}
-}
\ No newline at end of file
+	
+	node->func.as_offset = as_target(ctx->as);
+	f.profile = compile_profile_of(node, ctx);
+	ir_compile(&f, ctx->as, &ctx->ir_stats);
+	for(size_t i = 0; i < f.call_slots.len; i++) {
+		list_append(&node->func.addr_slots, ( (node_addr_slot_t){
+			.offset = f.call_slots.ptr[i].offset,
+			.target = f.call_slots.ptr[i].target
+		} ));
+	}
+	ir_destroy(&f);
+	
+	size_t* slot_offsets[node->func.addr_slots.len];
+	for(size_t i = 0; i < node->func.addr_slots.len; i++)
+		slot_offsets[i] = &node->func.addr_slots.ptr[i].offset;
+	ph_optimize(ctx->as, node->func.as_offset, slot_offsets, node->func.addr_slots.len, &ctx->peephole_stats);
+	
+	return ra_empty();
+}
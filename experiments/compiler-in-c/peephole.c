@@ -0,0 +1,764 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include "peephole.h"
+
+
+//
+// Decoded instructions
+//
+
+// Bits 0 to 15 are the general purpose registers
+#define PH_REG(index)  (1u << (index))
+#define PH_FLAGS       (1u << 16)
+#define PH_MEM         (1u << 17)
+#define PH_ALL_REGS    0xffff
+#define PH_ALL         (PH_MEM | PH_FLAGS | PH_ALL_REGS)
+
+typedef enum {
+	PH_OTHER,
+	PH_MOV,
+	PH_MOV_IMM,
+	PH_ALU,
+	PH_CMP,
+	PH_SETCC,
+	PH_PUSH,
+	PH_POP,
+	PH_JMP,
+	PH_JCC,
+	PH_CALL,
+	PH_RET,
+	PH_SYSCALL
+} ph_kind_t;
+
+typedef struct {
+	int8_t  base, index;  // -1 if not used
+	uint8_t scale;
+	bool    rip;
+	int32_t disp;
+} ph_mem_t;
+
+typedef struct {
+	uint8_t   bytes[15];
+	uint8_t   len;
+	size_t    offset;   // offset in the original code
+	
+	ph_kind_t kind;
+	uint8_t   bits;     // operand size
+	int8_t    reg;      // register in the ModR/M reg field, of PUSH, POP or MOV imm, -1 if none
+	int8_t    rm_reg;   // register addressed by ModR/M, -1 if it's memory or there is no ModR/M
+	bool      has_mem;
+	ph_mem_t  mem;
+	bool      rm_is_dest;
+	uint8_t   cc;       // condition code of SETcc and Jcc
+	int64_t   imm;
+	
+	size_t    target;   // instruction index of a JMP or Jcc target (count = end of code)
+	uint32_t  reads, writes, kills;
+	bool      is_target, deleted;
+} ph_instr_t, *ph_instr_p;
+
+typedef struct {
+	ph_instr_p instrs;
+	size_t     count;
+	uint32_t*  live_out;  // registers (and flags) read later on, after each instruction
+	bool       liveness_dirty;
+} ph_t, *ph_p;
+
+
+/**
+ * Decodes the instructions our assembler generates. Returns false for
+ * anything else. Only fills in the offset based target of jumps, they're
+ * converted to instruction indices later on.
+ */
+static bool ph_decode(const uint8_t* code, size_t code_len, ph_instr_p in, ssize_t* rel_target) {
+	memset(in, 0, sizeof(*in));
+	in->reg = -1;
+	in->rm_reg = -1;
+	*rel_target = -1;
+	
+	size_t p = 0;
+	bool prefix_66h = false;
+	uint8_t rex = 0;
+	if (p < code_len && code[p] == 0x66)
+		prefix_66h = true, p++;
+	if (p < code_len && (code[p] & 0xf0) == 0x40)
+		rex = code[p++];
+	if (p >= code_len)
+		return false;
+	uint8_t rex_W = (rex >> 3) & 1, rex_R = (rex >> 2) & 1, rex_X = (rex >> 1) & 1, rex_B = rex & 1;
+	
+	uint8_t op = code[p++];
+	bool has_modrm = false;
+	uint8_t imm_bytes = 0;
+	// Operand size of opcodes with a w bit
+	uint8_t full_bits = rex_W ? 64 : (prefix_66h ? 16 : 32);
+	
+	if (op == 0x0f) {
+		if (p >= code_len)
+			return false;
+		uint8_t op2 = code[p++];
+		if (op2 == 0x05) {
+			in->kind = PH_SYSCALL;
+		} else if (op2 == 0x31) {
+			// RDTSC
+			in->kind = PH_OTHER;
+		} else if ((op2 & 0xf0) == 0x80) {
+			in->kind = PH_JCC;
+			in->cc = op2 & 0x0f;
+			imm_bytes = 4;
+		} else if ((op2 & 0xf0) == 0x90) {
+			in->kind = PH_SETCC;
+			in->cc = op2 & 0x0f;
+			in->bits = 8;
+			has_modrm = true;
+		} else {
+			return false;
+		}
+	} else if ( (op & 0xc4) == 0x00 && ((op & 0x38) == 0x00 || (op & 0x38) == 0x20 || (op & 0x38) == 0x28 || (op & 0x38) == 0x38) ) {
+		// ADD, AND, SUB and CMP: 00xx x0dw
+		in->kind = ((op & 0x38) == 0x38) ? PH_CMP : PH_ALU;
+		in->bits = (op & 1) ? full_bits : 8;
+		in->rm_is_dest = !((op >> 1) & 1);
+		has_modrm = true;
+	} else if ((op & 0xfc) == 0x88) {
+		// MOV: 1000 10dw
+		in->kind = PH_MOV;
+		in->bits = (op & 1) ? full_bits : 8;
+		in->rm_is_dest = !((op >> 1) & 1);
+		has_modrm = true;
+	} else if (op == 0x81 || op == 0x83) {
+		in->kind = PH_ALU;
+		in->bits = full_bits;
+		in->rm_is_dest = true;
+		has_modrm = true;
+		imm_bytes = (op == 0x81) ? 4 : 1;
+	} else if (op == 0xc1) {
+		// SHL and SHR by imm8, handled with the ModR/M reg field below
+		in->kind = PH_ALU;
+		in->bits = full_bits;
+		in->rm_is_dest = true;
+		has_modrm = true;
+		imm_bytes = 1;
+	} else if (op == 0x69 || op == 0x8d) {
+		// IMUL with imm32 and LEA, both write the ModR/M reg field
+		in->kind = PH_ALU;
+		in->bits = full_bits;
+		has_modrm = true;
+		imm_bytes = (op == 0x69) ? 4 : 0;
+	} else if (op == 0xf6 || op == 0xf7) {
+		// MUL, DIV, etc. handled with the ModR/M reg field below
+		in->kind = PH_OTHER;
+		in->bits = (op & 1) ? full_bits : 8;
+		has_modrm = true;
+	} else if (op == 0xff || op == 0x8f) {
+		// PUSH, POP, CALL and JMP indirect, handled with the ModR/M reg field below
+		in->bits = 64;
+		has_modrm = true;
+	} else if ((op & 0xf8) == 0xb8) {
+		in->kind = PH_MOV_IMM;
+		in->bits = full_bits;
+		in->reg = (op & 0b111) | (rex_B << 3);
+		imm_bytes = rex_W ? 8 : 4;
+	} else if (op == 0xe9) {
+		in->kind = PH_JMP;
+		imm_bytes = 4;
+	} else if (op == 0xe8) {
+		in->kind = PH_CALL;
+		imm_bytes = 4;
+	} else if (op == 0xc3) {
+		in->kind = PH_RET;
+	} else if (op == 0xc2) {
+		in->kind = PH_RET;
+		imm_bytes = 2;
+	} else if (op == 0x68) {
+		in->kind = PH_PUSH;
+		imm_bytes = 4;
+	} else {
+		return false;
+	}
+	
+	uint8_t reg_field = 0;
+	if (has_modrm) {
+		if (p >= code_len)
+			return false;
+		uint8_t modrm = code[p++];
+		uint8_t mod = modrm >> 6, rm = modrm & 0b111;
+		reg_field = (modrm >> 3) & 0b111;
+		
+		if (mod == 0b11) {
+			in->rm_reg = rm | (rex_B << 3);
+		} else {
+			in->has_mem = true;
+			in->mem = (ph_mem_t){ .base = -1, .index = -1, .scale = 1 };
+			uint8_t disp_bytes = (mod == 0b01) ? 1 : (mod == 0b10) ? 4 : 0;
+			
+			if (rm == 0b100) {
+				if (p >= code_len)
+					return false;
+				uint8_t sib = code[p++];
+				uint8_t index = ((sib >> 3) & 0b111) | (rex_X << 3), base = sib & 0b111;
+				in->mem.scale = 1 << (sib >> 6);
+				if (index != 0b100)
+					in->mem.index = index;
+				if (base == 0b101 && mod == 0b00)
+					disp_bytes = 4;
+				else
+					in->mem.base = base | (rex_B << 3);
+			} else if (rm == 0b101 && mod == 0b00) {
+				in->mem.rip = true;
+				disp_bytes = 4;
+			} else {
+				in->mem.base = rm | (rex_B << 3);
+			}
+			
+			if (p + disp_bytes > code_len)
+				return false;
+			if (disp_bytes == 1)
+				in->mem.disp = (int8_t)code[p];
+			else if (disp_bytes == 4)
+				memcpy(&in->mem.disp, code + p, 4);
+			p += disp_bytes;
+		}
+	}
+	
+	if (p + imm_bytes > code_len)
+		return false;
+	if (imm_bytes == 8) {
+		memcpy(&in->imm, code + p, 8);
+	} else if (imm_bytes == 4) {
+		int32_t imm32 = 0;
+		memcpy(&imm32, code + p, 4);
+		in->imm = imm32;
+	} else if (imm_bytes == 2) {
+		int16_t imm16 = 0;
+		memcpy(&imm16, code + p, 2);
+		in->imm = imm16;
+	} else if (imm_bytes == 1) {
+		in->imm = (int8_t)code[p];
+	}
+	p += imm_bytes;
+	
+	in->len = p;
+	memcpy(in->bytes, code, p);
+	
+	// Registers used to address memory are always read
+	uint32_t addr_regs = 0;
+	if (in->has_mem) {
+		if (in->mem.base != -1)
+			addr_regs |= PH_REG(in->mem.base);
+		if (in->mem.index != -1)
+			addr_regs |= PH_REG(in->mem.index);
+	}
+	// Registers written in full. 8 and 16 bit writes keep the rest of the
+	// register so they don't end the life of the old value.
+	uint32_t rm_loc = 0, rm_kill = 0;
+	if (has_modrm) {
+		rm_loc = in->has_mem ? PH_MEM : PH_REG(in->rm_reg);
+		rm_kill = (!in->has_mem && in->bits >= 32) ? PH_REG(in->rm_reg) : 0;
+	}
+	uint32_t rsp = PH_REG(4), rax = PH_REG(0), rdx = PH_REG(2);
+	
+	switch(op) {
+		case 0x0f:
+			if (in->kind == PH_SYSCALL) {
+				// Input: RAX, RDI, RSI, RDX, R10, R8, R9, scratch: RCX, R11
+				in->reads = PH_REG(0) | PH_REG(7) | PH_REG(6) | PH_REG(2) | PH_REG(10) | PH_REG(8) | PH_REG(9) | PH_MEM;
+				in->writes = PH_REG(0) | PH_REG(1) | PH_REG(11) | PH_MEM;
+				in->kills = PH_REG(0) | PH_REG(1) | PH_REG(11);
+			} else if (in->kind == PH_JCC) {
+				in->reads = PH_FLAGS;
+				*rel_target = p + in->imm;
+			} else if (in->kind == PH_OTHER) {
+				// RDTSC
+				in->writes = rax | rdx;
+				in->kills = rax | rdx;
+			} else {
+				// SETcc only writes the lowest byte
+				in->reads = PH_FLAGS | addr_regs | rm_loc;
+				in->writes = rm_loc;
+			}
+			break;
+		case 0x81: case 0x83:
+			// ADD /0, AND /4, SUB /5 and CMP /7 with imm32 or imm8
+			in->reg = -1;
+			if (reg_field == 0b111)
+				in->kind = PH_CMP;
+			else if (reg_field != 0b000 && reg_field != 0b100 && reg_field != 0b101)
+				in->kind = PH_OTHER;
+			in->reads = addr_regs | rm_loc;
+			in->writes = PH_FLAGS | ((in->kind == PH_CMP) ? 0 : rm_loc);
+			in->kills = PH_FLAGS | ((in->kind == PH_CMP) ? 0 : rm_kill);
+			break;
+		case 0xc1:
+			// SHL /4 and SHR /5, we never shift by 0 so the flags are always written
+			if (reg_field != 0b100 && reg_field != 0b101)
+				return false;
+			in->reads = addr_regs | rm_loc;
+			in->writes = rm_loc | PH_FLAGS;
+			in->kills = rm_kill | PH_FLAGS;
+			break;
+		case 0x69: case 0x8d:
+			// Only write the reg operand, LEA only reads the address registers
+			// and doesn't touch the flags
+			in->reg = reg_field | (rex_R << 3);
+			if (op == 0x8d && !in->has_mem)
+				return false;
+			in->reads = addr_regs | ((op == 0x69) ? rm_loc : 0);
+			in->writes = PH_REG(in->reg) | ((op == 0x69) ? PH_FLAGS : 0);
+			in->kills = PH_REG(in->reg) | ((op == 0x69) ? PH_FLAGS : 0);
+			break;
+		case 0xf6: case 0xf7:
+			if (reg_field == 0b100 || reg_field == 0b110) {
+				// MUL and DIV
+				in->reads = addr_regs | rm_loc | rax | ((reg_field == 0b110) ? rdx : 0);
+				in->writes = rax | rdx | PH_FLAGS;
+				in->kills = (in->bits >= 32) ? (rax | rdx | PH_FLAGS) : PH_FLAGS;
+			} else {
+				return false;
+			}
+			break;
+		case 0xff:
+			if (reg_field == 0b110) {
+				in->kind = PH_PUSH;
+				in->reads = addr_regs | rm_loc | rsp;
+				in->writes = rsp | PH_MEM;
+			} else if (reg_field == 0b010) {
+				in->kind = PH_CALL;
+				in->reads = PH_ALL_REGS | PH_MEM;
+				in->writes = PH_ALL;
+				in->kills = PH_FLAGS;
+			} else {
+				// Indirect jumps would need targets we don't know
+				return false;
+			}
+			break;
+		case 0x8f:
+			if (reg_field != 0b000)
+				return false;
+			in->kind = PH_POP;
+			in->reads = addr_regs | rsp | PH_MEM;
+			in->writes = rm_loc | rsp;
+			in->kills = rm_kill;
+			break;
+		case 0xe9:
+			*rel_target = p + in->imm;
+			break;
+		case 0xe8:
+			// The called function might use any register but doesn't expect
+			// anything in the flags (and doesn't preserve them either)
+			in->reads = PH_ALL_REGS | PH_MEM;
+			in->writes = PH_ALL;
+			in->kills = PH_FLAGS;
+			break;
+		case 0xc3: case 0xc2:
+			// Every register might be used by the caller, but not the flags
+			in->reads = PH_ALL_REGS | PH_MEM;
+			in->writes = rsp;
+			break;
+		case 0x68:
+			in->reads = rsp;
+			in->writes = rsp | PH_MEM;
+			break;
+		default:
+			if (in->kind == PH_MOV_IMM) {
+				in->writes = PH_REG(in->reg);
+				in->kills = (in->bits >= 32) ? PH_REG(in->reg) : 0;
+				break;
+			}
+			
+			// ADD, SUB, CMP and MOV with the ModR/M reg field as register operand
+			in->reg = reg_field | (rex_R << 3);
+			uint32_t reg_loc = PH_REG(in->reg), reg_kill = (in->bits >= 32) ? PH_REG(in->reg) : 0;
+			uint32_t dest_loc = in->rm_is_dest ? rm_loc : reg_loc;
+			uint32_t dest_kill = in->rm_is_dest ? rm_kill : reg_kill;
+			uint32_t src_loc = in->rm_is_dest ? reg_loc : rm_loc;
+			
+			if (in->kind == PH_MOV) {
+				in->reads = addr_regs | src_loc | ((dest_kill == 0) ? dest_loc : 0);
+				in->writes = dest_loc;
+				in->kills = dest_kill;
+			} else if (in->kind == PH_CMP) {
+				in->reads = addr_regs | src_loc | dest_loc;
+				in->writes = PH_FLAGS;
+				in->kills = PH_FLAGS;
+			} else {
+				in->reads = addr_regs | src_loc | dest_loc;
+				in->writes = dest_loc | PH_FLAGS;
+				in->kills = dest_kill | PH_FLAGS;
+			}
+			break;
+	}
+	
+	return true;
+}
+
+
+//
+// Helpers for the patterns
+//
+
+// Index of the next instruction that isn't deleted (count at the end)
+static size_t ph_next(ph_p ph, size_t i) {
+	for(i++; i < ph->count && ph->instrs[i].deleted; i++) { }
+	return i;
+}
+
+static size_t ph_resolve_target(ph_p ph, size_t target) {
+	if (target < ph->count && ph->instrs[target].deleted)
+		return ph_next(ph, target);
+	return target;
+}
+
+static void ph_delete(ph_p ph, size_t i) {
+	ph_instr_p in = &ph->instrs[i];
+	in->deleted = true;
+	// Jumps to the deleted instruction now land on the next one
+	size_t next = ph_next(ph, i);
+	if (in->is_target && next < ph->count)
+		ph->instrs[next].is_target = true;
+	ph->liveness_dirty = true;
+}
+
+/**
+ * Replaces an instruction with the (single) instruction in the scratch
+ * assembler.
+ */
+static void ph_replace(ph_p ph, size_t i, asm_p scratch) {
+	ph_instr_p in = &ph->instrs[i];
+	ph_instr_t new_instr;
+	ssize_t rel_target;
+	if ( !ph_decode(scratch->code_ptr, scratch->code_len, &new_instr, &rel_target) || new_instr.len != scratch->code_len ) {
+		fprintf(stderr, "ph_replace(): replacement isn't a single known instruction!\n");
+		abort();
+	}
+	
+	new_instr.offset = in->offset;
+	new_instr.is_target = in->is_target;
+	*in = new_instr;
+	ph->liveness_dirty = true;
+}
+
+static bool ph_is_branch(ph_instr_p in) {
+	return in->kind == PH_JMP || in->kind == PH_JCC || in->kind == PH_CALL || in->kind == PH_RET;
+}
+
+/**
+ * Simple backward data flow analysis over the registers and flags. An
+ * instruction reads a value if it's in reads, and ends the life of the previous
+ * value if it's in kills. Everything is live at the end of the code (the
+ * function should end with a RET anyway).
+ */
+static void ph_liveness(ph_p ph) {
+	uint32_t* live_in = calloc(ph->count, sizeof(live_in[0]));
+	memset(ph->live_out, 0, ph->count * sizeof(ph->live_out[0]));
+	
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for(ssize_t i = ph->count - 1; i >= 0; i--) {
+			ph_instr_p in = &ph->instrs[i];
+			if (in->deleted)
+				continue;
+			
+			uint32_t out = 0;
+			if (in->kind != PH_JMP && in->kind != PH_RET) {
+				size_t next = ph_next(ph, i);
+				out |= (next < ph->count) ? live_in[next] : PH_ALL;
+			}
+			if (in->kind == PH_JMP || in->kind == PH_JCC) {
+				size_t target = ph_resolve_target(ph, in->target);
+				out |= (target < ph->count) ? live_in[target] : PH_ALL;
+			}
+			
+			uint32_t new_in = in->reads | (out & ~in->kills);
+			if (out != ph->live_out[i] || new_in != live_in[i]) {
+				ph->live_out[i] = out;
+				live_in[i] = new_in;
+				changed = true;
+			}
+		}
+	}
+	
+	free(live_in);
+	ph->liveness_dirty = false;
+}
+
+static uint32_t ph_live_out(ph_p ph, size_t i) {
+	if (ph->liveness_dirty)
+		ph_liveness(ph);
+	return ph->live_out[i];
+}
+
+static bool ph_mem_eq(ph_mem_t a, ph_mem_t b) {
+	return a.base == b.base && a.index == b.index && a.scale == b.scale && a.rip == b.rip && a.disp == b.disp;
+}
+
+
+//
+// Patterns
+//
+// Each pattern gets the index of a (not deleted) instruction and returns true
+// if it rewrote something.
+//
+
+// MOV r, r
+static bool ph_self_mov(ph_p ph, size_t i) {
+	ph_instr_p in = &ph->instrs[i];
+	if ( !(in->kind == PH_MOV && !in->has_mem && in->reg == in->rm_reg && in->bits == 64) )
+		return false;
+	
+	ph_delete(ph, i);
+	return true;
+}
+
+// JMP to the instruction right after it (e.g. from the last return statement)
+static bool ph_jump_to_next(ph_p ph, size_t i) {
+	ph_instr_p in = &ph->instrs[i];
+	if ( !(in->kind == PH_JMP && ph_resolve_target(ph, in->target) == ph_next(ph, i)) )
+		return false;
+	
+	ph_delete(ph, i);
+	return true;
+}
+
+/**
+ * PUSH a, ..., POP b where the instructions in between don't touch the stack
+ * and don't write a. Happens when the register allocator spills a register
+ * that isn't overwritten afterwards (e.g. around a syscall). The PUSH is
+ * removed and the POP becomes MOV b, a (removed by ph_self_mov() if a = b).
+ */
+static bool ph_push_pop(ph_p ph, size_t i) {
+	ph_instr_p push = &ph->instrs[i];
+	if ( !(push->kind == PH_PUSH && push->rm_reg != -1) )
+		return false;
+	
+	int8_t a = push->rm_reg;
+	uint32_t rsp = PH_REG(RSP.reg);
+	for(size_t j = ph_next(ph, i); j < ph->count; j = ph_next(ph, j)) {
+		ph_instr_p in = &ph->instrs[j];
+		if (in->is_target)
+			return false;
+		
+		if (in->kind == PH_POP) {
+			if (in->rm_reg == -1)
+				return false;
+			
+			asm_t scratch;
+			as_new(&scratch);
+			as_mov(&scratch, reg(in->rm_reg), reg(a));
+			ph_replace(ph, j, &scratch);
+			as_destroy(&scratch);
+			
+			ph_delete(ph, i);
+			return true;
+		}
+		
+		if ( ph_is_branch(in) || ((in->reads | in->writes) & rsp) || (in->writes & PH_REG(a)) )
+			return false;
+	}
+	
+	return false;
+}
+
+// MOV [m], a; MOV b, [m] → MOV [m], a; MOV b, a
+static bool ph_store_load(ph_p ph, size_t i) {
+	ph_instr_p store = &ph->instrs[i];
+	if ( !(store->kind == PH_MOV && store->has_mem && store->rm_is_dest && store->bits == 64 && !store->mem.rip) )
+		return false;
+	
+	size_t j = ph_next(ph, i);
+	if (j >= ph->count)
+		return false;
+	ph_instr_p load = &ph->instrs[j];
+	if ( !(load->kind == PH_MOV && load->has_mem && !load->rm_is_dest && load->bits == 64 && !load->is_target) )
+		return false;
+	if ( !ph_mem_eq(store->mem, load->mem) )
+		return false;
+	
+	asm_t scratch;
+	as_new(&scratch);
+	as_mov(&scratch, reg(load->reg), reg(store->reg));
+	ph_replace(ph, j, &scratch);
+	as_destroy(&scratch);
+	return true;
+}
+
+/**
+ * SETcc r8; CMP r, 0; JE/JNE target → J(!)cc target
+ *
+ * The code generator materializes the result of a comparison in a register
+ * and then tests it for the condition of if and while statements. When the
+ * register and flags aren't used afterwards we can jump on the original
+ * condition directly.
+ */
+static bool ph_setcc_cmp_jcc(ph_p ph, size_t i) {
+	ph_instr_p setcc = &ph->instrs[i];
+	if ( !(setcc->kind == PH_SETCC && setcc->rm_reg != -1) )
+		return false;
+	
+	size_t j = ph_next(ph, i);
+	size_t k = (j < ph->count) ? ph_next(ph, j) : ph->count;
+	if (k >= ph->count)
+		return false;
+	ph_instr_p cmp = &ph->instrs[j], jcc = &ph->instrs[k];
+	if ( !(cmp->kind == PH_CMP && cmp->rm_reg == setcc->rm_reg && cmp->reg == -1 && cmp->imm == 0 && !cmp->is_target) )
+		return false;
+	if ( !(jcc->kind == PH_JCC && (jcc->cc == CC_EQUAL || jcc->cc == CC_NOT_EQUAL) && !jcc->is_target) )
+		return false;
+	if ( ph_live_out(ph, k) & (PH_REG(setcc->rm_reg) | PH_FLAGS) )
+		return false;
+	
+	// Condition codes come in pairs, the lowest bit negates the condition
+	uint8_t cc = (jcc->cc == CC_EQUAL) ? (setcc->cc ^ 1) : setcc->cc;
+	jcc->cc = cc;
+	jcc->bytes[1] = 0x80 | cc;
+	ph_delete(ph, j);
+	ph_delete(ph, i);
+	return true;
+}
+
+// MOV, arithmetic, CMP or SETcc where nothing reads the result afterwards
+static bool ph_dead_code(ph_p ph, size_t i) {
+	ph_instr_p in = &ph->instrs[i];
+	if ( !(in->kind == PH_MOV || in->kind == PH_MOV_IMM || in->kind == PH_ALU || in->kind == PH_CMP || in->kind == PH_SETCC) )
+		return false;
+	if ( in->writes & (PH_MEM | PH_REG(RSP.reg)) )
+		return false;
+	if ( in->writes & ph_live_out(ph, i) )
+		return false;
+	
+	ph_delete(ph, i);
+	return true;
+}
+
+typedef bool (*ph_pattern_func_t)(ph_p ph, size_t i);
+static ph_pattern_func_t ph_patterns[] = {
+	ph_self_mov,
+	ph_jump_to_next,
+	ph_push_pop,
+	ph_store_load,
+	ph_setcc_cmp_jcc,
+	ph_dead_code,
+};
+
+
+//
+// Driver
+//
+
+void ph_optimize(asm_p as, size_t start, size_t* slot_offsets[], size_t slot_count, ph_stats_p stats) {
+	ph_t ph = { 0 };
+	size_t cap = 0;
+	ssize_t* rel_targets = NULL;
+	
+	// Decode the function
+	for(size_t offset = start; offset < as->code_len; ) {
+		if (ph.count == cap) {
+			cap = (cap == 0) ? 64 : cap * 2;
+			ph.instrs = realloc(ph.instrs, cap * sizeof(ph.instrs[0]));
+			rel_targets = realloc(rel_targets, cap * sizeof(rel_targets[0]));
+		}
+		
+		ph_instr_p in = &ph.instrs[ph.count];
+		ssize_t rel_target;
+		if ( !ph_decode(as->code_ptr + offset, as->code_len - offset, in, &rel_target) ) {
+			// Leave functions with instructions we don't understand alone
+			stats->skipped_functions++;
+			free(ph.instrs);
+			free(rel_targets);
+			return;
+		}
+		
+		in->offset = offset;
+		rel_targets[ph.count] = (rel_target == -1) ? -1 : (ssize_t)(offset + rel_target);
+		offset += in->len;
+		ph.count++;
+	}
+	
+	// Convert jump targets to instruction indices
+	for(size_t i = 0; i < ph.count; i++) {
+		if (rel_targets[i] == -1)
+			continue;
+		
+		size_t target = 0;
+		while (target < ph.count && ph.instrs[target].offset < (size_t)rel_targets[i])
+			target++;
+		bool exact = (target < ph.count) ? ph.instrs[target].offset == (size_t)rel_targets[i] : (size_t)rel_targets[i] == as->code_len;
+		if (!exact) {
+			// Jumps out of the function or into the middle of an instruction
+			stats->skipped_functions++;
+			free(ph.instrs);
+			free(rel_targets);
+			return;
+		}
+		
+		ph.instrs[i].target = target;
+		if (target < ph.count)
+			ph.instrs[target].is_target = true;
+	}
+	free(rel_targets);
+	
+	// Apply the patterns until none of them matches anymore
+	ph.live_out = malloc(ph.count * sizeof(ph.live_out[0]));
+	ph.liveness_dirty = true;
+	size_t pattern_count = sizeof(ph_patterns) / sizeof(ph_patterns[0]);
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for(size_t i = 0; i < ph.count; i++) {
+			for(size_t p = 0; p < pattern_count && !ph.instrs[i].deleted; p++) {
+				if ( ph_patterns[p](&ph, i) ) {
+					stats->rewrites++;
+					changed = true;
+				}
+			}
+		}
+	}
+	
+	// New offsets, deleted instructions get the offset of the next instruction
+	size_t new_offsets[ph.count + 1];
+	size_t offset = start;
+	for(size_t i = 0; i < ph.count; i++) {
+		new_offsets[i] = offset;
+		if (!ph.instrs[i].deleted)
+			offset += ph.instrs[i].len;
+	}
+	new_offsets[ph.count] = offset;
+	
+	// Write the code back and patch the jump displacements (all rel32)
+	size_t instructions_after = 0;
+	for(size_t i = 0; i < ph.count; i++) {
+		ph_instr_p in = &ph.instrs[i];
+		if (in->deleted)
+			continue;
+		
+		if (in->kind == PH_JMP || in->kind == PH_JCC) {
+			int32_t disp = (ssize_t)new_offsets[in->target] - (ssize_t)(new_offsets[i] + in->len);
+			memcpy(in->bytes + in->len - 4, &disp, 4);
+		}
+		memcpy(as->code_ptr + new_offsets[i], in->bytes, in->len);
+		instructions_after++;
+	}
+	
+	// Move the address slots along with their instructions
+	for(size_t s = 0; s < slot_count; s++) {
+		size_t slot = *slot_offsets[s];
+		for(size_t i = 0; i < ph.count; i++) {
+			if (slot >= ph.instrs[i].offset && slot < ph.instrs[i].offset + ph.instrs[i].len) {
+				*slot_offsets[s] = new_offsets[i] + (slot - ph.instrs[i].offset);
+				break;
+			}
+		}
+	}
+	
+	as->code_len = offset;
+	as->code_ptr = realloc(as->code_ptr, as->code_len);
+	
+	stats->instructions_before += ph.count;
+	stats->instructions_after += instructions_after;
+	
+	free(ph.live_out);
+	free(ph.instrs);
+}
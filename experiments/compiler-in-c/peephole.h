@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "asm.h"
+
+
+//
+// Peephole optimizer
+//
+// Works on a decoded view of the code of one function. The function has to be
+// the last thing in the code buffer (from start to code_len). Instructions
+// are rewritten by a table of patterns, then the code is written back and the
+// jump displacements within the function are patched to the new layout.
+//
+
+typedef struct {
+	size_t instructions_before;
+	size_t instructions_after;
+	size_t rewrites;
+	size_t skipped_functions;  // functions with instructions the decoder doesn't know
+} ph_stats_t, *ph_stats_p;
+
+/**
+ * Optimizes the code from start to the end of the code buffer. slot_offsets
+ * point to code offsets of address slots (e.g. call displacements patched by
+ * the linker later on). They're updated to the new code layout.
+ */
+void ph_optimize(asm_p as, size_t start, size_t* slot_offsets[], size_t slot_count, ph_stats_p stats);
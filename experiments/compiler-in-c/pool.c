@@ -0,0 +1,114 @@
+#include <sched.h>
+#include <stdio.h>
+#include "pool.h"
+
+
+void pool_new(pool_p pool, size_t worker_count, pool_task_func_t run, void* private) {
+	if (worker_count == 0) {
+		fprintf(stderr, "pool_new(): need at least one worker!\n");
+		abort();
+	}
+	
+	pool->run = run;
+	pool->private = private;
+	pool->worker_count = worker_count;
+	pool->queues = calloc(worker_count, sizeof(pool->queues[0]));
+	pool->pending = 0;
+	pool->steals = 0;
+	for(size_t i = 0; i < worker_count; i++) {
+		pthread_mutex_init(&pool->queues[i].lock, NULL);
+		deque_new(&pool->queues[i].tasks);
+	}
+}
+
+void pool_destroy(pool_p pool) {
+	for(size_t i = 0; i < pool->worker_count; i++) {
+		pthread_mutex_destroy(&pool->queues[i].lock);
+		deque_destroy(&pool->queues[i].tasks);
+	}
+	free(pool->queues);
+}
+
+
+/**
+ * Adds a task to the deque of worker. Can be called before pool_run() to add
+ * the initial tasks and by running tasks (with the worker they got).
+ */
+void pool_push(pool_p pool, size_t worker, void* task) {
+	pool_queue_p queue = &pool->queues[worker];
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	
+	pthread_mutex_lock(&queue->lock);
+	deque_push_back(&queue->tasks, task);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+// Takes a task from the back of the own deque or steals one from the front of
+// another one. Returns NULL if all deques are empty.
+static void* pool_take(pool_p pool, size_t worker) {
+	void* task = NULL;
+	for(size_t i = 0; i < pool->worker_count && task == NULL; i++) {
+		size_t victim = (worker + i) % pool->worker_count;
+		pool_queue_p queue = &pool->queues[victim];
+		
+		pthread_mutex_lock(&queue->lock);
+		if (queue->tasks.len > 0 && victim == worker) {
+			task = deque_back(&queue->tasks);
+			deque_pop_back(&queue->tasks);
+		} else if (queue->tasks.len > 0) {
+			task = deque_front(&queue->tasks);
+			deque_pop_front(&queue->tasks);
+			__atomic_add_fetch(&pool->steals, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+	
+	return task;
+}
+
+typedef struct {
+	pool_p pool;
+	size_t worker;
+} pool_worker_t, *pool_worker_p;
+
+static void* pool_worker(void* arg) {
+	pool_worker_p self = arg;
+	pool_p pool = self->pool;
+	
+	// A task can push new tasks until it's done. So only stop when nothing is
+	// pending anymore, empty deques aren't enough.
+	while ( __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0 ) {
+		void* task = pool_take(pool, self->worker);
+		if (task == NULL) {
+			sched_yield();
+			continue;
+		}
+		
+		pool->run(pool, self->worker, task);
+		__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	}
+	
+	return NULL;
+}
+
+/**
+ * Runs all tasks on worker_count threads (the calling thread is worker 0) and
+ * returns when they're done.
+ */
+void pool_run(pool_p pool) {
+	pthread_t threads[pool->worker_count];
+	pool_worker_t workers[pool->worker_count];
+	for(size_t i = 0; i < pool->worker_count; i++)
+		workers[i] = (pool_worker_t){ pool, i };
+	
+	for(size_t i = 1; i < pool->worker_count; i++) {
+		if ( pthread_create(&threads[i], NULL, pool_worker, &workers[i]) != 0 ) {
+			perror("pool_run(): pthread_create()");
+			abort();
+		}
+	}
+	
+	pool_worker(&workers[0]);
+	for(size_t i = 1; i < pool->worker_count; i++)
+		pthread_join(threads[i], NULL);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "common.h"
+
+
+//
+// Work stealing thread pool
+//
+// Every worker has its own deque of tasks. Tasks pushed by a task go to the
+// back of the deque of the worker running it and a worker takes its next task
+// from the back as well (the most recently pushed one). Workers without tasks
+// steal from the front of the other deques. pool_run() returns once all tasks
+// are done, including the ones pushed while it runs.
+//
+
+typedef struct pool_s pool_t, *pool_p;
+
+// worker is the index of the worker thread that runs the task (0 to
+// worker_count - 1), use it to get at per worker state
+typedef void (*pool_task_func_t)(pool_p pool, size_t worker, void* task);
+
+typedef struct {
+	pthread_mutex_t lock;
+	deque_t(void*)  tasks;
+} pool_queue_t, *pool_queue_p;
+
+struct pool_s {
+	pool_task_func_t run;
+	void*            private;
+	size_t           worker_count;
+	pool_queue_p     queues;
+	size_t           pending;  // tasks pushed but not done yet (atomic)
+	size_t           steals;
+};
+
+void pool_new(pool_p pool, size_t worker_count, pool_task_func_t run, void* private);
+void pool_destroy(pool_p pool);
+
+void pool_push(pool_p pool, size_t worker, void* task);
+void pool_run(pool_p pool);
@@ -0,0 +1,87 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include "profile.h"
+
+
+bool profile_is_exit_syscall(int64_t number) {
+	// exit and exit_group
+	return number == 60 || number == 231;
+}
+
+// RAX ← time stamp counter
+static void profile_emit_rdtsc(asm_p as) {
+	as_rdtsc(as);
+	as_shl(as, RDX, 32);
+	as_add(as, RAX, RDX);
+}
+
+/**
+ * Counts the call and stores the time stamp in tsc_slot. Has to be emitted
+ * after the in args were moved out of RDX.
+ */
+void profile_emit_enter(asm_p as, asm_arg_t tsc_slot, profile_func_t profile) {
+	as_add(as, memd(profile.entry + offsetof(profile_entry_t, count)), imm(1));
+	as_add(as, memd(profile.entry + offsetof(profile_entry_t, active)), imm(1));
+	profile_emit_rdtsc(as);
+	as_mov(as, tsc_slot, RAX);
+	if (profile.start_tsc != 0)
+		as_mov(as, memd(profile.start_tsc), RAX);
+}
+
+/**
+ * Adds the cycles since profile_emit_enter() to the function. Only the
+ * outermost call of a recursion does that, its cycles include all the others.
+ * Has to be emitted before the out args are put into RAX and RDX.
+ */
+void profile_emit_leave(asm_p as, asm_arg_t tsc_slot, profile_func_t profile) {
+	as_sub(as, memd(profile.entry + offsetof(profile_entry_t, active)), imm(1));
+	asm_jump_slot_t to_end = as_jmp_cc(as, CC_NOT_EQUAL, 0);
+	profile_emit_rdtsc(as);
+	as_sub(as, RAX, tsc_slot);
+	as_add(as, memd(profile.entry + offsetof(profile_entry_t, cycles)), RAX);
+	as_mark_jmp_slot_target(as, to_end);
+}
+
+// Counts a loop iteration, only touches the flags
+void profile_emit_count(asm_p as, size_t entry_vaddr) {
+	as_add(as, memd(entry_vaddr + offsetof(profile_entry_t, count)), imm(1));
+}
+
+/**
+ * Emits the function that is called right before an exit syscall. It writes
+ * the profile table into the file at path_vaddr (a zero terminated string).
+ * All registers are preserved so the syscall args stay in place. Errors are
+ * ignored, the program exits anyway.
+ */
+void profile_emit_exit_func(asm_p as, size_t table_vaddr, size_t table_size, size_t path_vaddr) {
+	asm_arg_t saved_regs[] = { RAX, RDI, RSI, RDX, RCX, R11 };
+	size_t saved_count = sizeof(saved_regs) / sizeof(saved_regs[0]);
+	for(size_t i = 0; i < saved_count; i++)
+		as_push(as, saved_regs[i]);
+	
+	profile_emit_rdtsc(as);
+	as_mov(as, memd(table_vaddr + offsetof(profile_header_t, exit_tsc)), RAX);
+	
+	// fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+	as_mov(as, RAX, imm(2));
+	as_mov(as, RDI, imm(path_vaddr));
+	as_mov(as, RSI, imm(O_WRONLY | O_CREAT | O_TRUNC));
+	as_mov(as, RDX, imm(0644));
+	as_syscall(as);
+	as_cmp(as, RAX, imm(0));
+	asm_jump_slot_t to_end = as_jmp_cc(as, CC_LESS, 0);
+	
+	// write(fd, table, table_size), close(fd)
+	as_mov(as, RDI, RAX);
+	as_mov(as, RAX, imm(1));
+	as_mov(as, RSI, imm(table_vaddr));
+	as_mov(as, RDX, imm(table_size));
+	as_syscall(as);
+	as_mov(as, RAX, imm(3));
+	as_syscall(as);
+	
+	as_mark_jmp_slot_target(as, to_end);
+	for(size_t i = saved_count; i-- > 0; )
+		as_pop(as, saved_regs[i]);
+	as_ret(as, 0);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "asm.h"
+
+
+//
+// Profiling instrumentation
+//
+// Programs compiled with --profile count the calls of each function and the
+// iterations of each loop and sum up the time stamp counter cycles spent in
+// each function (callees included, recursive calls only count once). The
+// counters are a table in the data segment. Right before the program exits (an
+// exit or exit_group syscall with a constant syscall number) the exit function
+// writes the table as it is into a profile file. profile_report prints it.
+//
+// File layout: A profile_header_t followed by entry_count profile_entry_t
+// (little endian, no padding).
+//
+
+#define PROFILE_MAGIC "LGPROF1"
+
+typedef struct {
+	char     magic[8];
+	uint64_t entry_count;
+	uint64_t start_tsc;  // time stamp counter when main was entered
+	uint64_t exit_tsc;   // and when the program exited
+} profile_header_t;
+
+typedef enum {
+	PROFILE_FUNC,
+	PROFILE_LOOP
+} profile_kind_t;
+
+typedef struct {
+	uint64_t kind;
+	uint64_t count;   // calls of a function, iterations of a loop body
+	uint64_t cycles;  // spent in a function, 0 for loops
+	uint64_t active;  // calls of the function that haven't returned yet
+	char     name[40];
+} profile_entry_t;
+
+// What the code generators need to instrument a function
+typedef struct {
+	size_t entry;      // vaddr of the profile_entry_t of the function, 0 if not instrumented
+	size_t start_tsc;  // vaddr of profile_header_t.start_tsc for main, 0 for all other functions
+	void*  exit_func;  // target of the call to the exit function (resolved by the linker)
+} profile_func_t;
+
+bool profile_is_exit_syscall(int64_t number);
+
+// The enter and leave code overwrite RAX, RDX and the flags. tsc_slot is a
+// frame slot the function reserves for the time stamp of its start.
+void profile_emit_enter(asm_p as, asm_arg_t tsc_slot, profile_func_t profile);
+void profile_emit_leave(asm_p as, asm_arg_t tsc_slot, profile_func_t profile);
+void profile_emit_count(asm_p as, size_t entry_vaddr);
+void profile_emit_exit_func(asm_p as, size_t table_vaddr, size_t table_size, size_t path_vaddr);
@@ -0,0 +1,75 @@
+// Prints the profile written by a program compiled with --profile (see
+// profile.h): The functions sorted by the cycles spent in them and the loops
+// sorted by their iterations. Functions and loops that never ran are left out.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+
+
+static int cmp_entries(const void* a, const void* b) {
+	const profile_entry_t* entry_a = a;
+	const profile_entry_t* entry_b = b;
+	if (entry_a->kind != entry_b->kind)
+		return (entry_a->kind > entry_b->kind) - (entry_a->kind < entry_b->kind);
+	// Highest first, functions by cycles and loops by iterations
+	uint64_t value_a = (entry_a->kind == PROFILE_FUNC) ? entry_a->cycles : entry_a->count;
+	uint64_t value_b = (entry_b->kind == PROFILE_FUNC) ? entry_b->cycles : entry_b->count;
+	return (value_a < value_b) - (value_a > value_b);
+}
+
+int main(int argc, char** argv) {
+	const char* filename = (argc > 1) ? argv[1] : "main.prof";
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL) {
+		perror(filename);
+		return 1;
+	}
+	
+	profile_header_t header;
+	if ( fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, PROFILE_MAGIC, sizeof(header.magic)) != 0 ) {
+		fprintf(stderr, "%s: not a profile\n", filename);
+		fclose(f);
+		return 1;
+	}
+	
+	profile_entry_t* entries = calloc(header.entry_count, sizeof(entries[0]));
+	if ( fread(entries, sizeof(entries[0]), header.entry_count, f) != header.entry_count ) {
+		fprintf(stderr, "%s: truncated, expected %lu entries\n", filename, header.entry_count);
+		free(entries);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+	
+	for(size_t i = 0; i < header.entry_count; i++)
+		entries[i].name[sizeof(entries[i].name) - 1] = '\0';
+	qsort(entries, header.entry_count, sizeof(entries[0]), cmp_entries);
+	
+	uint64_t total = header.exit_tsc - header.start_tsc;
+	printf("%lu cycles from the start of main to exit\n\n", total);
+	
+	printf("%-40s %12s %16s %12s %7s\n", "function", "calls", "cycles", "cycles/call", "time");
+	for(size_t i = 0; i < header.entry_count; i++) {
+		profile_entry_t* e = &entries[i];
+		if (e->kind != PROFILE_FUNC || e->count == 0)
+			continue;
+		// Cycles are only added when a function returns, so we don't know them
+		// for functions that were still running at exit (e.g. main)
+		if (e->active > 0)
+			printf("%-40s %12lu %16s\n", e->name, e->count, "running at exit");
+		else
+			printf("%-40s %12lu %16lu %12lu %6.1f%%\n", e->name, e->count, e->cycles, e->cycles / e->count,
+				(total > 0) ? 100.0 * e->cycles / total : 0.0);
+	}
+	
+	printf("\n%-40s %12s\n", "loop", "iterations");
+	for(size_t i = 0; i < header.entry_count; i++) {
+		profile_entry_t* e = &entries[i];
+		if (e->kind == PROFILE_LOOP && e->count > 0)
+			printf("%-40s %12lu\n", e->name, e->count);
+	}
+	
+	free(entries);
+	return 0;
+}
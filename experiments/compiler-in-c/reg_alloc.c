@@ -1,43 +1,86 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "reg_alloc.h"
 
+// Registers handed out for RA_ANY_REG in order of preference. Caller saved
+// registers first since a function has to preserve every callee saved register
+// it uses. Values live across calls avoid the caller saved ones anyway. RSP
+// and RBP are never used since they address the stack frame.
+static const int8_t ra_preferred_regs[] = { 11, 10, 9, 8, 7, 6, 1, 2, 0, 3, 12, 13, 14, 15 };
+#define RA_PREFERRED_REG_COUNT (sizeof(ra_preferred_regs) / sizeof(ra_preferred_regs[0]))
+
 void ra_new(ra_p ra) {
-	ra->allocated_registers = 0;
-	ra->allocated_reg_count = 0;
-	ra->spilled_reg_count = 0;
-	ra->spill_depth = 0;
+	memset(ra, 0, sizeof(*ra));
+	for(size_t i = 0; i < 16; i++)
+		ra->owner[i] = -1;
 }
 
 void ra_destroy(ra_p ra) {
-	ra->allocated_registers = 0;
-	ra->allocated_reg_count = 0;
-	ra->spilled_reg_count = 0;
-	ra->spill_depth = 0;
+	free(ra->intervals);
+	memset(ra, 0, sizeof(*ra));
 }
 
 
-static inline void mark_reg(ra_p ra, uint8_t reg_index) {
-	ra->allocated_registers |= (1 << reg_index);
+/**
+ * Starts the recording compilation of a function. Spill slots are allocated
+ * by growing frame_size (only during the second compilation).
+ */
+void ra_begin_func(ra_p ra, size_t* frame_size) {
+	ra->mode = RA_RECORD;
+	ra->frame_size = frame_size;
+	ra->interval_count = 0;
+	ra->position = 0;
+	ra->next_interval = 0;
+	for(size_t i = 0; i < 16; i++)
+		ra->owner[i] = -1;
 }
 
-static inline void unmark_reg(ra_p ra, uint8_t reg_index) {
-	ra->allocated_registers &= ~(1 << reg_index);
+/**
+ * Looks at all recorded intervals and figures out which registers each
+ * interval should stay away from. Then switches to RA_ASSIGN for the second
+ * compilation of the function. Spill slots are addressed relative to frame_reg.
+ * 
+ * Can be called again to repeat the assignment (e.g. once the compiler knows
+ * which registers the function uses). It hands out the same registers as long
+ * as the code generator does the same allocations.
+ */
+void ra_assign(ra_p ra, int8_t frame_reg) {
+	for(size_t i = 0; i < ra->interval_count; i++) {
+		ra_interval_p interval = &ra->intervals[i];
+		interval->avoid_fixed = 0;
+		
+		// Intervals are ordered by their start. All intervals that start
+		// before this one ends overlap with it.
+		for(size_t j = i + 1; j < ra->interval_count && ra->intervals[j].start < interval->end; j++) {
+			if (ra->intervals[j].fixed_reg != RA_ANY_REG)
+				interval->avoid_fixed |= 1 << ra->intervals[j].fixed_reg;
+		}
+	}
+	
+	ra->mode = RA_ASSIGN;
+	ra->frame_reg = frame_reg;
+	ra->used_regs = 0;
+	ra->position = 0;
+	ra->next_interval = 0;
+	for(size_t i = 0; i < 16; i++)
+		ra->owner[i] = -1;
 }
 
+
 bool ra_reg_allocated(ra_p ra, uint8_t reg_index) {
-	return ((1 << reg_index) & ra->allocated_registers) != 0;
+	return ra->owner[reg_index] != -1;
 }
 
 /**
- * Finds the highest unmarked register but ignores RSP (R4) and RBP (R5) because
- * they're used for addressing of variable access.
+ * Finds a free register (in order of preference) but ignores RSP (R4) and RBP
+ * (R5) because they're used for addressing of variable access.
  */
 int8_t ra_find_free_reg(ra_p ra) {
-	for(int8_t i = 15; i > 0; i--) {
-		if ( !(ra_reg_allocated(ra, i) && i != RSP.reg && i != RBP.reg) )
-			return i;
+	for(size_t i = 0; i < RA_PREFERRED_REG_COUNT; i++) {
+		if ( !ra_reg_allocated(ra, ra_preferred_regs[i]) )
+			return ra_preferred_regs[i];
 	}
 	
 	fprintf(stderr, "ra_find_free_reg(): no free register left!\n");
@@ -45,131 +88,208 @@ int8_t ra_find_free_reg(ra_p ra) {
 	return -1;
 }
 
-
-raa_t ra_alloc_reg(ra_p ra, asm_p as, int8_t reg_index, uint8_t bits) {
-	if (reg_index == -1)
-		reg_index = ra_find_free_reg(ra);
-	
-	raa_t allocation = (raa_t){
-		.reg_index = reg_index,
-		.spill_reg = RA_NO_SPILL,
-		.spill_depth = 0,
-		.bits = bits
-	};
-	if ( ra_reg_allocated(ra, reg_index) ) {
-		ra->spill_depth++;
-		allocation.spill_depth = ra->spill_depth;
-		allocation.spill_reg = RA_STACK_SPILL;
-		as_push(as, reg(reg_index));
-		
-		/*
-		// Spill it (old code, spilled into free registers, doesn't work for recursive functions)
-		allocation.spill_reg = ra_find_free_reg(ra);
-		as_mov(as, reg(allocation.spill_reg), reg(reg_index));
-		
-		// Mark the spill register as allocated
-		mark_reg(ra, allocation.spill_reg);
-		*/
-		
-		//printf("ALLOC r%d spill into r%d\n", reg_index, allocation.spill_reg);
-		ra->spilled_reg_count++;
-	} else {
-		// No need to spill, but mark the requested reg as allocated since it
-		// isn't yet
-		mark_reg(ra, reg_index);
-		
-		//printf("ALLOC r%d\n", reg_index);
-		ra->allocated_reg_count++;
+// Picks a register for an RA_ANY_REG interval during RA_ASSIGN. prefered_reg
+// is the register the value is currently in (when moved by ra_move_to()).
+static int8_t ra_pick_reg(ra_p ra, ra_interval_p interval, int8_t prefered_reg) {
+	// Take the hint if it doesn't get in the way of anything, that saves the
+	// move into the hinted register at the end of the interval. Same for the
+	// register the value is already in.
+	uint16_t avoid = interval->avoid_fixed;
+	if ( interval->hint != -1 && !ra_reg_allocated(ra, interval->hint) && !(avoid & (1 << interval->hint)) )
+		return interval->hint;
+	if ( prefered_reg != -1 && !ra_reg_allocated(ra, prefered_reg) && !(avoid & (1 << prefered_reg)) )
+		return prefered_reg;
+	
+	// Free registers without conflicts first, then ones that will be spilled
+	// later on
+	for(size_t m = 0; m < 2; m++) {
+		for(size_t i = 0; i < RA_PREFERRED_REG_COUNT; i++) {
+			int8_t reg_index = ra_preferred_regs[i];
+			if ( !ra_reg_allocated(ra, reg_index) && (m == 1 || !(avoid & (1 << reg_index))) )
+				return reg_index;
+		}
 	}
 	
-	return allocation;
+	// No free register at all, spill the interval that lives the longest
+	int8_t victim = -1;
+	for(size_t i = 0; i < RA_PREFERRED_REG_COUNT; i++) {
+		int8_t reg_index = ra_preferred_regs[i];
+		if ( victim == -1 || ra->intervals[ra->owner[reg_index]].end > ra->intervals[ra->owner[victim]].end )
+			victim = reg_index;
+	}
+	return victim;
 }
 
-void ra_free_reg(ra_p ra, asm_p as, raa_t allocation) {
-	if (allocation.spill_reg != RA_NO_SPILL) {
-		// We only do RA_STACK_SPILL right now
-		if (allocation.spill_reg != RA_STACK_SPILL) {
-			fprintf(stderr, "ra_free_reg(): can only handle stack spills for now!\n");
-			abort();
+// Spills the current owner of the register (if any) into a new stack frame slot
+static void ra_evict(ra_p ra, asm_p as, size_t interval_index, int8_t reg_index) {
+	ra_interval_p interval = &ra->intervals[interval_index];
+	interval->evicted = ra->owner[reg_index];
+	if (interval->evicted == -1)
+		return;
+	
+	ra_interval_p victim = &ra->intervals[interval->evicted];
+	*ra->frame_size += 8;
+	victim->spill_displ = -(int64_t)*ra->frame_size;
+	victim->in_memory = true;
+	as_mov(as, memrd(reg(ra->frame_reg), victim->spill_displ), reg(reg_index));
+	ra->spill_count++;
+}
+
+static raa_t ra_alloc(ra_p ra, asm_p as, int8_t reg_index, uint8_t bits, int8_t prefered_reg) {
+	size_t index;
+	if (ra->mode == RA_RECORD) {
+		if (ra->interval_count == ra->interval_cap) {
+			ra->interval_cap = (ra->interval_cap == 0) ? 16 : ra->interval_cap * 2;
+			ra->intervals = realloc(ra->intervals, ra->interval_cap * sizeof(ra->intervals[0]));
 		}
+		index = ra->interval_count++;
+		ra->intervals[index] = (ra_interval_t){
+			.start = ra->position,
+			.end = SIZE_MAX,
+			.fixed_reg = reg_index,
+			.hint = -1,
+			.evicted = -1
+		};
+		ra->position++;
 		
-		if (allocation.spill_depth != ra->spill_depth) {
-			fprintf(stderr, "ra_free_reg(): wrong spill depth! Expected %zu, got %zu. Make sure you free regs in the same order as you allocated them.\n",
-				ra->spill_depth, allocation.spill_depth);
+		// Hand out something plausible so the code generator can continue,
+		// the code of this compilation is thrown away anyway.
+		if (reg_index == RA_ANY_REG)
+			reg_index = ra_find_free_reg(ra);
+		ra->owner[reg_index] = index;
+	} else {
+		index = ra->next_interval++;
+		if (index >= ra->interval_count || ra->intervals[index].fixed_reg != reg_index) {
+			fprintf(stderr, "ra_alloc_reg(): allocation doesn't match the recorded one! Make sure the code "
+				"generator does the same allocations when a function is compiled twice.\n");
 			abort();
 		}
 		
-		as_pop(as, reg(allocation.reg_index));
-		
-		/*
-		// Old spill restore code from registers, doesn't work for recursive functions
-		as_mov(as, reg(allocation.reg_index), reg(allocation.spill_reg));
-		unmark_reg(ra, allocation.spill_reg);
-		*/
+		ra_interval_p interval = &ra->intervals[index];
+		if (reg_index == RA_ANY_REG)
+			reg_index = ra_pick_reg(ra, interval, prefered_reg);
+		ra_evict(ra, as, index, reg_index);
 		
-		//printf("FREE r%d restore from r%d\n", allocation.reg_index, allocation.spill_reg);
-		ra->spilled_reg_count--;
-	} else if (allocation.reg_index != -1) {
-		unmark_reg(ra, allocation.reg_index);
+		interval->reg = reg_index;
+		interval->active = true;
+		interval->in_memory = false;
+		ra->owner[reg_index] = index;
+		ra->used_regs |= 1 << reg_index;
+	}
+	
+	return (raa_t){ .reg_index = reg_index, .bits = bits, .interval = index };
+}
+
+raa_t ra_alloc_reg(ra_p ra, asm_p as, int8_t reg_index, uint8_t bits) {
+	return ra_alloc(ra, as, reg_index, bits, -1);
+}
+
+void ra_free_reg(ra_p ra, asm_p as, raa_t allocation) {
+	if (allocation.reg_index == -1)
+		return;
+	
+	ra_interval_p interval = &ra->intervals[allocation.interval];
+	if (ra->mode == RA_RECORD) {
+		interval->end = ra->position++;
+		if (ra->owner[allocation.reg_index] == (ssize_t)allocation.interval)
+			ra->owner[allocation.reg_index] = -1;
+		return;
+	}
+	
+	interval->active = false;
+	// The value is in a spill slot, the register belongs to someone else now
+	if (interval->in_memory)
+		return;
+	
+	// Reload the most recently spilled value that is still needed
+	int8_t reg_index = interval->reg;
+	ssize_t evicted = interval->evicted;
+	while (evicted != -1 && !ra->intervals[evicted].active)
+		evicted = ra->intervals[evicted].evicted;
+	
+	ra->owner[reg_index] = evicted;
+	if (evicted != -1) {
+		ra->intervals[evicted].in_memory = false;
+		as_mov(as, reg(reg_index), memrd(reg(ra->frame_reg), ra->intervals[evicted].spill_displ));
+		ra->reload_count++;
+	}
+}
+
+/**
+ * Moves the value of an allocation into the requested register. The old
+ * allocation is freed first so the assignment can put the value into the
+ * requested register right away (the move is omitted then).
+ * 
+ * With RA_ANY_REG the value gets a new interval that stays in the current
+ * register if possible. Use it for results that are kept around while other
+ * code is generated. Otherwise a value in a fixed register (e.g. the RAX result
+ * of a MUL) would get spilled by the next request for that register.
+ */
+raa_t ra_move_to(ra_p ra, asm_p as, raa_t allocation, int8_t reg_index) {
+	// Remember where the value ends up, the assignment tries to put it there
+	// right away
+	if (ra->mode == RA_RECORD)
+		ra->intervals[allocation.interval].hint = reg_index;
+	
+	bool in_memory = (ra->mode == RA_ASSIGN) && ra->intervals[allocation.interval].in_memory;
+	int64_t spill_displ = ra->intervals[allocation.interval].spill_displ;
+	
+	// Freeing the allocation would reload a value that was spilled for it (e.g.
+	// when a call result is moved out of RAX). Then the move has to happen
+	// before the register is handed back.
+	ssize_t evicted = in_memory ? -1 : ra->intervals[allocation.interval].evicted;
+	while (ra->mode == RA_ASSIGN && evicted != -1 && !ra->intervals[evicted].active)
+		evicted = ra->intervals[evicted].evicted;
+	if (ra->mode == RA_ASSIGN && evicted != -1) {
+		if (reg_index == allocation.reg_index) {
+			// Value is already in place, the new interval takes over the
+			// register along with the values waiting for it
+			ra->intervals[allocation.interval].active = false;
+			ra->owner[reg_index] = -1;
+			raa_t target = ra_alloc(ra, as, reg_index, allocation.bits, -1);
+			ra->intervals[target.interval].evicted = ra->intervals[allocation.interval].evicted;
+			return target;
+		}
 		
-		//printf("FREE r%d\n", allocation.reg_index);
-		ra->allocated_reg_count--;
+		raa_t target = ra_alloc(ra, as, reg_index, allocation.bits, -1);
+		as_mov(as, reg(target.reg_index), reg(allocation.reg_index));
+		ra_free_reg(ra, as, allocation);
+		return target;
 	}
+	
+	ra_free_reg(ra, as, allocation);
+	raa_t target = ra_alloc(ra, as, reg_index, allocation.bits, allocation.reg_index);
+	
+	if (in_memory)
+		as_mov(as, reg(target.reg_index), memrd(RBP, spill_displ));
+	else if (target.reg_index != allocation.reg_index)
+		as_mov(as, reg(target.reg_index), reg(allocation.reg_index));
+	return target;
 }
 
 void ra_ensure(ra_p ra, uint8_t allocated_reg_count, size_t spilled_reg_count) {
-	if (ra->allocated_reg_count != allocated_reg_count || ra->spilled_reg_count != spilled_reg_count) {
+	if (ra->mode == RA_RECORD)
+		return;
+	
+	uint8_t allocated = 0;
+	size_t spilled = 0;
+	for(size_t i = 0; i < ra->next_interval; i++) {
+		if (ra->intervals[i].active && ra->intervals[i].in_memory)
+			spilled++;
+		else if (ra->intervals[i].active)
+			allocated++;
+	}
+	
+	if (allocated != allocated_reg_count || spilled != spilled_reg_count) {
 		fprintf(stderr, "ra_ensure(): unexpected number of registerd allocated or spilled! "
 			"Allocated: %u (%u expected) Spilled: %zu (%zu expected)\n",
-			ra->allocated_reg_count, allocated_reg_count,
-			ra->spilled_reg_count, spilled_reg_count
+			allocated, allocated_reg_count,
+			spilled, spilled_reg_count
 		);
 		abort();
 	}
 }
 
 raa_t ra_empty() {
-	return (raa_t){ -1, RA_NO_SPILL, 0, 0 };
-}
-
-
-/*
-int main() {
-	ra_p ra = &(ra_t){ 0 };
-	ra_new(ra);
-	asm_p as = &(asm_t){ 0 };
-	as_new(as);
-	
-	raa_t a1 = ra_alloc_reg(ra, as, RAX.reg);
-		raa_t a2 = ra_alloc_reg(ra, as, RAX.reg);
-			raa_t a3 = ra_alloc_reg(ra, as, RAX.reg);
-			raa_t a31 = ra_alloc_reg(ra, as, RAX.reg);
-			raa_t a32 = ra_alloc_reg(ra, as, RDI.reg);
-			raa_t a33 = ra_alloc_reg(ra, as, RSI.reg);
-			raa_t a34 = ra_alloc_reg(ra, as, RDX.reg);
-			raa_t a35 = ra_alloc_reg(ra, as, RCX.reg);
-			raa_t a36 = ra_alloc_reg(ra, as, R8.reg);
-			raa_t a37 = ra_alloc_reg(ra, as, R9.reg);
-			raa_t a38 = ra_alloc_reg(ra, as, R10.reg);
-			raa_t a39 = ra_alloc_reg(ra, as, R11.reg);
-			
-			
-			ra_free_reg(ra, as, a39);
-			ra_free_reg(ra, as, a38);
-			ra_free_reg(ra, as, a37);
-			ra_free_reg(ra, as, a36);
-			ra_free_reg(ra, as, a35);
-			ra_free_reg(ra, as, a34);
-			ra_free_reg(ra, as, a33);
-			ra_free_reg(ra, as, a32);
-			ra_free_reg(ra, as, a31);
-			ra_free_reg(ra, as, a3);
-		ra_free_reg(ra, as, a2);
-	ra_free_reg(ra, as, a1);
-	
-	as_save_code(as, "ra_instructions.raw");
-	as_destroy(as);
-	ra_destroy(ra);
-	return 0;
+	return (raa_t){ -1, 0, 0 };
 }
-*/
\ No newline at end of file
@@ -1,11 +1,53 @@
 #pragma once
+#include <stdbool.h>
+#include <sys/types.h>
 #include "asm.h"
 
+//
+// Linear scan register allocator
+//
+// Each function is compiled twice. The first time (RA_RECORD) the allocator
+// just records the live interval of every allocation, which registers were
+// requested explicitly (e.g. RAX and RDX for MUL and DIV, the syscall and
+// call registers). The assignment then hands out registers in the same order
+// during the second compilation (RA_ASSIGN) but picks free registers that
+// aren't needed by a fixed request during the interval. When there is no way
+// around it the current owner of a register is spilled into a stack frame slot
+// and reloaded once the register is free again. Calls request all caller saved
+// registers that way, so values live across a call end up in callee saved
+// registers (or are saved around the call).
+//
+
+typedef enum {
+	RA_RECORD,
+	RA_ASSIGN
+} ra_mode_t;
+
 typedef struct {
-	uint16_t allocated_registers;
-	uint8_t allocated_reg_count;
-	size_t spilled_reg_count;
-	size_t spill_depth;
+	size_t   start, end;    // positions of the alloc and free events
+	int8_t   fixed_reg;     // requested register or RA_ANY_REG
+	int8_t   hint;          // register the value is moved into right after its end, -1 if none
+	uint16_t avoid_fixed;   // registers requested by intervals starting during this one
+	
+	int8_t   reg;           // assigned register
+	bool     active, in_memory;
+	int64_t  spill_displ;   // frame displacement of the spill slot (if in_memory)
+	ssize_t  evicted;       // interval that was spilled to make room for this one, -1 if none
+} ra_interval_t, *ra_interval_p;
+
+typedef struct {
+	ra_mode_t mode;
+	size_t* frame_size;  // stack frame size of the current function, spill slots are allocated there
+	int8_t frame_reg;    // register spill slots are addressed with (RBP or RSP)
+	uint16_t used_regs;  // registers handed out during RA_ASSIGN
+	
+	ra_interval_p intervals;
+	size_t interval_count, interval_cap;
+	size_t position, next_interval;
+	ssize_t owner[16];   // interval currently holding a register, -1 if free
+	
+	// Statistics over all functions
+	size_t spill_count, reload_count;
 } ra_t, *ra_p;
 
 void ra_new(ra_p ra);
@@ -13,18 +55,19 @@ void ra_destroy(ra_p ra);
 
 typedef struct {
 	int8_t reg_index;
-	int8_t spill_reg;
-	size_t spill_depth;
 	uint8_t bits;
+	size_t interval;
 } raa_t, *raa_p;
 
 #define RA_ANY_REG -1
-#define RA_NO_SPILL    -1
-#define RA_STACK_SPILL -2
+
+void  ra_begin_func(ra_p ra, size_t* frame_size);
+void  ra_assign(ra_p ra, int8_t frame_reg);
 
 raa_t ra_alloc_reg(ra_p ra, asm_p as, int8_t reg_index, uint8_t bits);
 void  ra_free_reg(ra_p ra, asm_p as, raa_t allocation);
+raa_t ra_move_to(ra_p ra, asm_p as, raa_t allocation, int8_t reg_index);
 void  ra_ensure(ra_p ra, uint8_t allocated_reg_count, size_t spilled_reg_count);
 bool  ra_reg_allocated(ra_p ra, uint8_t reg_index);
 raa_t ra_empty();
-int8_t ra_find_free_reg(ra_p ra);
\ No newline at end of file
+int8_t ra_find_free_reg(ra_p ra);
@@ -139,6 +139,13 @@ void test_basic_instructions() {
 		"syscall \n"
 	);
 	
+	as_clear(as);
+		as_rdtsc(as);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"rdtsc  \n"
+	);
+	
 	as_clear(as);
 		for(size_t i = 0; i < 16; i++)
 			as_mov(as, reg(i), imm(0x1122334455667788));
@@ -334,6 +341,39 @@ void test_arithmetic_instructions() {
 		"div    QWORD PTR [r15+0xbeba]\n"
 	);
 	
+	as_clear(as);
+		as_and(as, RAX, RCX);
+		as_and(as, R15, imm(0x7abbccdd));
+		as_shl(as, RCX, 3);
+		as_shl(as, R12, 63);
+		as_shr(as, RDX, 1);
+		as_shr(as, R13, 17);
+		as_imul(as, RAX, RAX, 0x7abbccdd);
+		as_imul(as, R9, RSI, 10);
+		as_lea(as, RAX, RAX, RAX, 2, 0);
+		as_lea(as, R15, R15, R15, 8, 0);
+		as_lea(as, RCX, RBP, R13, 4, 0);
+		as_lea(as, R8, R13, RDI, 1, 0);
+		as_lea(as, RDX, RSI, R10, 1, -8);
+		as_lea(as, R11, R12, RBX, 1, 0x7abbccdd);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"and    rax,rcx\n"
+		"and    r15,0x7abbccdd\n"
+		"shl    rcx,0x3\n"
+		"shl    r12,0x3f\n"
+		"shr    rdx,0x1\n"
+		"shr    r13,0x11\n"
+		"imul   rax,rax,0x7abbccdd\n"
+		"imul   r9,rsi,0xa\n"
+		"lea    rax,[rax+rax*2]\n"
+		"lea    r15,[r15+r15*8]\n"
+		"lea    rcx,[rbp+r13*4+0x0]\n"
+		"lea    r8,[r13+rdi*1+0x0]\n"
+		"lea    rdx,[rsi+r10*1-0x8]\n"
+		"lea    r11,[r12+rbx*1+0x7abbccdd]\n"
+	);
+	
 	free(disassembly);
 }
 
@@ -517,6 +557,19 @@ void test_compare_instructions() {
 		"cmp    r15,0x11223344\n"
 	);
 	
+	// Small immediates use the imm8 form
+	as_clear(as);
+		as_cmp(as, RAX, imm(0));
+		as_cmp(as, R9, imm(0x7f));
+		as_cmp(as, R9, imm(0x80));
+	st_check_int(as->code_len, 4 + 4 + 7);
+	disassembly = disassemble(as);
+	st_check_str(disassembly,
+		"cmp    rax,0x0\n"
+		"cmp    r9,0x7f\n"
+		"cmp    r9,0x80\n"
+	);
+	
 	free(disassembly);
 }
 
@@ -0,0 +1,46 @@
+// Measures how long it takes to compile a module with a lot of functions.
+// main calls every function directly so all of them end up in the compile
+// queue at once. Popping that queue used to be O(n) per function.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double current_time() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+	size_t func_count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+	const char* filename = "compile_queue_bench.lg";
+	
+	FILE* f = fopen(filename, "w");
+	fprintf(f, "func main {\n");
+	for(size_t i = 0; i < func_count; i++)
+		fprintf(f, "\tf%zu(%zu)\n", i, i);
+	fprintf(f, "\tsyscall(60, 0)\n");
+	fprintf(f, "}\n\n");
+	for(size_t i = 0; i < func_count; i++)
+		fprintf(f, "func f%zu in(ulong a) {\n\tvar x = a + 1\n}\n", i);
+	fclose(f);
+	
+	char command[512];
+	snprintf(command, sizeof(command), "./main %s > /dev/null 2>&1", filename);
+	
+	double start = current_time();
+	int status = system(command);
+	double duration = current_time() - start;
+	
+	remove(filename);
+	remove("main.elf");
+	
+	if (status != 0) {
+		fprintf(stderr, "compile_queue_bench: compiler failed with status %d\n", status);
+		return 1;
+	}
+	
+	printf("compiled %zu functions in %.3f s\n", func_count, duration);
+	return 0;
+}
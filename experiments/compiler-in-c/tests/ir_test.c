@@ -0,0 +1,269 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include "../ir.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+#include "utils.c"
+
+
+//
+// Helper functions
+//
+
+size_t live_block_count(ir_func_p f) {
+	size_t count = 0;
+	for(uint32_t b = f->first_block; b != IR_NO_BLOCK; b = ir_block(f, b)->next)
+		count++;
+	return count;
+}
+
+
+//
+// Test cases
+//
+
+void test_remove_unreachable_blocks_and_trivial_phis() {
+	ir_func_t f;
+	ir_new(&f, "test", 4, 1, 1);
+	
+	// b0 jumps to b2, b1 is unreachable but still jumps to b2. Once b1 is gone
+	// the phi in b2 only has one operand left.
+	uint32_t b0 = ir_block_new(&f), b1 = ir_block_new(&f), b2 = ir_block_new(&f);
+	ir_val_t arg = ir_in_arg(&f, b0, IR_U64, 0);
+	ir_jmp(&f, b0, b2);
+	ir_val_t dead = ir_const(&f, b1, IR_U64, 7);
+	ir_jmp(&f, b1, b2);
+	ir_val_t phi = ir_phi(&f, b2, IR_U64);
+	ir_list_append(&f, &ir_instr(&f, phi)->args, arg);
+	ir_list_append(&f, &ir_instr(&f, phi)->args, dead);
+	ir_ret(&f, b2, &phi, 1);
+	ir_verify(&f, "building");
+	
+	st_check( ir_remove_unreachable_blocks(&f) );
+	st_check( ir_block(&f, b1)->removed );
+	st_check_int(live_block_count(&f), 2);
+	st_check_int(ir_block(&f, b2)->preds.len, 1);
+	st_check_int(ir_instr(&f, phi)->args.len, 1);
+	
+	st_check( ir_remove_trivial_phis(&f) );
+	st_check_int(ir_instr(&f, phi)->op, IR_NOP);
+	st_check_int(ir_arg(&f, ir_block(&f, b2)->last, 0), arg);
+	ir_verify(&f, "test");
+	
+	// Nothing left to do
+	st_check( !ir_remove_unreachable_blocks(&f) );
+	st_check( !ir_remove_trivial_phis(&f) );
+	
+	ir_destroy(&f);
+}
+
+void test_split_critical_edges() {
+	ir_func_t f;
+	ir_new(&f, "test", 4, 1, 1);
+	
+	// b0 branches to b1 or directly to b2, the edge b0 -> b2 is critical since
+	// b0 has two successors and b2 has two predecessors with a phi
+	uint32_t b0 = ir_block_new(&f), b1 = ir_block_new(&f), b2 = ir_block_new(&f);
+	ir_val_t arg = ir_in_arg(&f, b0, IR_U64, 0);
+	ir_branch(&f, b0, arg, b1, b2);
+	ir_val_t one = ir_const(&f, b1, IR_U64, 1);
+	ir_jmp(&f, b1, b2);
+	ir_val_t phi = ir_phi(&f, b2, IR_U64);
+	ir_list_append(&f, &ir_instr(&f, phi)->args, arg);
+	ir_list_append(&f, &ir_instr(&f, phi)->args, one);
+	ir_ret(&f, b2, &phi, 1);
+	ir_verify(&f, "building");
+	
+	st_check( ir_split_critical_edges(&f) );
+	ir_verify(&f, "test");
+	st_check_int(f.block_count, 4);
+	
+	// The new block sits between b0 and b2
+	uint32_t split = ir_instr(&f, ir_block(&f, b0)->last)->targets[1];
+	st_check(split != b2);
+	st_check_int(ir_instr(&f, ir_block(&f, split)->last)->op, IR_JMP);
+	st_check_int(ir_instr(&f, ir_block(&f, split)->last)->targets[0], b2);
+	st_check_int(ir_list_ptr(&f, ir_block(&f, b2)->preds)[0], split);
+	
+	st_check( !ir_split_critical_edges(&f) );
+	ir_destroy(&f);
+}
+
+void test_fold_constants_and_remove_dead_values() {
+	ir_func_t f;
+	ir_new(&f, "test", 4, 1, 1);
+	
+	// if 2 < 1 then b1 else b2, b2 returns the arg. The sum is never used.
+	uint32_t b0 = ir_block_new(&f), b1 = ir_block_new(&f), b2 = ir_block_new(&f);
+	ir_val_t arg = ir_in_arg(&f, b0, IR_U64, 0);
+	ir_val_t two = ir_const(&f, b0, IR_U64, 2), one = ir_const(&f, b0, IR_U64, 1);
+	ir_val_t unused = ir_binary(&f, b0, IR_ADD, IR_U64, arg, two);
+	ir_val_t cond = ir_binary(&f, b0, IR_LT, IR_U64, two, one);
+	ir_branch(&f, b0, cond, b1, b2);
+	ir_ret(&f, b1, &one, 1);
+	ir_ret(&f, b2, &arg, 1);
+	ir_verify(&f, "building");
+	
+	st_check( ir_fold_constants(&f) );
+	st_check_int(ir_instr(&f, cond)->op, IR_CONST);
+	st_check_int(ir_instr(&f, cond)->imm, 0);
+	st_check_int(ir_instr(&f, ir_block(&f, b0)->last)->op, IR_JMP);
+	st_check_int(ir_instr(&f, ir_block(&f, b0)->last)->targets[0], b2);
+	st_check_int(ir_block(&f, b1)->preds.len, 0);
+	ir_verify(&f, "test");
+	
+	st_check( ir_remove_unreachable_blocks(&f) );
+	st_check( ir_remove_dead_values(&f) );
+	st_check_int(ir_instr(&f, unused)->op, IR_NOP);
+	st_check_int(ir_instr(&f, cond)->op, IR_NOP);
+	st_check_int(ir_instr(&f, arg)->op, IR_ARG);
+	ir_verify(&f, "test");
+	st_check( !ir_remove_dead_values(&f) );
+	
+	ir_destroy(&f);
+}
+
+void test_inline_call() {
+	// Callee: if a < 5 return 1 else return a
+	ir_func_t callee;
+	ir_new(&callee, "callee", 6, 1, 1);
+	uint32_t c0 = ir_block_new(&callee), c1 = ir_block_new(&callee), c2 = ir_block_new(&callee);
+	ir_val_t a = ir_in_arg(&callee, c0, IR_U64, 0);
+	ir_val_t one = ir_const(&callee, c0, IR_U64, 1);
+	ir_val_t cond = ir_binary(&callee, c0, IR_LT, IR_U64, a, ir_const(&callee, c0, IR_U64, 5));
+	ir_branch(&callee, c0, cond, c1, c2);
+	ir_ret(&callee, c1, &one, 1);
+	ir_ret(&callee, c2, &a, 1);
+	ir_verify(&callee, "building");
+	
+	// Caller: return callee(3) + 10
+	ir_func_t f;
+	ir_new(&f, "caller", 6, 0, 1);
+	uint32_t b0 = ir_block_new(&f);
+	ir_val_t three = ir_const(&f, b0, IR_U64, 3);
+	ir_val_t call = ir_call(&f, b0, IR_U64, &callee, 1, &three, 1);
+	ir_val_t sum = ir_binary(&f, b0, IR_ADD, IR_U64, call, ir_const(&f, b0, IR_U64, 10));
+	ir_ret(&f, b0, &sum, 1);
+	ir_verify(&f, "building");
+	
+	ir_inline_call(&f, call, &callee);
+	ir_verify(&f, "inlining");
+	st_check_int(ir_instr(&f, call)->op, IR_NOP);
+	st_check_int(ir_inline_cost(&callee), 4);
+	
+	// Both returns end up in a phi that is used instead of the call
+	ir_val_t phi = ir_arg(&f, sum, 0);
+	st_check_int(ir_instr(&f, phi)->op, IR_PHI);
+	st_check_int(ir_instr(&f, phi)->args.len, 2);
+	
+	// With the constant arg only the "return 1" case is left, 1 + 10 is folded
+	ir_stats_t stats = { 0 };
+	ir_run_passes(&f, ir_default_passes, ir_default_pass_count, &stats);
+	st_check_int(live_block_count(&f), 1);
+	ir_val_t result = ir_arg(&f, ir_block(&f, f.first_block)->last, 0);
+	st_check_int(ir_instr(&f, result)->op, IR_CONST);
+	st_check_int(ir_instr(&f, result)->imm, 11);
+	
+	ir_destroy(&f);
+	ir_destroy(&callee);
+}
+
+void test_loop_optimizations() {
+	// sum = 0; i = 0; while i < n { sum = sum + i * k + n * k; i = i + 1 }
+	ir_func_t f;
+	ir_new(&f, "kernel", 6, 2, 1);
+	uint32_t entry = ir_block_new(&f), body = ir_block_new(&f), cond = ir_block_new(&f), end = ir_block_new(&f);
+	ir_val_t n = ir_in_arg(&f, entry, IR_U64, 0), k = ir_in_arg(&f, entry, IR_U64, 1);
+	ir_val_t zero = ir_const(&f, entry, IR_U64, 0), one = ir_const(&f, entry, IR_U64, 1);
+	ir_jmp(&f, entry, cond);
+	
+	ir_val_t i = ir_phi(&f, cond, IR_U64), sum = ir_phi(&f, cond, IR_U64);
+	ir_val_t invariant = ir_binary(&f, body, IR_MUL, IR_U64, n, k);
+	ir_val_t product = ir_binary(&f, body, IR_MUL, IR_U64, i, k);
+	ir_val_t partial_sum = ir_binary(&f, body, IR_ADD, IR_U64, sum, product);
+	ir_val_t next_sum = ir_binary(&f, body, IR_ADD, IR_U64, partial_sum, invariant);
+	ir_val_t next_i = ir_binary(&f, body, IR_ADD, IR_U64, i, one);
+	ir_jmp(&f, body, cond);
+	
+	ir_list_append(&f, &ir_instr(&f, i)->args, zero);
+	ir_list_append(&f, &ir_instr(&f, i)->args, next_i);
+	ir_list_append(&f, &ir_instr(&f, sum)->args, zero);
+	ir_list_append(&f, &ir_instr(&f, sum)->args, next_sum);
+	ir_branch(&f, cond, ir_binary(&f, cond, IR_LT, IR_U64, i, n), body, end);
+	ir_ret(&f, end, &sum, 1);
+	ir_verify(&f, "building");
+	
+	// n * k is computed once before the loop
+	st_check( ir_hoist_loop_invariants(&f) );
+	ir_verify(&f, "test");
+	st_check_int(ir_instr(&f, invariant)->block, entry);
+	st_check_int(ir_instr(&f, product)->block, body);
+	
+	// i * k becomes a phi in the loop header that is increased by k
+	st_check( ir_reduce_induction_vars(&f) );
+	ir_verify(&f, "test");
+	st_check_int(ir_instr(&f, product)->op, IR_NOP);
+	ir_val_t reduced = ir_arg(&f, partial_sum, 1);
+	st_check_int(ir_instr(&f, reduced)->op, IR_PHI);
+	st_check_int(ir_instr(&f, reduced)->block, cond);
+	ir_val_t reduced_next = ir_arg(&f, reduced, 1);
+	st_check_int(ir_instr(&f, reduced_next)->op, IR_ADD);
+	st_check_int(ir_instr(&f, reduced_next)->block, body);
+	
+	ir_destroy(&f);
+}
+
+void test_compile_loop() {
+	// Sums up 1 to 10 in a loop and exits with the result
+	ir_func_t f;
+	ir_new(&f, "main", 4, 0, 0);
+	uint32_t entry = ir_block_new(&f), body = ir_block_new(&f), cond = ir_block_new(&f), end = ir_block_new(&f);
+	
+	ir_val_t zero = ir_const(&f, entry, IR_U64, 0);
+	ir_val_t one = ir_const(&f, entry, IR_U64, 1);
+	ir_jmp(&f, entry, cond);
+	
+	ir_val_t i = ir_phi(&f, cond, IR_U64), sum = ir_phi(&f, cond, IR_U64);
+	ir_val_t next_sum = ir_binary(&f, body, IR_ADD, IR_U64, sum, i);
+	ir_val_t next_i = ir_binary(&f, body, IR_ADD, IR_U64, i, one);
+	ir_jmp(&f, body, cond);
+	
+	// Predecessors of cond are entry and body (in that order)
+	ir_list_append(&f, &ir_instr(&f, i)->args, one);
+	ir_list_append(&f, &ir_instr(&f, i)->args, next_i);
+	ir_list_append(&f, &ir_instr(&f, sum)->args, zero);
+	ir_list_append(&f, &ir_instr(&f, sum)->args, next_sum);
+	ir_val_t ten = ir_const(&f, cond, IR_U64, 10);
+	ir_branch(&f, cond, ir_binary(&f, cond, IR_LE, IR_U64, i, ten), body, end);
+	
+	ir_val_t exit_args[] = { ir_const(&f, end, IR_U64, 60), sum };
+	ir_append(&f, end, IR_SYSCALL, IR_U64, exit_args, 2);
+	ir_ret(&f, end, NULL, 0);
+	
+	ir_stats_t stats = { 0 };
+	ir_run_passes(&f, ir_default_passes, ir_default_pass_count, &stats);
+	
+	asm_p as = &(asm_t){ 0 };
+	as_new(as);
+	ir_compile(&f, as, &stats);
+	st_check_int(f.call_slots.len, 0);
+	st_check_int(stats.spilled_values, 0);
+	as_save_elf(as, "test_compile_loop.elf");
+	as_destroy(as);
+	ir_destroy(&f);
+	
+	int status_code = run_and_delete("test_compile_loop.elf", "./test_compile_loop.elf", NULL);
+	st_check_int(status_code, 55);
+}
+
+
+int main() {
+	st_run(test_remove_unreachable_blocks_and_trivial_phis);
+	st_run(test_split_critical_edges);
+	st_run(test_fold_constants_and_remove_dead_values);
+	st_run(test_inline_call);
+	st_run(test_loop_optimizations);
+	st_run(test_compile_loop);
+	return st_show_report();
+}
@@ -0,0 +1,115 @@
+// For open_memstream
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../linker.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+
+//
+// Helper functions
+//
+
+// Four functions that call each other RELOC_COUNT times. Relocation k is the
+// 32 bit displacement at code offset 4k. They're spread over the functions
+// round robin so the relocation list isn't sorted by offset.
+#define FUNC_COUNT  4
+#define RELOC_COUNT 200
+
+node_p funcs[FUNC_COUNT];
+uint8_t code[RELOC_COUNT * 4];
+
+void build_funcs() {
+	char* names[FUNC_COUNT] = { "a", "b", "c", "d" };
+	for(size_t i = 0; i < FUNC_COUNT; i++) {
+		funcs[i] = node_alloc(NT_FUNC);
+		funcs[i]->func.name = str_from_c(names[i]);
+		funcs[i]->func.as_offset = 1000 * (i + 1);
+	}
+	
+	for(size_t k = 0; k < RELOC_COUNT; k++) {
+		node_addr_slot_t slot = { .offset = 4 * k, .target = funcs[(k * 7) % FUNC_COUNT] };
+		list_append(&funcs[k % FUNC_COUNT]->func.addr_slots, slot);
+	}
+	memset(code, 0, sizeof(code));
+}
+
+// True if every displacement points to its target
+bool all_relocs_patched() {
+	for(size_t k = 0; k < RELOC_COUNT; k++) {
+		int32_t displ;
+		memcpy(&displ, code + 4 * k, sizeof(displ));
+		int32_t expected = funcs[(k * 7) % FUNC_COUNT]->func.as_offset - (4 * k + 4);
+		if (displ != expected)
+			return false;
+	}
+	return true;
+}
+
+
+//
+// Test cases
+//
+
+void test_single_chunk() {
+	build_funcs();
+	link_stats_t stats = { 0 };
+	st_check( link_funcs(funcs, FUNC_COUNT, code, LINK_CHUNK_SIZE, stderr, &stats) );
+	st_check_int(stats.relocations, RELOC_COUNT);
+	st_check_int(stats.threads, 1);
+	st_check_int(stats.unresolved, 0);
+	st_check( all_relocs_patched() );
+	for(size_t i = 0; i < FUNC_COUNT; i++)
+		st_check( funcs[i]->func.linked );
+}
+
+void test_multiple_chunks() {
+	// 200 / 64 = 3 threads, 200 / 16 = 12 threads but limited to LINK_MAX_THREADS
+	size_t chunk_sizes[] = { 64, 16 };
+	size_t thread_counts[] = { 3, LINK_MAX_THREADS };
+	for(size_t i = 0; i < 2; i++) {
+		build_funcs();
+		link_stats_t stats = { 0 };
+		st_check( link_funcs(funcs, FUNC_COUNT, code, chunk_sizes[i], stderr, &stats) );
+		st_check_int(stats.relocations, RELOC_COUNT);
+		st_check_int(stats.threads, thread_counts[i]);
+		st_check( all_relocs_patched() );
+	}
+}
+
+void test_unresolved_symbols() {
+	build_funcs();
+	
+	// d isn't in the function list, every 4th relocation calls it
+	char*  output_ptr = NULL;
+	size_t output_len = 0;
+	FILE* output = open_memstream(&output_ptr, &output_len);
+		link_stats_t stats = { 0 };
+		bool linked = link_funcs(funcs, FUNC_COUNT - 1, code, 16, output, &stats);
+	fclose(output);
+	
+	st_check( !linked );
+	st_check_int(stats.unresolved, RELOC_COUNT / 4);
+	st_check_strn(output_ptr, "link_funcs(): 50 unresolved symbols!\n", 37);
+	// k = 1 is the first relocation with (k * 7) % 4 == 3
+	st_check_not_null( strstr(output_ptr, "  d referenced at code offset 4\n") );
+	st_check_null( strstr(output_ptr, "  a referenced") );
+	free(output_ptr);
+	
+	// Nothing is patched
+	for(size_t i = 0; i < sizeof(code); i++)
+		st_check_int(code[i], 0);
+	st_check( !funcs[0]->func.linked );
+}
+
+
+int main() {
+	st_run(test_single_chunk);
+	st_run(test_multiple_chunks);
+	st_run(test_unresolved_symbols);
+	return st_show_report();
+}
@@ -0,0 +1,166 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include "../peephole.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+
+//
+// Helper functions
+//
+
+bool code_eq(asm_p a, asm_p b) {
+	if (a->code_len != b->code_len)
+		return false;
+	
+	for(size_t i = 0; i < a->code_len; i++) {
+		if (a->code_ptr[i] != b->code_ptr[i])
+			return false;
+	}
+	
+	return true;
+}
+
+
+//
+// Test cases
+//
+
+void test_push_pop_and_self_mov() {
+	asm_p as = &(asm_t){ 0 }, expected = &(asm_t){ 0 };
+	as_new(as);
+	as_new(expected);
+	ph_stats_t stats = { 0 };
+	
+	// Spill around an instruction that doesn't touch the register
+	as_push(as, R10);
+	as_syscall(as);
+	as_pop(as, R10);
+	// Spill restored into another register
+	as_push(as, RDI);
+	as_mov(as, RAX, imm(60));
+	as_pop(as, RSI);
+	as_mov(as, RBX, RBX);
+	as_ret(as, 0);
+	ph_optimize(as, 0, NULL, 0, &stats);
+	
+	as_syscall(expected);
+	as_mov(expected, RAX, imm(60));
+	as_mov(expected, RSI, RDI);
+	as_ret(expected, 0);
+	st_check( code_eq(as, expected) );
+	st_check_int(stats.instructions_before, 8);
+	st_check_int(stats.instructions_after, 4);
+	
+	as_destroy(expected);
+	as_destroy(as);
+}
+
+void test_store_load_and_dead_code() {
+	asm_p as = &(asm_t){ 0 }, expected = &(asm_t){ 0 };
+	as_new(as);
+	as_new(expected);
+	ph_stats_t stats = { 0 };
+	
+	as_mov(as, RAX, imm(1));
+	as_mov(as, RAX, imm(2));
+	as_mov(as, memrd(RBP, -8), R15);
+	as_mov(as, R14, memrd(RBP, -8));
+	as_ret(as, 0);
+	ph_optimize(as, 0, NULL, 0, &stats);
+	
+	as_mov(expected, RAX, imm(2));
+	as_mov(expected, memrd(RBP, -8), R15);
+	as_mov(expected, R14, R15);
+	as_ret(expected, 0);
+	st_check( code_eq(as, expected) );
+	
+	as_destroy(expected);
+	as_destroy(as);
+}
+
+void test_setcc_cmp_jcc() {
+	asm_p as = &(asm_t){ 0 }, expected = &(asm_t){ 0 };
+	as_new(as);
+	as_new(expected);
+	ph_stats_t stats = { 0 };
+	
+	// Code of an if statement with else case, both cases overwrite RAX
+	as_mov(as, RAX, imm(9));
+	as_mov(as, RCX, imm(10));
+	as_cmp(as, RAX, RCX);
+	as_set_cc(as, CC_LESS, regb(RAX.reg));
+	as_cmp(as, RAX, imm(0));
+	asm_jump_slot_t to_false_case = as_jmp_cc(as, CC_EQUAL, 0);
+		as_mov(as, RAX, imm(100));
+		asm_jump_slot_t to_end = as_jmp(as, reld(0));
+	as_mark_jmp_slot_target(as, to_false_case);
+		as_mov(as, RAX, imm(2));
+	as_mark_jmp_slot_target(as, to_end);
+	as_ret(as, 0);
+	ph_optimize(as, 0, NULL, 0, &stats);
+	
+	as_mov(expected, RAX, imm(9));
+	as_mov(expected, RCX, imm(10));
+	as_cmp(expected, RAX, RCX);
+	to_false_case = as_jmp_cc(expected, CC_GREATER_OR_EQUAL, 0);
+		as_mov(expected, RAX, imm(100));
+		to_end = as_jmp(expected, reld(0));
+	as_mark_jmp_slot_target(expected, to_false_case);
+		as_mov(expected, RAX, imm(2));
+	as_mark_jmp_slot_target(expected, to_end);
+	as_ret(expected, 0);
+	st_check( code_eq(as, expected) );
+	
+	as_destroy(expected);
+	as_destroy(as);
+}
+
+void test_jumps_and_slots() {
+	asm_p as = &(asm_t){ 0 }, expected = &(asm_t){ 0 };
+	as_new(as);
+	as_new(expected);
+	ph_stats_t stats = { 0 };
+	
+	// Code before the function is left alone
+	as_mov(as, RAX, RAX);
+	size_t start = as_target(as);
+	
+	// A loop with a jump to the next instruction and a call slot after it
+	size_t loop_start = as_target(as);
+	as_mov(as, RBX, RBX);
+	as_mov(as, RAX, imm(1));
+	as_cmp(as, RAX, imm(0));
+	asm_jump_slot_t to_end = as_jmp_cc(as, CC_EQUAL, 0);
+	as_mark_jmp_slot_target(as, as_jmp(as, reld(0)));
+	size_t call_slot = as_call(as, reld(0));
+	as_set_jmp_slot_target(as, as_jmp(as, reld(0)), loop_start);
+	as_mark_jmp_slot_target(as, to_end);
+	as_ret(as, 0);
+	ph_optimize(as, start, (size_t*[]){ &call_slot }, 1, &stats);
+	
+	as_mov(expected, RAX, RAX);
+	loop_start = as_target(expected);
+	as_mov(expected, RAX, imm(1));
+	as_cmp(expected, RAX, imm(0));
+	to_end = as_jmp_cc(expected, CC_EQUAL, 0);
+	size_t expected_call_slot = as_call(expected, reld(0));
+	as_set_jmp_slot_target(expected, as_jmp(expected, reld(0)), loop_start);
+	as_mark_jmp_slot_target(expected, to_end);
+	as_ret(expected, 0);
+	st_check( code_eq(as, expected) );
+	st_check_int(call_slot, expected_call_slot);
+	
+	as_destroy(expected);
+	as_destroy(as);
+}
+
+
+int main() {
+	st_run(test_push_pop_and_self_mov);
+	st_run(test_store_load_and_dead_code);
+	st_run(test_setcc_cmp_jcc);
+	st_run(test_jumps_and_slots);
+	return st_show_report();
+}
@@ -0,0 +1,71 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../pool.h"
+
+#define SLIM_TEST_IMPLEMENTATION
+#include "slim_test.h"
+
+
+//
+// Helper functions
+//
+
+// Tasks are the nodes of a binary tree, task i pushes 2i+1 and 2i+2. The index
+// is stored in the task pointer (offset by 1 so it's never NULL).
+#define TASK_COUNT 5000
+
+size_t runs[TASK_COUNT];
+size_t workers_used[64];
+
+void run_tree_task(pool_p pool, size_t worker, void* task) {
+	size_t index = (uintptr_t)task - 1;
+	__atomic_add_fetch(&runs[index], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&workers_used[worker], 1, __ATOMIC_RELAXED);
+
+	for(size_t child = 2 * index + 1; child <= 2 * index + 2 && child < TASK_COUNT; child++)
+		pool_push(pool, worker, (void*)(uintptr_t)(child + 1));
+}
+
+bool run_tree(size_t worker_count) {
+	memset(runs, 0, sizeof(runs));
+	memset(workers_used, 0, sizeof(workers_used));
+
+	pool_t pool;
+	pool_new(&pool, worker_count, run_tree_task, NULL);
+	pool_push(&pool, 0, (void*)(uintptr_t)1);
+	pool_run(&pool);
+	pool_destroy(&pool);
+
+	for(size_t i = 0; i < TASK_COUNT; i++) {
+		if (runs[i] != 1)
+			return false;
+	}
+	return true;
+}
+
+
+//
+// Test cases
+//
+
+void test_single_worker() {
+	st_check( run_tree(1) );
+	st_check_int(workers_used[0], TASK_COUNT);
+}
+
+void test_multiple_workers() {
+	// Every task has to run exactly once no matter who steals what
+	for(size_t i = 0; i < 10; i++) {
+		st_check( run_tree(4) );
+		st_check_int(workers_used[0] + workers_used[1] + workers_used[2] + workers_used[3], TASK_COUNT);
+	}
+}
+
+
+int main() {
+	st_run(test_single_worker);
+	st_run(test_multiple_workers);
+	return st_show_report();
+}
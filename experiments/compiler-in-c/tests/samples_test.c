@@ -1,8 +1,11 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <glob.h>
 #include "../asm.h"
+#include "../profile.h"
 
 #define SLIM_TEST_IMPLEMENTATION
 #include "slim_test.h"
@@ -34,29 +37,161 @@ void test_samples() {
 		fclose(f);
 		//printf("expected status: %d, output: %s\n", expected_status, expected_output);
 		
-		char command[512];
-		snprintf(command, sizeof(command), "./main %s", filename);
-		//printf("compile command: %s\n", command);
-		system(command);
-		
-		char* output = NULL;
-		int status_code = run_and_delete("main.elf", "./main.elf", &output);
-		if (expected_status != -1) {
-			st_check_int(status_code, expected_status);
-		}
-		if (expected_output != NULL) {
-			st_check_str(output, expected_output);
+		// Compile each sample with the tree compiler and through the IR
+		const char* commands[] = { "./main %s", "./main --ir %s" };
+		for(size_t j = 0; j < sizeof(commands) / sizeof(commands[0]); j++) {
+			char command[512];
+			snprintf(command, sizeof(command), commands[j], filename);
+			//printf("compile command: %s\n", command);
+			system(command);
+			
+			char* output = NULL;
+			int status_code = run_and_delete("main.elf", "./main.elf", &output);
+			if (expected_status != -1) {
+				st_check_int(status_code, expected_status);
+			}
+			if (expected_output != NULL) {
+				st_check_str(output, expected_output);
+			}
+			
+			free(output);
 		}
 		
-		free(output);
 		free(expected_output);
 	}
 	
 	globfree(&samples);
 }
 
+// Returns the compiled main.elf of command and deletes it, NULL if the compiler
+// didn't write one. log is set to what the compiler wrote to stdout.
+char* compile_to_buffer(const char* command, size_t* size, char** log) {
+	*log = NULL;
+	run_and_delete(NULL, command, log);
+	
+	FILE* f = fopen("main.elf", "rb");
+	if (f == NULL)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* buffer = malloc(*size);
+	*size = fread(buffer, 1, *size, f);
+	fclose(f);
+	
+	unlink("main.elf");
+	return buffer;
+}
+
+void test_parallel_compile() {
+	glob_t samples;
+	int error = glob("tests/samples/*.lg", GLOB_ERR, NULL, &samples);
+	st_check_int(error, 0);
+	
+	// The parallel compiler has to put the functions in the same order as the
+	// serial one, so the binaries and the logs have to be byte identical
+	const char* commands[][2] = {
+		{ "./main %s 2> /dev/null",      "./main --jobs 4 %s 2> /dev/null" },
+		{ "./main --ir %s 2> /dev/null", "./main --ir --jobs 4 %s 2> /dev/null" },
+	};
+	for(size_t i = 0; i < samples.gl_pathc; i++) {
+		for(size_t j = 0; j < sizeof(commands) / sizeof(commands[0]); j++) {
+			char serial_command[512], parallel_command[512];
+			snprintf(serial_command, sizeof(serial_command), commands[j][0], samples.gl_pathv[i]);
+			snprintf(parallel_command, sizeof(parallel_command), commands[j][1], samples.gl_pathv[i]);
+			
+			size_t serial_size = 0, parallel_size = 0;
+			char *serial_log = NULL, *parallel_log = NULL;
+			char* serial = compile_to_buffer(serial_command, &serial_size, &serial_log);
+			char* parallel = compile_to_buffer(parallel_command, &parallel_size, &parallel_log);
+			
+			st_check( (serial == NULL) == (parallel == NULL) );
+			if (serial != NULL && parallel != NULL) {
+				st_check_int(parallel_size, serial_size);
+				st_check( serial_size == parallel_size && memcmp(serial, parallel, serial_size) == 0 );
+			}
+			st_check( (serial_log == NULL) == (parallel_log == NULL) );
+			if (serial_log != NULL && parallel_log != NULL) {
+				st_check_str(parallel_log, serial_log);
+			}
+			
+			free(serial);
+			free(parallel);
+			free(serial_log);
+			free(parallel_log);
+		}
+	}
+	
+	globfree(&samples);
+}
+
+// Compiles and runs a sample with --profile and returns the entries named in
+// names of the profile it wrote
+void run_profiled(const char* command, const char* names[], profile_entry_t entries[], size_t count) {
+	memset(entries, 0, count * sizeof(entries[0]));
+	system(command);
+	run_and_delete("main.elf", "./main.elf", NULL);
+	
+	FILE* f = fopen("main.prof", "rb");
+	st_check_not_null(f);
+	
+	profile_header_t header = { .entry_count = 0 };
+	st_check( fread(&header, sizeof(header), 1, f) == 1 );
+	st_check_str(header.magic, PROFILE_MAGIC);
+	st_check(header.exit_tsc > header.start_tsc);
+	for(size_t i = 0; i < header.entry_count; i++) {
+		profile_entry_t entry;
+		st_check( fread(&entry, sizeof(entry), 1, f) == 1 );
+		for(size_t j = 0; j < count; j++) {
+			if ( strcmp(entry.name, names[j]) == 0 )
+				entries[j] = entry;
+		}
+	}
+	
+	fclose(f);
+	unlink("main.prof");
+}
+
+void test_profile() {
+	const char* modes[] = { "", "--ir" };
+	for(size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		char command[512];
+		profile_entry_t entries[2];
+		
+		snprintf(command, sizeof(command), "./main %s --profile tests/samples/14-recursion.lg > /dev/null 2>&1", modes[i]);
+		run_profiled(command, (const char*[]){ "main", "fac" }, entries, 2);
+		// main never returns, it exits
+		st_check_int(entries[0].kind, PROFILE_FUNC);
+		st_check_int(entries[0].count, 1);
+		st_check_int(entries[0].active, 1);
+		st_check_int(entries[1].kind, PROFILE_FUNC);
+		st_check_int(entries[1].count, 3);
+		st_check_int(entries[1].active, 0);
+		st_check(entries[1].cycles > 0);
+		
+		snprintf(command, sizeof(command), "./main %s --profile tests/samples/24-loop-kernel.lg > /dev/null 2>&1", modes[i]);
+		run_profiled(command, (const char*[]){ "main loop 1" }, entries, 1);
+		st_check_int(entries[0].kind, PROFILE_LOOP);
+		st_check_int(entries[0].count, 10);
+	}
+}
+void test_options() {
+	// The inline report is made by the IR compiler
+	char* output = NULL;
+	int status = run_and_delete(NULL, "./main --inline-report tests/samples/01-syscall.lg 2>&1", &output);
+	st_check_int(status, 1);
+	st_check_str(output, "--inline-report only works with --ir\n");
+	st_check( access("main.elf", F_OK) != 0 );
+	free(output);
+	
+	status = run_and_delete("main.elf", "./main --ir --inline-report tests/samples/01-syscall.lg > /dev/null 2>&1", NULL);
+	st_check_int(status, 0);
+}
 
 int main() {
 	st_run(test_samples);
+	st_run(test_parallel_compile);
+	st_run(test_profile);
+	st_run(test_options);
 	return st_show_report();
 }
\ No newline at end of file